@@ -9,39 +9,225 @@
 #include "verilog_ast_common.h"
 #include "verilog_preprocessor.h"
 #include "verilog_ast_util.h"
+#include "verilog_parse_cache.h"
 
-int main(int argc, char ** argv)
+//! The options given ahead of the file paths on the command line.
+typedef struct main_options_t{
+    ast_boolean   parallel;  //!< "-j N", parse on a pool of threads.
+    unsigned int  threads;   //!< The N of "-j N".
+    ast_boolean   pipelined; //!< "-p", scan on a thread of its own.
+    ast_boolean   skeleton;  //!< "-s", skip behavioural code.
+    ast_boolean   lazy;      //!< "-l", parse module bodies when looked up.
+    char        * cache;     //!< "-c <directory>", or NULL.
+    int           first;     //!< Index of the first file path.
+} main_options;
+
+//! Prints how to run the program.
+static void print_usage(char * program)
 {
-    if(argc < 2)
+    printf("Usage: %s [-j N] [-p] [-s] [-l] [-c <directory>] <file>...\n",
+           program);
+    printf("\t-j N   Parse on N threads, or one per processor if N is 0.\n");
+    printf("\t-p     Scan each file on a thread of its own.\n");
+    printf("\t-s     Skeleton mode: skip behavioural code.\n");
+    printf("\t-l     Leave module bodies to be parsed when looked up.\n");
+    printf("\t-c <directory>  Reuse the results of earlier runs.\n");
+}
+
+/*!
+@brief Reads every option ahead of the file paths, then checks they can be
+used together.
+@returns Zero if the options are usable, non-zero after printing why not.
+*/
+static int parse_options(int argc, char ** argv, main_options * options)
+{
+    memset(options, 0, sizeof(main_options));
+
+    int A;
+    for(A = 1; A < argc && argv[A][0] == '-'; A ++)
+    {
+        if((strcmp(argv[A], "-j") == 0 || strcmp(argv[A], "-c") == 0) &&
+           A + 1 >= argc)
+        {
+            printf("ERROR. '%s' expects an argument.\n", argv[A]);
+            return 1;
+        }
+        else if(strcmp(argv[A], "-j") == 0)
+        {
+            char * end;
+            options -> parallel = AST_TRUE;
+            options -> threads  = strtoul(argv[++A], &end, 10);
+            if(*argv[A] == '\0' || *end != '\0')
+            {
+                printf("ERROR. '-j' expects a number of threads, not '%s'.\n",
+                       argv[A]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[A], "-c") == 0)
+        {
+            options -> cache = argv[++A];
+        }
+        else if(strcmp(argv[A], "-p") == 0)
+        {
+            options -> pipelined = AST_TRUE;
+        }
+        else if(strcmp(argv[A], "-s") == 0)
+        {
+            options -> skeleton = AST_TRUE;
+        }
+        else if(strcmp(argv[A], "-l") == 0)
+        {
+            options -> lazy = AST_TRUE;
+        }
+        else
+        {
+            printf("ERROR. Unknown option '%s'.\n", argv[A]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    options -> first = A;
+
+    if(options -> first >= argc)
     {
         printf("ERROR. Please supply at least one file path argument.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    else if(options -> parallel && options -> cache != NULL)
+    {
+        printf("ERROR. '-j' cannot be used with '-c'.\n");
+        return 1;
+    }
+    else if(options -> lazy && (options -> parallel || options -> pipelined
+            || options -> skeleton || options -> cache != NULL))
+    {
+        // Modules are loaded by contexts of their own, later on.
+        printf("ERROR. '-l' cannot be used with any other option.\n");
         return 1;
     }
+
+    return 0;
+}
+
+//! Sets up the preprocessor of each context used by the "-j" mode.
+static void setup_context(verilog_parser_context * context, void * data)
+{
+    main_options * options = data;
+
+    context -> pipelined   = options -> pipelined;
+    context -> skeleton    = options -> skeleton;
+
+    // Files are parsed at the same time, so errors must say which is which.
+    context -> name_errors = AST_TRUE;
+
+    // Setup the preprocessor to look in ./tests/ for include files.
+    ast_list_append(context -> preprocessor -> search_dirs, "./tests/");
+    ast_list_append(context -> preprocessor -> search_dirs, "./");
+}
+
+/*!
+@brief Parses all of the files in parallel with verilog_parse_files, or
+splits up the file with verilog_parse_file_chunked if there is only one.
+@returns Zero if every file parsed successfully.
+*/
+static int parse_parallel(main_options * options, char ** paths, int count)
+{
+    int * results = calloc(count, sizeof(int));
+    int   failed  = 0;
+
+    verilog_source_tree * tree;
+
+    if(count == 1)
+    {
+        // Split up a single file instead.
+        tree = verilog_parse_file_chunked(paths[0], options -> threads,
+            setup_context, options, results);
+    }
     else
     {
+        tree = verilog_parse_files(paths, count, options -> threads,
+            setup_context, options, results);
+    }
+
+    int F;
+    for(F = 0; F < count; F ++)
+    {
+        if(results[F] == 0)
+        {
+            printf("%s  - Parse successful\n", paths[F]);
+        }
+        else
+        {
+            printf("%s  - Parse failed\n", paths[F]);
+            failed = 1;
+        }
+    }
+
+    verilog_free_source_tree(tree);
+    free(results);
+    return failed;
+}
+
+int main(int argc, char ** argv)
+{
+    main_options options;
+    if(parse_options(argc, argv, &options) != 0)
+    {
+        return 1;
+    }
+    else if(options.parallel)
+    {
+        return parse_parallel(&options, argv + options.first,
+                              argc - options.first);
+    }
+    else
+    {
+        // Reuse the results of earlier runs with "-c <directory>".
+        verilog_parse_cache * cache = NULL;
+        int                   first = options.first;
+
+        if(options.cache != NULL)
+        {
+            cache = verilog_new_parse_cache(options.cache);
+            if(cache == NULL)
+            {
+                printf("ERROR. Cannot use cache directory '%s'.\n",
+                       options.cache);
+                return 1;
+            }
+        }
 
         int F = 0;
-        for(F = 1; F < argc; F++)
+        for(F = first; F < argc; F++)
         {
             
-            // Initialise the parser.
-            verilog_parser_init();
+            // Initialise a fresh parser context for each file.
+            verilog_parser_context * context = verilog_new_parser_context();
+            verilog_preprocessor_context * preproc = context -> preprocessor;
+            context -> pipelined = options.pipelined;
+            context -> skeleton  = options.skeleton;
 
             // Setup the preprocessor to look in ./tests/ for include files.
-            ast_list_append(yy_preproc -> search_dirs, "./tests/");
-            ast_list_append(yy_preproc -> search_dirs, "./");
+            ast_list_append(preproc -> search_dirs, "./tests/");
+            ast_list_append(preproc -> search_dirs, "./");
             printf("%s ", argv[F]);fflush(stdout);
 
-            // Load the file.
-            FILE * fh = fopen(argv[F], "r");
-
-            verilog_preprocessor_set_file(yy_preproc, argv[F]);
-            
-            // Parse the file and store the result.
-            int result = verilog_parse_file(fh);
-
-            // Close the file handle
-            fclose(fh);
+            // Map in and parse the file, and store the result.
+            int result;
+            if(options.lazy)
+            {
+                result = verilog_parse_path_lazy(context, argv[F]);
+            }
+            else if(cache != NULL)
+            {
+                result = verilog_parse_path_cached(context, cache, argv[F]);
+            }
+            else
+            {
+                result = verilog_parse_path_r(context, argv[F]);
+            }
             
             if(result == 0)
             {
@@ -50,11 +236,17 @@ int main(int argc, char ** argv)
             else
             {
                 printf(" - Parse failed\n");
-                if(argc<=2) return 1;
+                if(argc<=first+1) return 1;
             }
 
-            verilog_resolve_modules(yy_verilog_source_tree);
+            verilog_resolve_modules(context -> source_tree);
+
+            // Release the tree, and the preprocessor context whose file
+            // names the tree refers to.
+            verilog_free_parser_context(context);
         }
+
+        verilog_free_parse_cache(cache);
     }
     return 0;
 }
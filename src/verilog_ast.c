@@ -5,20 +5,72 @@ Syntax Tree (AST)
 */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #include "verilog_ast.h"
+#include "verilog_ast_image.h"
+#include "verilog_ast_util.h"
+#include "verilog_parser.h"
 #include "verilog_preprocessor.h"
 
 /*!
-@brief Responsible for setting the line number and file of each node's
+@brief Responsible for setting the position and file of each node's
 meta data member.
 @param [inout] meta - A pointer to the metadata member to modify.
 */
 void ast_set_meta_info(ast_metadata * meta)
 {
-    meta -> line = yylineno;
-    meta -> file = verilog_preprocessor_current_file(yy_preproc);
+    ast_location * location = yy_node_location;
+
+    if(location == NULL)
+    {
+        // Not parsing, so there is no sensible position to record.
+        meta -> offset = 0;
+        meta -> file   = 0;
+        meta -> length = 0;
+        return;
+    }
+
+    meta -> offset = location -> start;
+    meta -> file   = location -> file;
+    ast_set_meta_end(meta, location -> end);
+}
+
+/*!
+@brief Moves the end of the position in some node metadata.
+*/
+void ast_set_meta_end(ast_metadata * meta, size_t end)
+{
+    size_t length = end > meta -> offset ? end - meta -> offset : 0;
+    meta -> length = length < UINT32_MAX ? (uint32_t)length : UINT32_MAX;
+}
+
+/*!
+@brief Returns the id of the file the preprocessor of this thread is
+reading, in the file table of the tree being parsed into.
+*/
+ast_file_id ast_current_file()
+{
+    verilog_source_tree * tree = yy_verilog_source_tree;
+    if(tree == NULL || yy_preproc == NULL)
+    {
+        return 0;
+    }
+
+    char * path = verilog_preprocessor_current_file(yy_preproc);
+    if(path == NULL)
+    {
+        return tree -> text_file;
+    }
+
+    // The file only changes at includes.
+    if(path != tree -> last_path)
+    {
+        tree -> last_file = verilog_source_tree_add_file(tree, path);
+        tree -> last_path = path;
+    }
+    return tree -> last_file;
 }
 
 /*!
@@ -573,8 +625,8 @@ initial starting value.
 should be:
     - CONCATENATION_EXPRESSION          : ast_expression
     - CONCATENATION_CONSTANT_EXPRESSION : ast_expression
-    - CONCATENATION_NET                 : TBD
-    - CONCATENATION_VARIABLE            : TBD
+    - CONCATENATION_NET                 : ast_expression
+    - CONCATENATION_VARIABLE            : ast_expression
     - CONCATENATION_MODULE_PATH         : TBD
 @todo Better implement repetition of elements.
 */
@@ -933,11 +985,9 @@ ast_case_statement * ast_new_case_statement(ast_expression * expression,
 
     if(tr -> cases != NULL)
     {
-        unsigned int i;
-        for(i = 0; i < tr -> cases -> items; i ++)
+        ast_case_item * the_case;
+        ast_list_foreach(the_case, tr -> cases)
         {
-            ast_case_item * the_case = ast_list_get(tr->cases,i);
-
             if(the_case == NULL){
                 break;
             }
@@ -1305,10 +1355,9 @@ ast_assignment * ast_new_continuous_assignment(
                 sizeof(ast_continuous_assignment));
     trc -> assignments = assignments;
 
-    unsigned int i;
-    for(i = 0; i < assignments -> items;  i++)
+    ast_single_assignment * item;
+    ast_list_foreach(item, assignments)
     {
-        ast_single_assignment * item = ast_list_get(assignments,i);
         item -> drive_strength = strength;
         item -> delay    = delay;
     }
@@ -2062,6 +2111,7 @@ ast_type_declaration * ast_new_type_declaration(ast_declaration_type type)
 
     tr -> type = type;
     tr -> identifiers = NULL;
+    tr -> values = NULL;
     tr -> delay = NULL;
     tr -> drive_strength = NULL;
     tr -> charge_strength = CHARGE_DEFAULT;
@@ -2089,13 +2139,14 @@ ast_list * ast_new_net_declaration(
 
     ast_list * tr = ast_list_new();
     
-    unsigned int i = 0;
-    for (i = 0; i < type_dec -> identifiers -> items; i ++)
+    ast_identifier identifier;
+    ast_list_foreach(identifier, type_dec -> identifiers)
     {
         ast_net_declaration * toadd =ast_calloc(1,sizeof(ast_net_declaration));
+        unsigned int          index = tr -> items;
         toadd -> meta       = type_dec -> meta;
 
-        toadd -> identifier = ast_list_get(type_dec -> identifiers, i);
+        toadd -> identifier = identifier;
         toadd -> type       = type_dec -> net_type;
         toadd -> delay      = type_dec -> delay;
         toadd -> drive      = type_dec -> drive_strength;
@@ -2103,7 +2154,8 @@ ast_list * ast_new_net_declaration(
         toadd -> vectored   = type_dec -> vectored;
         toadd -> scalared   = type_dec -> scalared;
         toadd -> is_signed  = type_dec -> is_signed;
-        toadd -> value      = NULL;
+        toadd -> value      = type_dec -> values == NULL ? NULL :
+                              ast_list_get(type_dec -> values, index);
 
         ast_list_append(tr,toadd);
     }
@@ -2111,6 +2163,26 @@ ast_list * ast_new_net_declaration(
     return tr;
 }
 
+/*!
+@brief Fills in the identifiers of a net type declaration, and the values
+assigned to them, from a list of net declaration assignments.
+*/
+void ast_set_net_decl_assignments(
+    ast_type_declaration * type_dec,
+    ast_list             * assignments
+){
+    type_dec -> identifiers = ast_list_new();
+    type_dec -> values      = ast_list_new();
+
+    ast_single_assignment * assignment;
+    ast_list_foreach(assignment, assignments)
+    {
+        ast_list_append(type_dec -> identifiers,
+                        assignment -> lval -> data.identifier);
+        ast_list_append(type_dec -> values, assignment -> expression);
+    }
+}
+
 /*!
 @brief Creates a new reg declaration object.
 @details Turns a generic "type declaration" object into a reg_declration
@@ -2123,13 +2195,13 @@ ast_list * ast_new_reg_declaration(
 ){
     ast_list * tr = ast_list_new();
     
-    unsigned int i = 0;
-    for (i = 0; i < type_dec -> identifiers -> items; i ++)
+    ast_identifier identifier;
+    ast_list_foreach(identifier, type_dec -> identifiers)
     {
         ast_reg_declaration * toadd =ast_calloc(1,sizeof(ast_reg_declaration));
         toadd -> meta       = type_dec -> meta;
 
-        toadd -> identifier = ast_list_get(type_dec -> identifiers, i);
+        toadd -> identifier = identifier;
         toadd -> range      = type_dec -> range;
         toadd -> is_signed  = type_dec -> is_signed;
         toadd -> value      = NULL;
@@ -2152,13 +2224,13 @@ ast_list * ast_new_var_declaration(
 ){
     ast_list * tr = ast_list_new();
     
-    unsigned int i = 0;
-    for (i = 0; i < type_dec -> identifiers -> items; i ++)
+    ast_identifier identifier;
+    ast_list_foreach(identifier, type_dec -> identifiers)
     {
         ast_var_declaration * toadd =ast_calloc(1,sizeof(ast_var_declaration));
         toadd -> meta       = type_dec -> meta;
 
-        toadd -> identifier = ast_list_get(type_dec -> identifiers,i);
+        toadd -> identifier = identifier;
         toadd -> type       = type_dec -> type;
 
         ast_list_append(tr,toadd);
@@ -2403,6 +2475,26 @@ ast_module_item * ast_new_module_item(
     return tr;
 }
 
+/*!
+@brief Creates and returns a new skipped construct, starting at the current
+line.
+*/
+ast_skipped_construct * ast_new_skipped_construct(
+    ast_module_item_type type,
+    size_t               start
+){
+    ast_skipped_construct * tr = ast_calloc(1,sizeof(ast_skipped_construct));
+    ast_set_meta_info(&(tr->meta));
+
+    tr -> type     = type;
+    tr -> end_line = yy_verilog_source_tree == NULL ? 0 :
+        verilog_source_tree_get_line(yy_verilog_source_tree, &(tr -> meta));
+    tr -> start    = start;
+    tr -> end      = start;
+
+    return tr;
+}
+
 /*!
 @brief Takes a body statement (type = STM_BLK) and splits it into it's event
 trigger and statements.
@@ -2411,7 +2503,7 @@ ast_statement_block * ast_extract_statement_block(
     ast_statement_type  type,
     ast_statement     * body
 ){
-    //printf("Reforming block from line %d of %s\n", body -> meta.line,body -> meta.file);
+    ast_line line = yy_node_location != NULL ? yy_node_location -> line : 0;
 
     if(body -> type == STM_BLOCK)
     {
@@ -2456,7 +2548,7 @@ ast_statement_block * ast_extract_statement_block(
 
             ast_statement_block * tr = ast_new_statement_block(
                 STM_BLOCK,
-                ast_new_identifier("Unnamed block", body -> meta.line),
+                ast_new_identifier("Unnamed block", line),
                 ast_list_new(), // Empty list, no declarations are made.
                 stm_list
             );
@@ -2475,7 +2567,7 @@ ast_statement_block * ast_extract_statement_block(
 
         ast_statement_block * tr = ast_new_statement_block(
             STM_BLOCK,
-            ast_new_identifier("Unnamed block", body -> meta.line),
+            ast_new_identifier("Unnamed block", line),
             ast_list_new(), // Empty list, no declarations are made.
             stm_list
         );
@@ -2535,13 +2627,11 @@ ast_module_declaration * ast_new_module_declaration(
     tr -> task_declarations      = ast_list_new();
     tr -> time_declarations      = ast_list_new();
     tr -> udp_instantiations     = ast_list_new();
+    tr -> skipped_constructs     = ast_list_new();
 
-    unsigned int i;
-
-    for(i = 0; i < constructs -> items; i++)
+    ast_module_item * construct;
+    ast_list_foreach(construct, constructs)
     {
-        ast_module_item * construct = ast_list_get(constructs, i);
-
         if(construct -> type == MOD_ITEM_PORT_DECLARATION && ports == NULL){
             // Only accept ports declared this way iff the ports argument to
             // this function is NULL, signifying the old style of port 
@@ -2643,6 +2733,10 @@ ast_module_declaration * ast_new_module_declaration(
             ast_list_append(tr -> function_declarations,
                             construct -> function_declaration);
         } 
+        else if(construct -> type == MOD_ITEM_SKIPPED_CONSTRUCT){
+            ast_list_append(tr -> skipped_constructs,
+                            construct -> skipped_construct);
+        } 
         else
         {
             printf("ERROR: Unsupported module construct type: %d\n",
@@ -2678,33 +2772,117 @@ array.
 */
 char * ast_identifier_tostring(ast_identifier id)
 {
-    char * tr = ast_strdup(id -> identifier);   
-    ast_identifier walker = id;
+    // Work out how long the result is first, so we only allocate once.
+    size_t len = 0;
+    ast_identifier walker;
+    for(walker = id; walker != NULL; walker = walker -> next)
+    {
+        len += strlen(walker -> identifier);
+    }
 
-    while(walker -> next != NULL)
+    char * tr  = ast_calloc(len + 1, sizeof(char));
+    char * end = tr;
+    for(walker = id; walker != NULL; walker = walker -> next)
     {
-        walker = walker -> next;
+        size_t seglen = strlen(walker -> identifier);
+        memcpy(end, walker -> identifier, seglen);
+        end += seglen;
+    }
+    return tr;
+}
 
-        size_t len = strlen(walker -> identifier)+1 + strlen(tr);
-        tr = realloc(tr,len);
-        strcat(tr, walker -> identifier);
+/*!
+@brief Returns a string which can be used as a hashtable key for an
+identifier.
+*/
+char * ast_identifier_key(ast_identifier id, ast_region * region)
+{
+    if(id -> next == NULL)
+    {
+        return id -> identifier;
     }
+
+    ast_region * previous = ast_region_set_current(region);
+    char * tr = ast_identifier_tostring(id);
+    ast_region_set_current(previous);
     return tr;
 }
 
 /*!
 @brief Acts like strcmp but works on ast identifiers.
+@details Compares the same text that @ref ast_identifier_tostring would
+produce, but walks the segments of each identifier in place rather than
+building the strings, so nothing is allocated.
 */
 int ast_identifier_cmp(
     ast_identifier a,
     ast_identifier b
 ){
-    char * s1 = ast_identifier_tostring(a);
-    char * s2 = ast_identifier_tostring(b);
+    // Segments which share interned text are identical, so skip them.
+    while(a != NULL && b != NULL && a -> identifier == b -> identifier)
+    {
+        a = a -> next;
+        b = b -> next;
+    }
+
+    const char * c1 = a != NULL ? a -> identifier : "";
+    const char * c2 = b != NULL ? b -> identifier : "";
+
+    while(1)
+    {
+        // Step over the ends of segments onto the start of the next.
+        while(*c1 == '\0' && a != NULL)
+        {
+            a  = a -> next;
+            c1 = a != NULL ? a -> identifier : "";
+        }
+        while(*c2 == '\0' && b != NULL)
+        {
+            b  = b -> next;
+            c2 = b != NULL ? b -> identifier : "";
+        }
+
+        if(*c1 != *c2 || *c1 == '\0')
+        {
+            return (int)(unsigned char)*c1 - (int)(unsigned char)*c2;
+        }
+
+        c1 ++;
+        c2 ++;
+    }
+}
+
+/*!
+@brief Returns true if two identifiers have the same text.
+@details Equivalent to ast_identifier_cmp(a,b) == 0, but simple identifiers
+are usually decided by comparing their interned pointers, lengths and hashes
+without looking at the text at all.
+*/
+ast_boolean ast_identifier_eq(
+    ast_identifier a,
+    ast_identifier b
+){
+    if(a -> next == NULL && b -> next == NULL)
+    {
+        const char * s1 = a -> identifier;
+        const char * s2 = b -> identifier;
 
-    int result = strcmp(s1,s2);
+        if(s1 == s2)
+        {
+            return AST_TRUE;
+        }
+        else if(ast_intern_length(s1) != ast_intern_length(s2) ||
+                ast_intern_hash(s1)   != ast_intern_hash(s2))
+        {
+            return AST_FALSE;
+        }
+        else
+        {
+            return memcmp(s1, s2, ast_intern_length(s1)) == 0;
+        }
+    }
 
-    return result;
+    return ast_identifier_cmp(a,b) == 0;
 }
 
 ast_identifier ast_new_identifier(
@@ -2714,7 +2892,7 @@ ast_identifier ast_new_identifier(
     ast_identifier tr = ast_calloc(1,sizeof(struct ast_identifier_t));
     ast_set_meta_info(&(tr->meta));
     
-    tr -> identifier = ast_strdup(identifier);
+    tr -> identifier = ast_intern(identifier);
     tr -> from_line = from_line;
     tr -> type = ID_UNKNOWN;
     tr -> next = NULL;
@@ -2884,29 +3062,208 @@ char * ast_number_tostring(
 
 /*!
 @brief Global source tree object, used to store parsed constructs.
-@details This is a global variable, initialised prior to calling
+@details This is a per-thread variable, initialised prior to calling
 the verilog_parse function, into which all objects the parser finds are
 stored.
 */
-verilog_source_tree * yy_verilog_source_tree;
+AST_THREAD_LOCAL verilog_source_tree * yy_verilog_source_tree;
+
+//! Span of the rule being reduced, or of the token just read.
+AST_THREAD_LOCAL ast_location * yy_node_location;
 
 /*!
-@brief Creates and returns a new, empty source tree.
-@details This should be called ahead of parsing anything, so we will
-have an object to put parsed constructs into.
+@brief The files the nodes of one or more source trees come from.
+@details Entry i has id i + 1. Entries are never removed or moved, so once
+one has been found it may be used without the lock. Paths and entries live
+in the table's own region, which is freed along with the last tree to use
+the table.
 */
-verilog_source_tree * verilog_new_source_tree()
+struct verilog_file_table_t{
+    pthread_mutex_t   lock;   //!< Held while anything below is used.
+    ast_region      * region; //!< Holds the entries and their paths.
+    ast_list        * files;  //!< ast_source_file, in id order.
+    ast_hashtable   * index;  //!< The same entries, by path.
+    unsigned int      users;  //!< Number of trees using the table.
+};
+
+//! Creates a file table with no entries, and no users yet.
+static verilog_file_table * verilog_new_file_table()
 {
+    verilog_file_table * tr = calloc(1, sizeof(verilog_file_table));
+    pthread_mutex_init(&(tr -> lock), NULL);
+
+    tr -> region = ast_region_new();
+    ast_region * previous = ast_region_set_current(tr -> region);
+    tr -> files  = ast_list_new();
+    tr -> index  = ast_hashtable_new();
+    ast_region_set_current(previous);
+
+    return tr;
+}
+
+/*!
+@brief Stops a tree using a file table, freeing the table if no other tree
+does. Registered with @ref ast_region_at_free on each tree's region.
+*/
+static void verilog_file_table_release(void * data)
+{
+    verilog_file_table * table = data;
+
+    pthread_mutex_lock(&(table -> lock));
+    unsigned int users = -- table -> users;
+    pthread_mutex_unlock(&(table -> lock));
+
+    if(users == 0)
+    {
+        ast_region_free(table -> region);
+        pthread_mutex_destroy(&(table -> lock));
+        free(table);
+    }
+}
+
+/*!
+@brief Adds an entry to a file table. The table must be locked.
+@param [inout] table - The table to add to.
+@param [in] path - The path of the file, already in the table's region, or
+NULL.
+*/
+static ast_source_file * verilog_file_table_append(
+    verilog_file_table * table,
+    char               * path
+){
+    ast_source_file * tr = ast_region_calloc(table -> region, 1,
+                                             sizeof(ast_source_file));
+    tr -> path = path;
+
+    ast_list_append(table -> files, tr);
+    tr -> id = table -> files -> items;
+
+    if(path != NULL)
+    {
+        ast_hashtable_insert(table -> index, path, tr);
+    }
+    return tr;
+}
+
+/*!
+@brief Finds the offset of every newline in some text.
+@details Done without any table locked, so that threads reading different
+files do not wait on each other.
+@param [in] text - The text to search.
+@param [in] length - The length of the text in bytes.
+@param [out] count - Receives the number of newlines found.
+@returns The offsets, allocated with malloc.
+*/
+static size_t * verilog_find_newlines(
+    const char * text,
+    size_t       length,
+    size_t     * count
+){
+    const char * at  = text;
+    const char * end = text + length;
+
+    *count = 0;
+    while(at < end && (at = memchr(at, '\n', end - at)) != NULL)
+    {
+        (*count) ++;
+        at       ++;
+    }
+
+    size_t * tr = malloc((*count > 0 ? *count : 1) * sizeof(size_t));
+    size_t   i  = 0;
+
+    at = text;
+    while(at < end && (at = memchr(at, '\n', end - at)) != NULL)
+    {
+        tr[i ++] = at - text;
+        at ++;
+    }
+    return tr;
+}
+
+/*!
+@brief Gives the entry of a file a copy of the offsets of its newlines. The
+file's table must be locked.
+*/
+static void verilog_file_table_index(
+    verilog_file_table * table,
+    ast_source_file    * file,
+    const size_t       * newlines,
+    size_t               count
+){
+    file -> newlines = ast_region_calloc(table -> region,
+                                         count > 0 ? count : 1,
+                                         sizeof(size_t));
+    if(count > 0)
+    {
+        memcpy(file -> newlines, newlines, count * sizeof(size_t));
+    }
+    file -> newline_count = count;
+    file -> indexed       = AST_TRUE;
+}
+
+/*!
+@brief Creates a source tree which uses the supplied file table.
+@details The tree gets a memory region of its own, and is itself allocated
+from it.
+*/
+static verilog_source_tree * verilog_new_source_tree_with(
+    verilog_file_table * table
+){
+    ast_region * region   = ast_region_new();
+    ast_region * previous = ast_region_set_current(region);
+
     verilog_source_tree * tr = ast_calloc(1,sizeof(verilog_source_tree));
 
     tr -> modules       =   ast_list_new();
     tr -> primitives    =   ast_list_new();
     tr -> configs       =   ast_list_new();
     tr -> libraries     =   ast_list_new();
+    tr -> region        =   region;
+    tr -> module_index  =   ast_hashtable_new();
+    tr -> modules_indexed = 0;
+    tr -> pending_instantiations = ast_hashtable_new();
+    tr -> modules_resolved = 0;
+    tr -> description_callback = NULL;
+    tr -> callback_data        = NULL;
+    tr -> description_region   = NULL;
+    tr -> description_kept     = AST_FALSE;
+    tr -> file_units           = ast_hashtable_new();
+    tr -> file_table           = table;
+    tr -> file_index           = ast_hashtable_new();
+
+    ast_region_set_current(previous);
+
+    pthread_mutex_lock(&(table -> lock));
+    table -> users ++;
+    pthread_mutex_unlock(&(table -> lock));
+    ast_region_at_free(region, verilog_file_table_release, table);
 
     return tr;
 }
 
+/*!
+@brief Creates and returns a new, empty source tree.
+@details This should be called ahead of parsing anything, so we will
+have an object to put parsed constructs into. The tree gets a memory region
+of its own, and is itself allocated from it.
+*/
+verilog_source_tree * verilog_new_source_tree()
+{
+    return verilog_new_source_tree_with(verilog_new_file_table());
+}
+
+/*!
+@brief Creates and returns a new, empty source tree which shares the file
+table of another.
+*/
+verilog_source_tree * verilog_new_source_tree_sharing(
+    verilog_source_tree * files_of
+){
+    assert(files_of != NULL);
+    return verilog_new_source_tree_with(files_of -> file_table);
+}
+
 /*!
 @brief Releases a source tree object from memory.
 @param [in] tofree - The source tree to be free'd
@@ -2914,5 +3271,797 @@ verilog_source_tree * verilog_new_source_tree()
 void verilog_free_source_tree(
     verilog_source_tree * tofree
 ){
-    printf("ERROR: Function not implemented. Source tree at %p not freed.\n", tofree);
+    if(tofree == NULL)
+    {
+        return;
+    }
+    else if(tofree == yy_verilog_source_tree)
+    {
+        yy_verilog_source_tree = NULL;
+    }
+
+    // The tree structure lives inside its own region, so this is the last
+    // thing we may touch.
+    ast_region_free(tofree -> region);
+}
+
+/*!
+@brief Records a module in the module_index under the given key, unless a
+module of that name is already there, and resolves any instantiations which
+were waiting for it.
+*/
+static void verilog_source_tree_index_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module,
+    char                   * key
+){
+    // On a collision, the first declaration of the name wins.
+    if(ast_hashtable_insert(tree -> module_index, key, module) !=
+       HASH_SUCCESS)
+    {
+        return;
+    }
+
+    // Patch up any instantiations which were waiting for this module.
+    void * waiting;
+    if(ast_hashtable_get(tree -> pending_instantiations, key, &waiting)
+       == HASH_SUCCESS)
+    {
+        ast_module_instantiation * submod;
+        ast_list_foreach(submod, (ast_list*)waiting)
+        {
+            submod -> resolved    = AST_TRUE;
+            submod -> declaration = module;
+        }
+        ast_hashtable_delete(tree -> pending_instantiations, key);
+    }
+}
+
+/*!
+@brief Adds any modules appended directly to the modules list of a tree to
+its module_index.
+*/
+void verilog_source_tree_index_modules(
+    verilog_source_tree * tree
+){
+    while(tree -> modules_indexed < tree -> modules -> items)
+    {
+        ast_module_declaration * module = ast_list_get(tree -> modules,
+            tree -> modules_indexed);
+        tree -> modules_indexed ++;
+
+        if(module -> identifier == NULL)
+        {
+            continue;
+        }
+
+        verilog_source_tree_index_module(tree, module,
+            ast_identifier_key(module -> identifier, tree -> region));
+    }
+}
+
+/*!
+@brief Adds a module declaration to a source tree.
+*/
+void verilog_source_tree_add_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+){
+    ast_list_append(tree -> modules, module);
+    verilog_source_tree_index_modules(tree);
+}
+
+/*!
+@brief Inserts a module declaration into a source tree, at a given position
+in its modules list.
+*/
+void verilog_source_tree_insert_module(
+    verilog_source_tree    * tree,
+    unsigned int             index,
+    ast_module_declaration * module
+){
+    if(index >= tree -> modules -> items)
+    {
+        verilog_source_tree_add_module(tree, module);
+        return;
+    }
+
+    ast_list_insert_at(tree -> modules, index, module);
+
+    // Modules before the counters have been indexed and resolved already,
+    // so this one must be too.
+    if(index <= tree -> modules_indexed)
+    {
+        tree -> modules_indexed ++;
+        if(module -> identifier != NULL)
+        {
+            verilog_source_tree_index_module(tree, module,
+                ast_identifier_key(module -> identifier, tree -> region));
+        }
+    }
+    if(index < tree -> modules_resolved)
+    {
+        tree -> modules_resolved ++;
+        verilog_resolve_instantiations(tree, module);
+    }
+}
+
+/*!
+@brief Takes the instantiations made by a module out of the lists of those
+waiting for modules to be added.
+*/
+static void verilog_source_tree_unqueue_instantiations(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+){
+    if(module -> module_instantiations == NULL)
+    {
+        return;
+    }
+
+    ast_module_instantiation * submod;
+    ast_list_foreach(submod, module -> module_instantiations)
+    {
+        if(submod -> resolved)
+        {
+            continue;
+        }
+
+        char * key = ast_identifier_key(submod -> module_identifer,
+                                        tree -> region);
+        void * waiting;
+        if(ast_hashtable_get(tree -> pending_instantiations, key, &waiting)
+           != HASH_SUCCESS)
+        {
+            continue;
+        }
+
+        ast_list   * list = waiting;
+        unsigned int i;
+        for(i = 0; i < list -> items; i ++)
+        {
+            if(ast_list_get(list, i) == submod)
+            {
+                ast_list_remove_at(list, i);
+                break;
+            }
+        }
+
+        if(list -> items == 0)
+        {
+            ast_hashtable_delete(tree -> pending_instantiations, key);
+        }
+    }
+}
+
+/*!
+@brief Replaces a module declaration in a source tree with another, keeping
+the old declaration's place and address.
+*/
+void verilog_source_tree_replace_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module,
+    ast_module_declaration * parsed
+){
+    verilog_source_tree_unqueue_instantiations(tree, module);
+    *module = *parsed;
+    verilog_resolve_instantiations(tree, module);
+}
+
+/*!
+@brief Removes a module declaration from a source tree.
+*/
+void verilog_source_tree_remove_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+){
+    unsigned int i;
+    for(i = 0; i < tree -> modules -> items; i ++)
+    {
+        if(ast_list_get(tree -> modules, i) == module)
+        {
+            break;
+        }
+    }
+
+    if(i == tree -> modules -> items)
+    {
+        return;
+    }
+
+    ast_list_remove_at(tree -> modules, i);
+
+    // Keep the counters pointing at the same modules as before.
+    ast_boolean indexed = i < tree -> modules_indexed;
+    if(indexed)
+    {
+        tree -> modules_indexed --;
+    }
+    if(i < tree -> modules_resolved)
+    {
+        tree -> modules_resolved --;
+    }
+
+    // Nothing the module instantiates should be resolved later on.
+    verilog_source_tree_unqueue_instantiations(tree, module);
+
+    if(!indexed || module -> identifier == NULL)
+    {
+        return;
+    }
+
+    char * key = ast_identifier_key(module -> identifier, tree -> region);
+    void * found;
+    if(ast_hashtable_get(tree -> module_index, key, &found) != HASH_SUCCESS
+       || found != module)
+    {
+        // Another module of the same name is the one being used.
+        return;
+    }
+
+    ast_hashtable_delete(tree -> module_index, key);
+
+    // Anything instantiating the module waits for a new one instead.
+    ast_region             * previous = ast_region_set_current(tree->region);
+    ast_module_declaration * parent;
+    ast_list_foreach(parent, tree -> modules)
+    {
+        if(parent -> module_instantiations == NULL)
+        {
+            continue;
+        }
+
+        ast_module_instantiation * submod;
+        ast_list_foreach(submod, parent -> module_instantiations)
+        {
+            if(submod -> declaration != module)
+            {
+                continue;
+            }
+
+            // The name shares space with the declaration.
+            submod -> resolved         = AST_FALSE;
+            submod -> module_identifer = module -> identifier;
+
+            void * waiting;
+            if(ast_hashtable_get(tree -> pending_instantiations, key,
+                                 &waiting) != HASH_SUCCESS)
+            {
+                waiting = ast_list_new();
+                ast_hashtable_insert(tree -> pending_instantiations, key,
+                                     waiting);
+            }
+            ast_list_append(waiting, submod);
+        }
+    }
+    ast_region_set_current(previous);
+
+    // Fall back on the next declaration of the same name, if there is one.
+    for(i = 0; i < tree -> modules_indexed; i ++)
+    {
+        ast_module_declaration * other = ast_list_get(tree -> modules, i);
+        if(other -> identifier != NULL &&
+           ast_identifier_eq(other -> identifier, module -> identifier))
+        {
+            verilog_source_tree_index_module(tree, other, key);
+            break;
+        }
+    }
+}
+
+/*!
+@brief Adds a module or primitive declaration which has just been parsed to
+a source tree.
+*/
+void verilog_source_tree_add_description(
+    verilog_source_tree * tree,
+    ast_source_item     * item
+){
+    ast_boolean keep = AST_TRUE;
+
+    if(tree -> description_callback != NULL)
+    {
+        keep = tree -> description_callback(tree, item,
+                                            tree -> callback_data);
+    }
+
+    if(keep && item -> type == SOURCE_MODULE)
+    {
+        verilog_source_tree_add_module(tree, item -> module);
+    }
+    else if(keep && item -> type == SOURCE_UDP)
+    {
+        ast_list_append(tree -> primitives, item -> udp);
+    }
+    else if(keep)
+    {
+        // Do nothing / unknown / unsupported type.
+        printf("line %d of %s - Unknown source item type: %d",
+            __LINE__,
+            __FILE__,
+            item -> type);
+    }
+
+    if(tree -> description_region == NULL)
+    {
+        return;
+    }
+    else if(keep)
+    {
+        tree -> description_kept = AST_TRUE;
+    }
+    else if(tree -> description_kept)
+    {
+        // Declarations kept earlier share the region, so it cannot be
+        // reset. Leave it to the tree, and parse the next into a new one.
+        tree -> description_region = ast_region_new();
+        tree -> description_kept   = AST_FALSE;
+        ast_region_adopt(tree -> region, tree -> description_region);
+        ast_region_set_current(tree -> description_region);
+    }
+    else
+    {
+        ast_region_reset(tree -> description_region);
+    }
+}
+
+/*!
+@brief Sets a function to be called as each module or primitive
+declaration parsed into a tree is completed.
+*/
+void verilog_source_tree_set_callback(
+    verilog_source_tree          * tree,
+    verilog_description_callback   callback,
+    void                         * data
+){
+    tree -> description_callback = callback;
+    tree -> callback_data        = data;
+
+    if(callback != NULL && tree -> description_region == NULL)
+    {
+        // Adopted straight away, so it is released along with the tree.
+        tree -> description_region = ast_region_new();
+        tree -> description_kept   = AST_FALSE;
+        ast_region_adopt(tree -> region, tree -> description_region);
+    }
+    else if(callback == NULL)
+    {
+        tree -> description_region = NULL;
+    }
+}
+
+//! What verilog_renumber_metadata needs to give nodes their new file ids.
+typedef struct verilog_file_renumbering_t{
+    ast_file_id * ids;   //!< New id of each old id, indexed by the old one.
+    ast_file_id   count; //!< Number of old ids.
+} verilog_file_renumbering;
+
+//! Gives the metadata of one node the id its file has in another table.
+static void verilog_renumber_metadata(
+    ast_metadata * meta,
+    unsigned int * line,
+    void         * data
+){
+    (void)line;
+    verilog_file_renumbering * renumbering = data;
+    if(meta -> file != 0 && meta -> file <= renumbering -> count)
+    {
+        meta -> file = renumbering -> ids[meta -> file];
+    }
+}
+
+/*!
+@brief Adds the file table entries of one tree to the table of another,
+and gives the nodes of the first the ids their files have in the second.
+@details Nodes are only visited if some id changes, which it will not when
+"from" was the first tree to use its table and "into" has no files yet.
+@note Visiting writes to every node, so for a tree loaded with
+@ref verilog_source_tree_load it copies the pages of the image it touches.
+*/
+static void verilog_source_tree_renumber(
+    verilog_source_tree * into,
+    verilog_source_tree * from
+){
+    verilog_file_table * table = from -> file_table;
+    verilog_file_table * other = into -> file_table;
+
+    // Take a copy of the entries, so only one table is locked at a time.
+    pthread_mutex_lock(&(table -> lock));
+    ast_file_id       count   = table -> files -> items;
+    ast_source_file * entries = calloc(count + 1, sizeof(ast_source_file));
+    ast_file_id       i;
+    for(i = 0; i < count; i ++)
+    {
+        entries[i + 1] = *(ast_source_file*)ast_list_get(table -> files, i);
+    }
+    pthread_mutex_unlock(&(table -> lock));
+
+    verilog_file_renumbering renumbering;
+    renumbering.ids   = calloc(count + 1, sizeof(ast_file_id));
+    renumbering.count = count;
+    ast_boolean identity = AST_TRUE;
+
+    for(i = 1; i <= count; i ++)
+    {
+        if(entries[i].path != NULL)
+        {
+            renumbering.ids[i] = verilog_source_tree_add_file(
+                into, entries[i].path);
+        }
+        else
+        {
+            pthread_mutex_lock(&(other -> lock));
+            renumbering.ids[i] = verilog_file_table_append(other, NULL) -> id;
+            pthread_mutex_unlock(&(other -> lock));
+        }
+
+        // The newlines go too, so lines are found without reading the file.
+        if(entries[i].indexed)
+        {
+            pthread_mutex_lock(&(other -> lock));
+            ast_source_file * file = ast_list_get(other -> files,
+                                                  renumbering.ids[i] - 1);
+            if(!file -> indexed)
+            {
+                verilog_file_table_index(other, file, entries[i].newlines,
+                                         entries[i].newline_count);
+            }
+            pthread_mutex_unlock(&(other -> lock));
+        }
+        identity = identity && renumbering.ids[i] == i;
+    }
+
+    // Parents can only be filled in once every entry has its new id.
+    pthread_mutex_lock(&(other -> lock));
+    for(i = 1; i <= count; i ++)
+    {
+        ast_source_file * file = ast_list_get(other -> files,
+                                              renumbering.ids[i] - 1);
+        if(file -> parent == 0 && entries[i].parent != 0 &&
+           entries[i].parent <= count)
+        {
+            file -> parent = renumbering.ids[entries[i].parent];
+            file -> line   = entries[i].line;
+        }
+    }
+    pthread_mutex_unlock(&(other -> lock));
+
+    if(!identity)
+    {
+        verilog_source_tree_visit_metadata(from, verilog_renumber_metadata,
+                                           &renumbering);
+    }
+
+    free(renumbering.ids);
+    free(entries);
+}
+
+/*!
+@brief Moves the contents of one source tree onto the end of another.
+*/
+void verilog_source_tree_merge(
+    verilog_source_tree * into,
+    verilog_source_tree * from
+){
+    assert(into != NULL);
+    assert(from != NULL && from != into);
+
+    // Make sure the modules already in "into" take precedence by name.
+    verilog_source_tree_index_modules(into);
+
+    if(from -> file_table != into -> file_table)
+    {
+        verilog_source_tree_renumber(into, from);
+    }
+
+    ast_list_concat(into -> modules,    from -> modules);
+    ast_list_concat(into -> primitives, from -> primitives);
+    ast_list_concat(into -> configs,    from -> configs);
+    ast_list_concat(into -> libraries,  from -> libraries);
+
+    verilog_source_tree_index_modules(into);
+
+    if(from == yy_verilog_source_tree)
+    {
+        yy_verilog_source_tree = NULL;
+    }
+
+    // The tree structure of "from" lives in this region too.
+    ast_region_adopt(into -> region, from -> region);
+}
+
+/*!
+@brief Adds a file to the file table of a source tree, if it is not already
+there.
+@details The tree keeps its own index of the files it has looked up, so
+that the table, which may be shared, is only locked for files new to the
+tree.
+*/
+ast_file_id verilog_source_tree_add_file(
+    verilog_source_tree * tree,
+    char                * path
+){
+    ast_source_file * file;
+    if(ast_hashtable_get(tree -> file_index, path, (void**)&file) ==
+       HASH_SUCCESS)
+    {
+        return file -> id;
+    }
+
+    verilog_file_table * table = tree -> file_table;
+    pthread_mutex_lock(&(table -> lock));
+
+    if(ast_hashtable_get(table -> index, path, (void**)&file) != HASH_SUCCESS)
+    {
+        file = verilog_file_table_append(table, ast_region_intern(
+            table -> region, path, strlen(path)));
+    }
+
+    pthread_mutex_unlock(&(table -> lock));
+
+    ast_hashtable_insert(tree -> file_index, file -> path, file);
+    return file -> id;
+}
+
+/*!
+@brief Finds the newlines of a file afresh, from text which has just been
+read from it.
+*/
+void verilog_source_tree_index_file(
+    verilog_source_tree * tree,
+    char                * path,
+    const char          * text,
+    size_t                length
+){
+    ast_file_id          id    = verilog_source_tree_add_file(tree, path);
+    verilog_file_table * table = tree -> file_table;
+
+    size_t   count;
+    size_t * newlines = verilog_find_newlines(text, length, &count);
+
+    pthread_mutex_lock(&(table -> lock));
+    verilog_file_table_index(table, ast_list_get(table -> files, id - 1),
+                             newlines, count);
+    pthread_mutex_unlock(&(table -> lock));
+
+    free(newlines);
+}
+
+/*!
+@brief Finds the newlines of a file from text which has just been read from
+it, unless they have been found already.
+*/
+void verilog_source_tree_index_new_file(
+    verilog_source_tree * tree,
+    char                * path,
+    const char          * text,
+    size_t                length
+){
+    ast_file_id          id    = verilog_source_tree_add_file(tree, path);
+    verilog_file_table * table = tree -> file_table;
+
+    pthread_mutex_lock(&(table -> lock));
+    ast_boolean indexed = ((ast_source_file*)ast_list_get(table -> files,
+                                                          id - 1)) -> indexed;
+    pthread_mutex_unlock(&(table -> lock));
+
+    if(!indexed)
+    {
+        verilog_source_tree_index_file(tree, path, text, length);
+    }
+}
+
+/*!
+@brief Gives an entry in the file table of a source tree the newlines found
+when the file was parsed, unless it has some already.
+*/
+void verilog_source_tree_set_newlines(
+    verilog_source_tree * tree,
+    ast_file_id           file,
+    const size_t        * newlines,
+    size_t                count
+){
+    verilog_file_table * table = tree -> file_table;
+    pthread_mutex_lock(&(table -> lock));
+
+    if(file != 0 && file <= table -> files -> items)
+    {
+        ast_source_file * entry = ast_list_get(table -> files, file - 1);
+        if(!entry -> indexed)
+        {
+            verilog_file_table_index(table, entry, newlines, count);
+        }
+    }
+
+    pthread_mutex_unlock(&(table -> lock));
+}
+
+/*!
+@brief Adds text parsed from memory to the file table of a source tree.
+*/
+ast_file_id verilog_source_tree_add_text(
+    verilog_source_tree * tree,
+    const char          * text,
+    size_t                length
+){
+    verilog_file_table * table    = tree -> file_table;
+    size_t               count    = 0;
+    size_t             * newlines = text != NULL ?
+        verilog_find_newlines(text, length, &count) : NULL;
+
+    pthread_mutex_lock(&(table -> lock));
+
+    ast_source_file * file = verilog_file_table_append(table, NULL);
+    if(newlines != NULL)
+    {
+        verilog_file_table_index(table, file, newlines, count);
+    }
+
+    pthread_mutex_unlock(&(table -> lock));
+
+    free(newlines);
+    return file -> id;
+}
+
+/*!
+@brief Adds a file to the file table of a source tree as it is included,
+recording which file included it.
+*/
+void verilog_source_tree_add_include(
+    verilog_source_tree * tree,
+    char                * path,
+    char                * parent,
+    ast_line              line
+){
+    ast_file_id id     = verilog_source_tree_add_file(tree, path);
+    ast_file_id parent_id = parent != NULL ?
+        verilog_source_tree_add_file(tree, parent) : tree -> text_file;
+
+    verilog_file_table * table = tree -> file_table;
+    pthread_mutex_lock(&(table -> lock));
+
+    ast_source_file * file = ast_list_get(table -> files, id - 1);
+    if(file -> parent == 0 && parent_id != 0)
+    {
+        file -> parent = parent_id;
+        file -> line   = line;
+    }
+
+    pthread_mutex_unlock(&(table -> lock));
+}
+
+/*!
+@brief Returns the number of entries in the file table of a source tree.
+*/
+unsigned int verilog_source_tree_file_count(
+    verilog_source_tree * tree
+){
+    verilog_file_table * table = tree -> file_table;
+    pthread_mutex_lock(&(table -> lock));
+    unsigned int tr = table -> files -> items;
+    pthread_mutex_unlock(&(table -> lock));
+    return tr;
+}
+
+/*!
+@brief Looks up a file, named by node metadata, in the file table of a
+source tree.
+*/
+ast_source_file * verilog_source_tree_get_file(
+    verilog_source_tree * tree,
+    ast_file_id           file
+){
+    verilog_file_table * table = tree -> file_table;
+    ast_source_file    * tr    = NULL;
+
+    pthread_mutex_lock(&(table -> lock));
+    if(file != 0 && file <= table -> files -> items)
+    {
+        tr = ast_list_get(table -> files, file - 1);
+    }
+    pthread_mutex_unlock(&(table -> lock));
+
+    return tr;
+}
+
+/*!
+@brief Finds the line the position in some node metadata is on, and the
+offset that line starts at.
+@details The newlines of a file are found the first time this is asked of
+it, and kept with its entry.
+@returns AST_FALSE if the file is not known, or can no longer be read.
+*/
+static ast_boolean verilog_source_tree_find_line(
+    verilog_source_tree * tree,
+    ast_metadata        * meta,
+    ast_line            * line,
+    size_t              * line_start
+){
+    ast_source_file * file = verilog_source_tree_get_file(tree,
+                                                          meta -> file);
+    if(file == NULL)
+    {
+        return AST_FALSE;
+    }
+
+    verilog_file_table  * table    = tree -> file_table;
+    verilog_mapped_file * mapped   = NULL;
+    size_t              * newlines = NULL;
+    size_t                count    = 0;
+
+    pthread_mutex_lock(&(table -> lock));
+    ast_boolean indexed = file -> indexed;
+    pthread_mutex_unlock(&(table -> lock));
+
+    // Parsing finds the newlines of every file it reads, so this is only
+    // for files added to the table by hand. Read outside of the lock, so
+    // other threads can carry on parsing.
+    if(!indexed && file -> path != NULL &&
+       (mapped = verilog_map_file(file -> path)) != NULL)
+    {
+        newlines = verilog_find_newlines(mapped -> data, mapped -> length,
+                                         &count);
+        verilog_unmap_file(mapped);
+    }
+
+    pthread_mutex_lock(&(table -> lock));
+
+    if(!file -> indexed && newlines != NULL)
+    {
+        verilog_file_table_index(table, file, newlines, count);
+    }
+
+    ast_boolean tr = file -> indexed;
+    if(tr)
+    {
+        // Count the newlines before the position.
+        size_t low  = 0;
+        size_t high = file -> newline_count;
+        while(low < high)
+        {
+            size_t middle = low + (high - low) / 2;
+            if(file -> newlines[middle] < meta -> offset)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        *line       = (ast_line)low + 1;
+        *line_start = low > 0 ? file -> newlines[low - 1] + 1 : 0;
+    }
+
+    pthread_mutex_unlock(&(table -> lock));
+
+    free(newlines);
+    return tr;
+}
+
+/*!
+@brief Works out the line of the position in some node metadata.
+*/
+ast_line verilog_source_tree_get_line(
+    verilog_source_tree * tree,
+    ast_metadata        * meta
+){
+    ast_line line;
+    size_t   start;
+    return verilog_source_tree_find_line(tree, meta, &line, &start) ?
+           line : 0;
+}
+
+/*!
+@brief Works out the column of the position in some node metadata.
+*/
+unsigned int verilog_source_tree_get_column(
+    verilog_source_tree * tree,
+    ast_metadata        * meta
+){
+    ast_line line;
+    size_t   start;
+    return verilog_source_tree_find_line(tree, meta, &line, &start) ?
+           (unsigned int)(meta -> offset - start) + 1 : 0;
 }
@@ -5,6 +5,7 @@
 */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,8 +14,6 @@
 #ifndef VERILOG_AST_H
 #define VERILOG_AST_H
 
-extern int yylineno;
-
 //! Forward declare. Defines the core node type for the AST.
 typedef struct ast_node_t ast_node;
 
@@ -122,17 +121,70 @@ typedef enum ast_port_direction_e{
 
 //! Refers to a source code file line number.
 typedef int ast_line;
-//! Refers to a source code file name.
-typedef char * ast_file;
+
+/*!
+@brief Refers to a source code file, by its place in a file table.
+@details A file's id is one more than its index in the file table of the
+source tree its nodes belong to, so @ref verilog_source_tree_get_file finds
+it straight away. Zero means no file. Trees made to be merged share one
+table, and so agree on ids. Anything else is renumbered as it is merged.
+*/
+typedef uint32_t ast_file_id;
 
 /*!
 @brief Stores "meta" information and other tagging stuff about nodes.
+@details The position runs from the start of the first token of the
+construct to the end of its last, as byte offsets into the file it came
+from. Lines and columns are worked out from the offset only when they are
+asked for, by @ref verilog_source_tree_get_line and
+@ref verilog_source_tree_get_column. Tokens which come from the expansion of
+a macro are all placed where the macro is used.
+@note There is no longer a line member. Code which read meta.line should
+call @ref verilog_source_tree_get_line with the node's tree instead. Its
+lines count from one.
 */
 typedef struct ast_metadata_t{
-    ast_line line;  //!< The line number the construct came from.
-    ast_file file;  //!< The file the construct came from.
+    size_t       offset; //!< Byte offset of the first token of the construct.
+    ast_file_id  file;   //!< The file the construct came from.
+    uint32_t     length; //!< Bytes to the end of its last token, at most 4 GiB.
 } ast_metadata;
 
+/*!
+@brief Where a token, or a run of them, was read from.
+@details Used as the location type of the parser, so that each rule spans
+the tokens it was reduced from.
+*/
+typedef struct ast_location_t{
+    size_t       start; //!< Byte offset of the first character.
+    size_t       end;   //!< Byte offset just past the last character.
+    ast_file_id  file;  //!< The file, in the table of the tree parsed into.
+    ast_line     line;  //!< Line of the first character, as the scanner counts.
+} ast_location;
+
+/*!
+@brief Responsible for setting the position and file of each node's
+meta data member.
+@details Takes them from @ref yy_node_location, which is the span of the
+rule being reduced, or of the token just read by the scanner.
+@param [inout] meta - A pointer to the metadata member to modify.
+*/
+void ast_set_meta_info(ast_metadata * meta);
+
+/*!
+@brief Moves the end of the position in some node metadata.
+@param [inout] meta - The metadata to change.
+@param [in] end - Byte offset just past the last character.
+*/
+void ast_set_meta_end(ast_metadata * meta, size_t end);
+
+/*!
+@brief Returns the id of the file the preprocessor of this thread is
+reading, in the file table of the tree being parsed into.
+@details The file is added to the table the first time it is seen.
+@returns The id, or zero if nothing is being parsed.
+*/
+ast_file_id ast_current_file();
+
 /*! @} */
 
 //-------------- Numbers ---------------------------------------
@@ -260,12 +312,17 @@ typedef enum ast_concatenation_type_e
     CONCATENATION_MODULE_PATH           //!< Module path concatenation.
 } ast_concatenation_type;
 
-//! Fully describes a concatenation in terms of type and data.
+/*!
+@brief Fully describes a concatenation in terms of type and data.
+@details The items are ast_expression for every type of concatenation. In
+net and variable concatenations, an identifier is a primary expression
+naming it, and a nested concatenation is a primary expression holding it.
+*/
 struct ast_concatenation_t{
     ast_metadata    meta;   //!< Node metadata.
     ast_concatenation_type   type;  //!< The type of concatenation
     ast_expression         * repeat;//!< The number of repetitions. Normally 1.
-    ast_list               * items; //!< sequence of items.
+    ast_list               * items; //!< ast_expression, in order.
 };
 
 /*!
@@ -1600,7 +1657,7 @@ typedef struct ast_udp_body_t{
 //! Describes a single combinatorial entry in the UDP ast tree.
 typedef struct ast_udp_combinatorial_entry_t{
     ast_metadata    meta;   //!< Node metadata.
-    ast_list * input_levels;
+    ast_list * input_levels; //!< ast_level_symbol, each allocated alone.
     ast_udp_next_state  output_symbol;
 } ast_udp_combinatorial_entry;
 
@@ -1610,7 +1667,8 @@ typedef struct ast_udp_sequential_entry_t{
     ast_udp_seqential_entry_prefix entry_prefix;
     union {
         ast_list * edges; //!< iff entry_prefix == PREFIX_EDGES
-        ast_list * levels;  //!< iff entry_prefix == PREFIX_LEVELS
+        ast_list * levels;  //!< iff entry_prefix == PREFIX_LEVELS.
+                            //!< ast_level_symbol, each allocated alone.
     };
     ast_level_symbol   current_state;
     ast_udp_next_state output;
@@ -1620,7 +1678,8 @@ typedef struct ast_udp_sequential_entry_t{
 @brief Describes the declaration of a user defined primitive (UDP)
 @note The ports member can represent the udp_port_list non-terminal
 in the grammar. This means that the first element is the output terminal,
-while the subsequent elements are input terminals.
+while the subsequent elements are input terminals. Otherwise it holds one
+ast_udp_port for each port declaration, in order.
 */
 typedef struct ast_udp_declaration_t{
     ast_metadata    meta;   //!< Node metadata.
@@ -1842,17 +1901,22 @@ ast_module_instance * ast_new_module_instance(
 
 /*! 
 @brief Decribes a single port connection in a module instance.
+@details Every item of a port connection list is one of these, whether the
+port is named or connected by position, so lists may be walked without
+knowing which. Lists of parameter values given to an instantiation are the
+same.
 @note This is also used to represent parameter assignments.
 */
 typedef struct ast_port_connection_t{
     ast_metadata    meta;   //!< Node metadata.
-    ast_identifier   port_name;
-    ast_expression * expression;
+    ast_identifier   port_name;  //!< NULL for positional connections.
+    ast_expression * expression; //!< NULL for unconnected ports.
 } ast_port_connection;
 
 /*!
 @brief Creates and returns a new port connection representation.
-@param port_name - The port being assigned to.
+@param port_name - The port being assigned to, or NULL if the connection is
+made by position.
 @param expression - The thing inside the module the port connects to.
 @note This is also used for module parameter assignments.
 */
@@ -2222,6 +2286,8 @@ typedef enum ast_gate_type_e{
 
 /*!
 @brief Fully describes the instantiation of one or more gate level primitives.
+@details The instance list of whichever member is set holds every gate the
+statement instantiates, in order.
 */
 typedef struct ast_gate_instantiation_t{
     ast_metadata    meta;   //!< Node metadata.
@@ -2440,6 +2506,7 @@ typedef struct ast_type_declaration_t{
     ast_declaration_type  type;
     ast_net_type          net_type;
     ast_list            * identifiers;
+    ast_list            * values;   //!< Assigned to each identifier, or NULL.
     ast_delay3          * delay;
     ast_drive_strength  * drive_strength;
     ast_charge_strength   charge_strength;
@@ -2491,6 +2558,18 @@ ast_list * ast_new_net_declaration(
     ast_type_declaration * type_dec
 );
 
+/*!
+@brief Fills in the identifiers of a net type declaration, and the values
+assigned to them, from a list of net declaration assignments.
+@param [inout] type_dec - The declaration to fill in.
+@param [in] assignments - ast_single_assignment, one for each net.
+Assignments without a value give a NULL value.
+*/
+void ast_set_net_decl_assignments(
+    ast_type_declaration * type_dec,
+    ast_list             * assignments
+);
+
 /*!
 @brief Creates a new reg declaration object.
 @details Turns a generic "type declaration" object into a reg_declration
@@ -2799,7 +2878,7 @@ typedef enum ast_module_item_type_e{
     MOD_ITEM_GENERATED_INSTANTIATION,
     MOD_ITEM_PARAMETER_DECLARATION, //!< Local or global.
     MOD_ITEM_SPECIFY_BLOCK,
-    MOD_ITEM_SPECPARAM_DECLARATION,
+    MOD_ITEM_SPECPARAM_DECLARATION, //!< Whatever the module header style.
     MOD_ITEM_PARAMETER_OVERRIDE,
     MOD_ITEM_CONTINOUS_ASSIGNMENT, //!< access continuous_assignment
     MOD_ITEM_GATE_INSTANTIATION,
@@ -2816,9 +2895,39 @@ typedef enum ast_module_item_type_e{
     MOD_ITEM_EVENT_DECLARATION,
     MOD_ITEM_GENVAR_DECLARATION,
     MOD_ITEM_TASK_DECLARATION,
-    MOD_ITEM_FUNCTION_DECLARATION
+    MOD_ITEM_FUNCTION_DECLARATION,
+    MOD_ITEM_SKIPPED_CONSTRUCT //!< Skipped over in skeleton mode.
 } ast_module_item_type;
 
+/*!
+@brief A behavioural construct which was skipped over rather than parsed.
+@details Stands in for always and initial constructs, function and task
+declarations and specify blocks when parsing in skeleton mode. Only where
+the construct was is recorded. Byte offsets are into the file the construct
+was found in. Where a macro expansion is involved, they count the expanded
+text as though it were part of the file.
+@see verilog_parser_context
+*/
+typedef struct ast_skipped_construct_t{
+    ast_metadata         meta;     //!< Node metadata. Line of the keyword.
+    ast_module_item_type type;     //!< What sort of construct was skipped.
+    ast_line             end_line; //!< Line it ends on, counting from one.
+    size_t               start;    //!< Byte offset of the first character.
+    size_t               end;      //!< Byte offset after the last character.
+} ast_skipped_construct;
+
+/*!
+@brief Creates and returns a new skipped construct, starting at the current
+line.
+@param [in] type - What sort of construct is being skipped.
+@param [in] start - The byte offset of its first character.
+@note The end of the construct is filled in once it is found.
+*/
+ast_skipped_construct * ast_new_skipped_construct(
+    ast_module_item_type type,
+    size_t               start
+);
+
 //! Describes a single module item, its type and data structure.
 struct ast_module_item_t{
     ast_metadata    meta;   //!< Node metadata.
@@ -2847,6 +2956,7 @@ struct ast_module_item_t{
         ast_type_declaration        * genvar_declaration;
         ast_task_declaration        * task_declaration;
         ast_function_declaration    * function_declaration;
+        ast_skipped_construct       * skipped_construct;
     };
 };
 
@@ -2881,15 +2991,35 @@ ast_statement_block * ast_extract_statement_block(
 @brief Details declaration of module ports and parameters.
 */
 
+/*!
+@brief Where to find the body of a module which has not been parsed yet.
+@details Records everything needed to parse the declaration on its own
+later on: where its text is, and the state of the preprocessor, such as the
+macros defined, when it was reached.
+@see verilog_parse_path_lazy
+*/
+typedef struct ast_lazy_module_t{
+    char        * path;     //!< The file the declaration is in.
+    size_t        start;    //!< Byte offset its text starts at.
+    size_t        length;   //!< Length of its text in bytes.
+    ast_line      line;     //!< The line its text starts on.
+    //! A snapshot of the preprocessor taken before the declaration.
+    struct verilog_preprocessor_context_t * preprocessor;
+    ast_boolean   failed;   //!< Set if the text could not be parsed.
+} ast_lazy_module;
+
 /*!
 @brief Fully describes a single module declaration in terms of parameters
 ports and internal constructs.
-@details
+@details If lazy is not NULL, only the name of the module is known so far,
+and its lists are all empty. @ref verilog_find_module_declaration parses
+the rest of it, in place, the first time it is looked up.
 */
 struct ast_module_declaration_t{
     ast_metadata    meta;   //!< Node metadata.
     ast_node_attributes * attributes; //!< Tool specific attributes.
     ast_identifier        identifier; //!< The name of the module.
+    ast_lazy_module     * lazy;       //!< Body still to parse, or NULL.
     ast_list * always_blocks; //!< ast_statement_block
     ast_list * continuous_assignments; //!< ast_single_assignment
     ast_list * event_declarations; //!< ast_var_declaration
@@ -2909,10 +3039,11 @@ struct ast_module_declaration_t{
     ast_list * realtime_declarations; //!< ast_var_declaration
     ast_list * reg_declarations; //!< ast_reg_declaration
     ast_list * specify_blocks; //!< Not Supported
-    ast_list * specparams; //!< ast_parameter_declaration
+    ast_list * specparams; //!< ast_parameter_declaration, for any header.
     ast_list * task_declarations; //!< ast_task_declaration
     ast_list * time_declarations; //!< ast_var_declaration
     ast_list * udp_instantiations; //!< ast_udp_instantiation
+    ast_list * skipped_constructs; //!< ast_skipped_construct
 
 } ;
 
@@ -3018,7 +3149,7 @@ typedef enum ast_id_range_or_index_e{
 struct ast_identifier_t{
     ast_metadata    meta;   //!< Node metadata.
     ast_identifier_type   type;         //!< What construct does it identify?
-    char                * identifier;   //!< The identifier value.
+    char                * identifier;   //!< Interned text. Do not modify.
     unsigned int          from_line;    //!< The line number of the file.
     ast_boolean           is_system;    //!< Is this a system identifier?
     ast_identifier        next;         //!< Represents a hierarchical id.
@@ -3043,14 +3174,41 @@ array.
 */
 char * ast_identifier_tostring(ast_identifier id);
 
+/*!
+@brief Returns a string which can be used as a hashtable key for an
+identifier.
+@details Two identifiers get keys which compare equal exactly when
+@ref ast_identifier_eq says they are equal. For simple identifiers the key
+is the interned text itself, so nothing is allocated. Otherwise it is the
+full name, as from @ref ast_identifier_tostring, allocated in the given
+region.
+@param [in] id - The identifier to make a key for.
+@param [inout] region - Where to allocate the key if one is needed.
+*/
+char * ast_identifier_key(ast_identifier id, ast_region * region);
+
 /*!
 @brief Acts like strcmp but works on ast identifiers.
+@details Hierarchical identifiers are compared as the concatenation of their
+segments, exactly as returned by @ref ast_identifier_tostring. No memory is
+allocated.
 */
 int ast_identifier_cmp(
     ast_identifier a,
     ast_identifier b
 );
 
+/*!
+@brief Returns true if two identifiers have the same text.
+@details Faster than @ref ast_identifier_cmp when only equality is needed,
+since the cached length and hash of each interned segment let most unequal
+pairs be rejected without comparing text.
+*/
+ast_boolean ast_identifier_eq(
+    ast_identifier a,
+    ast_identifier b
+);
+
 /*!
 @brief Creates and returns a new node representing an identifier.
 @details By default, the returned identifier has the ID_UNKNOWN type,
@@ -3262,22 +3420,116 @@ set manually.
 */
 ast_source_item * ast_new_source_item(ast_source_item_type type);
 
+//! Typedef over verilog_source_tree_t
+typedef struct verilog_source_tree_t verilog_source_tree;
+
+/*!
+@brief An entry in the file table of a source tree.
+@details Text parsed from memory gets an entry too, with no path, so that
+the lines of nodes parsed from it can still be found.
+*/
+typedef struct ast_source_file_t{
+    ast_file_id   id;       //!< As stored in node metadata.
+    ast_file_id   parent;   //!< The file which first included it, or zero.
+    char        * path;     //!< The path, as the preprocessor named it.
+    ast_line      line;     //!< The line of parent it was included on.
+    ast_boolean   indexed;  //!< True once newlines has been filled in.
+    size_t        newline_count; //!< Number of entries in newlines.
+    size_t      * newlines; //!< Offset of every newline in the file.
+} ast_source_file;
+
+/*!
+@brief The files a source tree's nodes come from.
+@details Defined in verilog_ast.c. Trees which are made to be merged share
+a table, and it is locked while it changes, so that trees being parsed on
+different threads may do so at once.
+*/
+typedef struct verilog_file_table_t verilog_file_table;
+
+/*!
+@brief Called by the parser as each module or primitive declaration is
+completed.
+@param [in] tree - The tree the declaration is being parsed into.
+@param [in] item - The declaration.
+@param [in] data - The data pointer given with the callback.
+@returns AST_TRUE to add the declaration to the tree, or AST_FALSE to have
+it released as soon as the callback returns.
+@see verilog_source_tree_set_callback
+*/
+typedef ast_boolean (*verilog_description_callback)(
+    verilog_source_tree * tree,
+    ast_source_item     * item,
+    void                * data
+);
+
 /*!
 @brief Top level container for parsed source code.
 @details All source code which the parser processes is placed inside an
 instance of this object. It contains lists of all top level objects which
 a verilog source file can contain.
+
+Every node parsed into the tree is allocated from the tree's own memory
+region, so that releasing the tree with @ref verilog_free_source_tree
+releases exactly the nodes which belong to it.
+
+Modules should be added with @ref verilog_source_tree_add_module, which
+keeps the module_index up to date as well as the modules list.
+
+If a callback is set with @ref verilog_source_tree_set_callback, the nodes
+of each module and primitive declaration are instead allocated from the
+description_region, so that declarations the callback does not keep can be
+released one at a time.
 */
-typedef struct verilog_source_tree_t{
+struct verilog_source_tree_t{
     ast_list    *   modules;
     ast_list    *   primitives;
     ast_list    *   configs;
     ast_list    *   libraries;
-} verilog_source_tree;
+    ast_region  *   region;     //!< Owns all memory for the tree's nodes.
+    ast_hashtable * module_index;   //!< Module declarations by name.
+    unsigned int    modules_indexed;//!< How many modules are in the index.
+    /*!
+    @brief Lists of unresolved module instantiations, keyed by the name of
+    the module they instantiate.
+    @details Filled by @ref verilog_resolve_modules, and emptied as modules
+    of the right names are added to the tree.
+    */
+    ast_hashtable * pending_instantiations;
+    unsigned int    modules_resolved;//!< Modules seen by module resolution.
+    //! Called as each declaration is parsed, or NULL.
+    verilog_description_callback description_callback;
+    void          * callback_data;  //!< Passed through to the callback.
+    //! Holds the declaration being parsed while a callback is set.
+    ast_region    * description_region;
+    //! True if the description_region also holds declarations kept.
+    ast_boolean     description_kept;
+    /*!
+    @brief What was parsed from each file by
+    @ref verilog_parse_path_incremental, keyed by path.
+    */
+    ast_hashtable * file_units;
+    verilog_file_table * file_table; //!< Possibly shared with other trees.
+    ast_hashtable * file_index; //!< Files of file_table looked up, by path.
+    char          * last_path;  //!< Path ast_current_file saw last.
+    ast_file_id     last_file;  //!< Id of last_path.
+    ast_file_id     text_file;  //!< Id of text being parsed from memory.
+};
+
 
+/*!
+@brief This is where we put all of the parsed constructs.
+@details Each thread has its own. The parse functions point it at the tree
+of the parser context being used for as long as they run.
+*/
+extern AST_THREAD_LOCAL verilog_source_tree * yy_verilog_source_tree;
 
-//! This is where we put all of the parsed constructs.
-extern verilog_source_tree * yy_verilog_source_tree;
+/*!
+@brief The span of the rule the parser is reducing, or of the token the
+scanner has just read, or NULL when nothing is being parsed.
+@details Each thread has its own. @ref ast_set_meta_info gives new nodes
+this position.
+*/
+extern AST_THREAD_LOCAL ast_location * yy_node_location;
 
 
 /*!
@@ -3287,16 +3539,305 @@ have an object to put parsed constructs into.
 */
 verilog_source_tree * verilog_new_source_tree();
 
+/*!
+@brief Creates and returns a new, empty source tree which shares the file
+table of another.
+@details Files get the same ids in both, so the new tree can be merged into
+the other, or the other into it, without renumbering any nodes. Either tree
+may be parsed into on a different thread from the other.
+@param [in] files_of - The tree whose file table to share.
+*/
+verilog_source_tree * verilog_new_source_tree_sharing(
+    verilog_source_tree * files_of
+);
+
 /*!
 @brief Releases a source tree object from memory.
 @details Frees the top level source tree object, and all of it's child
-ast_* objects by calling the ast_free_all function.
+ast_* objects by releasing the memory region which owns them.
 @param [in] tofree - The source tree to be free'd
+@warning Any pointers into the tree, including ones held by other trees
+after module resolution, are invalid once this returns.
 */
 void verilog_free_source_tree(
     verilog_source_tree * tofree
 );
 
+/*!
+@brief Adds a module declaration to a source tree.
+@details Appends the module to the modules list, and records it in the
+tree's module_index so that @ref verilog_find_module_declaration can look it
+up by name. Where two modules share a name, the first one added is the one
+found. Any instantiations already waiting for a module of this name, after
+an earlier call to @ref verilog_resolve_modules, are resolved to it.
+@param [inout] tree - The tree to add the module to.
+@param [in] module - The module declaration to add.
+*/
+void verilog_source_tree_add_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+);
+
+/*!
+@brief Inserts a module declaration into a source tree, at a given position
+in its modules list.
+@details Does what @ref verilog_source_tree_add_module does, but keeps the
+modules list in some order, such as the order of the source. If the module
+goes before modules which @ref verilog_resolve_modules has passed over, its
+instantiations are resolved straight away.
+@param [inout] tree - The tree to add the module to.
+@param [in] index - Where the module goes. An index past the end of the
+list appends it.
+@param [in] module - The module declaration to add.
+*/
+void verilog_source_tree_insert_module(
+    verilog_source_tree    * tree,
+    unsigned int             index,
+    ast_module_declaration * module
+);
+
+/*!
+@brief Replaces a module declaration in a source tree with a new version of
+it, in place.
+@details The new declaration is copied over the old one, so instantiations
+resolved to the old one stay resolved, and it keeps its place in the
+modules list. Instantiations the old one made which were waiting for
+modules to be added stop waiting, and those of the new one are resolved.
+@param [inout] tree - The tree holding the module.
+@param [inout] module - The declaration to replace.
+@param [in] parsed - The new declaration. Only its contents are used.
+@pre Both declarations have the same name.
+*/
+void verilog_source_tree_replace_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module,
+    ast_module_declaration * parsed
+);
+
+/*!
+@brief Removes a module declaration from a source tree.
+@details The module is taken out of the modules list and the module_index.
+Instantiations which had been resolved to it are unresolved, and wait for
+another module of the same name to be added. If the tree already holds
+another module of that name, they are resolved to it straight away.
+Instantiations the module itself made stop waiting for modules to be added.
+The module's memory is not released until the tree is.
+@param [inout] tree - The tree to remove the module from.
+@param [in] module - The module to remove. Nothing happens if it is not in
+the tree.
+*/
+void verilog_source_tree_remove_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+);
+
+/*!
+@brief Adds any modules appended directly to the modules list of a tree to
+its module_index.
+@details Only needed by code which appends to the modules list itself
+rather than using @ref verilog_source_tree_add_module.
+*/
+void verilog_source_tree_index_modules(
+    verilog_source_tree * tree
+);
+
+/*!
+@brief Adds a module or primitive declaration which has just been parsed to
+a source tree.
+@details Called by the parser for each declaration as soon as it is
+complete. If the tree has a callback, it is called first, and decides
+whether the declaration is added or released.
+@param [inout] tree - The tree being parsed into.
+@param [in] item - The declaration.
+*/
+void verilog_source_tree_add_description(
+    verilog_source_tree * tree,
+    ast_source_item     * item
+);
+
+/*!
+@brief Sets a function to be called as each module or primitive
+declaration parsed into a tree is completed.
+@details This allows very large inputs to be processed one declaration at a
+time, in bounded memory. While a callback is set, each declaration is parsed
+into a region of its own. If the callback returns AST_FALSE, the
+declaration is not added to the tree, and all of its memory is released
+(and reused for the next declaration) as soon as the callback returns.
+The callback must not keep any pointers into a declaration it releases.
+@param [inout] tree - The tree which will be parsed into.
+@param [in] callback - The function to call, or NULL to stop calling one.
+@param [in] data - Passed through to the callback.
+@note Kept declarations share regions, but a declaration released just
+after one was kept is only freed along with the tree.
+*/
+void verilog_source_tree_set_callback(
+    verilog_source_tree          * tree,
+    verilog_description_callback   callback,
+    void                         * data
+);
+
+/*!
+@brief Moves the contents of one source tree onto the end of another.
+@details The modules, primitives, configs and libraries of "from" are
+appended, in order, to those of "into", and modules are added to its
+module_index. Files in the file table of "from" are added to that of
+"into". Unless the trees share a file table, the nodes of "from" are then
+visited to give them the ids their files have in "into", which is the only
+part of a merge which takes time in proportion to the size of "from".
+Module resolution is not run. The memory region of "from" is
+adopted by "into", so the moved nodes stay valid until "into" is freed.
+@param [inout] into - The tree to add to.
+@param [in] from - The tree to take the contents of. It is consumed, and
+must not be used or freed afterwards.
+*/
+void verilog_source_tree_merge(
+    verilog_source_tree * into,
+    verilog_source_tree * from
+);
+
+/*!
+@brief Adds a file to the file table of a source tree, if it is not already
+there.
+@param [inout] tree - The tree to add the file to.
+@param [in] path - The path of the file. It is copied.
+@returns The file's id, for use in node metadata.
+*/
+ast_file_id verilog_source_tree_add_file(
+    verilog_source_tree * tree,
+    char                * path
+);
+
+/*!
+@brief Finds the newlines of a file afresh, after it has changed.
+@details Lines and columns are otherwise worked out from the newlines found
+when the file was parsed, which are wrong once it has been edited.
+@param [inout] tree - The tree whose file table holds the file.
+@param [in] path - The file. It is added to the table if it is not there.
+@param [in] text - The file's contents as they are now.
+@param [in] length - The length of the text in bytes.
+@note Nodes of any tree sharing the table, which were read from the file as
+it was, get lines from the new text too.
+*/
+void verilog_source_tree_index_file(
+    verilog_source_tree * tree,
+    char                * path,
+    const char          * text,
+    size_t                length
+);
+
+/*!
+@brief Finds the newlines of a file which has just been read, as
+@ref verilog_source_tree_index_file does, unless they have been found
+already.
+@details Used for include files, which are read again for every file which
+includes them.
+@param [inout] tree - The tree whose file table holds the file.
+@param [in] path - The file. It is added to the table if it is not there.
+@param [in] text - The file's contents.
+@param [in] length - The length of the text in bytes.
+*/
+void verilog_source_tree_index_new_file(
+    verilog_source_tree * tree,
+    char                * path,
+    const char          * text,
+    size_t                length
+);
+
+/*!
+@brief Gives an entry in the file table of a source tree the newlines found
+when the file was parsed, unless it has some already.
+@details Used to restore them when a saved tree is loaded.
+@param [inout] tree - The tree whose file table holds the file.
+@param [in] file - The id of the file's entry.
+@param [in] newlines - The offset of every newline in the file. They are
+copied.
+@param [in] count - The number of newlines.
+*/
+void verilog_source_tree_set_newlines(
+    verilog_source_tree * tree,
+    ast_file_id           file,
+    const size_t        * newlines,
+    size_t                count
+);
+
+/*!
+@brief Adds text parsed from memory to the file table of a source tree.
+@details The newlines in the text are found straight away, since it may be
+gone by the time a line is asked for.
+@param [inout] tree - The tree to add the text to.
+@param [in] text - The text, or NULL if its lines are not known.
+@param [in] length - The length of the text in bytes.
+@returns The id of the new entry, for use in node metadata.
+*/
+ast_file_id verilog_source_tree_add_text(
+    verilog_source_tree * tree,
+    const char          * text,
+    size_t                length
+);
+
+/*!
+@brief Adds a file to the file table of a source tree as it is included,
+recording which file included it.
+@details Only the first include of each file is recorded.
+@param [inout] tree - The tree to add the file to.
+@param [in] path - The path of the included file. It is copied.
+@param [in] parent - The path of the file with the include directive, or
+NULL if it is the text being parsed from memory.
+@param [in] line - The line of the include directive.
+*/
+void verilog_source_tree_add_include(
+    verilog_source_tree * tree,
+    char                * path,
+    char                * parent,
+    ast_line              line
+);
+
+//! Returns the number of entries in the file table of a source tree.
+unsigned int verilog_source_tree_file_count(
+    verilog_source_tree * tree
+);
+
+/*!
+@brief Looks up a file, named by node metadata, in the file table of a
+source tree.
+@param [in] tree - The tree the node belongs to.
+@param [in] file - The file member of the node's metadata.
+@returns The file's entry, or NULL if it is not in the table.
+*/
+ast_source_file * verilog_source_tree_get_file(
+    verilog_source_tree * tree,
+    ast_file_id           file
+);
+
+/*!
+@brief Works out the line of the position in some node metadata.
+@details The newlines of each file are found as it is parsed, and kept with
+its entry in the file table, so this just searches them. That is so for
+files read lazily, from a parse cache or from an image too, so the file
+need not still be there. Only a file which was added to the table without
+being parsed is read, the first time a line in it is asked for.
+@param [in] tree - The tree the node belongs to.
+@param [in] meta - The node's metadata.
+@returns The line, counting from one, or zero if the file is not known.
+*/
+ast_line verilog_source_tree_get_line(
+    verilog_source_tree * tree,
+    ast_metadata        * meta
+);
+
+/*!
+@brief Works out the column of the position in some node metadata, in the
+same way as @ref verilog_source_tree_get_line works out its line.
+@param [in] tree - The tree the node belongs to.
+@param [in] meta - The node's metadata.
+@returns The column, counting from one, in bytes, or zero if the file is
+not known.
+*/
+unsigned int verilog_source_tree_get_column(
+    verilog_source_tree * tree,
+    ast_metadata        * meta
+);
+
 // --------------------------------------------------------------
 
 /*!
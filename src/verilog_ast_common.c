@@ -12,17 +12,21 @@
 
 #include "verilog_ast_common.h"
 
+//! Number of slots allocated the first time an item is added to a list.
+#define AST_LIST_MIN_CAPACITY 8
+
 /*!
 @brief Creates and returns a pointer to a new linked list.
+@details No storage is allocated until the first item is added.
 */
 ast_list * ast_list_new ()
 {
     ast_list * tr = ast_calloc(1, sizeof(ast_list));
-    tr -> head          = NULL;
-    tr -> tail          = NULL;
-    tr -> walker        = NULL;
+    tr -> storage       = NULL;
+    tr -> elements      = NULL;
     tr -> items         = 0;
-    tr -> current_item  = 0;
+    tr -> capacity      = 0;
+    tr -> region        = ast_region_current();
     return tr;
 }
 
@@ -30,27 +34,79 @@ ast_list * ast_list_new ()
 @brief Frees the memory of the supplied linked list.
 @note Does not free the memory of the data elements in the list, only
 the list construct itself.
+@note The list is allocated from a memory region, so its storage is only
+returned to the system when that region is released.
 */
 void       ast_list_free(ast_list * list)
 {
-    if(list -> items > 0)
+    // The list and its elements live in the region they were allocated
+    // from, and are reclaimed when that region is released. All we can do
+    // here is make sure the list is not used again by accident.
+    list -> storage      = NULL;
+    list -> elements     = NULL;
+    list -> items        = 0;
+    list -> capacity     = 0;
+}
+
+//! Number of free slots in front of the first item of a list.
+#define AST_LIST_HEADROOM(L) ((unsigned int)((L) -> elements - (L) -> storage))
+
+//! Number of free slots after the last item of a list.
+#define AST_LIST_TAILROOM(L) \
+    ((L) -> capacity - AST_LIST_HEADROOM(L) - (L) -> items)
+
+/*!
+@brief Re-allocates the storage of a list so that it has at least
+"headroom" free slots in front of the items and "tailroom" after them.
+@details Capacity at least doubles each time, so growth is amortised O(1).
+Growing at the back only is done with ast_region_realloc, which can often
+extend the array in place.
+*/
+static void ast_list_grow(
+    ast_list     * list,
+    unsigned int   headroom,
+    unsigned int   tailroom
+){
+    unsigned int needed   = headroom + list -> items + tailroom;
+    unsigned int capacity = list -> capacity * 2;
+
+    if(capacity < AST_LIST_MIN_CAPACITY)
     {
-        list -> walker = list -> head;
-        
-        // Walk along the list, freeing elements as we go.
-        while(list -> walker != NULL)
-        {
-            ast_list_element * tmp = list -> walker;
-            list -> walker = list -> walker -> next;
+        capacity = AST_LIST_MIN_CAPACITY;
+    }
+    if(capacity < needed)
+    {
+        capacity = needed;
+    }
+
+    // Give whichever end is growing all of the extra space.
+    unsigned int old_headroom = AST_LIST_HEADROOM(list);
+    unsigned int new_headroom = old_headroom;
+    if(headroom > old_headroom)
+    {
+        new_headroom = capacity - list -> items - AST_LIST_TAILROOM(list);
+    }
 
-            if(tmp != NULL)
-            {
-                free(tmp);
-            }
+    void ** storage;
+    if(new_headroom == old_headroom)
+    {
+        storage = ast_region_realloc(list -> region, list -> storage,
+                                     list -> capacity * sizeof(void*),
+                                     capacity * sizeof(void*));
+    }
+    else
+    {
+        storage = ast_region_calloc(list -> region, capacity, sizeof(void*));
+        if(list -> items > 0)
+        {
+            memcpy(storage + new_headroom, list -> elements,
+                   list -> items * sizeof(void*));
         }
     }
 
-    free(list);
+    list -> storage  = storage;
+    list -> elements = storage + new_headroom;
+    list -> capacity = capacity;
 }
 
 /*!
@@ -58,24 +114,24 @@ void       ast_list_free(ast_list * list)
 */
 void       ast_list_append(ast_list * list, void * data)
 {
-    if(list -> items == 0)
+    if(list -> storage == NULL || AST_LIST_TAILROOM(list) == 0)
     {
-        list -> head         = ast_calloc(1,sizeof(ast_list_element));
-        list -> head -> next = NULL;
-        list -> head -> data = data;
-
-        list -> tail         = list -> head;
-        list -> walker       = list -> tail;
-        list -> items       += 1;
-        list -> current_item = list -> items-1;
+        ast_list_grow(list, 0, 1);
     }
-    else
-    {
-        list -> tail -> next = ast_calloc(1, sizeof(ast_list_element));
-        list -> tail = list -> tail -> next;
-        list -> tail -> data = data;
 
-        list -> items += 1;
+    list -> elements[list -> items] = data;
+    list -> items += 1;
+}
+
+/*!
+@brief Makes sure that "count" items can be appended to the list without
+it needing to grow.
+*/
+void       ast_list_reserve(ast_list * list, unsigned int count)
+{
+    if(list -> storage == NULL || AST_LIST_TAILROOM(list) < count)
+    {
+        ast_list_grow(list, 0, count);
     }
 }
 
@@ -85,66 +141,65 @@ void       ast_list_append(ast_list * list, void * data)
 */
 void      ast_list_remove_at(ast_list * list, unsigned int i)
 {
-    if(i > list -> items - 1)
+    if(i >= list -> items)
     {
         return;
     }
+    else if(i == 0)
+    {
+        // Removing the front item just gives it back as headroom.
+        list -> elements += 1;
+        list -> items    -= 1;
+    }
     else
     {
-        if(i <= list -> current_item)
-        {
-            list -> current_item = 0;
-            list -> walker = list -> head;
-        }
-
-        while(list -> current_item != i-1 && list -> walker != NULL)
-        {
-            list -> walker = list -> walker -> next;
-            list -> current_item += 1;
-        }
-        if(i > 0){
-            assert(i-1 == list -> current_item);
-            list -> walker -> next = list -> walker -> next -> next;
-            list -> items -= 1;
-            //ast_list_element * toremove =  list -> walker -> next;
-            //free(toremove);
-        } else {
-            list -> head = list -> head -> next;
-            //ast_list_element * toremove =  list -> head;
-            //free(toremove);
-            list -> items -= 1;
-        }
+        memmove(list -> elements + i, list -> elements + i + 1,
+                (list -> items - i - 1) * sizeof(void*));
+        list -> items -= 1;
     }
 }
 
 
 /*!
-@brief Adds a new item to the front of a linked list.
+@brief Inserts an item into a linked list, so that it becomes the i'th.
 */
-void       ast_list_preappend(ast_list * list, void * data)
+void      ast_list_insert_at(ast_list * list, unsigned int i, void * data)
 {
-    if(list -> items == 0)
+    if(i >= list -> items)
     {
-        list -> head         = ast_calloc(1,sizeof(ast_list_element));
-        list -> head -> next = NULL;
-        list -> head -> data = data;
-
-        list -> tail         = list -> head;
-        list -> walker       = list -> tail;
-        list -> items       += 1;
-        list -> current_item = list -> items-1;
+        ast_list_append(list, data);
+        return;
     }
-    else
+    else if(i == 0)
+    {
+        ast_list_preappend(list, data);
+        return;
+    }
+
+    if(list -> storage == NULL || AST_LIST_TAILROOM(list) == 0)
     {
-        ast_list_element * to_add = ast_calloc(1, sizeof(ast_list_element));
-        to_add -> data = data;
+        ast_list_grow(list, 0, 1);
+    }
 
-        to_add -> next = list -> head;
-        list   -> head = to_add;
+    memmove(list -> elements + i + 1, list -> elements + i,
+            (list -> items - i) * sizeof(void*));
+    list -> elements[i] = data;
+    list -> items += 1;
+}
 
-        list -> items += 1;
-        list -> current_item += 1;
+/*!
+@brief Adds a new item to the front of a linked list.
+*/
+void       ast_list_preappend(ast_list * list, void * data)
+{
+    if(list -> storage == NULL || AST_LIST_HEADROOM(list) == 0)
+    {
+        ast_list_grow(list, 1, 0);
     }
+
+    list -> elements -= 1;
+    list -> elements[0] = data;
+    list -> items += 1;
 }
 
 /*!
@@ -152,35 +207,16 @@ void       ast_list_preappend(ast_list * list, void * data)
 @details Returns a void* pointer. The programmer must be sure to cast this
 as the correct type.
 */
-void *    ast_list_get(ast_list * list, unsigned int item)
+void *    ast_list_get(const ast_list * list, unsigned int item)
 {
     assert(list != NULL);
-    if(item > list -> items - 1)
+    if(item >= list -> items)
     {
         return NULL;
     }
     else
     {
-        if(item < list -> current_item)
-        {
-            list -> current_item = 0;
-            list -> walker = list -> head;
-        }
-
-        while(list -> current_item != item && list -> walker != NULL)
-        {
-            list -> walker = list -> walker -> next;
-            list -> current_item += 1;
-        }
-
-        if(list -> walker == NULL)
-        {
-            return NULL;
-        }
-        else
-        {
-            return list -> walker -> data;
-        }
+        return list -> elements[item];
     }
 }
 
@@ -193,34 +229,38 @@ pointer has the same address as the supplied data pointer, the item is
 considered to be found.
 */
 int ast_list_contains(
-    ast_list * list,
+    const ast_list * list,
     void * data
 ){
     assert(list != NULL);
-    if(list -> items  <= 0)
-    {
-        return 0;
-    }
-    else
-    {
-        list -> current_item = 0;
-        list -> walker = list -> head;
 
-        while(list -> walker != NULL)
+    unsigned int i;
+    for(i = 0; i < list -> items; i ++)
+    {
+        if(list -> elements[i] == data)
         {
-            if(list -> walker -> data == data)
-            {
-                return 1;
-            }
-            else
-            {
-                list -> walker = list -> walker -> next;
-                list -> current_item += 1;
-            }
+            return 1;
         }
+    }
+
+    return 0;
+}
+
 
-        return 0;
+//! Returns an iterator positioned at the first item of a list.
+ast_list_iterator ast_list_begin(const ast_list * list)
+{
+    assert(list != NULL);
+
+    ast_list_iterator tr;
+    tr.item = list -> elements;
+    tr.end  = list -> elements;
+
+    if(tr.item != NULL)
+    {
+        tr.end += list -> items;
     }
+    return tr;
 }
 
 
@@ -229,43 +269,22 @@ int ast_list_contains(
 @param head - This will form the "front" of the new list.
 @param tail - This will form the "end" of the new list.
 @details This function takes all the elements in tail and appends them
-to those in head. The tail argument is then released from memory, and the
-original head pointer is returned, with all data items still in tact.
+to those in head. The tail argument is left untouched, and the original
+head pointer is returned, with all data items still in tact.
 */
 ast_list *    ast_list_concat(ast_list * head, ast_list * tail)
 {
     assert(head != NULL);
     assert(tail != NULL);
 
-    // Perform the concatenation.
-
-    if(head -> tail == NULL)
-    {
-        head -> tail = tail -> head;
-        head -> head = tail -> head;
-    }
-    else if(head -> tail -> next == NULL)
-    {
-        head -> tail -> next = tail -> head;
-        head -> tail = tail -> tail;
-    }
-    else
+    if(tail -> items > 0)
     {
-        while(head -> tail -> next != NULL)
-        {
-            head -> tail = head -> tail -> next;
-        }
-        head -> tail -> next = tail -> head;
-        head -> tail = tail -> tail;
+        ast_list_reserve(head, tail -> items);
+        memcpy(head -> elements + head -> items, tail -> elements,
+               tail -> items * sizeof(void*));
+        head -> items += tail -> items;
     }
 
-    head -> items += tail -> items;
-    head -> walker = head -> head;
-    head -> current_item = 0;
-
-    // Free only the tail data-structure, not it's elements.
-    //free(tail);
-
     // return the new list.
     return head;
 }
@@ -276,6 +295,7 @@ ast_list *    ast_list_concat(ast_list * head, ast_list * tail)
 ast_stack * ast_stack_new(){
     ast_stack * tr = ast_calloc(1,sizeof(ast_stack));
     tr -> depth = 0;
+    tr -> region = ast_region_current();
     return tr;
 }
 
@@ -284,14 +304,10 @@ ast_stack * ast_stack_new(){
 */
 void ast_stack_free(ast_stack * stack){
     assert(stack != NULL);
-    
-    while(stack -> items != NULL){
-        ast_stack_element * tmp = stack -> items -> next;
-        free(stack -> items);
-        stack -> items = tmp;
-    }
 
-    free(stack);
+    // Stack elements are region allocated, so just drop them.
+    stack -> items = NULL;
+    stack -> depth = 0;
 }
 
 /*!
@@ -307,12 +323,14 @@ void ast_stack_push(
 
     if(stack -> items == NULL)
     {
-        stack -> items = ast_calloc(1,sizeof(ast_stack_element));
+        stack -> items = ast_region_calloc(stack -> region, 1,
+                                           sizeof(ast_stack_element));
         stack -> items -> data = item;
     } 
     else
     {
-        ast_stack_element * toadd = ast_calloc(1,sizeof(ast_stack_element));
+        ast_stack_element * toadd = ast_region_calloc(stack -> region, 1,
+                                           sizeof(ast_stack_element));
         toadd -> data = item;
         toadd -> next = stack -> items;
         stack -> items = toadd;
@@ -399,7 +417,9 @@ ast_hashtable * ast_hashtable_new(){
     ast_hashtable * tr = ast_calloc(1,sizeof(ast_hashtable));
 
     tr -> size = 0;
-    tr -> elements = ast_list_new();
+    tr -> capacity = 0;
+    tr -> elements = NULL;
+    tr -> region = ast_region_current();
 
     return tr;
 }
@@ -408,11 +428,118 @@ ast_hashtable * ast_hashtable_new(){
 void  ast_hashtable_free(
     ast_hashtable * table  //!< The table to free.
 ){
-    ast_list_free(table -> elements);
-    free(table);
+    // The slots are released along with the table's region.
+    table -> elements = NULL;
+    table -> capacity = 0;
+    table -> size = 0;
     return;
 }
 
+//! How far the element in a slot is from the slot its hash wants.
+#define AST_HASH_DISTANCE(T,E,SLOT) \
+    (((SLOT) - (E) -> hash) & ((T) -> capacity - 1))
+
+/*!
+@brief Places an element known not to be in the table, robin-hood style.
+@details Whenever the element being placed is further from its home slot
+than the one occupying a slot, they swap, and the displaced element carries
+on looking for a slot. This keeps probe lengths short and even.
+@pre There is at least one empty slot.
+*/
+static void ast_hashtable_place(
+    ast_hashtable         * table,
+    ast_hashtable_element   toplace
+){
+    unsigned int mask = table -> capacity - 1;
+    unsigned int slot = toplace.hash & mask;
+    unsigned int dist = 0;
+
+    while(table -> elements[slot].key != NULL)
+    {
+        ast_hashtable_element * e = &(table -> elements[slot]);
+        unsigned int e_dist = AST_HASH_DISTANCE(table, e, slot);
+
+        if(e_dist < dist)
+        {
+            ast_hashtable_element swap = *e;
+            *e      = toplace;
+            toplace = swap;
+            dist    = e_dist;
+        }
+
+        slot = (slot + 1) & mask;
+        dist ++;
+    }
+
+    table -> elements[slot] = toplace;
+}
+
+//! Re-allocates the slots of a table and re-inserts every element.
+static void ast_hashtable_resize(
+    ast_hashtable * table,
+    unsigned int    capacity
+){
+    ast_hashtable_element * old_elements = table -> elements;
+    unsigned int            old_capacity = table -> capacity;
+
+    table -> elements = ast_region_calloc(table -> region, capacity,
+        sizeof(ast_hashtable_element));
+    table -> capacity = capacity;
+
+    unsigned int i;
+    for(i = 0; i < old_capacity; i ++)
+    {
+        if(old_elements[i].key != NULL)
+        {
+            ast_hashtable_place(table, old_elements[i]);
+        }
+    }
+}
+
+/*!
+@brief Returns the slot holding key, or -1 if it is not in the table.
+*/
+static int ast_hashtable_find(
+    ast_hashtable * table,
+    char          * key,
+    unsigned int    hash
+){
+    if(table -> size == 0)
+    {
+        return -1;
+    }
+
+    unsigned int mask = table -> capacity - 1;
+    unsigned int slot = hash & mask;
+    unsigned int dist = 0;
+
+    while(table -> elements[slot].key != NULL)
+    {
+        ast_hashtable_element * e = &(table -> elements[slot]);
+
+        if(AST_HASH_DISTANCE(table, e, slot) < dist)
+        {
+            // Key would have displaced this element had it been present.
+            return -1;
+        }
+        else if(e -> hash == hash && strcmp(e -> key, key) == 0)
+        {
+            return (int)slot;
+        }
+
+        slot = (slot + 1) & mask;
+        dist ++;
+    }
+
+    return -1;
+}
+
+//! Hashes a hashtable key.
+static unsigned int ast_hashtable_hash(char * key)
+{
+    return ast_string_hash(key, strlen(key));
+}
+
 //! Inserts a new item into the hashtable.
 ast_hashtable_result ast_hashtable_insert(
     ast_hashtable * table, //!< The table to insert into.
@@ -422,21 +549,21 @@ ast_hashtable_result ast_hashtable_insert(
     assert(key != NULL);
     assert(table != NULL);
 
-    unsigned int i;
-    for(i = 0; i < table -> elements -> items; i ++)
+    unsigned int hash = ast_hashtable_hash(key);
+
+    if(ast_hashtable_find(table, key, hash) >= 0)
     {
-        ast_hashtable_element * e = ast_list_get(table->elements, i);
-        if(e != NULL)
-        {
-            if(strcmp(e -> key , key) == 0){
-                return HASH_KEY_COLLISION;
-            }
-        }
+        return HASH_KEY_COLLISION;
     }
-    ast_hashtable_element * toinsert = ast_calloc(1,sizeof(ast_hashtable_element));
-    toinsert -> key = key;
-    toinsert -> data = value;
-    ast_list_append(table -> elements, toinsert);;
+
+    ast_hashtable_reserve(table, table -> size + 1);
+
+    ast_hashtable_element toinsert;
+    toinsert.key  = key;
+    toinsert.data = value;
+    toinsert.hash = hash;
+    ast_hashtable_place(table, toinsert);
+    table -> size ++;
 
     return HASH_SUCCESS;
 }
@@ -447,19 +574,15 @@ ast_hashtable_result ast_hashtable_get(
     char          * key,   //!< The key of the data to fetch.
     void         ** value  //!< [out] The data being returned.
 ){
-    unsigned int i;
-    for(i = 0; i < table -> elements -> items; i ++)
+    int slot = ast_hashtable_find(table, key, ast_hashtable_hash(key));
+
+    if(slot < 0)
     {
-        ast_hashtable_element * e = ast_list_get(table->elements, i);
-        if(e != NULL)
-        {
-            if(strcmp(e -> key , key) == 0){
-                *value = (e -> data);
-                return HASH_SUCCESS;
-            }
-        }
+        return HASH_KEY_NOT_FOUND;
     }
-    return HASH_KEY_NOT_FOUND;
+
+    *value = table -> elements[slot].data;
+    return HASH_SUCCESS;
 }
 
 //! Removes a key value pair from the hashtable.
@@ -467,19 +590,33 @@ ast_hashtable_result ast_hashtable_delete(
     ast_hashtable * table, //!< The table to delete from.
     char          * key    //!< The key to delete.
 ){
-    unsigned int i;
-    for(i = 0; i < table -> elements -> items; i ++)
+    int found = ast_hashtable_find(table, key, ast_hashtable_hash(key));
+
+    if(found < 0)
     {
-        ast_hashtable_element * e = ast_list_get(table->elements, i);
-        if(e != NULL)
-        {
-            if(strcmp(e -> key , key) == 0){
-                ast_list_remove_at(table->elements, i);
-                return HASH_SUCCESS;
-            }
-        }
+        return HASH_KEY_NOT_FOUND;
+    }
+
+    // Shift every following displaced element back by one slot, so that no
+    // tombstone is needed to keep their probe sequences intact.
+    unsigned int mask = table -> capacity - 1;
+    unsigned int slot = (unsigned int)found;
+    unsigned int next = (slot + 1) & mask;
+
+    while(table -> elements[next].key != NULL &&
+          AST_HASH_DISTANCE(table, &(table -> elements[next]), next) > 0)
+    {
+        table -> elements[slot] = table -> elements[next];
+        slot = next;
+        next = (next + 1) & mask;
     }
-    return HASH_KEY_NOT_FOUND;
+
+    table -> elements[slot].key  = NULL;
+    table -> elements[slot].data = NULL;
+    table -> elements[slot].hash = 0;
+    table -> size --;
+
+    return HASH_SUCCESS;
 }
 
 //! Updates an existing item in the hashtable.
@@ -488,14 +625,63 @@ ast_hashtable_result ast_hashtable_update(
     char          * key,   //!< The key to update with.
     void          * value  //!< The new data item to update.
 ){
-    unsigned int i;
-    for(i = 0; i < table -> elements -> items; i ++)
+    int slot = ast_hashtable_find(table, key, ast_hashtable_hash(key));
+
+    if(slot < 0)
+    {
+        return HASH_KEY_NOT_FOUND;
+    }
+
+    table -> elements[slot].data = value;
+    return HASH_SUCCESS;
+}
+
+/*!
+@brief Makes sure the table can hold at least "count" elements without
+growing.
+*/
+void ast_hashtable_reserve(
+    ast_hashtable * table, //!< The table to grow.
+    unsigned int    count  //!< The number of elements to make room for.
+){
+    unsigned int capacity = table -> capacity ? table -> capacity : 16;
+
+    // Keep the table at most three quarters full.
+    while(count > capacity - capacity / 4)
+    {
+        capacity *= 2;
+    }
+
+    if(capacity != table -> capacity)
+    {
+        ast_hashtable_resize(table, capacity);
+    }
+}
+
+//! Returns the number of slots currently allocated for the table.
+unsigned int ast_hashtable_capacity(
+    ast_hashtable * table  //!< The table to query.
+){
+    return table -> capacity;
+}
+
+/*!
+@brief Steps through every element of the table, in no particular order.
+*/
+ast_hashtable_element * ast_hashtable_iterate(
+    ast_hashtable * table,   //!< The table to iterate over.
+    unsigned int  * position //!< [inout] Where to continue from.
+){
+    while(*position < table -> capacity)
     {
-        ast_hashtable_element * e = ast_list_get(table->elements, i);
-        if(strcmp(e -> key , key) == 0){
-            e -> data = value;
-            return HASH_SUCCESS;
+        ast_hashtable_element * e = &(table -> elements[*position]);
+        *position += 1;
+
+        if(e -> key != NULL)
+        {
+            return e;
         }
     }
-    return HASH_KEY_NOT_FOUND;
+
+    return NULL;
 }
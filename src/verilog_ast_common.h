@@ -20,35 +20,34 @@
 @defgroup ast-linked-lists Linked List
 @{
 @ingroup ast-utility
+@brief An ordered list of pointers.
+@details Despite the name, which is kept for compatibility, the list is
+stored as a contiguous array which grows geometrically. Getting the i'th
+item is O(1), and appending is amortised O(1). Free slots are kept at the
+front of the array as well as the back, so that adding items to the front
+of the list is also amortised O(1).
 */
 
 
-//! Typedef for the ast_list_element_t
-typedef struct ast_list_element_t ast_list_element;
-
 /*!
-@brief Storage container for a single element in the linked list.
-*/
-struct ast_list_element_t{
-    ast_list_element * next;
-    void             * data;
-};
-
-
-/*!
-@brief Container struct for the linked list data structure.
+@brief Container struct for the list data structure.
+@details The items live in elements[0] to elements[items-1]. The elements
+pointer points into the storage array, leaving room in front of it for
+@ref ast_list_preappend.
 */
 typedef struct ast_list_t {
-    ast_list_element *  head;         //!< The "front" of the list.
-    ast_list_element *  tail;         //!< The "end" of the list.
-    ast_list_element *  walker;       //!< Used to "walk" along the list.
+    void             ** storage;      //!< Start of the allocated array.
+    void             ** elements;     //!< The first item in the list.
     unsigned int        items;        //!< Number of items in the list.
-    unsigned int        current_item; //! Current position of walker in list.
+    unsigned int        capacity;     //!< Number of slots in storage.
+    ast_region       *  region;       //!< Where list elements are allocated.
 } ast_list;
 
 
 /*!
 @brief Creates and returns a pointer to a new linked list.
+@details The list, and every element later added to it, is allocated from
+the current region. See @ref ast_region_current.
 */
 ast_list * ast_list_new ();
 
@@ -56,6 +55,9 @@ ast_list * ast_list_new ();
 @brief Frees the memory of the supplied linked list.
 @note Does not free the memory of the data elements in the list, only
 the list construct itself.
+@note The list is allocated from a memory region, so its storage is only
+returned to the system when that region is released. After this call the
+list is empty.
 */
 void       ast_list_free(ast_list * list);
 
@@ -70,25 +72,39 @@ void       ast_list_append(ast_list * list, void * data);
 */
 void       ast_list_preappend(ast_list * list, void * data);
 
+/*!
+@brief Makes sure that "count" items can be appended to the list without
+it needing to grow.
+*/
+void       ast_list_reserve(ast_list * list, unsigned int count);
+
 /*!
 @brief Finds and returns the i'th item in the linked list.
 @details Returns a void* pointer. The programmer must be sure to cast this
-as the correct type.
+as the correct type. Takes constant time, and does not modify the list, so
+many threads may read the same list at once.
+@returns The item, or NULL if the index is past the end of the list.
 */
-void *    ast_list_get(ast_list * list, unsigned int item);
+void *    ast_list_get(const ast_list * list, unsigned int item);
 
 /*!
 @brief Removes the i'th item from a linked list.
 */
 void      ast_list_remove_at(ast_list * list, unsigned int i);
 
+/*!
+@brief Inserts an item into a linked list, so that it becomes the i'th.
+@details An index at or past the end of the list appends the item.
+*/
+void      ast_list_insert_at(ast_list * list, unsigned int i, void * data);
+
 /*!
 @brief concatenates the two supplied lists into one.
 @param head - This will form the "front" of the new list.
 @param tail - This will form the "end" of the new list.
 @details This function takes all the elements in tail and appends them
-to those in head. The tail argument is then released from memory, and the
-original head pointer is returned, with all data items still in tact.
+to those in head. The tail argument is left untouched, and the original
+head pointer is returned, with all data items still in tact.
 */
 ast_list *    ast_list_concat(ast_list * head, ast_list * tail);
 
@@ -101,10 +117,52 @@ pointer has the same address as the supplied data pointer, the item is
 considered to be found.
 */
 int ast_list_contains(
-    ast_list * list,
+    const ast_list * list,
     void * data
 );
 
+/*!
+@brief A read-only cursor over the items of a list.
+@details Iterators hold no state inside the list itself, so any number of
+them may walk the same list at once, from any number of threads, provided
+nothing modifies the list meanwhile.
+@see ast_list_begin ast_list_foreach
+*/
+typedef struct ast_list_iterator_t{
+    void * const * item;    //!< The item the iterator is currently at.
+    void * const * end;     //!< One past the last item of the list.
+} ast_list_iterator;
+
+//! Returns an iterator positioned at the first item of a list.
+ast_list_iterator ast_list_begin(const ast_list * list);
+
+//! True once an iterator has moved past the last item of its list.
+#define ast_list_iterator_done(IT) ((IT).item >= (IT).end)
+
+//! Returns the item an iterator is currently at.
+#define ast_list_iterator_get(IT) (*((IT).item))
+
+//! Moves an iterator on to the next item.
+#define ast_list_iterator_next(IT) ((IT).item ++)
+
+/*!
+@brief Runs the following statement once for each item in a list, in order.
+@details ITEM must be a variable of the list's element type, declared
+beforehand, which holds the current item inside the loop body.
+@code
+ast_module_declaration * module;
+ast_list_foreach(module, source -> modules)
+{
+    ...
+}
+@endcode
+*/
+#define ast_list_foreach(ITEM, LIST)                                    \
+    for(ast_list_iterator ITEM ## _iterator = ast_list_begin(LIST);     \
+        !ast_list_iterator_done(ITEM ## _iterator) &&                   \
+            (((ITEM) = ast_list_iterator_get(ITEM ## _iterator)), 1);   \
+        ast_list_iterator_next(ITEM ## _iterator))
+
 
 /*! @} */
 
@@ -131,6 +189,7 @@ struct ast_stack_element_t{
 typedef struct ast_stack_t{
     unsigned int          depth; //!< How many items are on the stack?
     ast_stack_element   * items; //!< The stack of items.
+    ast_region          * region;//!< Where stack elements are allocated.
 } ast_stack;
 
 /*!
@@ -187,12 +246,16 @@ void * ast_stack_peek2(
 @defgroup ast-hashtable Hash Table
 @{
 @ingroup ast-utility
-@brief A *very* simple hash table implemented (for now) over a linked list.
-@details This can be used for simple key-value pair storage. Current
-access time is O(n) for a table with N elements in it.
-@warning This is a *terrible* way to implement a hash table. It doesn't
-even do any hashing!
-@todo Re-implement over a proper hash table structure.
+@brief A hash table keyed by null terminated strings.
+@details This can be used for simple key-value pair storage. The table uses
+open addressing with robin-hood probing over a power-of-two number of slots.
+Each slot stores the hash of its key, so probes rarely need to compare key
+text, and deletion shifts later entries back rather than leaving
+tombstones. The table grows automatically once it is three quarters full.
+
+Keys are not copied, and must remain valid for as long as they are in the
+table. Slot arrays are allocated from the region that was current when the
+table was created.
 */
 
 /*! @} */
@@ -200,15 +263,18 @@ even do any hashing!
 
 //! A single element in the hash table.
 typedef struct ast_hashtable_element_t{
-    char * key; //!< The key for the element.
+    char * key; //!< The key for the element, or NULL for an empty slot.
     void * data;    //!< The data associated with they key.
+    unsigned int hash;  //!< Hash of the key, from ast_string_hash.
 } ast_hashtable_element;
 
 
 //! A hash table object.
 typedef struct ast_hashtable_t{
-    ast_list * elements; //!< The items.
-    unsigned int size;   //!< The number of elements in the table.
+    ast_hashtable_element * elements; //!< The slots, capacity of them.
+    unsigned int size;      //!< The number of elements in the table.
+    unsigned int capacity;  //!< The number of slots. Zero or a power of two.
+    ast_region * region; //!< Where table elements are allocated.
 } ast_hashtable;
 
 typedef enum ast_hashtable_result_e{
@@ -253,4 +319,37 @@ ast_hashtable_result ast_hashtable_update(
     void          * value  //!< The new data item to update.
 );
 
+/*!
+@brief Makes sure the table can hold at least "count" elements without
+growing.
+*/
+void ast_hashtable_reserve(
+    ast_hashtable * table, //!< The table to grow.
+    unsigned int    count  //!< The number of elements to make room for.
+);
+
+//! Returns the number of slots currently allocated for the table.
+unsigned int ast_hashtable_capacity(
+    ast_hashtable * table  //!< The table to query.
+);
+
+/*!
+@brief Steps through every element of the table, in no particular order.
+@details Set *position to zero to begin. Each call returns the next element
+and advances *position, until NULL is returned once every element has been
+visited. The table must not be modified while it is being iterated over.
+@code
+unsigned int position = 0;
+ast_hashtable_element * e;
+while((e = ast_hashtable_iterate(table, &position)) != NULL)
+{
+    printf("%s\n", e -> key);
+}
+@endcode
+*/
+ast_hashtable_element * ast_hashtable_iterate(
+    ast_hashtable * table,   //!< The table to iterate over.
+    unsigned int  * position //!< [inout] Where to continue from.
+);
+
 #endif
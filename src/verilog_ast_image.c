@@ -0,0 +1,2532 @@
+/*!
+@file verilog_ast_image.c
+@brief Contains definitions of functions for saving source trees to, and
+loading them from, binary images.
+*/
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "verilog_ast_image.h"
+#include "verilog_parser.h"
+
+/*!
+@brief Set in an offset to show that it is into the packed list headers
+rather than the nodes.
+@details Everything in an image is aligned to at least this many bytes
+plus one, so the bit is otherwise always clear.
+*/
+#define IMAGE_LIST_TAG 1
+
+//! Alignment of every node and string in an image.
+#define IMAGE_ALIGN (sizeof(void*))
+
+/*!
+@brief First address which images prefer to be mapped at.
+@details Chosen to be well clear of where programs and shared libraries are
+normally mapped on 64-bit systems. Each image picks one of 256 bases
+@ref IMAGE_BASE_STEP apart from this, so that several can usually be loaded
+without being relocated.
+*/
+#define IMAGE_BASE ((size_t)0x100000000000ULL)
+
+//! Distance between the bases images may choose.
+#define IMAGE_BASE_STEP ((size_t)1 << 36)
+
+//! A growable block of bytes an image is built in.
+typedef struct verilog_image_buffer_t{
+    char      * data;   //!< The bytes.
+    size_t      used;   //!< Number of bytes written.
+    size_t      size;   //!< Number of bytes allocated.
+} verilog_image_buffer;
+
+/*!
+@brief An open addressing table from the address of something written to an
+image to its offset in the image.
+*/
+typedef struct verilog_image_map_t{
+    const void ** keys;     //!< Addresses, or NULL for empty slots.
+    size_t      * values;   //!< Offsets, parallel to keys.
+    size_t        count;    //!< Number of keys stored.
+    size_t        capacity; //!< Number of slots. Always a power of two.
+} verilog_image_map;
+
+//! State kept while a tree is written to an image.
+typedef struct verilog_image_writer_t{
+    verilog_image_buffer  nodes;       //!< Header, nodes and strings.
+    verilog_image_buffer  lists;       //!< Packed list headers.
+    verilog_image_buffer  relocations; //!< Offsets of pointer slots.
+    verilog_image_map     written;     //!< Nodes written so far.
+    size_t              * strings;     //!< Offsets of strings, by hash.
+    size_t                string_count;
+    size_t                string_capacity;
+    ast_metadata_visitor  visit;       //!< If set, only visit, not write.
+    void                * visit_data;  //!< Passed to visit.
+} verilog_image_writer;
+
+/*!
+@brief Writes one item of a list, or the target of a pointer, returning its
+offset in the image, or zero for NULL.
+*/
+typedef size_t (*verilog_image_item)(verilog_image_writer * w, void * data);
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Appends zeroed space to a buffer.
+@returns The offset of the space within the buffer.
+*/
+static size_t image_reserve(verilog_image_buffer * buffer, size_t size)
+{
+    size_t at   = (buffer -> used + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+    size_t need = at + size;
+
+    if(need > buffer -> size)
+    {
+        size_t grown = buffer -> size ? buffer -> size * 2 : 64 * 1024;
+        while(grown < need)
+        {
+            grown *= 2;
+        }
+        buffer -> data = realloc(buffer -> data, grown);
+        buffer -> size = grown;
+    }
+
+    memset(buffer -> data + buffer -> used, 0, need - buffer -> used);
+    buffer -> used = need;
+    return at;
+}
+
+//! Returns the slot in a map where a key is, or should be inserted.
+static size_t image_map_slot(verilog_image_map * map, const void * key)
+{
+    size_t mask = map -> capacity - 1;
+    size_t slot = (((size_t)key >> 3) * (size_t)0x9E3779B97F4A7C15ULL) & mask;
+
+    while(map -> keys[slot] != NULL && map -> keys[slot] != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+//! Finds the offset recorded for a key, or returns NULL.
+static size_t * image_map_find(verilog_image_map * map, const void * key)
+{
+    if(map -> count == 0)
+    {
+        return NULL;
+    }
+    size_t slot = image_map_slot(map, key);
+    return map -> keys[slot] == key ? &map -> values[slot] : NULL;
+}
+
+//! Records the offset of a key which is not yet in the map.
+static void image_map_insert(
+    verilog_image_map * map,
+    const void        * key,
+    size_t              value
+){
+    if((map -> count + 1) * 2 > map -> capacity)
+    {
+        verilog_image_map grown;
+        grown.capacity = map -> capacity ? map -> capacity * 2 : 1024;
+        grown.count    = map -> count;
+        grown.keys     = calloc(grown.capacity, sizeof(void*));
+        grown.values   = calloc(grown.capacity, sizeof(size_t));
+
+        size_t i;
+        for(i = 0; i < map -> capacity; i ++)
+        {
+            if(map -> keys[i] != NULL)
+            {
+                size_t slot = image_map_slot(&grown, map -> keys[i]);
+                grown.keys[slot]   = map -> keys[i];
+                grown.values[slot] = map -> values[i];
+            }
+        }
+
+        free(map -> keys);
+        free(map -> values);
+        *map = grown;
+    }
+
+    size_t slot = image_map_slot(map, key);
+    map -> keys[slot]   = key;
+    map -> values[slot] = value;
+    map -> count ++;
+}
+
+//! Returns the address within the writer's buffers of a (tagged) offset.
+static char * image_at(verilog_image_writer * w, size_t offset)
+{
+    if(offset & IMAGE_LIST_TAG)
+    {
+        return w -> lists.data + (offset & ~(size_t)IMAGE_LIST_TAG);
+    }
+    return w -> nodes.data + offset;
+}
+
+/*!
+@brief Stores the offset of a pointer's target in a pointer slot, and
+records the slot for relocation.
+@param [inout] w - The writer.
+@param [in] slot - Offset of the pointer to set.
+@param [in] target - Offset of what it points to, or zero for NULL.
+*/
+static void image_pointer(verilog_image_writer * w, size_t slot, size_t target)
+{
+    if(w -> visit != NULL)
+    {
+        return;
+    }
+
+    *(size_t*)image_at(w, slot) = target;
+
+    if(target != 0)
+    {
+        size_t at = image_reserve(&w -> relocations, sizeof(size_t));
+        *(size_t*)(w -> relocations.data + at) = slot;
+    }
+}
+
+//! Sets the pointer member FIELD, of a node of type TYPE written at AT.
+#define IMAGE_FIELD(W, AT, TYPE, FIELD, TARGET) \
+    image_pointer((W), (AT) + offsetof(TYPE, FIELD), (TARGET))
+
+/*!
+@brief Copies a node into the image, unless it has been already.
+@details When the writer is only visiting, nothing is copied, and the
+offset given is just a stand in, but the node is still only visited once.
+@param [inout] w - The writer.
+@param [in] node - The node to copy, or NULL.
+@param [in] size - The size of the node.
+@param [in] meta - Whether the node starts with its metadata.
+@param [out] at - Set to the offset of the copy, or zero if node is NULL.
+@returns AST_TRUE if the node was copied, and its pointer members must now
+be written, or AST_FALSE if there is nothing more to do.
+*/
+static ast_boolean image_copy(
+    verilog_image_writer * w,
+    const void           * node,
+    size_t                 size,
+    ast_boolean            meta,
+    size_t               * at
+){
+    if(node == NULL)
+    {
+        *at = 0;
+        return AST_FALSE;
+    }
+
+    size_t * found = image_map_find(&w -> written, node);
+    if(found != NULL)
+    {
+        *at = *found;
+        return AST_FALSE;
+    }
+
+    if(w -> visit != NULL)
+    {
+        *at = IMAGE_ALIGN;
+        if(meta)
+        {
+            w -> visit((ast_metadata*)node, NULL, w -> visit_data);
+        }
+    }
+    else
+    {
+        *at = image_reserve(&w -> nodes, size);
+        memcpy(w -> nodes.data + *at, node, size);
+    }
+    image_map_insert(&w -> written, node, *at);
+    return AST_TRUE;
+}
+
+//! Copies a node which starts with its metadata, as every node but a few do.
+static ast_boolean image_visit(
+    verilog_image_writer * w,
+    const void           * node,
+    size_t                 size,
+    size_t               * at
+){
+    return image_copy(w, node, size, AST_TRUE, at);
+}
+
+/*!
+@brief Writes a null terminated string, giving it an interned string
+header. Each distinct string is only written once.
+@returns The offset of the text, or zero for NULL.
+*/
+static size_t image_string(verilog_image_writer * w, const char * text)
+{
+    if(text == NULL || w -> visit != NULL)
+    {
+        return 0;
+    }
+
+    size_t       length = strlen(text);
+    unsigned int hash   = ast_string_hash(text, length);
+
+    if((w -> string_count + 1) * 2 > w -> string_capacity)
+    {
+        size_t   capacity = w -> string_capacity ? w -> string_capacity * 2
+                                                 : 1024;
+        size_t * strings  = calloc(capacity, sizeof(size_t));
+        size_t i;
+        for(i = 0; i < w -> string_capacity; i ++)
+        {
+            size_t offset = w -> strings[i];
+            if(offset != 0)
+            {
+                size_t slot = ast_intern_hash(w -> nodes.data + offset) &
+                              (capacity - 1);
+                while(strings[slot] != 0)
+                {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                strings[slot] = offset;
+            }
+        }
+        free(w -> strings);
+        w -> strings         = strings;
+        w -> string_capacity = capacity;
+    }
+
+    size_t slot = hash & (w -> string_capacity - 1);
+    while(w -> strings[slot] != 0)
+    {
+        char * other = w -> nodes.data + w -> strings[slot];
+        if(ast_intern_hash(other) == hash &&
+           ast_intern_length(other) == length &&
+           memcmp(other, text, length) == 0)
+        {
+            return w -> strings[slot];
+        }
+        slot = (slot + 1) & (w -> string_capacity - 1);
+    }
+
+    size_t header = image_reserve(&w -> nodes,
+                                  sizeof(ast_interned) + length + 1);
+    ast_interned * interned = (ast_interned*)(w -> nodes.data + header);
+    interned -> hash   = hash;
+    interned -> length = length;
+    memcpy(interned + 1, text, length);
+
+    size_t tr = header + sizeof(ast_interned);
+    w -> strings[slot] = tr;
+    w -> string_count ++;
+    return tr;
+}
+
+/*!
+@brief Writes a list, and each of its items using the supplied function.
+@details The list header goes in the packed list section, and its storage
+is cut down to exactly the items it holds.
+@returns The tagged offset of the list header, or zero for NULL.
+*/
+static size_t image_list(
+    verilog_image_writer * w,
+    ast_list             * list,
+    verilog_image_item     item
+){
+    if(list == NULL)
+    {
+        return 0;
+    }
+
+    size_t * found = image_map_find(&w -> written, list);
+    if(found != NULL)
+    {
+        return *found;
+    }
+
+    if(w -> visit != NULL)
+    {
+        image_map_insert(&w -> written, list, IMAGE_LIST_TAG);
+
+        unsigned int i;
+        for(i = 0; i < list -> items; i ++)
+        {
+            item(w, list -> elements[i]);
+        }
+        return IMAGE_LIST_TAG;
+    }
+
+    size_t at = image_reserve(&w -> lists, sizeof(ast_list)) | IMAGE_LIST_TAG;
+    image_map_insert(&w -> written, list, at);
+
+    ast_list * header = (ast_list*)image_at(w, at);
+    header -> items    = list -> items;
+    header -> capacity = list -> items;
+
+    if(list -> items > 0)
+    {
+        size_t elements = image_reserve(&w -> nodes,
+                                        list -> items * sizeof(void*));
+        IMAGE_FIELD(w, at, ast_list, storage, elements);
+        IMAGE_FIELD(w, at, ast_list, elements, elements);
+
+        unsigned int i;
+        for(i = 0; i < list -> items; i ++)
+        {
+            image_pointer(w, elements + i * sizeof(void*),
+                          item(w, list -> elements[i]));
+        }
+    }
+
+    return at;
+}
+
+/*!
+@brief Writes an empty list in place of one whose items have no node type
+yet.
+*/
+static size_t image_unsupported(verilog_image_writer * w, void * data)
+{
+    ast_list * list = data;
+    if(list == NULL || w -> visit != NULL)
+    {
+        return 0;
+    }
+
+    size_t * found = image_map_find(&w -> written, list);
+    if(found != NULL)
+    {
+        return *found;
+    }
+
+    size_t at = image_reserve(&w -> lists, sizeof(ast_list)) | IMAGE_LIST_TAG;
+    image_map_insert(&w -> written, list, at);
+    return at;
+}
+
+//! Writes a string which is the item of a list.
+static size_t image_text(verilog_image_writer * w, void * data)
+{
+    return image_string(w, data);
+}
+
+//! Writes a level symbol, which has no pointers to follow, nor metadata.
+static size_t image_level_symbol(verilog_image_writer * w, void * data)
+{
+    size_t at;
+    image_copy(w, data, sizeof(ast_level_symbol), AST_FALSE, &at);
+    return at;
+}
+
+/*!
+@brief Writes a node which has no pointers to follow.
+@details Only the size of the node differs, so callers pass their own.
+*/
+static size_t image_leaf(verilog_image_writer * w, void * data, size_t size)
+{
+    size_t at;
+    image_visit(w, data, size, &at);
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+/*
+Every writer below follows the same pattern: copy the node, then write each
+thing it points to and set the matching pointer in the copy. Members of
+unions are chosen by the node's type, in the same way as the documentation
+of each node describes.
+*/
+
+static size_t image_expression(verilog_image_writer * w, void * data);
+static size_t image_statement(verilog_image_writer * w, void * data);
+static size_t image_identifier(verilog_image_writer * w, void * data);
+static size_t image_concatenation(verilog_image_writer * w, void * data);
+static size_t image_module_item(verilog_image_writer * w, void * data);
+static size_t image_module_declaration(verilog_image_writer * w, void*data);
+static size_t image_single_assignment(verilog_image_writer * w, void * data);
+static size_t image_timing_control(verilog_image_writer * w, void * data);
+static size_t image_config_declaration(verilog_image_writer * w, void*data);
+
+//! Writes a range.
+static size_t image_range(verilog_image_writer * w, void * data)
+{
+    ast_range * node = data;
+    size_t at;
+    if(image_copy(w, node, sizeof(ast_range), AST_FALSE, &at))
+    {
+        IMAGE_FIELD(w, at, ast_range, upper,
+                    image_expression(w, node -> upper));
+        IMAGE_FIELD(w, at, ast_range, lower,
+                    image_expression(w, node -> lower));
+    }
+    return at;
+}
+
+//! Writes an attribute, and those after it.
+static size_t image_attributes(verilog_image_writer * w, void * data)
+{
+    ast_node_attributes * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_node_attributes), &at))
+    {
+        IMAGE_FIELD(w, at, ast_node_attributes, attr_name,
+                    image_identifier(w, node -> attr_name));
+        IMAGE_FIELD(w, at, ast_node_attributes, attr_value,
+                    image_expression(w, node -> attr_value));
+        IMAGE_FIELD(w, at, ast_node_attributes, next,
+                    image_attributes(w, node -> next));
+    }
+    return at;
+}
+
+//! Writes an identifier, and the rest of its hierarchy.
+static size_t image_identifier(verilog_image_writer * w, void * data)
+{
+    ast_identifier node = data;
+    size_t at;
+    if(!image_copy(w, node, sizeof(struct ast_identifier_t),
+                   w -> visit == NULL, &at))
+    {
+        return at;
+    }
+    else if(w -> visit != NULL)
+    {
+        w -> visit(&(node -> meta), &(node -> from_line), w -> visit_data);
+    }
+
+    IMAGE_FIELD(w, at, struct ast_identifier_t, identifier,
+                image_string(w, node -> identifier));
+    IMAGE_FIELD(w, at, struct ast_identifier_t, next,
+                image_identifier(w, node -> next));
+
+    size_t index = 0;
+    switch(node -> range_or_idx)
+    {
+        case ID_HAS_RANGES:
+            index = image_list(w, node -> ranges, image_range);
+            break;
+        case ID_HAS_RANGE:
+            index = image_range(w, node -> range);
+            break;
+        case ID_HAS_INDEX:
+            index = image_expression(w, node -> index);
+            break;
+        default:
+            break;
+    }
+    IMAGE_FIELD(w, at, struct ast_identifier_t, ranges, index);
+    return at;
+}
+
+//! Writes a number.
+static size_t image_number(verilog_image_writer * w, void * data)
+{
+    ast_number * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_number), &at))
+    {
+        if(node -> representation == REP_BITS)
+        {
+            IMAGE_FIELD(w, at, ast_number, as_bits,
+                        image_string(w, node -> as_bits));
+        }
+    }
+    return at;
+}
+
+//! Writes a function call.
+static size_t image_function_call(verilog_image_writer * w, void * data)
+{
+    ast_function_call * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_function_call), &at))
+    {
+        IMAGE_FIELD(w, at, ast_function_call, function,
+                    image_identifier(w, node -> function));
+        IMAGE_FIELD(w, at, ast_function_call, arguments,
+                    image_list(w, node -> arguments, image_expression));
+        IMAGE_FIELD(w, at, ast_function_call, attributes,
+                    image_attributes(w, node -> attributes));
+    }
+    return at;
+}
+
+//! Writes an expression primary.
+static size_t image_primary(verilog_image_writer * w, void * data)
+{
+    ast_primary * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_primary), &at))
+    {
+        return at;
+    }
+
+
+    verilog_image_item item = NULL;
+    switch(node -> value_type)
+    {
+        case PRIMARY_NUMBER:        item = image_number;        break;
+        case PRIMARY_IDENTIFIER:    item = image_identifier;    break;
+        case PRIMARY_CONCATENATION: item = image_concatenation; break;
+        case PRIMARY_FUNCTION_CALL: item = image_function_call; break;
+        case PRIMARY_MINMAX_EXP:    item = image_expression;    break;
+        case PRIMARY_MACRO_USAGE:   item = image_identifier;    break;
+    }
+    IMAGE_FIELD(w, at, ast_primary, value,
+                item ? item(w, node -> value.number) : 0);
+    return at;
+}
+
+//! Writes an expression tree.
+static size_t image_expression(verilog_image_writer * w, void * data)
+{
+    ast_expression * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_expression), &at))
+    {
+        IMAGE_FIELD(w, at, ast_expression, attributes,
+                    image_attributes(w, node -> attributes));
+        IMAGE_FIELD(w, at, ast_expression, left,
+                    image_expression(w, node -> left));
+        IMAGE_FIELD(w, at, ast_expression, right,
+                    image_expression(w, node -> right));
+        IMAGE_FIELD(w, at, ast_expression, aux,
+                    image_expression(w, node -> aux));
+        IMAGE_FIELD(w, at, ast_expression, primary,
+                    image_primary(w, node -> primary));
+        IMAGE_FIELD(w, at, ast_expression, string,
+                    image_string(w, node -> string));
+    }
+    return at;
+}
+
+//! Writes a concatenation, all of whose items are expressions.
+static size_t image_concatenation(verilog_image_writer * w, void * data)
+{
+    ast_concatenation * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_concatenation), &at))
+    {
+        IMAGE_FIELD(w, at, ast_concatenation, repeat,
+                    image_expression(w, node -> repeat));
+        IMAGE_FIELD(w, at, ast_concatenation, items,
+                    image_list(w, node -> items, image_expression));
+    }
+    return at;
+}
+
+//! Writes the target of an assignment.
+static size_t image_lvalue(verilog_image_writer * w, void * data)
+{
+    ast_lvalue * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_lvalue), &at))
+    {
+        if(node -> type == NET_CONCATENATION ||
+           node -> type == VAR_CONCATENATION)
+        {
+            IMAGE_FIELD(w, at, ast_lvalue, data,
+                        image_concatenation(w, node -> data.concatenation));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_lvalue, data,
+                        image_identifier(w, node -> data.identifier));
+        }
+    }
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a delay value.
+static size_t image_delay_value(verilog_image_writer * w, void * data)
+{
+    ast_delay_value * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_delay_value), &at))
+    {
+        return at;
+    }
+
+
+    verilog_image_item item = NULL;
+    switch(node -> type)
+    {
+        case DELAY_VAL_PARAMETER:
+        case DELAY_VAL_SPECPARAM: item = image_identifier; break;
+        case DELAY_VAL_NUMBER:    item = image_number;     break;
+        case DELAY_VAL_MINTYPMAX: item = image_expression; break;
+    }
+    IMAGE_FIELD(w, at, ast_delay_value, data,
+                item ? item(w, node -> data) : 0);
+    return at;
+}
+
+//! Writes a set of three delays.
+static size_t image_delay3(verilog_image_writer * w, void * data)
+{
+    ast_delay3 * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_delay3), &at))
+    {
+        IMAGE_FIELD(w, at, ast_delay3, min,
+                    image_delay_value(w, node -> min));
+        IMAGE_FIELD(w, at, ast_delay3, max,
+                    image_delay_value(w, node -> max));
+        IMAGE_FIELD(w, at, ast_delay3, avg,
+                    image_delay_value(w, node -> avg));
+    }
+    return at;
+}
+
+//! Writes a pair of delays.
+static size_t image_delay2(verilog_image_writer * w, void * data)
+{
+    ast_delay2 * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_delay2), &at))
+    {
+        IMAGE_FIELD(w, at, ast_delay2, min,
+                    image_delay_value(w, node -> min));
+        IMAGE_FIELD(w, at, ast_delay2, max,
+                    image_delay_value(w, node -> max));
+    }
+    return at;
+}
+
+//! Writes a drive strength.
+static size_t image_drive_strength(verilog_image_writer * w, void * data)
+{
+    return image_leaf(w, data, sizeof(ast_drive_strength));
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes an event expression, or a sequence of them.
+static size_t image_event_expression(verilog_image_writer * w, void * data)
+{
+    ast_event_expression * node = data;
+    size_t at;
+    if(image_copy(w, node, sizeof(ast_event_expression), AST_FALSE, &at))
+    {
+        if(node -> type == EVENT_SEQUENCE)
+        {
+            IMAGE_FIELD(w, at, ast_event_expression, sequence,
+                image_list(w, node -> sequence, image_event_expression));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_event_expression, expression,
+                        image_expression(w, node -> expression));
+        }
+    }
+    return at;
+}
+
+//! Writes an event control.
+static size_t image_event_control(verilog_image_writer * w, void * data)
+{
+    ast_event_control * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_event_control), &at))
+    {
+        IMAGE_FIELD(w, at, ast_event_control, expression,
+                    image_event_expression(w, node -> expression));
+    }
+    return at;
+}
+
+//! Writes a delay control.
+static size_t image_delay_ctrl(verilog_image_writer * w, void * data)
+{
+    ast_delay_ctrl * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_delay_ctrl), &at))
+    {
+        if(node -> type == DELAY_CTRL_VALUE)
+        {
+            IMAGE_FIELD(w, at, ast_delay_ctrl, value,
+                        image_delay_value(w, node -> value));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_delay_ctrl, mintypmax,
+                        image_expression(w, node -> mintypmax));
+        }
+    }
+    return at;
+}
+
+//! Writes a statement with a delay or event control.
+static size_t image_timing_control(verilog_image_writer * w, void * data)
+{
+    ast_timing_control_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_timing_control_statement), &at))
+    {
+        if(node -> type == TIMING_CTRL_DELAY_CONTROL)
+        {
+            IMAGE_FIELD(w, at, ast_timing_control_statement, delay,
+                        image_delay_ctrl(w, node -> delay));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_timing_control_statement, event_ctrl,
+                        image_event_control(w, node -> event_ctrl));
+        }
+        IMAGE_FIELD(w, at, ast_timing_control_statement, repeat,
+                    image_expression(w, node -> repeat));
+        IMAGE_FIELD(w, at, ast_timing_control_statement, statement,
+                    image_statement(w, node -> statement));
+    }
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a single assignment.
+static size_t image_single_assignment(verilog_image_writer * w, void * data)
+{
+    ast_single_assignment * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_single_assignment), &at))
+    {
+        IMAGE_FIELD(w, at, ast_single_assignment, lval,
+                    image_lvalue(w, node -> lval));
+        IMAGE_FIELD(w, at, ast_single_assignment, expression,
+                    image_expression(w, node -> expression));
+        IMAGE_FIELD(w, at, ast_single_assignment, drive_strength,
+                    image_drive_strength(w, node -> drive_strength));
+        IMAGE_FIELD(w, at, ast_single_assignment, delay,
+                    image_delay3(w, node -> delay));
+    }
+    return at;
+}
+
+//! Writes a list of single assignments.
+static size_t image_single_assignments(verilog_image_writer * w, void * data)
+{
+    return image_list(w, data, image_single_assignment);
+}
+
+//! Writes a continuous assignment.
+static size_t image_continuous_assignment(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_continuous_assignment * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_continuous_assignment), &at))
+    {
+        IMAGE_FIELD(w, at, ast_continuous_assignment, assignments,
+            image_list(w, node -> assignments, image_single_assignment));
+    }
+    return at;
+}
+
+//! Writes a blocking or non-blocking assignment.
+static size_t image_procedural_assignment(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_procedural_assignment * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_procedural_assignment), &at))
+    {
+        IMAGE_FIELD(w, at, ast_procedural_assignment, lval,
+                    image_lvalue(w, node -> lval));
+        IMAGE_FIELD(w, at, ast_procedural_assignment, expression,
+                    image_expression(w, node -> expression));
+        IMAGE_FIELD(w, at, ast_procedural_assignment, delay_or_event,
+                    image_timing_control(w, node -> delay_or_event));
+    }
+    return at;
+}
+
+//! Writes a procedural continuous assignment.
+static size_t image_hybrid_assignment(verilog_image_writer * w, void * data)
+{
+    ast_hybrid_assignment * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_hybrid_assignment), &at))
+    {
+        if(node -> type == HYBRID_ASSIGNMENT_DEASSIGN ||
+           node -> type == HYBRID_ASSIGNMENT_RELEASE_VAR ||
+           node -> type == HYBRID_ASSIGNMENT_RELEASE_NET)
+        {
+            IMAGE_FIELD(w, at, ast_hybrid_assignment, lval,
+                        image_lvalue(w, node -> lval));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_hybrid_assignment, assignment,
+                        image_single_assignment(w, node -> assignment));
+        }
+    }
+    return at;
+}
+
+//! Writes any kind of assignment.
+static size_t image_assignment(verilog_image_writer * w, void * data)
+{
+    ast_assignment * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_assignment), &at))
+    {
+        return at;
+    }
+
+
+    verilog_image_item item = NULL;
+    switch(node -> type)
+    {
+        case ASSIGNMENT_CONTINUOUS:  item = image_continuous_assignment;
+                                     break;
+        case ASSIGNMENT_BLOCKING:
+        case ASSIGNMENT_NONBLOCKING: item = image_procedural_assignment;
+                                     break;
+        case ASSIGNMENT_HYBRID:      item = image_hybrid_assignment;
+                                     break;
+    }
+    IMAGE_FIELD(w, at, ast_assignment, continuous,
+                item ? item(w, node -> continuous) : 0);
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes one arm of a case statement.
+static size_t image_case_item(verilog_image_writer * w, void * data)
+{
+    ast_case_item * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_case_item), &at))
+    {
+        IMAGE_FIELD(w, at, ast_case_item, conditions,
+                    image_list(w, node -> conditions, image_expression));
+        IMAGE_FIELD(w, at, ast_case_item, body,
+                    image_statement(w, node -> body));
+    }
+    return at;
+}
+
+//! Writes a case statement.
+static size_t image_case_statement(verilog_image_writer * w, void * data)
+{
+    ast_case_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_case_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_case_statement, expression,
+                    image_expression(w, node -> expression));
+        IMAGE_FIELD(w, at, ast_case_statement, cases,
+                    image_list(w, node -> cases, image_case_item));
+        IMAGE_FIELD(w, at, ast_case_statement, default_item,
+                    image_statement(w, node -> default_item));
+    }
+    return at;
+}
+
+//! Writes one branch of an if statement.
+static size_t image_conditional_statement(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_conditional_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_conditional_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_conditional_statement, statement,
+                    image_statement(w, node -> statement));
+        IMAGE_FIELD(w, at, ast_conditional_statement, condition,
+                    image_expression(w, node -> condition));
+    }
+    return at;
+}
+
+//! Writes an if / else if / else statement.
+static size_t image_if_else(verilog_image_writer * w, void * data)
+{
+    ast_if_else * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_if_else), &at))
+    {
+        IMAGE_FIELD(w, at, ast_if_else, conditional_statements,
+                    image_list(w, node -> conditional_statements,
+                               image_conditional_statement));
+        IMAGE_FIELD(w, at, ast_if_else, else_condition,
+                    image_statement(w, node -> else_condition));
+    }
+    return at;
+}
+
+//! Writes a disable statement.
+static size_t image_disable_statement(verilog_image_writer * w, void * data)
+{
+    ast_disable_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_disable_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_disable_statement, id,
+                    image_identifier(w, node -> id));
+    }
+    return at;
+}
+
+//! Writes a generate block.
+static size_t image_generate_block(verilog_image_writer * w, void * data)
+{
+    ast_generate_block * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_generate_block), &at))
+    {
+        IMAGE_FIELD(w, at, ast_generate_block, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_generate_block, generate_items,
+                    image_list(w, node -> generate_items, image_statement));
+    }
+    return at;
+}
+
+//! Writes any kind of loop.
+static size_t image_loop_statement(verilog_image_writer * w, void * data)
+{
+    ast_loop_statement * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_loop_statement), &at))
+    {
+        return at;
+    }
+
+    if(node -> type == LOOP_GENERATE)
+    {
+        IMAGE_FIELD(w, at, ast_loop_statement, generate_items,
+                    image_list(w, node -> generate_items, image_statement));
+    }
+    else
+    {
+        IMAGE_FIELD(w, at, ast_loop_statement, inner_statement,
+                    image_statement(w, node -> inner_statement));
+    }
+    IMAGE_FIELD(w, at, ast_loop_statement, condition,
+                image_expression(w, node -> condition));
+    IMAGE_FIELD(w, at, ast_loop_statement, initial,
+                image_single_assignment(w, node -> initial));
+    IMAGE_FIELD(w, at, ast_loop_statement, modify,
+                image_single_assignment(w, node -> modify));
+    return at;
+}
+
+//! Writes a task enable statement.
+static size_t image_task_enable(verilog_image_writer * w, void * data)
+{
+    ast_task_enable_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_task_enable_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_task_enable_statement, expressions,
+                    image_list(w, node -> expressions, image_expression));
+        IMAGE_FIELD(w, at, ast_task_enable_statement, identifier,
+                    image_identifier(w, node -> identifier));
+    }
+    return at;
+}
+
+//! Writes a wait statement.
+static size_t image_wait_statement(verilog_image_writer * w, void * data)
+{
+    ast_wait_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_wait_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_wait_statement, expression,
+                    image_expression(w, node -> expression));
+        IMAGE_FIELD(w, at, ast_wait_statement, statement,
+                    image_statement(w, node -> statement));
+    }
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a declaration of several nets or variables of the same type.
+static size_t image_type_declaration(verilog_image_writer * w, void * data)
+{
+    ast_type_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_type_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_type_declaration, identifiers,
+                    image_list(w, node -> identifiers, image_identifier));
+        IMAGE_FIELD(w, at, ast_type_declaration, values,
+                    image_list(w, node -> values, image_expression));
+        IMAGE_FIELD(w, at, ast_type_declaration, delay,
+                    image_delay3(w, node -> delay));
+        IMAGE_FIELD(w, at, ast_type_declaration, drive_strength,
+                    image_drive_strength(w, node -> drive_strength));
+        IMAGE_FIELD(w, at, ast_type_declaration, range,
+                    image_range(w, node -> range));
+    }
+    return at;
+}
+
+//! Writes a net declaration.
+static size_t image_net_declaration(verilog_image_writer * w, void * data)
+{
+    ast_net_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_net_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_net_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_net_declaration, delay,
+                    image_delay3(w, node -> delay));
+        IMAGE_FIELD(w, at, ast_net_declaration, drive,
+                    image_drive_strength(w, node -> drive));
+        IMAGE_FIELD(w, at, ast_net_declaration, range,
+                    image_range(w, node -> range));
+        IMAGE_FIELD(w, at, ast_net_declaration, value,
+                    image_expression(w, node -> value));
+    }
+    return at;
+}
+
+//! Writes a reg declaration.
+static size_t image_reg_declaration(verilog_image_writer * w, void * data)
+{
+    ast_reg_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_reg_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_reg_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_reg_declaration, range,
+                    image_range(w, node -> range));
+        IMAGE_FIELD(w, at, ast_reg_declaration, value,
+                    image_expression(w, node -> value));
+    }
+    return at;
+}
+
+//! Writes a variable declaration.
+static size_t image_var_declaration(verilog_image_writer * w, void * data)
+{
+    ast_var_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_var_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_var_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+    }
+    return at;
+}
+
+//! Writes a set of parameter or specparam declarations.
+static size_t image_parameter_declarations(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_parameter_declarations * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_parameter_declarations), &at))
+    {
+        IMAGE_FIELD(w, at, ast_parameter_declarations, assignments,
+            image_list(w, node -> assignments, image_single_assignment));
+        IMAGE_FIELD(w, at, ast_parameter_declarations, range,
+                    image_range(w, node -> range));
+    }
+    return at;
+}
+
+//! Writes a port declaration.
+static size_t image_port_declaration(verilog_image_writer * w, void * data)
+{
+    ast_port_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_port_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_port_declaration, range,
+                    image_range(w, node -> range));
+        IMAGE_FIELD(w, at, ast_port_declaration, port_names,
+                    image_list(w, node -> port_names, image_identifier));
+    }
+    return at;
+}
+
+//! Writes a reg declaration inside a block.
+static size_t image_block_reg_declaration(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_block_reg_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_block_reg_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_block_reg_declaration, range,
+                    image_range(w, node -> range));
+        IMAGE_FIELD(w, at, ast_block_reg_declaration, identifiers,
+                    image_list(w, node -> identifiers, image_identifier));
+    }
+    return at;
+}
+
+//! Writes a declaration made inside a block.
+static size_t image_block_item_declaration(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_block_item_declaration * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_block_item_declaration), &at))
+    {
+        return at;
+    }
+
+    IMAGE_FIELD(w, at, ast_block_item_declaration, attributes,
+                image_attributes(w, node -> attributes));
+
+    verilog_image_item item = NULL;
+    switch(node -> type)
+    {
+        case BLOCK_ITEM_REG:   item = image_block_reg_declaration;  break;
+        case BLOCK_ITEM_PARAM: item = image_parameter_declarations; break;
+        case BLOCK_ITEM_TYPE:  item = image_type_declaration;       break;
+    }
+    IMAGE_FIELD(w, at, ast_block_item_declaration, reg,
+                item ? item(w, node -> reg) : 0);
+    return at;
+}
+
+//! Writes a sequential or parallel block of statements.
+static size_t image_statement_block(verilog_image_writer * w, void * data)
+{
+    ast_statement_block * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_statement_block), &at))
+    {
+        IMAGE_FIELD(w, at, ast_statement_block, block_identifier,
+                    image_identifier(w, node -> block_identifier));
+        IMAGE_FIELD(w, at, ast_statement_block, declarations,
+                    image_list(w, node -> declarations,
+                               image_block_item_declaration));
+        IMAGE_FIELD(w, at, ast_statement_block, statements,
+                    image_list(w, node -> statements, image_statement));
+        IMAGE_FIELD(w, at, ast_statement_block, trigger,
+                    image_timing_control(w, node -> trigger));
+    }
+    return at;
+}
+
+//! Writes any kind of statement.
+static size_t image_statement(verilog_image_writer * w, void * data)
+{
+    ast_statement * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_statement), &at))
+    {
+        return at;
+    }
+
+    IMAGE_FIELD(w, at, ast_statement, attributes,
+                image_attributes(w, node -> attributes));
+
+    verilog_image_item item = NULL;
+    switch(node -> type)
+    {
+        case STM_GENERATE:       item = image_generate_block;      break;
+        case STM_ASSIGNMENT:     item = node -> is_function_statement ?
+                                        image_single_assignment :
+                                        image_assignment;          break;
+        case STM_CASE:           item = image_case_statement;      break;
+        case STM_CONDITIONAL:    item = image_if_else;             break;
+        case STM_DISABLE:        item = image_disable_statement;   break;
+        case STM_EVENT_TRIGGER:  item = image_identifier;          break;
+        case STM_LOOP:           item = image_loop_statement;      break;
+        case STM_BLOCK:
+        case STM_BLOCK_ALWAYS:
+        case STM_BLOCK_INITIAL:  item = image_statement_block;     break;
+        case STM_TIMING_CONTROL: item = image_timing_control;      break;
+        case STM_FUNCTION_CALL:  item = image_function_call;       break;
+        case STM_TASK_ENABLE:    item = image_task_enable;         break;
+        case STM_WAIT:           item = image_wait_statement;      break;
+        case STM_MODULE_ITEM:    item = image_module_item;         break;
+    }
+    IMAGE_FIELD(w, at, ast_statement, data,
+                item ? item(w, node -> data) : 0);
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes the return range or type of a function.
+static size_t image_range_or_type(verilog_image_writer * w, void * data)
+{
+    ast_range_or_type * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_range_or_type), &at))
+    {
+        if(node -> is_range)
+        {
+            IMAGE_FIELD(w, at, ast_range_or_type, range,
+                        image_range(w, node -> range));
+        }
+    }
+    return at;
+}
+
+//! Writes the declaration of some task or function ports.
+static size_t image_task_port(verilog_image_writer * w, void * data)
+{
+    ast_task_port * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_task_port), &at))
+    {
+        IMAGE_FIELD(w, at, ast_task_port, range,
+                    image_range(w, node -> range));
+        IMAGE_FIELD(w, at, ast_task_port, identifiers,
+                    image_list(w, node -> identifiers, image_identifier));
+    }
+    return at;
+}
+
+//! Writes a port or other declaration inside a task or function.
+static size_t image_function_item_declaration(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_function_item_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_function_item_declaration), &at))
+    {
+        if(node -> is_port_declaration)
+        {
+            IMAGE_FIELD(w, at, ast_function_item_declaration,
+                        port_declaration,
+                        image_task_port(w, node -> port_declaration));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_function_item_declaration, block_item,
+                        image_block_item_declaration(w, node -> block_item));
+        }
+    }
+    return at;
+}
+
+//! Writes a function declaration.
+static size_t image_function_declaration(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_function_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_function_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_function_declaration, rot,
+                    image_range_or_type(w, node -> rot));
+        IMAGE_FIELD(w, at, ast_function_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_function_declaration, item_declarations,
+                    image_list(w, node -> item_declarations,
+                               node -> function_or_block ?
+                               image_function_item_declaration :
+                               image_block_item_declaration));
+        IMAGE_FIELD(w, at, ast_function_declaration, statements,
+                    image_statement(w, node -> statements));
+    }
+    return at;
+}
+
+//! Writes a task declaration.
+static size_t image_task_declaration(verilog_image_writer * w, void * data)
+{
+    ast_task_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_task_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_task_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_task_declaration, ports,
+                    image_list(w, node -> ports, image_task_port));
+        IMAGE_FIELD(w, at, ast_task_declaration, declarations,
+                    image_list(w, node -> declarations,
+                               node -> ports == NULL ?
+                               image_function_item_declaration :
+                               image_block_item_declaration));
+        IMAGE_FIELD(w, at, ast_task_declaration, statements,
+                    image_statement(w, node -> statements));
+    }
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a connection to a port or parameter of a module instance.
+static size_t image_port_connection(verilog_image_writer * w, void * data)
+{
+    ast_port_connection * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_port_connection), &at))
+    {
+        IMAGE_FIELD(w, at, ast_port_connection, port_name,
+                    image_identifier(w, node -> port_name));
+        IMAGE_FIELD(w, at, ast_port_connection, expression,
+                    image_expression(w, node -> expression));
+    }
+    return at;
+}
+
+//! Writes a single instance of a module.
+static size_t image_module_instance(verilog_image_writer * w, void * data)
+{
+    ast_module_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_module_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_module_instance, instance_identifier,
+                    image_identifier(w, node -> instance_identifier));
+        IMAGE_FIELD(w, at, ast_module_instance, port_connections,
+                    image_list(w, node -> port_connections,
+                               image_port_connection));
+    }
+    return at;
+}
+
+/*!
+@brief Writes a set of module instances.
+@details Resolved instantiations point at the module they instance, which
+is written (once) like any other node. Only visiting does not follow them,
+since the module may belong to some other tree.
+*/
+static size_t image_module_instantiation(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_module_instantiation * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_module_instantiation), &at))
+    {
+        return at;
+    }
+
+    if(node -> resolved && w -> visit != NULL)
+    {
+        // Nothing to follow.
+    }
+    else if(node -> resolved)
+    {
+        IMAGE_FIELD(w, at, ast_module_instantiation, declaration,
+                    image_module_declaration(w, node -> declaration));
+    }
+    else
+    {
+        IMAGE_FIELD(w, at, ast_module_instantiation, module_identifer,
+                    image_identifier(w, node -> module_identifer));
+    }
+    IMAGE_FIELD(w, at, ast_module_instantiation, module_parameters,
+                image_list(w, node -> module_parameters,
+                           image_port_connection));
+    IMAGE_FIELD(w, at, ast_module_instantiation, module_instances,
+                image_list(w, node -> module_instances,
+                           image_module_instance));
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a switch type, and its delays.
+static size_t image_switch_gate(verilog_image_writer * w, void * data)
+{
+    ast_switch_gate * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_switch_gate), &at))
+    {
+        if(node -> type == SWITCH_TRAN || node -> type == SWITCH_RTRAN)
+        {
+            IMAGE_FIELD(w, at, ast_switch_gate, delay2,
+                        image_delay2(w, node -> delay2));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_switch_gate, delay3,
+                        image_delay3(w, node -> delay3));
+        }
+    }
+    return at;
+}
+
+//! Writes a cmos switch.
+static size_t image_cmos_switch(verilog_image_writer * w, void * data)
+{
+    ast_cmos_switch_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_cmos_switch_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_cmos_switch_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_cmos_switch_instance, output_terminal,
+                    image_lvalue(w, node -> output_terminal));
+        IMAGE_FIELD(w, at, ast_cmos_switch_instance, ncontrol_terminal,
+                    image_expression(w, node -> ncontrol_terminal));
+        IMAGE_FIELD(w, at, ast_cmos_switch_instance, pcontrol_terminal,
+                    image_expression(w, node -> pcontrol_terminal));
+        IMAGE_FIELD(w, at, ast_cmos_switch_instance, input_terminal,
+                    image_expression(w, node -> input_terminal));
+    }
+    return at;
+}
+
+//! Writes a mos switch.
+static size_t image_mos_switch(verilog_image_writer * w, void * data)
+{
+    ast_mos_switch_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_mos_switch_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_mos_switch_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_mos_switch_instance, output_terminal,
+                    image_lvalue(w, node -> output_terminal));
+        IMAGE_FIELD(w, at, ast_mos_switch_instance, enable_terminal,
+                    image_expression(w, node -> enable_terminal));
+        IMAGE_FIELD(w, at, ast_mos_switch_instance, input_terminal,
+                    image_expression(w, node -> input_terminal));
+    }
+    return at;
+}
+
+//! Writes a pass switch.
+static size_t image_pass_switch(verilog_image_writer * w, void * data)
+{
+    ast_pass_switch_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_pass_switch_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_pass_switch_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_pass_switch_instance, terminal_1,
+                    image_lvalue(w, node -> terminal_1));
+        IMAGE_FIELD(w, at, ast_pass_switch_instance, terminal_2,
+                    image_lvalue(w, node -> terminal_2));
+    }
+    return at;
+}
+
+//! Writes a set of switches, whose kind depends on the gate type.
+static size_t image_switches(
+    verilog_image_writer * w,
+    ast_switches         * node,
+    ast_gate_type          type
+){
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_switches), &at))
+    {
+        IMAGE_FIELD(w, at, ast_switches, type,
+                    image_switch_gate(w, node -> type));
+        IMAGE_FIELD(w, at, ast_switches, switches,
+                    image_list(w, node -> switches,
+                               type == GATE_CMOS ? image_cmos_switch :
+                               type == GATE_MOS  ? image_mos_switch  :
+                                                   image_pass_switch));
+    }
+    return at;
+}
+
+//! Writes a pass enable switch.
+static size_t image_pass_enable_switch(verilog_image_writer * w, void * data)
+{
+    ast_pass_enable_switch * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_pass_enable_switch), &at))
+    {
+        IMAGE_FIELD(w, at, ast_pass_enable_switch, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_pass_enable_switch, terminal_1,
+                    image_lvalue(w, node -> terminal_1));
+        IMAGE_FIELD(w, at, ast_pass_enable_switch, terminal_2,
+                    image_lvalue(w, node -> terminal_2));
+        IMAGE_FIELD(w, at, ast_pass_enable_switch, enable,
+                    image_expression(w, node -> enable));
+    }
+    return at;
+}
+
+//! Writes a set of pass enable switches.
+static size_t image_pass_enable_switches(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_pass_enable_switches * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_pass_enable_switches), &at))
+    {
+        IMAGE_FIELD(w, at, ast_pass_enable_switches, delay,
+                    image_delay2(w, node -> delay));
+        IMAGE_FIELD(w, at, ast_pass_enable_switches, switches,
+                    image_list(w, node -> switches,
+                               image_pass_enable_switch));
+    }
+    return at;
+}
+
+//! Writes an enable gate.
+static size_t image_enable_gate(verilog_image_writer * w, void * data)
+{
+    ast_enable_gate_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_enable_gate_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_enable_gate_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_enable_gate_instance, output_terminal,
+                    image_lvalue(w, node -> output_terminal));
+        IMAGE_FIELD(w, at, ast_enable_gate_instance, enable_terminal,
+                    image_expression(w, node -> enable_terminal));
+        IMAGE_FIELD(w, at, ast_enable_gate_instance, input_terminal,
+                    image_expression(w, node -> input_terminal));
+    }
+    return at;
+}
+
+//! Writes a set of enable gates.
+static size_t image_enable_gates(verilog_image_writer * w, void * data)
+{
+    ast_enable_gate_instances * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_enable_gate_instances), &at))
+    {
+        IMAGE_FIELD(w, at, ast_enable_gate_instances, delay,
+                    image_delay3(w, node -> delay));
+        IMAGE_FIELD(w, at, ast_enable_gate_instances, drive_strength,
+                    image_drive_strength(w, node -> drive_strength));
+        IMAGE_FIELD(w, at, ast_enable_gate_instances, instances,
+                    image_list(w, node -> instances, image_enable_gate));
+    }
+    return at;
+}
+
+//! Writes a gate with several inputs.
+static size_t image_n_input_gate(verilog_image_writer * w, void * data)
+{
+    ast_n_input_gate_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_n_input_gate_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_n_input_gate_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_n_input_gate_instance, input_terminals,
+                    image_list(w, node -> input_terminals,
+                               image_expression));
+        IMAGE_FIELD(w, at, ast_n_input_gate_instance, output_terminal,
+                    image_lvalue(w, node -> output_terminal));
+    }
+    return at;
+}
+
+//! Writes a set of gates with several inputs.
+static size_t image_n_input_gates(verilog_image_writer * w, void * data)
+{
+    ast_n_input_gate_instances * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_n_input_gate_instances), &at))
+    {
+        IMAGE_FIELD(w, at, ast_n_input_gate_instances, delay,
+                    image_delay3(w, node -> delay));
+        IMAGE_FIELD(w, at, ast_n_input_gate_instances, drive_strength,
+                    image_drive_strength(w, node -> drive_strength));
+        IMAGE_FIELD(w, at, ast_n_input_gate_instances, instances,
+                    image_list(w, node -> instances, image_n_input_gate));
+    }
+    return at;
+}
+
+//! Writes a gate with several outputs.
+static size_t image_n_output_gate(verilog_image_writer * w, void * data)
+{
+    ast_n_output_gate_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_n_output_gate_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_n_output_gate_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_n_output_gate_instance, outputs,
+                    image_list(w, node -> outputs, image_lvalue));
+        IMAGE_FIELD(w, at, ast_n_output_gate_instance, input,
+                    image_expression(w, node -> input));
+    }
+    return at;
+}
+
+//! Writes a set of gates with several outputs.
+static size_t image_n_output_gates(verilog_image_writer * w, void * data)
+{
+    ast_n_output_gate_instances * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_n_output_gate_instances), &at))
+    {
+        IMAGE_FIELD(w, at, ast_n_output_gate_instances, delay,
+                    image_delay2(w, node -> delay));
+        IMAGE_FIELD(w, at, ast_n_output_gate_instances, drive_strength,
+                    image_drive_strength(w, node -> drive_strength));
+        IMAGE_FIELD(w, at, ast_n_output_gate_instances, instances,
+                    image_list(w, node -> instances, image_n_output_gate));
+    }
+    return at;
+}
+
+//! Writes a pullup or pulldown gate.
+static size_t image_pull_gate(verilog_image_writer * w, void * data)
+{
+    ast_pull_gate_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_pull_gate_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_pull_gate_instance, name,
+                    image_identifier(w, node -> name));
+        IMAGE_FIELD(w, at, ast_pull_gate_instance, output_terminal,
+                    image_lvalue(w, node -> output_terminal));
+    }
+    return at;
+}
+
+//! Writes a gate instantiation of any type.
+static size_t image_gate_instantiation(verilog_image_writer * w, void * data)
+{
+    ast_gate_instantiation * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_gate_instantiation), &at))
+    {
+        return at;
+    }
+
+    switch(node -> type)
+    {
+        case GATE_CMOS:
+        case GATE_MOS:
+        case GATE_PASS:
+            IMAGE_FIELD(w, at, ast_gate_instantiation, switches,
+                        image_switches(w, node -> switches, node -> type));
+            break;
+        case GATE_ENABLE:
+            IMAGE_FIELD(w, at, ast_gate_instantiation, enable,
+                        image_enable_gates(w, node -> enable));
+            break;
+        case GATE_N_OUT:
+            IMAGE_FIELD(w, at, ast_gate_instantiation, n_out,
+                        image_n_output_gates(w, node -> n_out));
+            break;
+        case GATE_N_IN:
+            IMAGE_FIELD(w, at, ast_gate_instantiation, n_in,
+                        image_n_input_gates(w, node -> n_in));
+            break;
+        case GATE_PASS_EN:
+            IMAGE_FIELD(w, at, ast_gate_instantiation, pass_en,
+                        image_pass_enable_switches(w, node -> pass_en));
+            break;
+        case GATE_PULL_UP:
+        case GATE_PULL_DOWN:
+            IMAGE_FIELD(w, at, ast_gate_instantiation, pull_strength,
+                        image_leaf(w, node -> pull_strength,
+                                   sizeof(ast_primitive_pull_strength)));
+            IMAGE_FIELD(w, at, ast_gate_instantiation, pull_gates,
+                        image_list(w, node -> pull_gates, image_pull_gate));
+            break;
+    }
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a single instance of a user defined primitive.
+static size_t image_udp_instance(verilog_image_writer * w, void * data)
+{
+    ast_udp_instance * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_udp_instance), &at))
+    {
+        IMAGE_FIELD(w, at, ast_udp_instance, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_udp_instance, range,
+                    image_range(w, node -> range));
+        IMAGE_FIELD(w, at, ast_udp_instance, output,
+                    image_lvalue(w, node -> output));
+        IMAGE_FIELD(w, at, ast_udp_instance, inputs,
+                    image_list(w, node -> inputs, image_expression));
+    }
+    return at;
+}
+
+//! Writes a set of instances of a user defined primitive.
+static size_t image_udp_instantiation(verilog_image_writer * w, void * data)
+{
+    ast_udp_instantiation * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_udp_instantiation), &at))
+    {
+        IMAGE_FIELD(w, at, ast_udp_instantiation, instances,
+                    image_list(w, node -> instances, image_udp_instance));
+        IMAGE_FIELD(w, at, ast_udp_instantiation, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_udp_instantiation, drive_strength,
+                    image_drive_strength(w, node -> drive_strength));
+        IMAGE_FIELD(w, at, ast_udp_instantiation, delay,
+                    image_delay2(w, node -> delay));
+    }
+    return at;
+}
+
+//! Writes a port of a user defined primitive.
+static size_t image_udp_port(verilog_image_writer * w, void * data)
+{
+    ast_udp_port * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_udp_port), &at))
+    {
+        return at;
+    }
+
+    if(node -> direction == PORT_INPUT)
+    {
+        IMAGE_FIELD(w, at, ast_udp_port, identifiers,
+                    image_list(w, node -> identifiers, image_identifier));
+    }
+    else
+    {
+        IMAGE_FIELD(w, at, ast_udp_port, identifier,
+                    image_identifier(w, node -> identifier));
+    }
+    IMAGE_FIELD(w, at, ast_udp_port, attributes,
+                image_attributes(w, node -> attributes));
+    IMAGE_FIELD(w, at, ast_udp_port, default_value,
+                image_expression(w, node -> default_value));
+    return at;
+}
+
+//! Writes a row of a combinatorial primitive's table.
+static size_t image_udp_combinatorial_entry(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_udp_combinatorial_entry * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_udp_combinatorial_entry), &at))
+    {
+        IMAGE_FIELD(w, at, ast_udp_combinatorial_entry, input_levels,
+                    image_list(w, node -> input_levels,
+                               image_level_symbol));
+    }
+    return at;
+}
+
+//! Writes a row of a sequential primitive's table.
+static size_t image_udp_sequential_entry(
+    verilog_image_writer * w,
+    void                 * data
+){
+    ast_udp_sequential_entry * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_udp_sequential_entry), &at))
+    {
+        IMAGE_FIELD(w, at, ast_udp_sequential_entry, levels,
+                    image_list(w, node -> levels, image_level_symbol));
+    }
+    return at;
+}
+
+//! Writes the initial statement of a sequential primitive.
+static size_t image_udp_initial(verilog_image_writer * w, void * data)
+{
+    ast_udp_initial_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_udp_initial_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_udp_initial_statement, output_port,
+                    image_identifier(w, node -> output_port));
+        IMAGE_FIELD(w, at, ast_udp_initial_statement, initial_value,
+                    image_number(w, node -> initial_value));
+    }
+    return at;
+}
+
+//! Writes a user defined primitive.
+static size_t image_udp_declaration(verilog_image_writer * w, void * data)
+{
+    ast_udp_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_udp_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_udp_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_udp_declaration, attributes,
+                    image_attributes(w, node -> attributes));
+        IMAGE_FIELD(w, at, ast_udp_declaration, ports,
+                    image_list(w, node -> ports, image_udp_port));
+        IMAGE_FIELD(w, at, ast_udp_declaration, body_entries,
+                    image_list(w, node -> body_entries,
+                               node -> body_type == UDP_BODY_COMBINATORIAL ?
+                               image_udp_combinatorial_entry :
+                               image_udp_sequential_entry));
+        IMAGE_FIELD(w, at, ast_udp_declaration, initial,
+                    image_udp_initial(w, node -> initial));
+    }
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes an item of a module or generate block.
+static size_t image_module_item(verilog_image_writer * w, void * data)
+{
+    ast_module_item * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_module_item), &at))
+    {
+        return at;
+    }
+
+    IMAGE_FIELD(w, at, ast_module_item, attributes,
+                image_attributes(w, node -> attributes));
+
+    verilog_image_item item = NULL;
+    switch(node -> type)
+    {
+        case MOD_ITEM_PORT_DECLARATION:
+            item = image_port_declaration;       break;
+        case MOD_ITEM_GENERATED_INSTANTIATION:
+            item = image_generate_block;         break;
+        case MOD_ITEM_PARAMETER_DECLARATION:
+        case MOD_ITEM_SPECPARAM_DECLARATION:
+            item = image_parameter_declarations; break;
+        case MOD_ITEM_SPECIFY_BLOCK:
+            item = image_unsupported;            break;
+        case MOD_ITEM_PARAMETER_OVERRIDE:
+            item = image_single_assignments;     break;
+        case MOD_ITEM_CONTINOUS_ASSIGNMENT:
+            item = image_continuous_assignment;  break;
+        case MOD_ITEM_GATE_INSTANTIATION:
+            item = image_gate_instantiation;     break;
+        case MOD_ITEM_UDP_INSTANTIATION:
+            item = image_udp_instantiation;      break;
+        case MOD_ITEM_MODULE_INSTANTIATION:
+            item = image_module_instantiation;   break;
+        case MOD_ITEM_INITIAL_CONSTRUCT:
+        case MOD_ITEM_ALWAYS_CONSTRUCT:
+            item = image_statement;              break;
+        case MOD_ITEM_NET_DECLARATION:
+        case MOD_ITEM_REG_DECLARATION:
+        case MOD_ITEM_INTEGER_DECLARATION:
+        case MOD_ITEM_REAL_DECLARATION:
+        case MOD_ITEM_TIME_DECLARATION:
+        case MOD_ITEM_REALTIME_DECLARATION:
+        case MOD_ITEM_EVENT_DECLARATION:
+        case MOD_ITEM_GENVAR_DECLARATION:
+            item = image_type_declaration;       break;
+        case MOD_ITEM_TASK_DECLARATION:
+            item = image_task_declaration;       break;
+        case MOD_ITEM_FUNCTION_DECLARATION:
+            item = image_function_declaration;   break;
+        case MOD_ITEM_SKIPPED_CONSTRUCT:
+            item = NULL;
+            IMAGE_FIELD(w, at, ast_module_item, skipped_construct,
+                        image_leaf(w, node -> skipped_construct,
+                                   sizeof(ast_skipped_construct)));
+            return at;
+    }
+    IMAGE_FIELD(w, at, ast_module_item, port_declaration,
+                item ? item(w, node -> port_declaration) : 0);
+    return at;
+}
+
+//! Writes a construct skipped by a skeleton parse.
+static size_t image_skipped_construct(verilog_image_writer * w, void * data)
+{
+    return image_leaf(w, data, sizeof(ast_skipped_construct));
+}
+
+//! Writes an always or initial block.
+static size_t image_block_statement(verilog_image_writer * w, void * data)
+{
+    return image_statement_block(w, data);
+}
+
+/*!
+@brief Writes a module declaration.
+@details Lazy modules are loaded by the caller before anything is written,
+so the copy never has a lazy record.
+*/
+static size_t image_module_declaration(verilog_image_writer * w, void * data)
+{
+    ast_module_declaration * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_module_declaration), &at))
+    {
+        return at;
+    }
+
+    IMAGE_FIELD(w, at, ast_module_declaration, attributes,
+                image_attributes(w, node -> attributes));
+    IMAGE_FIELD(w, at, ast_module_declaration, identifier,
+                image_identifier(w, node -> identifier));
+    IMAGE_FIELD(w, at, ast_module_declaration, lazy, 0);
+
+    #define IMAGE_MODULE_LIST(FIELD, ITEM) \
+        IMAGE_FIELD(w, at, ast_module_declaration, FIELD, \
+                    image_list(w, node -> FIELD, ITEM))
+
+    IMAGE_MODULE_LIST(always_blocks,          image_block_statement);
+    IMAGE_MODULE_LIST(continuous_assignments, image_continuous_assignment);
+    IMAGE_MODULE_LIST(event_declarations,     image_var_declaration);
+    IMAGE_MODULE_LIST(function_declarations,  image_function_declaration);
+    IMAGE_MODULE_LIST(gate_instantiations,    image_gate_instantiation);
+    IMAGE_MODULE_LIST(genvar_declarations,    image_var_declaration);
+    IMAGE_MODULE_LIST(generate_blocks,        image_generate_block);
+    IMAGE_MODULE_LIST(initial_blocks,         image_block_statement);
+    IMAGE_MODULE_LIST(integer_declarations,   image_var_declaration);
+    IMAGE_MODULE_LIST(local_parameters,       image_parameter_declarations);
+    IMAGE_MODULE_LIST(module_instantiations,  image_module_instantiation);
+    IMAGE_MODULE_LIST(module_parameters,      image_parameter_declarations);
+    IMAGE_MODULE_LIST(module_ports,           image_port_declaration);
+    IMAGE_MODULE_LIST(net_declarations,       image_net_declaration);
+    IMAGE_MODULE_LIST(parameter_overrides,    image_single_assignments);
+    IMAGE_MODULE_LIST(real_declarations,      image_var_declaration);
+    IMAGE_MODULE_LIST(realtime_declarations,  image_var_declaration);
+    IMAGE_MODULE_LIST(reg_declarations,       image_reg_declaration);
+    IMAGE_MODULE_LIST(specify_blocks,         image_unsupported);
+    IMAGE_MODULE_LIST(specparams,             image_parameter_declarations);
+    IMAGE_MODULE_LIST(task_declarations,      image_task_declaration);
+    IMAGE_MODULE_LIST(time_declarations,      image_var_declaration);
+    IMAGE_MODULE_LIST(udp_instantiations,     image_udp_instantiation);
+    IMAGE_MODULE_LIST(skipped_constructs,     image_skipped_construct);
+
+    #undef IMAGE_MODULE_LIST
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a rule of a configuration.
+static size_t image_config_rule(verilog_image_writer * w, void * data)
+{
+    ast_config_rule_statement * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_config_rule_statement), &at))
+    {
+        IMAGE_FIELD(w, at, ast_config_rule_statement, clause_1,
+                    image_identifier(w, node -> clause_1));
+        if(node -> multiple_clauses)
+        {
+            IMAGE_FIELD(w, at, ast_config_rule_statement, clauses,
+                        image_list(w, node -> clauses, image_identifier));
+        }
+        else
+        {
+            IMAGE_FIELD(w, at, ast_config_rule_statement, clause_2,
+                        image_identifier(w, node -> clause_2));
+        }
+    }
+    return at;
+}
+
+//! Writes a configuration.
+static size_t image_config_declaration(verilog_image_writer * w, void * data)
+{
+    ast_config_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_config_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_config_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_config_declaration, design_statement,
+                    image_identifier(w, node -> design_statement));
+        IMAGE_FIELD(w, at, ast_config_declaration, rule_statements,
+                    image_list(w, node -> rule_statements,
+                               image_config_rule));
+    }
+    return at;
+}
+
+//! Writes a library declaration.
+static size_t image_library_declaration(verilog_image_writer * w, void*data)
+{
+    ast_library_declaration * node = data;
+    size_t at;
+    if(image_visit(w, node, sizeof(ast_library_declaration), &at))
+    {
+        IMAGE_FIELD(w, at, ast_library_declaration, identifier,
+                    image_identifier(w, node -> identifier));
+        IMAGE_FIELD(w, at, ast_library_declaration, file_paths,
+                    image_list(w, node -> file_paths, image_text));
+        IMAGE_FIELD(w, at, ast_library_declaration, incdirs,
+                    image_list(w, node -> incdirs, image_text));
+    }
+    return at;
+}
+
+//! Writes an item of a library source text.
+static size_t image_library_description(verilog_image_writer * w, void*data)
+{
+    ast_library_descriptions * node = data;
+    size_t at;
+    if(!image_visit(w, node, sizeof(ast_library_descriptions), &at))
+    {
+        return at;
+    }
+
+
+    verilog_image_item item = NULL;
+    switch(node -> type)
+    {
+        case LIB_LIBRARY: item = image_library_declaration; break;
+        case LIB_INCLUDE: item = image_text;                break;
+        case LIB_CONFIG:  item = image_config_declaration;  break;
+    }
+    IMAGE_FIELD(w, at, ast_library_descriptions, library,
+                item ? item(w, node -> library) : 0);
+    return at;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Returns a hash of the size of every node, and of pointers.
+@details Since the bytes of the sizes are hashed, images written on
+machines of a different byte order also fail to match.
+*/
+static unsigned int verilog_image_layout()
+{
+    size_t sizes[] = {
+        sizeof(void*), sizeof(ast_list), sizeof(ast_metadata),
+        sizeof(ast_interned), sizeof(verilog_image_header),
+        sizeof(ast_source_file), sizeof(ast_location),
+        sizeof(struct ast_identifier_t), sizeof(ast_node_attributes),
+        sizeof(ast_number), sizeof(ast_primary), sizeof(ast_expression),
+        sizeof(ast_concatenation), sizeof(ast_function_call),
+        sizeof(ast_lvalue), sizeof(ast_range), sizeof(ast_delay_value),
+        sizeof(ast_delay3), sizeof(ast_delay2), sizeof(ast_drive_strength),
+        sizeof(ast_event_expression), sizeof(ast_event_control),
+        sizeof(ast_delay_ctrl), sizeof(ast_timing_control_statement),
+        sizeof(ast_single_assignment), sizeof(ast_continuous_assignment),
+        sizeof(ast_procedural_assignment), sizeof(ast_hybrid_assignment),
+        sizeof(ast_assignment), sizeof(ast_case_item),
+        sizeof(ast_case_statement), sizeof(ast_conditional_statement),
+        sizeof(ast_if_else), sizeof(ast_disable_statement),
+        sizeof(ast_generate_block), sizeof(ast_loop_statement),
+        sizeof(ast_task_enable_statement), sizeof(ast_wait_statement),
+        sizeof(ast_type_declaration), sizeof(ast_net_declaration),
+        sizeof(ast_reg_declaration), sizeof(ast_var_declaration),
+        sizeof(ast_parameter_declarations), sizeof(ast_port_declaration),
+        sizeof(ast_block_reg_declaration),
+        sizeof(ast_block_item_declaration), sizeof(ast_statement_block),
+        sizeof(ast_statement), sizeof(ast_range_or_type),
+        sizeof(ast_task_port), sizeof(ast_function_item_declaration),
+        sizeof(ast_function_declaration), sizeof(ast_task_declaration),
+        sizeof(ast_port_connection), sizeof(ast_module_instance),
+        sizeof(ast_module_instantiation), sizeof(ast_switch_gate),
+        sizeof(ast_cmos_switch_instance), sizeof(ast_mos_switch_instance),
+        sizeof(ast_pass_switch_instance), sizeof(ast_switches),
+        sizeof(ast_pass_enable_switch), sizeof(ast_pass_enable_switches),
+        sizeof(ast_enable_gate_instance), sizeof(ast_enable_gate_instances),
+        sizeof(ast_n_input_gate_instance),
+        sizeof(ast_n_input_gate_instances),
+        sizeof(ast_n_output_gate_instance),
+        sizeof(ast_n_output_gate_instances), sizeof(ast_pull_gate_instance),
+        sizeof(ast_primitive_pull_strength), sizeof(ast_gate_instantiation),
+        sizeof(ast_udp_instance), sizeof(ast_udp_instantiation),
+        sizeof(ast_udp_port), sizeof(ast_udp_combinatorial_entry),
+        sizeof(ast_udp_sequential_entry), sizeof(ast_udp_initial_statement),
+        sizeof(ast_udp_declaration), sizeof(ast_level_symbol),
+        sizeof(ast_module_item), sizeof(ast_skipped_construct),
+        sizeof(ast_module_declaration), sizeof(ast_config_rule_statement),
+        sizeof(ast_config_declaration), sizeof(ast_library_declaration),
+        sizeof(ast_library_descriptions)
+    };
+    return ast_string_hash((const char*)sizes, sizeof(sizes));
+}
+
+/*!
+@brief Turns the offsets written by the writer into addresses relative to
+the image's base, and the slots in the relocation table into offsets from
+the start of the image.
+*/
+static void verilog_image_finish(
+    verilog_image_writer * w,
+    size_t                 lists,
+    size_t                 base
+){
+    size_t * slots = (size_t*)w -> relocations.data;
+    size_t   count = w -> relocations.used / sizeof(size_t);
+    size_t   i;
+
+    for(i = 0; i < count; i ++)
+    {
+        size_t * slot  = (size_t*)image_at(w, slots[i]);
+        size_t   value = *slot;
+
+        if(value & IMAGE_LIST_TAG)
+        {
+            value = (value & ~(size_t)IMAGE_LIST_TAG) + lists;
+        }
+        *slot = value + base;
+
+        if(slots[i] & IMAGE_LIST_TAG)
+        {
+            slots[i] = (slots[i] & ~(size_t)IMAGE_LIST_TAG) + lists;
+        }
+    }
+}
+
+/*!
+@brief Writes the contents of some buffers to a file.
+@returns Zero if everything was written.
+*/
+static int verilog_image_write_file(
+    char                 * path,
+    verilog_image_buffer * parts[],
+    unsigned int           count
+){
+    size_t length = strlen(path) + 32;
+    char * temp   = malloc(length);
+    snprintf(temp, length, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE * file = fopen(temp, "wb");
+    if(file == NULL)
+    {
+        free(temp);
+        return 1;
+    }
+
+    int tr = 0;
+    unsigned int i;
+    for(i = 0; i < count; i ++)
+    {
+        if(parts[i] -> used > 0 &&
+           fwrite(parts[i] -> data, 1, parts[i] -> used, file) !=
+               parts[i] -> used)
+        {
+            tr = 1;
+        }
+    }
+
+    if(fclose(file) != 0 || tr != 0 || rename(temp, path) != 0)
+    {
+        remove(temp);
+        tr = 1;
+    }
+
+    free(temp);
+    return tr;
+}
+
+/*!
+@brief Saves a source tree to an image file.
+*/
+int verilog_source_tree_save(
+    verilog_source_tree * tree,
+    char                * path
+){
+    assert(tree != NULL && path != NULL);
+
+    unsigned int m;
+    for(m = 0; m < tree -> modules -> items; m ++)
+    {
+        ast_module_declaration * module = ast_list_get(tree -> modules, m);
+        if(module -> lazy != NULL)
+        {
+            verilog_load_module(tree, module);
+        }
+    }
+
+    verilog_image_writer w;
+    memset(&w, 0, sizeof(verilog_image_writer));
+
+    size_t header = image_reserve(&w.nodes, sizeof(verilog_image_header));
+    IMAGE_FIELD(&w, header, verilog_image_header, modules,
+                image_list(&w, tree -> modules, image_module_declaration));
+    IMAGE_FIELD(&w, header, verilog_image_header, primitives,
+                image_list(&w, tree -> primitives, image_udp_declaration));
+    IMAGE_FIELD(&w, header, verilog_image_header, configs,
+                image_list(&w, tree -> configs, image_config_declaration));
+    IMAGE_FIELD(&w, header, verilog_image_header, libraries,
+                image_list(&w, tree -> libraries,
+                           image_library_description));
+
+    // The file table is an array of records, rather than a list, since the
+    // loader indexes it straight away. Newlines go with it, so the lines of
+    // a loaded tree are found without reading its files.
+    size_t file_count = verilog_source_tree_file_count(tree);
+    if(file_count > 0)
+    {
+        size_t files = image_reserve(&w.nodes,
+                                     file_count * sizeof(ast_source_file));
+        size_t i;
+        for(i = 0; i < file_count; i ++)
+        {
+            ast_source_file * file = verilog_source_tree_get_file(tree, i + 1);
+            size_t            at   = files + i * sizeof(ast_source_file);
+            memcpy(w.nodes.data + at, file, sizeof(ast_source_file));
+            IMAGE_FIELD(&w, at, ast_source_file, path,
+                        image_string(&w, file -> path));
+
+            size_t newlines = 0;
+            if(file -> indexed && file -> newline_count > 0)
+            {
+                size_t size = file -> newline_count * sizeof(size_t);
+                newlines = image_reserve(&w.nodes, size);
+                memcpy(w.nodes.data + newlines, file -> newlines, size);
+            }
+            IMAGE_FIELD(&w, at, ast_source_file, newlines, newlines);
+        }
+        IMAGE_FIELD(&w, header, verilog_image_header, files, files);
+    }
+
+    // Pad the nodes so the packed lists which follow them are aligned.
+    image_reserve(&w.nodes, 0);
+    size_t lists       = w.nodes.used;
+    size_t relocations = lists + w.lists.used;
+    size_t count       = w.relocations.used / sizeof(size_t);
+    size_t size        = relocations + w.relocations.used;
+
+    // Spread images over different bases, so that loading several at once
+    // does not mean relocating all but the first.
+    size_t base = IMAGE_BASE + ((size ^ count) & 0xff) * IMAGE_BASE_STEP;
+
+    verilog_image_finish(&w, lists, base);
+
+    verilog_image_header * h = (verilog_image_header*)(w.nodes.data + header);
+    memcpy(h -> magic, VERILOG_IMAGE_MAGIC, sizeof(h -> magic));
+    h -> version          = VERILOG_IMAGE_VERSION;
+    h -> layout           = verilog_image_layout();
+    h -> base             = base;
+    h -> size             = size;
+    h -> file_count       = file_count;
+    h -> lists            = lists;
+    h -> list_count       = w.lists.used / sizeof(ast_list);
+    h -> relocations      = relocations;
+    h -> relocation_count = count;
+
+    verilog_image_buffer * parts[] = {&w.nodes, &w.lists, &w.relocations};
+    int tr = verilog_image_write_file(path, parts, 3);
+
+    free(w.nodes.data);
+    free(w.lists.data);
+    free(w.relocations.data);
+    free(w.written.keys);
+    free(w.written.values);
+    free(w.strings);
+    return tr;
+}
+
+// ------------------------------------------------------------------------
+
+//! A mapped image, released along with the tree loaded from it.
+typedef struct verilog_image_mapping_t{
+    void   * data;      //!< Start of the mapping.
+    size_t   length;    //!< Length of the mapping.
+} verilog_image_mapping;
+
+//! Unmaps an image. Registered with @ref ast_region_at_free.
+static void verilog_image_unmap(void * data)
+{
+    verilog_image_mapping * mapping = data;
+    munmap(mapping -> data, mapping -> length);
+}
+
+//! Checks that a pointer in an image header points into the image.
+static ast_boolean verilog_image_inside(
+    verilog_image_header * header,
+    const void           * pointer
+){
+    size_t at = (size_t)pointer;
+    return pointer == NULL || (at >= header -> base &&
+                               at - header -> base < header -> relocations);
+}
+
+/*!
+@brief Checks that an image header describes an image which this build can
+load, and which fits in a file of the given length.
+@details The pointers in the header are checked too, which catches a base
+address that does not match the one the image was written for.
+*/
+static ast_boolean verilog_image_header_valid(
+    verilog_image_header * header,
+    size_t                 length
+){
+    return memcmp(header -> magic, VERILOG_IMAGE_MAGIC,
+                  sizeof(header -> magic)) == 0 &&
+           header -> version == VERILOG_IMAGE_VERSION &&
+           header -> layout  == verilog_image_layout() &&
+           header -> size    == length &&
+           header -> base % IMAGE_BASE_STEP == 0 &&
+           header -> lists  <= header -> relocations &&
+           header -> list_count <=
+               (header -> relocations - header -> lists) / sizeof(ast_list) &&
+           header -> file_count <= header -> lists / sizeof(ast_source_file) &&
+           header -> relocations <= length &&
+           header -> relocation_count ==
+               (length - header -> relocations) / sizeof(size_t) &&
+           verilog_image_inside(header, header -> modules) &&
+           verilog_image_inside(header, header -> primitives) &&
+           verilog_image_inside(header, header -> configs) &&
+           verilog_image_inside(header, header -> libraries) &&
+           verilog_image_inside(header, header -> files);
+}
+
+/*!
+@brief Loads a source tree from an image written by
+@ref verilog_source_tree_save.
+*/
+verilog_source_tree * verilog_source_tree_load(
+    char * path
+){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat          info;
+    verilog_image_header header;
+    if(fstat(fd, &info) != 0 ||
+       pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       !verilog_image_header_valid(&header, (size_t)info.st_size))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // Asking for the image's base is only a hint. If the kernel honours it
+    // there is nothing to relocate, and pages are only copied as lists in
+    // them are touched.
+    char * image = mmap((void*)header.base, header.size,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    size_t * relocations = (size_t*)(image + header.relocations);
+    size_t   delta       = (size_t)image - header.base;
+    size_t   i;
+    for(i = 0; i < header.relocation_count; i ++)
+    {
+        if(relocations[i] > header.relocations - sizeof(size_t))
+        {
+            munmap(image, header.size);
+            return NULL;
+        }
+        if(delta != 0)
+        {
+            *(size_t*)(image + relocations[i]) += delta;
+        }
+    }
+
+    verilog_source_tree  * tr     = verilog_new_source_tree();
+    verilog_image_header * mapped = (verilog_image_header*)image;
+
+    verilog_image_mapping * mapping = ast_region_calloc(tr -> region, 1,
+        sizeof(verilog_image_mapping));
+    mapping -> data   = image;
+    mapping -> length = header.size;
+    ast_region_at_free(tr -> region, verilog_image_unmap, mapping);
+
+    ast_list * lists = (ast_list*)(image + header.lists);
+    for(i = 0; i < header.list_count; i ++)
+    {
+        lists[i].region = tr -> region;
+    }
+
+    tr -> modules    = mapped -> modules;
+    tr -> primitives = mapped -> primitives;
+    tr -> configs    = mapped -> configs;
+    tr -> libraries  = mapped -> libraries;
+
+    // The table is new, so each file gets the id it had when saved. Its
+    // newlines are copied, since other trees may come to share the table.
+    for(i = 0; i < header.file_count; i ++)
+    {
+        ast_source_file * file = mapped -> files + i;
+        ast_file_id       id   = file -> path != NULL ?
+            verilog_source_tree_add_file(tr, file -> path) :
+            verilog_source_tree_add_text(tr, NULL, 0);
+
+        ast_source_file * entry = verilog_source_tree_get_file(tr, id);
+        entry -> parent = file -> parent;
+        entry -> line   = file -> line;
+
+        size_t newlines = (size_t)file -> newlines - (size_t)image;
+        if(file -> indexed && (file -> newline_count == 0 ||
+           (newlines <= header.lists && file -> newline_count <=
+            (header.lists - newlines) / sizeof(size_t))))
+        {
+            verilog_source_tree_set_newlines(tr, id, file -> newlines,
+                                             file -> newline_count);
+        }
+    }
+
+    verilog_source_tree_index_modules(tr);
+    return tr;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Calls a function with the metadata of every node reachable from a
+source tree, once each.
+*/
+void verilog_source_tree_visit_metadata(
+    verilog_source_tree  * tree,
+    ast_metadata_visitor   visitor,
+    void                 * data
+){
+    assert(tree != NULL && visitor != NULL);
+
+    verilog_image_writer w;
+    memset(&w, 0, sizeof(verilog_image_writer));
+    w.visit      = visitor;
+    w.visit_data = data;
+
+    image_list(&w, tree -> modules,    image_module_declaration);
+    image_list(&w, tree -> primitives, image_udp_declaration);
+    image_list(&w, tree -> configs,    image_config_declaration);
+    image_list(&w, tree -> libraries,  image_library_description);
+
+    free(w.written.keys);
+    free(w.written.values);
+}
+
+/*!
+@brief Calls a function with the metadata of every node of one module or
+primitive declaration, once each.
+*/
+void verilog_declaration_visit_metadata(
+    void                 * declaration,
+    ast_boolean            module,
+    ast_metadata_visitor   visitor,
+    void                 * data
+){
+    assert(declaration != NULL && visitor != NULL);
+
+    verilog_image_writer w;
+    memset(&w, 0, sizeof(verilog_image_writer));
+    w.visit      = visitor;
+    w.visit_data = data;
+
+    if(module)
+    {
+        image_module_declaration(&w, declaration);
+    }
+    else
+    {
+        image_udp_declaration(&w, declaration);
+    }
+
+    free(w.written.keys);
+    free(w.written.values);
+}
@@ -0,0 +1,149 @@
+/*!
+@file verilog_ast_image.h
+@brief Contains declarations for saving a whole source tree to a compact
+binary image, and loading it back again.
+*/
+
+#include "verilog_ast.h"
+
+#ifndef VERILOG_AST_IMAGE_H
+#define VERILOG_AST_IMAGE_H
+
+/*!
+@defgroup ast-image Source Tree Images
+@{
+@ingroup ast-utility
+@brief Saving parsed source trees, so that they need not be parsed again.
+@details An image holds a copy of every node reachable from a source tree,
+laid out exactly as the ast_* structures are in memory. Pointers are stored
+as the address they would have if the image were mapped at its preferred
+base address, and the offset of every pointer is listed in a relocation
+table at the end of the file. Loading an image maps the file, adjusts the
+pointers by however far from its base it was mapped (if at all), and points
+the lists it contains at the new tree's region. Nothing is parsed, and no
+nodes are allocated or copied.
+
+Interned strings are stored once each, with the same header that
+@ref ast_region_intern gives them, and the list headers are packed together
+at the end of the nodes so that loading them touches as few pages as
+possible.
+
+Images are only readable by a build of the library with the same version
+and node layout as the one which wrote them. Anything else is rejected
+when it is loaded.
+*/
+
+//! The first bytes of every image file.
+#define VERILOG_IMAGE_MAGIC "VLOGAST"
+
+//! Changed whenever the layout of an image changes.
+#define VERILOG_IMAGE_VERSION 5
+
+/*!
+@brief The start of an image file.
+@details Pointer members are relocated along with those in the nodes, so
+once an image is loaded they may be followed directly.
+*/
+typedef struct verilog_image_header_t{
+    char              magic[8];         //!< VERILOG_IMAGE_MAGIC.
+    unsigned int      version;          //!< VERILOG_IMAGE_VERSION.
+    unsigned int      layout;           //!< Hash of the size of every node.
+    size_t            base;             //!< Address the pointers assume.
+    size_t            size;             //!< Size of the whole image in bytes.
+    ast_list        * modules;          //!< The tree's modules list.
+    ast_list        * primitives;       //!< The tree's primitives list.
+    ast_list        * configs;          //!< The tree's configs list.
+    ast_list        * libraries;        //!< The tree's libraries list.
+    ast_source_file * files;            //!< The tree's file table.
+    size_t            file_count;       //!< Number of entries in files.
+    size_t            lists;            //!< Offset of the packed list headers.
+    size_t            list_count;       //!< Number of list headers.
+    size_t            relocations;      //!< Offset of the relocation table.
+    size_t            relocation_count; //!< Number of pointers to relocate.
+} verilog_image_header;
+
+/*!
+@brief Saves a source tree to an image file.
+@details Modules which have been found by @ref verilog_parse_path_lazy but
+not loaded yet are loaded first. The file is written under a temporary name
+and renamed into place, so a reader never sees half of an image.
+@param [in] tree - The tree to save. It is not changed, except for loading
+lazy modules.
+@param [in] path - The file to write.
+@returns Zero if the image was written, non-zero otherwise.
+@note The description callback, files read incrementally, and instantiations
+waiting for modules to be added are not saved. Contents of specify blocks,
+which the parser does not yet build nodes for, are saved as empty lists.
+*/
+int verilog_source_tree_save(
+    verilog_source_tree * tree,
+    char                * path
+);
+
+/*!
+@brief Loads a source tree from an image written by
+@ref verilog_source_tree_save.
+@details The nodes of the new tree live in the mapped file, which is
+unmapped when the tree is freed. Lists grow into the tree's own region, so
+the tree may be added to, merged and resolved like any other. Module
+instantiations which were resolved when the image was saved still are.
+@param [in] path - The image file to load.
+@returns A new source tree, or NULL if the file could not be read, or is
+not an image this build of the library can load.
+*/
+verilog_source_tree * verilog_source_tree_load(
+    char * path
+);
+
+/*!
+@brief Called by @ref verilog_source_tree_visit_metadata with each node's
+metadata.
+@details Identifiers also keep the line they are on, which is given as
+"line". It is NULL for every other node.
+*/
+typedef void (*ast_metadata_visitor)(
+    ast_metadata * meta,
+    unsigned int * line,
+    void         * data
+);
+
+/*!
+@brief Calls a function with the metadata of every node reachable from a
+source tree, once each.
+@details This walks the tree the same way @ref verilog_source_tree_save
+does, but writes nothing. Modules found by @ref verilog_parse_path_lazy and
+not loaded yet are not loaded, and module instantiations are not followed
+to the declarations they have been resolved to.
+@param [in] tree - The tree to walk.
+@param [in] visitor - Called with the metadata of each node, which it may
+change.
+@param [in] data - Passed to the visitor.
+*/
+void verilog_source_tree_visit_metadata(
+    verilog_source_tree  * tree,
+    ast_metadata_visitor   visitor,
+    void                 * data
+);
+
+/*!
+@brief Calls a function with the metadata of every node of one module or
+primitive declaration, once each.
+@details Walks the declaration as @ref verilog_source_tree_visit_metadata
+walks a tree, so module instantiations are not followed to the
+declarations they have been resolved to.
+@param [in] declaration - An ast_module_declaration or ast_udp_declaration.
+@param [in] module - True if the declaration is a module.
+@param [in] visitor - Called with the metadata of each node, which it may
+change.
+@param [in] data - Passed to the visitor.
+*/
+void verilog_declaration_visit_metadata(
+    void                 * declaration,
+    ast_boolean            module,
+    ast_metadata_visitor   visitor,
+    void                 * data
+);
+
+/*! @} */
+
+#endif
@@ -4,6 +4,10 @@
 manage dynamic memory allocation within the library.
 */
 
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+
 #include "verilog_ast_mem.h"
 
 /*!
@@ -13,95 +17,544 @@ manage dynamic memory allocation within the library.
 @ingroup ast-utility
 */
 
-//! The total number of memory allocations made.
-unsigned int memory_allocations = 0;
+//! Size of a chunk header, rounded up so the chunk data stays aligned.
+#define AST_REGION_HEADER \
+    ((sizeof(ast_region_chunk) + AST_REGION_ALIGN - 1) & ~(AST_REGION_ALIGN-1))
+
+//! Returns a pointer to the first usable byte of a chunk.
+#define AST_CHUNK_DATA(c) (((char*)(c)) + AST_REGION_HEADER)
 
-//! The total number of bytes ever allocated using ast_alloc
-size_t       total_allocated = 0;
+//! Rounds n up to the nearest multiple of align, which is a power of two.
+#define AST_ALIGN_UP(n,align) (((n) + (align) - 1) & ~((size_t)(align) - 1))
 
-//! Head of the linked list of allocated memory.
-ast_memory * memory_head = NULL;
+/*!
+@brief The largest single allocation a region will attempt. Anything bigger
+would overflow when the chunk header and alignment padding are added.
+*/
+#define AST_REGION_MAX_ALLOC \
+    (SIZE_MAX - AST_REGION_HEADER - AST_REGION_MAX_CHUNK)
 
-//! Walker for the linked list of allocated memory.
-ast_memory * walker = NULL;
+//! The region used by ast_calloc when no other is selected.
+static AST_THREAD_LOCAL ast_region * ast_default_region = NULL;
 
+//! The region selected with ast_region_set_current, or NULL for the default.
+static AST_THREAD_LOCAL ast_region * ast_selected_region = NULL;
 
 /*!
-@brief A simple wrapper around calloc.
-@details Makes it very easy to clean up afterward using the @ref ast_free_all
-function.
-@param [in] num - Number of elements to allocate space for.
-@param [in] size - The size of each element being allocated.
-@returns A pointer to the start of the block of memory allocated.
+@brief Creates and returns a new, empty memory region.
+@details No chunk is allocated until the first allocation is made, so empty
+regions are cheap.
 */
-void * ast_calloc(size_t num, size_t size)
+ast_region * ast_region_new()
+{
+    ast_region * tr = calloc(1, sizeof(ast_region));
+    tr -> chunks      = NULL;
+    tr -> chunk_size  = AST_REGION_MIN_CHUNK;
+    tr -> last        = NULL;
+    tr -> allocations = 0;
+    tr -> allocated   = 0;
+    tr -> memory_head = NULL;
+    tr -> strings.slots    = NULL;
+    tr -> strings.capacity = 0;
+    tr -> strings.count    = 0;
+    tr -> adopted      = NULL;
+    tr -> next_adopted = NULL;
+    tr -> cleanups     = NULL;
+    return tr;
+}
+
+/*!
+@brief Runs, and forgets, the cleanup functions registered with a region.
+*/
+static void ast_region_run_cleanups(ast_region * region)
 {
-    // This is the memory the user asked for.
-    void * data = calloc(num,size);
-    
-    memory_allocations += 1;
+    while(region -> cleanups != NULL)
+    {
+        ast_region_cleanup * torun = region -> cleanups;
+        region -> cleanups = torun -> next;
+        torun -> function(torun -> data);
+        free(torun);
+    }
+}
 
-    // Add the allocated memory to tracking data structure.
-    if(walker == NULL)
+/*!
+@brief Releases every allocation ever made from the region, and the region
+itself.
+*/
+void ast_region_free(ast_region * region)
+{
+    if(region == NULL)
     {
-        memory_head = calloc(1,sizeof(ast_memory));
-        memory_head -> size = num * size;
-        total_allocated += memory_head -> size;
-        memory_head -> data = data;
-        memory_head -> next = NULL;
-        walker      = memory_head;
-    } 
-    else
+        return;
+    }
+    else if(region == ast_selected_region)
     {
-        walker -> next = calloc(1,sizeof(ast_memory));
-        walker -> next -> size = num * size;
-        total_allocated += walker -> next -> size;
-        walker -> next -> data = data;
-        walker -> next -> next = NULL;
-        walker         = walker -> next;
+        ast_selected_region = NULL;
     }
 
+    while(region -> adopted != NULL)
+    {
+        ast_region * child = region -> adopted;
+        region -> adopted = child -> next_adopted;
+        ast_region_free(child);
+    }
 
-    return data;
+    ast_region_run_cleanups(region);
+
+    while(region -> chunks != NULL)
+    {
+        ast_region_chunk * tofree = region -> chunks;
+        region -> chunks = tofree -> next;
+        free(tofree);
+    }
+
+    while(region -> memory_head != NULL)
+    {
+        ast_memory * tofree = region -> memory_head;
+        region -> memory_head = tofree -> next;
+        free(tofree -> data);
+        free(tofree);
+    }
+
+    free(region -> strings.slots);
+    free(region);
 }
 
 /*!
-@brief Frees all memory allocated using @ref ast_calloc.
-@details Free's all data stored in the linked list pointed to by the
-@ref head variable.
-@post @ref walker and @ref head are NULL. All memory allocated by ast_calloc
-has been freed.
+@brief Releases every allocation made from a region, but keeps the region,
+and its most recent chunk, ready to be allocated from again.
 */
-void ast_free_all()
+void ast_region_reset(ast_region * region)
 {
-    printf("Freeing data for %u memory allocations.\n", memory_allocations);
-    size_t total_freed = 0;
+    assert(region != NULL);
 
-    while(memory_head != NULL)
+    while(region -> adopted != NULL)
     {
-        walker = memory_head -> next;
-        total_freed += memory_head -> size;
+        ast_region * child = region -> adopted;
+        region -> adopted = child -> next_adopted;
+        ast_region_free(child);
+    }
+
+    ast_region_run_cleanups(region);
 
-        free(memory_head -> data);
-        free(memory_head);
-        
-        memory_head = walker;
+    // Big allocations are always linked in behind the current chunk, so
+    // the one we keep is a normal sized chunk.
+    ast_region_chunk * keep = region -> chunks;
+    if(keep != NULL)
+    {
+        while(keep -> next != NULL)
+        {
+            ast_region_chunk * tofree = keep -> next;
+            keep -> next = tofree -> next;
+            free(tofree);
+        }
+        keep -> used = 0;
     }
 
-    printf("\tFree'd %lu bytes of %lu bytes allocated.\n", 
-        total_freed, total_allocated);
-    printf("\tBytes remaining: %lu\n", total_allocated - total_freed);
-    total_allocated -= total_freed;
+    while(region -> memory_head != NULL)
+    {
+        ast_memory * tofree = region -> memory_head;
+        region -> memory_head = tofree -> next;
+        free(tofree -> data);
+        free(tofree);
+    }
+
+    if(region -> strings.slots != NULL)
+    {
+        memset(region -> strings.slots, 0,
+               region -> strings.capacity * sizeof(char*));
+    }
+    region -> strings.count = 0;
+
+    region -> last        = NULL;
+    region -> allocations = 0;
+    region -> allocated   = 0;
 }
 
+/*!
+@brief Registers a function to be run when a region is freed or reset.
+*/
+void ast_region_at_free(
+    ast_region                  * region,
+    ast_region_cleanup_function   function,
+    void                        * data
+){
+    assert(region != NULL && function != NULL);
+
+    ast_region_cleanup * cleanup = malloc(sizeof(ast_region_cleanup));
+    cleanup -> function = function;
+    cleanup -> data     = data;
+    cleanup -> next     = region -> cleanups;
+    region -> cleanups  = cleanup;
+}
 
-char * ast_strdup(char * in)
+/*!
+@brief Makes one region responsible for releasing another.
+*/
+void ast_region_adopt(ast_region * parent, ast_region * child)
+{
+    assert(parent != NULL);
+    assert(child  != NULL && child != parent);
+
+    child  -> next_adopted = parent -> adopted;
+    parent -> adopted      = child;
+}
+
+/*!
+@brief Adds a new chunk to the region, large enough for at least "size"
+bytes.
+@details Requests which would take up a large fraction of a normal chunk
+get a chunk of their own, which is linked in *behind* the current chunk so
+that the space left in the current one is not wasted.
+*/
+#ifndef VERILOG_PARSER_MALLOC_DEBUG
+static ast_region_chunk * ast_region_grow(ast_region * region, size_t size)
+{
+    if(size > region -> chunk_size / 4 && region -> chunks != NULL)
+    {
+        ast_region_chunk * big = malloc(AST_REGION_HEADER + size);
+        if(big == NULL)
+        {
+            return NULL;
+        }
+        big -> size = size;
+        big -> used = 0;
+        big -> next = region -> chunks -> next;
+        region -> chunks -> next = big;
+        return big;
+    }
+
+    size_t chunk_size = region -> chunk_size;
+    if(chunk_size < size)
+    {
+        chunk_size = size;
+    }
+
+    ast_region_chunk * tr = malloc(AST_REGION_HEADER + chunk_size);
+    if(tr == NULL)
+    {
+        return NULL;
+    }
+    tr -> size = chunk_size;
+    tr -> used = 0;
+    tr -> next = region -> chunks;
+    region -> chunks = tr;
+
+    if(region -> chunk_size < AST_REGION_MAX_CHUNK)
+    {
+        region -> chunk_size *= 2;
+    }
+
+    return tr;
+}
+#endif
+
+/*!
+@brief Carves a block of "size" bytes with the given alignment out of the
+region. The returned memory is zero filled.
+@returns The block, or NULL if it is too big or memory has run out, just
+like calloc.
+*/
+static void * ast_region_alloc(ast_region * region, size_t size, size_t align)
+{
+    assert(region != NULL);
+
+    if(size > AST_REGION_MAX_ALLOC)
+    {
+        return NULL;
+    }
+
+    region -> allocations += 1;
+    region -> allocated   += size;
+
+#ifdef VERILOG_PARSER_MALLOC_DEBUG
+    (void)align;
+    ast_memory * record = calloc(1,sizeof(ast_memory));
+    void       * data   = calloc(1, size > 0 ? size : 1);
+    if(record == NULL || data == NULL)
+    {
+        free(record);
+        free(data);
+        return NULL;
+    }
+    record -> size = size;
+    record -> data = data;
+    record -> next = region -> memory_head;
+    region -> memory_head = record;
+    region -> last = record -> data;
+    return record -> data;
+#else
+    ast_region_chunk * chunk = region -> chunks;
+    size_t offset = 0;
+
+    if(chunk != NULL)
+    {
+        offset = AST_ALIGN_UP(chunk -> used, align);
+    }
+
+    if(chunk == NULL || offset > chunk -> size ||
+       size > chunk -> size - offset)
+    {
+        chunk  = ast_region_grow(region, size);
+        offset = 0;
+        if(chunk == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    void * tr = AST_CHUNK_DATA(chunk) + offset;
+    chunk -> used = offset + size;
+    region -> last = tr;
+
+    memset(tr, 0, size);
+    return tr;
+#endif
+}
+
+/*!
+@brief Allocates zero-initialised memory from a region.
+*/
+void * ast_region_calloc(ast_region * region, size_t num, size_t size)
+{
+    if(size != 0 && num > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+    return ast_region_alloc(region, num * size, AST_REGION_ALIGN);
+}
+
+/*!
+@brief Grows a block previously returned by @ref ast_region_calloc.
+*/
+void * ast_region_realloc(
+    ast_region * region,
+    void       * data,
+    size_t       old_size,
+    size_t       new_size
+){
+    if(data == NULL)
+    {
+        return ast_region_calloc(region, 1, new_size);
+    }
+    else if(new_size <= old_size)
+    {
+        return data;
+    }
+
+#ifndef VERILOG_PARSER_MALLOC_DEBUG
+    // The last block may be in a chunk of its own, behind the current one,
+    // so it can only grow in place if it is inside the current chunk.
+    ast_region_chunk * chunk = region -> chunks;
+    if(data == region -> last && chunk != NULL &&
+       (char*)data >= AST_CHUNK_DATA(chunk) &&
+       (char*)data <  AST_CHUNK_DATA(chunk) + chunk -> size &&
+       new_size <= (size_t)(AST_CHUNK_DATA(chunk) + chunk -> size -
+                            (char*)data))
+    {
+        memset((char*)data + old_size, 0, new_size - old_size);
+        chunk -> used = ((char*)data - AST_CHUNK_DATA(chunk)) + new_size;
+        region -> allocated += new_size - old_size;
+        return data;
+    }
+#endif
+
+    void * tr = ast_region_calloc(region, 1, new_size);
+    if(tr != NULL)
+    {
+        memcpy(tr, data, old_size);
+    }
+    return tr;
+}
+
+//! Duplicates the supplied null terminated string into a region.
+char * ast_region_strdup(ast_region * region, const char * in)
 {
     size_t len = strlen(in);
-    char * tr = ast_calloc(len+1,sizeof(char));
-    memcpy(tr,in,len);
+    char * tr = ast_region_alloc(region, len+1, 1);
+    if(tr != NULL)
+    {
+        memcpy(tr,in,len);
+    }
     return tr;
 }
 
-/*!@}*/
+/*!
+@brief Hashes the first "length" bytes of a string.
+*/
+unsigned int ast_string_hash(const char * in, size_t length)
+{
+    unsigned int tr = 2166136261u;
+    size_t i;
+    for(i = 0; i < length; i ++)
+    {
+        tr ^= (unsigned char)in[i];
+        tr *= 16777619u;
+    }
+    return tr;
+}
+
+/*!
+@brief Doubles the number of slots in a string pool, re-inserting every
+string already interned.
+@returns Zero, leaving the pool as it was, if memory has run out.
+*/
+static int ast_string_pool_grow(ast_string_pool * pool)
+{
+    size_t   new_capacity = pool -> capacity ? pool -> capacity * 2 : 256;
+    char  ** new_slots    = calloc(new_capacity, sizeof(char*));
+    size_t   mask         = new_capacity - 1;
+    size_t   i;
+
+    if(new_slots == NULL)
+    {
+        return 0;
+    }
+
+    for(i = 0; i < pool -> capacity; i ++)
+    {
+        char * str = pool -> slots[i];
+        if(str != NULL)
+        {
+            size_t slot = ast_intern_hash(str) & mask;
+            while(new_slots[slot] != NULL)
+            {
+                slot = (slot + 1) & mask;
+            }
+            new_slots[slot] = str;
+        }
+    }
+
+    free(pool -> slots);
+    pool -> slots    = new_slots;
+    pool -> capacity = new_capacity;
+    return 1;
+}
+
+/*!
+@brief Returns the unique copy of a string held by a region.
+*/
+char * ast_region_intern(ast_region * region, const char * in, size_t length)
+{
+    ast_string_pool * pool = &(region -> strings);
+    unsigned int      hash = ast_string_hash(in, length);
+
+    if(length > UINT_MAX)
+    {
+        return NULL;
+    }
+    else if((pool -> count + 1) * 4 > pool -> capacity * 3 &&
+            !ast_string_pool_grow(pool))
+    {
+        return NULL;
+    }
+
+    size_t mask = pool -> capacity - 1;
+    size_t slot = hash & mask;
+
+    while(pool -> slots[slot] != NULL)
+    {
+        char * candidate = pool -> slots[slot];
+        if(ast_intern_hash(candidate)   == hash   &&
+           ast_intern_length(candidate) == length &&
+           memcmp(candidate, in, length) == 0)
+        {
+            return candidate;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    ast_interned * header = ast_region_alloc(region,
+        sizeof(ast_interned) + length + 1, sizeof(unsigned int));
+    if(header == NULL)
+    {
+        return NULL;
+    }
+    header -> hash   = hash;
+    header -> length = (unsigned int)length;
 
+    char * tr = (char*)(header + 1);
+    memcpy(tr, in, length);
+
+    pool -> slots[slot] = tr;
+    pool -> count      += 1;
+    return tr;
+}
+
+//! Interns a null terminated string in the current region.
+char * ast_intern(const char * in)
+{
+    return ast_region_intern(ast_region_current(), in, strlen(in));
+}
+
+/*!
+@brief Returns the region which ast_calloc and ast_strdup currently
+allocate from.
+*/
+ast_region * ast_region_current()
+{
+    if(ast_selected_region != NULL)
+    {
+        return ast_selected_region;
+    }
+    else if(ast_default_region == NULL)
+    {
+        ast_default_region = ast_region_new();
+    }
+
+    return ast_default_region;
+}
+
+/*!
+@brief Selects the region which ast_calloc and ast_strdup allocate from.
+*/
+ast_region * ast_region_set_current(ast_region * region)
+{
+    ast_region * tr = ast_selected_region;
+    ast_selected_region = region;
+    return tr;
+}
+
+/*!
+@brief A simple wrapper around calloc.
+@details Makes it very easy to clean up afterward using the @ref ast_free_all
+function.
+@param [in] num - Number of elements to allocate space for.
+@param [in] size - The size of each element being allocated.
+@returns A pointer to the start of the block of memory allocated.
+*/
+void * ast_calloc(size_t num, size_t size)
+{
+    return ast_region_calloc(ast_region_current(), num, size);
+}
+
+/*!
+@brief Frees all memory allocated using @ref ast_calloc from the default
+region.
+@details Releases every chunk of the global region in one go. Memory owned
+by other regions, like those of source trees, is not touched.
+@post All memory allocated by ast_calloc from the default region has been
+freed.
+*/
+void ast_free_all()
+{
+    if(ast_default_region == NULL)
+    {
+        return;
+    }
+
+    printf("Freeing data for %u memory allocations.\n",
+        ast_default_region -> allocations);
+    printf("\tFree'd %lu bytes.\n", ast_default_region -> allocated);
+
+    ast_region_free(ast_default_region);
+    ast_default_region = NULL;
+}
+
+
+char * ast_strdup(char * in)
+{
+    return ast_region_strdup(ast_region_current(), in);
+}
+
+/*!@}*/
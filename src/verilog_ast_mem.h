@@ -12,6 +12,36 @@ manage dynamic memory allocation within the library.
 #ifndef VERILOG_AST_MEM_H
 #define VERILOG_AST_MEM_H
 
+/*!
+@brief Size in bytes of the first chunk a region allocates.
+@details Subsequent chunks double in size up to @ref AST_REGION_MAX_CHUNK.
+*/
+#ifndef AST_REGION_MIN_CHUNK
+    #define AST_REGION_MIN_CHUNK (64 * 1024)
+#endif
+
+//! Largest chunk size a region will grow to.
+#ifndef AST_REGION_MAX_CHUNK
+    #define AST_REGION_MAX_CHUNK (4 * 1024 * 1024)
+#endif
+
+//! Alignment of every block returned by @ref ast_region_calloc.
+#define AST_REGION_ALIGN 16
+
+/*!
+@brief Storage class for the library's few remaining global variables.
+@details Each thread gets its own copy of the current region, preprocessor
+context and source tree, so that separate threads can parse separate inputs
+at the same time.
+*/
+#ifndef AST_THREAD_LOCAL
+    #if defined(_MSC_VER)
+        #define AST_THREAD_LOCAL __declspec(thread)
+    #else
+        #define AST_THREAD_LOCAL __thread
+    #endif
+#endif
+
 //! Typedef over ast_memory_T
 typedef struct ast_memory_t ast_memory;
 
@@ -22,6 +52,224 @@ struct ast_memory_t{
     ast_memory  *   next;   //!< Next element to be allocated.
 };
 
+/*!
+@brief Header stored immediately before the text of every interned string.
+@see ast_region_intern
+*/
+typedef struct ast_interned_t{
+    unsigned int hash;      //!< Hash of the text, from @ref ast_string_hash.
+    unsigned int length;    //!< Length of the text, excluding the terminator.
+} ast_interned;
+
+/*!
+@brief An open addressing set of the strings interned in a region.
+@details Slots hold pointers to interned text, and are probed linearly. The
+slot array itself is allocated with malloc so that it can be resized, and is
+released along with the region.
+*/
+typedef struct ast_string_pool_t{
+    char     ** slots;      //!< Interned strings, or NULL for empty slots.
+    size_t      capacity;   //!< Number of slots. Always a power of two.
+    size_t      count;      //!< Number of strings interned.
+} ast_string_pool;
+
+//! Typedef over ast_region_chunk_t
+typedef struct ast_region_chunk_t ast_region_chunk;
+
+/*!
+@brief A single large block of memory from which region allocations are
+carved.
+@details The usable bytes follow the header directly.
+*/
+struct ast_region_chunk_t{
+    ast_region_chunk * next;    //!< The chunk filled before this one.
+    size_t             size;    //!< Number of usable bytes in the chunk.
+    size_t             used;    //!< Number of bytes handed out so far.
+};
+
+//! A function run on some data when a region is released.
+typedef void (*ast_region_cleanup_function)(void * data);
+
+//! Typedef over ast_region_cleanup_t
+typedef struct ast_region_cleanup_t ast_region_cleanup;
+
+/*!
+@brief Something other than memory owned by a region, such as a mapped
+file, stored as a linked list.
+@see ast_region_at_free
+*/
+struct ast_region_cleanup_t{
+    ast_region_cleanup_function   function; //!< Releases the data.
+    void                        * data;     //!< Argument to the function.
+    ast_region_cleanup          * next;     //!< Registered before this one.
+};
+
+/*!
+@brief A bump-pointer memory region.
+@details Allocations are carved sequentially out of large chunks, and can
+only be released all at once with @ref ast_region_free. This makes building
+very large trees cheap, since each node costs a pointer increment rather
+than a call to malloc, and makes teardown proportional to the number of
+chunks rather than the number of nodes.
+
+When the library is built with VERILOG_PARSER_MALLOC_DEBUG defined, each
+allocation is instead made with its own call to calloc and tracked in a
+linked list of @ref ast_memory records. This is much slower, but lets tools
+like valgrind see the bounds of every individual allocation.
+*/
+typedef struct ast_region_t{
+    ast_region_chunk * chunks;      //!< Current chunk, linked to older ones.
+    size_t             chunk_size;  //!< Size of the next chunk to allocate.
+    void             * last;        //!< Most recent allocation made.
+    unsigned int       allocations; //!< Number of allocations made.
+    size_t             allocated;   //!< Number of bytes handed out.
+    ast_memory       * memory_head; //!< Debug allocation tracking list.
+    ast_string_pool    strings;     //!< Strings interned in the region.
+    struct ast_region_t * adopted;  //!< Regions released along with this.
+    struct ast_region_t * next_adopted; //!< Sibling in a parent's list.
+    ast_region_cleanup * cleanups;  //!< Run when the region is released.
+} ast_region;
+
+/*!
+@brief Creates and returns a new, empty memory region.
+*/
+ast_region * ast_region_new();
+
+/*!
+@brief Releases every allocation ever made from the region, and the region
+itself.
+@param [in] region - The region to free.
+*/
+void ast_region_free(ast_region * region);
+
+/*!
+@brief Releases every allocation made from a region, but keeps the region,
+and its most recent chunk, ready to be allocated from again.
+@details Cheaper than freeing the region and making a new one when the same
+kind of short lived data is built over and over. Regions it had adopted are
+freed, and its string pool is emptied.
+@param [inout] region - The region to reset.
+*/
+void ast_region_reset(ast_region * region);
+
+/*!
+@brief Makes one region responsible for releasing another.
+@details Used when the contents of one region come to be referenced by
+another, such as when source trees parsed separately are merged. The child
+stays valid for as long as the parent, and is released by
+@ref ast_region_free along with it.
+@param [inout] parent - The region which takes ownership.
+@param [in] child - The region to adopt. It must not be freed directly, or
+adopted by any other region, afterwards.
+*/
+void ast_region_adopt(ast_region * parent, ast_region * child);
+
+/*!
+@brief Registers a function to be run when a region is freed or reset.
+@details Lets a region own resources it did not allocate itself, such as
+the mapping of a file its nodes point into. Functions run in the reverse of
+the order they were registered, before any of the region's memory is
+released.
+@param [inout] region - The region which takes ownership.
+@param [in] function - Called with data as its only argument.
+@param [in] data - Passed to the function.
+*/
+void ast_region_at_free(
+    ast_region                  * region,
+    ast_region_cleanup_function   function,
+    void                        * data
+);
+
+/*!
+@brief Allocates zero-initialised memory from a region.
+@param [inout] region - The region to allocate from.
+@param [in] num - Number of elements to allocate space for.
+@param [in] size - The size of each element being allocated.
+@returns A pointer to the start of the block of memory allocated, aligned
+to @ref AST_REGION_ALIGN bytes, or NULL if num * size overflows or memory
+has run out, just like calloc.
+*/
+void * ast_region_calloc(ast_region * region, size_t num, size_t size);
+
+/*!
+@brief Grows a block previously returned by @ref ast_region_calloc.
+@details If the block is the most recent allocation made from the region,
+and there is space left in its chunk, it is grown in place. Otherwise a new
+block is allocated and the old contents copied into it. Any bytes past
+old_size are zeroed.
+@param [inout] region - The region the block was allocated from.
+@param [in] data - The block to grow, or NULL.
+@param [in] old_size - The current size of the block in bytes.
+@param [in] new_size - The size the block should become.
+@returns A pointer to the grown block, or NULL if memory has run out, in
+which case the old block is left as it was.
+*/
+void * ast_region_realloc(
+    ast_region * region,
+    void       * data,
+    size_t       old_size,
+    size_t       new_size
+);
+
+//! Duplicates the supplied null terminated string into a region.
+char * ast_region_strdup(ast_region * region, const char * in);
+
+/*!
+@brief Hashes the first "length" bytes of a string.
+@details This is the 32-bit FNV-1a hash. It is the hash stored alongside
+interned strings, so it may be used to look them up in other tables without
+hashing them again.
+*/
+unsigned int ast_string_hash(const char * in, size_t length);
+
+/*!
+@brief Returns the unique copy of a string held by a region.
+@details The first time some text is interned in a region, it is copied
+into the region along with its length and hash. Every later request for the
+same text returns the same pointer, so interned strings from the same
+region may be compared for equality by comparing pointers.
+@param [inout] region - The region whose pool to intern the string in.
+@param [in] in - The text to intern. Need not be null terminated.
+@param [in] length - The length of the text in bytes.
+@returns A null terminated copy of the text, which must not be modified,
+or NULL if memory has run out.
+*/
+char * ast_region_intern(ast_region * region, const char * in, size_t length);
+
+/*!
+@brief Interns a null terminated string in the current region.
+@see ast_region_intern ast_region_current
+*/
+char * ast_intern(const char * in);
+
+/*!
+@brief Returns the hash of a string returned by @ref ast_region_intern.
+@pre The string must have been interned. Other strings have no header.
+*/
+#define ast_intern_hash(S) (((const ast_interned*)(S)) - 1) -> hash
+
+/*!
+@brief Returns the length of a string returned by @ref ast_region_intern.
+@pre The string must have been interned. Other strings have no header.
+*/
+#define ast_intern_length(S) (((const ast_interned*)(S)) - 1) -> length
+
+/*!
+@brief Returns the region which ast_calloc and ast_strdup currently
+allocate from.
+@details If no region has been selected with @ref ast_region_set_current,
+this is a global default region which is released by @ref ast_free_all.
+Both the selection and the default region are per-thread.
+*/
+ast_region * ast_region_current();
+
+/*!
+@brief Selects the region which ast_calloc and ast_strdup allocate from.
+@param [in] region - The region to allocate from, or NULL to select the
+global default region.
+@returns The previously selected region, so that callers can restore it.
+*/
+ast_region * ast_region_set_current(ast_region * region);
 
 //! Iterates over all allocated memory and frees it.
 void ast_free_all();
@@ -31,17 +279,17 @@ char * ast_strdup(char * in);
 
 /*!
 @brief A simple wrapper around calloc.
-@details This function is identical to calloc, but uses the head and
-walker variables above to keep a linked list of all heap memory that the
-AST construction allocates. This makes it very easy to clean up afterward
-using the @ref ast_free_all function.
+@details This function is identical to calloc, but carves its memory out of
+the current region (see @ref ast_region_current). This makes it very easy to
+clean up afterward, either by releasing the region, or using the
+@ref ast_free_all function for the default region.
 @param [in] num - Number of elements to allocate space for.
 @param [in] size - The size of each element being allocated.
-@returns A pointer to the start of the block of memory allocated.
+@returns A pointer to the start of the block of memory allocated, or NULL
+if num * size overflows or memory has run out.
 */
 void * ast_calloc(size_t num, size_t size);
 
 
 
 #endif
-
@@ -8,24 +8,37 @@
 #include <stdio.h>
 
 #include "verilog_ast_util.h"
+#include "verilog_parser.h"
 
 
 /*!
-@brief Searches the list of modules in the parsed source tree, returning the
-one that matches the passed identifer.
-@returns The matching module declaration, or NULL if no such declaration
-exists.
+@brief Finds a module by name, without loading it if it is lazy.
+@details Simple names are looked up in the tree's module_index. Only
+hierarchical names, which almost never occur, need a search of the whole
+modules list.
 */
-ast_module_declaration * verilog_find_module_declaration(
+static ast_module_declaration * verilog_lookup_module(
     verilog_source_tree * source,
     ast_identifier module_name
 ){
-    unsigned int m;
-    for(m = 0; m < source -> modules -> items; m++)
+    verilog_source_tree_index_modules(source);
+
+    if(module_name -> next == NULL)
     {
-        ast_module_declaration * candidate = ast_list_get(source -> modules,m);
+        void * found;
+        if(ast_hashtable_get(source -> module_index,
+                             module_name -> identifier,
+                             &found) == HASH_SUCCESS)
+        {
+            return found;
+        }
+        return NULL;
+    }
 
-        if(ast_identifier_cmp(module_name, candidate -> identifier) == 0)
+    ast_module_declaration * candidate;
+    ast_list_foreach(candidate, source -> modules)
+    {
+        if(ast_identifier_eq(module_name, candidate -> identifier))
         {
             return candidate;
         }
@@ -34,10 +47,90 @@ ast_module_declaration * verilog_find_module_declaration(
     return NULL;
 }
 
+/*!
+@brief Resolves the instantiations made by a single module in a source
+tree.
+*/
+void verilog_resolve_instantiations(
+    verilog_source_tree    * source,
+    ast_module_declaration * module
+){
+    if(module -> module_instantiations == NULL)
+    {
+        return;
+    }
+
+    // Anything allocated while resolving belongs to the tree.
+    ast_region * previous = ast_region_set_current(source -> region);
+
+    ast_module_instantiation * submod;
+    ast_list_foreach(submod, module -> module_instantiations)
+    {
+        if(submod -> resolved)
+        {
+            // Do Nothing
+            continue;
+        }
+
+        // Find the module via it's identifier.
+        ast_module_declaration * foundmod= 
+            verilog_lookup_module(source, submod -> module_identifer);
+        if(foundmod != NULL)
+        {
+            submod -> resolved = AST_TRUE;
+            submod -> declaration = foundmod;
+            continue;
+        }
+
+        // Wait for a module of this name to be added.
+        char * key = ast_identifier_key(submod -> module_identifer,
+                                        source -> region);
+        void * waiting;
+        if(ast_hashtable_get(source -> pending_instantiations, key,
+                             &waiting) != HASH_SUCCESS)
+        {
+            waiting = ast_list_new();
+            ast_hashtable_insert(source -> pending_instantiations, key,
+                                 waiting);
+        }
+        ast_list_append(waiting, submod);
+    }
+
+    ast_region_set_current(previous);
+}
+
+/*!
+@brief Searches the list of modules in the parsed source tree, returning the
+one that matches the passed identifer.
+@details If the module was found by @ref verilog_parse_path_lazy and has not
+been parsed yet, it is parsed now, and its instantiations resolved.
+@returns The matching module declaration, or NULL if no such declaration
+exists.
+*/
+ast_module_declaration * verilog_find_module_declaration(
+    verilog_source_tree * source,
+    ast_identifier module_name
+){
+    ast_module_declaration * tr = verilog_lookup_module(source, module_name);
+
+    if(tr != NULL && tr -> lazy != NULL && verilog_load_module(source, tr))
+    {
+        verilog_resolve_instantiations(source, tr);
+    }
+
+    return tr;
+}
+
 
 /*!
 @brief searches across an entire verilog source tree, resolving module
 identifiers to their declarations.
+@details Only modules added since the last call are examined. Their
+instantiations are either resolved straight away or, if no module of the
+right name exists yet, left in the tree's pending_instantiations table.
+Modules added later resolve the instantiations waiting for them as they are
+added, so calling this after every file parsed costs time proportional to
+the size of that file, not the size of the whole tree.
 */
 void verilog_resolve_modules(
     verilog_source_tree * source
@@ -45,13 +138,17 @@ void verilog_resolve_modules(
     assert(source != NULL);
     assert(source -> modules != NULL);
 
-    int resolved = 0;
-    int unresolved = 0;
+    // Anything allocated while resolving belongs to the tree.
+    ast_region * previous = ast_region_set_current(source -> region);
+
+    // Index new modules first, which resolves anything already waiting.
+    verilog_source_tree_index_modules(source);
 
-    unsigned int m;
-    for(m = 0; m < source -> modules -> items; m++)
+    while(source -> modules_resolved < source -> modules -> items)
     {
-        ast_module_declaration * module = ast_list_get(source -> modules, m);
+        ast_module_declaration * module = ast_list_get(source -> modules,
+            source -> modules_resolved);
+        source -> modules_resolved ++;
         
         assert(module != NULL);
 
@@ -60,45 +157,11 @@ void verilog_resolve_modules(
             continue;
         }
         
-        assert(module -> identifier != NULL);
-        assert(module -> module_instantiations != NULL);
-
-        //printf("%s\n", ast_identifier_tostring(module -> identifier));
-
-        
-        unsigned int sm;
-        for(sm = 0; sm < module -> module_instantiations -> items; sm ++)
-        {
-            ast_module_instantiation * submod = 
-                            ast_list_get(module -> module_instantiations, sm);
-            
-            if(submod -> resolved)
-            {
-                // Do Nothing
-            }
-            else
-            {
-                // Find the module via it's identifier.
-                ast_module_declaration * foundmod= 
-                    verilog_find_module_declaration(source,
-                        submod -> module_identifer);
-                if(foundmod == NULL)
-                {
-                    //printf("Could not resolve module name '%s'\n",
-                    //ast_identifier_tostring(submod -> module_identifer));
-                    unresolved ++;
-                }
-                else
-                {
-                    submod -> resolved = AST_TRUE;
-                    submod -> declaration = foundmod;
-                    resolved ++;
-                }
-            }
-        }
+        // Lazy modules are resolved when they are loaded.
+        verilog_resolve_instantiations(source, module);
     }
-    //printf("Resolved Modules: %d\t Unresolved Modules: %d\n", 
-    //    resolved,unresolved);
+
+    ast_region_set_current(previous);
 }
 
 
@@ -111,17 +174,13 @@ ast_list * verilog_module_get_children(
 ){
     ast_list * tr = ast_list_new();
     
-    unsigned int m;
-    for(m = 0; m < module -> module_instantiations -> items; m++)
+    ast_module_instantiation * child;
+    ast_list_foreach(child, module -> module_instantiations)
     {
-        ast_module_instantiation * child = 
-                            ast_list_get(module -> module_instantiations, m);
-
-        unsigned int c;
         unsigned char added_already = 0;
-        for(c = 0; c < tr -> items; c++)
+        ast_module_instantiation * maybe;
+        ast_list_foreach(maybe, tr)
         {
-            ast_module_instantiation * maybe = ast_list_get(tr,c);
             ast_identifier i1, i2;
             if(maybe -> resolved)
                 i1 = maybe -> declaration -> identifier;
@@ -133,7 +192,7 @@ ast_list * verilog_module_get_children(
             else
                 i2 = child-> module_identifer;
 
-            if(ast_identifier_cmp(i1,i2) == 0)
+            if(ast_identifier_eq(i1,i2))
             {
                 added_already = 1;
                 break;
@@ -167,11 +226,9 @@ ast_hashtable * verilog_modules_get_children(
 ){
     ast_hashtable * tr = ast_hashtable_new();
 
-    unsigned int m;
-    for(m = 0; m < source -> modules -> items; m++)
+    ast_module_declaration * module;
+    ast_list_foreach(module, source -> modules)
     {
-        ast_module_declaration * module = ast_list_get(source -> modules, m);
-
         ast_list * children = verilog_module_get_children(module);
 
         char * key = ast_identifier_tostring(module -> identifier);
@@ -22,14 +22,32 @@
 /*!
 @brief searches across an entire verilog source tree, resolving module
 identifiers to their declarations.
+@details Incremental. Only modules added to the tree since the previous
+call are examined, and instantiations of modules which do not exist yet
+are resolved automatically when those modules are added.
 */
 void verilog_resolve_modules(
     verilog_source_tree * source
 );
 
+/*!
+@brief Resolves the instantiations made by a single module in a source
+tree.
+@details Used when a module is replaced after @ref verilog_resolve_modules
+has already passed over it. Instantiations which cannot be resolved yet
+wait in the tree's pending_instantiations table, as they would for
+verilog_resolve_modules.
+*/
+void verilog_resolve_instantiations(
+    verilog_source_tree    * source,
+    ast_module_declaration * module
+);
+
 /*!
 @brief Searches the list of modules in the parsed source tree, returning the
 one that matches the passed identifer.
+@details Modules found by verilog_parse_path_lazy are parsed the first time
+they are returned.
 @returns The matching module declaration, or NULL if no such declaration
 exists.
 */
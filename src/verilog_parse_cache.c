@@ -0,0 +1,689 @@
+/*!
+@file verilog_parse_cache.c
+@brief Contains definitions of functions for keeping parsed files in an
+on-disk cache.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "verilog_parse_cache.h"
+#include "verilog_ast_image.h"
+
+//! The first word of every preprocessor record.
+#define VERILOG_CACHE_MAGIC "VLOGPRE"
+
+/*!
+@brief An include directive read from a preprocessor record, and the hash
+of the file it found.
+*/
+typedef struct verilog_cache_include_t{
+    verilog_include_directive directive; //!< As the preprocessor made it.
+    unsigned long long        hash;      //!< Contents of the file found.
+} verilog_cache_include;
+
+/*!
+@brief Everything a file did to the preprocessor parsing it.
+@details Written alongside the image of the file's source tree, and read
+back in place of parsing it. Macros are the whole table as the file left
+it, since the table it started with is part of the key.
+*/
+typedef struct verilog_cache_record_t{
+    unsigned long long          key;            //!< Key of the entry.
+    unsigned int                tokens;         //!< Tokens scanned.
+    ast_boolean                 in_cell_define; //!< State at the end.
+    ast_primitive_strength      unconnected_drive_pull; //!< Ditto.
+    verilog_timescale_directive timescale;      //!< Ditto.
+    ast_list                  * includes;       //!< verilog_cache_include
+    ast_list                  * net_types;      //!< Relative token numbers.
+    ast_list                  * macros;         //!< verilog_macro_directive
+} verilog_cache_record;
+
+//! Where a preprocessor was up to before a file was parsed.
+typedef struct verilog_cache_start_t{
+    unsigned int tokens;    //!< Its token_count.
+    unsigned int includes;  //!< Number of its include directives.
+    unsigned int net_types; //!< Number of its default net type directives.
+} verilog_cache_start;
+
+// ------------------------------------------------------------------------
+
+//! Adds some bytes to a 64-bit FNV-1a hash.
+static unsigned long long verilog_cache_hash(
+    unsigned long long   hash,
+    const void         * data,
+    size_t               length
+){
+    const unsigned char * bytes = data;
+    size_t i;
+    for(i = 0; i < length; i ++)
+    {
+        VERILOG_HASH_STEP(hash, bytes[i]);
+    }
+    return hash;
+}
+
+//! Hashes the contents of a file, returning AST_FALSE if it can't be read.
+static ast_boolean verilog_cache_hash_file(
+    char               * path,
+    unsigned long long * hash
+){
+    verilog_mapped_file * mapped = verilog_map_file(path);
+    if(mapped == NULL)
+    {
+        return AST_FALSE;
+    }
+    *hash = verilog_cache_hash(VERILOG_HASH_BASIS, mapped -> data,
+                               mapped -> length);
+    verilog_unmap_file(mapped);
+    return AST_TRUE;
+}
+
+/*!
+@brief Hashes the contents of an include file, using the copy the
+preprocessor keeps so that headers used by many files are read once.
+*/
+static ast_boolean verilog_cache_hash_include(
+    verilog_preprocessor_context * preproc,
+    char                         * path,
+    unsigned long long           * hash
+){
+    verilog_mapped_file * mapped =
+        verilog_preprocessor_read_include(preproc, path);
+    if(mapped == NULL)
+    {
+        return AST_FALSE;
+    }
+    *hash = verilog_cache_hash(VERILOG_HASH_BASIS, mapped -> data,
+                               mapped -> length);
+    return AST_TRUE;
+}
+
+/*!
+@brief Works out the key a file is stored under.
+@details Macros are hashed one at a time and the hashes summed, since the
+order a hash table gives them in depends on how it was filled.
+*/
+static unsigned long long verilog_cache_key(
+    verilog_parser_context * context,
+    char                   * path,
+    unsigned long long       contents
+){
+    verilog_preprocessor_context * preproc = context -> preprocessor;
+
+    unsigned int versions[] = {
+        VERILOG_PARSE_CACHE_VERSION,
+        VERILOG_IMAGE_VERSION,
+        context -> skeleton,
+        preproc -> search_dirs -> items
+    };
+
+    unsigned long long tr = VERILOG_HASH_BASIS;
+    tr = verilog_cache_hash(tr, versions, sizeof(versions));
+    tr = verilog_cache_hash(tr, path, strlen(path) + 1);
+    tr = verilog_cache_hash(tr, &contents, sizeof(contents));
+
+    char * dir;
+    ast_list_foreach(dir, preproc -> search_dirs)
+    {
+        tr = verilog_cache_hash(tr, dir, strlen(dir) + 1);
+    }
+
+    unsigned long long      macros   = 0;
+    unsigned int            position = 0;
+    ast_hashtable_element * element;
+    while((element = ast_hashtable_iterate(preproc -> macrodefines,
+                                           &position)) != NULL)
+    {
+        verilog_macro_directive * macro = element -> data;
+        unsigned long long        hash  = VERILOG_HASH_BASIS;
+        hash = verilog_cache_hash(hash, macro -> macro_id,
+                                  strlen(macro -> macro_id) + 1);
+        hash = verilog_cache_hash(hash, macro -> macro_value,
+                                  strlen(macro -> macro_value) + 1);
+        macros += hash;
+    }
+    return verilog_cache_hash(tr, &macros, sizeof(macros));
+}
+
+/*!
+@brief Returns the path of a cache entry, allocated with malloc.
+@param [in] cache - The cache.
+@param [in] key - The key of the entry.
+@param [in] kind - Either "ast" for the image, or "pre" for the record.
+*/
+static char * verilog_cache_path(
+    verilog_parse_cache * cache,
+    unsigned long long    key,
+    const char          * kind
+){
+    size_t length = strlen(cache -> directory) + 32;
+    char * tr     = malloc(length);
+    snprintf(tr, length, "%s/%016llx.%s", cache -> directory, key, kind);
+    return tr;
+}
+
+// ------------------------------------------------------------------------
+
+//! Writes a string, which may be NULL, to a preprocessor record.
+static void verilog_cache_put_string(FILE * file, const char * text)
+{
+    if(text == NULL)
+    {
+        fputs("-\n", file);
+    }
+    else
+    {
+        fprintf(file, "%zu ", strlen(text));
+        fputs(text, file);
+        fputc('\n', file);
+    }
+}
+
+/*!
+@brief Reads a string written by verilog_cache_put_string.
+@param [in] file - The record being read.
+@param [in] region - Where to allocate the string.
+@param [in] limit - The size of the record, which no string can be longer
+than.
+@param [out] text - The string read.
+@returns AST_TRUE if a string was read.
+*/
+static ast_boolean verilog_cache_get_string(
+    FILE        * file,
+    ast_region  * region,
+    size_t        limit,
+    char       ** text
+){
+    int first = fgetc(file);
+    if(first == '-')
+    {
+        *text = NULL;
+        return fgetc(file) == '\n';
+    }
+    ungetc(first, file);
+
+    size_t length;
+    if(fscanf(file, "%zu", &length) != 1 || length > limit ||
+       fgetc(file) != ' ')
+    {
+        return AST_FALSE;
+    }
+
+    *text = ast_region_calloc(region, length + 1, sizeof(char));
+    return fread(*text, 1, length, file) == length && fgetc(file) == '\n';
+}
+
+/*!
+@brief Writes the preprocessor record of a file which has just been
+parsed.
+@param [in] file - Where to write the record.
+@param [in] key - The key of the entry.
+@param [in] preproc - The preprocessor, as the file left it.
+@param [in] start - Where the preprocessor was up to before the file was
+parsed.
+@returns AST_TRUE if every file found by an include directive could be
+hashed.
+*/
+static ast_boolean verilog_cache_put_record(
+    FILE                         * file,
+    unsigned long long             key,
+    verilog_preprocessor_context * preproc,
+    verilog_cache_start          * start
+){
+    fprintf(file, "%s %d %016llx\n", VERILOG_CACHE_MAGIC,
+            VERILOG_PARSE_CACHE_VERSION, key);
+    fprintf(file, "%u %d %d\n", preproc -> token_count - start -> tokens,
+            (int)preproc -> in_cell_define,
+            (int)preproc -> unconnected_drive_pull);
+    verilog_cache_put_string(file, preproc -> timescale.scale);
+    verilog_cache_put_string(file, preproc -> timescale.precision);
+
+    unsigned int i;
+    unsigned int first = start -> includes;
+    fprintf(file, "%u\n", preproc -> includes -> items - first);
+    for(i = first; i < preproc -> includes -> items; i ++)
+    {
+        verilog_include_directive * include =
+            ast_list_get(preproc -> includes, i);
+        unsigned long long hash = 0;
+
+        if(include -> file_found &&
+           !verilog_cache_hash_include(preproc, include -> filename, &hash))
+        {
+            return AST_FALSE;
+        }
+
+        fprintf(file, "%u %d %016llx\n", include -> lineNumber,
+                (int)include -> file_found, hash);
+        verilog_cache_put_string(file, include -> name);
+        verilog_cache_put_string(file, include -> file_found ?
+                                       include -> filename : NULL);
+    }
+
+    first = start -> net_types;
+    fprintf(file, "%u\n", preproc -> net_types -> items - first);
+    for(i = first; i < preproc -> net_types -> items; i ++)
+    {
+        verilog_default_net_type * net_type =
+            ast_list_get(preproc -> net_types, i);
+        fprintf(file, "%u %u %d\n",
+                net_type -> token_number - start -> tokens,
+                net_type -> line_number, (int)net_type -> type);
+    }
+
+    unsigned int            position = 0;
+    ast_hashtable_element * element;
+    fprintf(file, "%u\n", preproc -> macrodefines -> size);
+    while((element = ast_hashtable_iterate(preproc -> macrodefines,
+                                           &position)) != NULL)
+    {
+        verilog_macro_directive * macro = element -> data;
+        fprintf(file, "%u\n", macro -> line);
+        verilog_cache_put_string(file, macro -> macro_id);
+        verilog_cache_put_string(file, macro -> macro_value);
+        verilog_cache_put_string(file, macro -> src_file);
+    }
+
+    return AST_TRUE;
+}
+
+/*!
+@brief Reads a preprocessor record.
+@param [in] path - The record to read.
+@param [in] region - Where to allocate everything in the record.
+@param [out] record - The record read.
+@returns AST_TRUE if the record was read, and was written by this version
+of the cache.
+*/
+static ast_boolean verilog_cache_get_record(
+    char                 * path,
+    ast_region           * region,
+    verilog_cache_record * record
+){
+    FILE * file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        return AST_FALSE;
+    }
+
+    struct stat info;
+    if(fstat(fileno(file), &info) != 0)
+    {
+        fclose(file);
+        return AST_FALSE;
+    }
+    size_t limit = (size_t)info.st_size;
+
+    char         magic[8];
+    int          version, in_cell_define, pull;
+    unsigned int count, i;
+    ast_boolean  tr = AST_FALSE;
+
+    if(fscanf(file, "%7s %d %llx", magic, &version, &record -> key) != 3 ||
+       strcmp(magic, VERILOG_CACHE_MAGIC) != 0 ||
+       version != VERILOG_PARSE_CACHE_VERSION ||
+       fscanf(file, "%u %d %d\n", &record -> tokens, &in_cell_define,
+              &pull) != 3 ||
+       !verilog_cache_get_string(file, region, limit,
+                                 &record -> timescale.scale) ||
+       !verilog_cache_get_string(file, region, limit,
+                                 &record -> timescale.precision) ||
+       fscanf(file, "%u\n", &count) != 1 || count > limit)
+    {
+        goto done;
+    }
+    record -> in_cell_define         = in_cell_define;
+    record -> unconnected_drive_pull = pull;
+
+    ast_region * previous = ast_region_set_current(region);
+    record -> includes  = ast_list_new();
+    record -> net_types = ast_list_new();
+    record -> macros    = ast_list_new();
+    ast_region_set_current(previous);
+
+    for(i = 0; i < count; i ++)
+    {
+        verilog_cache_include * include =
+            ast_region_calloc(region, 1, sizeof(verilog_cache_include));
+        int found;
+        if(fscanf(file, "%u %d %llx\n", &include -> directive.lineNumber,
+                  &found, &include -> hash) != 3 ||
+           !verilog_cache_get_string(file, region, limit,
+                                     &include -> directive.name) ||
+           !verilog_cache_get_string(file, region, limit,
+                                     &include -> directive.filename) ||
+           include -> directive.name == NULL ||
+           (found != 0) != (include -> directive.filename != NULL))
+        {
+            goto done;
+        }
+        include -> directive.file_found = found ? AST_TRUE : AST_FALSE;
+        ast_list_append(record -> includes, include);
+    }
+
+    if(fscanf(file, "%u\n", &count) != 1 || count > limit)
+    {
+        goto done;
+    }
+    for(i = 0; i < count; i ++)
+    {
+        verilog_default_net_type * net_type =
+            ast_region_calloc(region, 1, sizeof(verilog_default_net_type));
+        int type;
+        if(fscanf(file, "%u %u %d\n", &net_type -> token_number,
+                  &net_type -> line_number, &type) != 3)
+        {
+            goto done;
+        }
+        net_type -> type = type;
+        ast_list_append(record -> net_types, net_type);
+    }
+
+    if(fscanf(file, "%u\n", &count) != 1 || count > limit)
+    {
+        goto done;
+    }
+    for(i = 0; i < count; i ++)
+    {
+        verilog_macro_directive * macro =
+            ast_region_calloc(region, 1, sizeof(verilog_macro_directive));
+        if(fscanf(file, "%u\n", &macro -> line) != 1 ||
+           !verilog_cache_get_string(file, region, limit,
+                                     &macro -> macro_id) ||
+           !verilog_cache_get_string(file, region, limit,
+                                     &macro -> macro_value) ||
+           !verilog_cache_get_string(file, region, limit,
+                                     &macro -> src_file) ||
+           macro -> macro_id == NULL || macro -> macro_value == NULL)
+        {
+            goto done;
+        }
+        ast_list_append(record -> macros, macro);
+    }
+
+    tr = AST_TRUE;
+
+    done:
+    fclose(file);
+    return tr;
+}
+
+/*!
+@brief Checks that each include directive in a record would still find the
+same file, with the same contents.
+*/
+static ast_boolean verilog_cache_includes_valid(
+    verilog_preprocessor_context * preproc,
+    verilog_cache_record         * record
+){
+    verilog_cache_include * include;
+    ast_list_foreach(include, record -> includes)
+    {
+        char * found = verilog_preprocessor_find_include(
+            preproc, include -> directive.name);
+        unsigned long long hash;
+
+        if(found == NULL || include -> directive.filename == NULL)
+        {
+            if(found != include -> directive.filename)
+            {
+                return AST_FALSE;
+            }
+        }
+        else if(strcmp(found, include -> directive.filename) != 0 ||
+                !verilog_cache_hash_include(preproc, found, &hash) ||
+                hash != include -> hash)
+        {
+            return AST_FALSE;
+        }
+    }
+    return AST_TRUE;
+}
+
+/*!
+@brief Makes the changes to a preprocessor which the file a record was
+written for made when it was parsed.
+*/
+static void verilog_cache_apply_record(
+    verilog_preprocessor_context * preproc,
+    verilog_cache_record         * record
+){
+    ast_region * previous = ast_region_set_current(preproc -> region);
+
+    unsigned int tokens = preproc -> token_count;
+    preproc -> token_count           += record -> tokens;
+    preproc -> in_cell_define         = record -> in_cell_define;
+    preproc -> unconnected_drive_pull = record -> unconnected_drive_pull;
+    preproc -> timescale.scale        = record -> timescale.scale == NULL ?
+        NULL : ast_strdup(record -> timescale.scale);
+    preproc -> timescale.precision    = record -> timescale.precision == NULL ?
+        NULL : ast_strdup(record -> timescale.precision);
+
+    verilog_cache_include * include;
+    ast_list_foreach(include, record -> includes)
+    {
+        verilog_include_directive * copy =
+            ast_calloc(1, sizeof(verilog_include_directive));
+        *copy = include -> directive;
+        copy -> name     = ast_strdup(include -> directive.name);
+        copy -> filename = copy -> file_found ?
+                           ast_strdup(include -> directive.filename) :
+                           copy -> name;
+        ast_list_append(preproc -> includes, copy);
+    }
+
+    verilog_default_net_type * net_type;
+    ast_list_foreach(net_type, record -> net_types)
+    {
+        verilog_default_net_type * copy =
+            ast_calloc(1, sizeof(verilog_default_net_type));
+        *copy = *net_type;
+        copy -> token_number += tokens;
+        ast_list_append(preproc -> net_types, copy);
+    }
+
+    // Replace the macro table with the one the file left behind.
+    unsigned int            count    = preproc -> macrodefines -> size;
+    char                 ** keys     = malloc((count + 1) * sizeof(char*));
+    unsigned int            position = 0;
+    unsigned int            i        = 0;
+    ast_hashtable_element * element;
+    while((element = ast_hashtable_iterate(preproc -> macrodefines,
+                                           &position)) != NULL)
+    {
+        keys[i ++] = element -> key;
+    }
+    while(i > 0)
+    {
+        ast_hashtable_delete(preproc -> macrodefines, keys[-- i]);
+    }
+    free(keys);
+
+    verilog_macro_directive * macro;
+    ast_list_foreach(macro, record -> macros)
+    {
+        verilog_macro_directive * copy =
+            ast_calloc(1, sizeof(verilog_macro_directive));
+        copy -> line        = macro -> line;
+        copy -> macro_id    = ast_intern(macro -> macro_id);
+        copy -> macro_value = ast_strdup(macro -> macro_value);
+        copy -> src_file    = macro -> src_file == NULL ? NULL :
+                              ast_strdup(macro -> src_file);
+        ast_hashtable_insert(preproc -> macrodefines, copy -> macro_id, copy);
+    }
+
+    ast_region_set_current(previous);
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Tries to read a file from the cache into a context.
+@returns AST_TRUE if it was found, and nothing need be parsed.
+*/
+static ast_boolean verilog_cache_lookup(
+    verilog_parser_context * context,
+    verilog_parse_cache    * cache,
+    unsigned long long       key
+){
+    ast_region           * region = ast_region_new();
+    verilog_cache_record   record;
+    ast_boolean            tr     = AST_FALSE;
+    char                 * path   = verilog_cache_path(cache, key, "pre");
+
+    memset(&record, 0, sizeof(verilog_cache_record));
+
+    if(verilog_cache_get_record(path, region, &record) &&
+       record.key == key &&
+       verilog_cache_includes_valid(context -> preprocessor, &record))
+    {
+        free(path);
+        path = verilog_cache_path(cache, key, "ast");
+
+        verilog_source_tree * loaded = verilog_source_tree_load(path);
+        if(loaded != NULL)
+        {
+            verilog_cache_apply_record(context -> preprocessor, &record);
+            verilog_source_tree_merge(context -> source_tree, loaded);
+            tr = AST_TRUE;
+        }
+    }
+
+    free(path);
+    ast_region_free(region);
+    return tr;
+}
+
+/*!
+@brief Adds a file which has just been parsed to the cache.
+@details Failing to write an entry is not an error. The file will just be
+parsed again next time.
+*/
+static void verilog_cache_store(
+    verilog_parser_context       * context,
+    verilog_parse_cache          * cache,
+    unsigned long long             key,
+    verilog_source_tree          * tree,
+    verilog_cache_start          * start
+){
+    char * image = verilog_cache_path(cache, key, "ast");
+    char * path  = verilog_cache_path(cache, key, "pre");
+
+    // The image goes first, so a record is never seen without one.
+    if(verilog_source_tree_save(tree, image) == 0)
+    {
+        size_t length = strlen(path) + 32;
+        char * temp   = malloc(length);
+        snprintf(temp, length, "%s.%ld.tmp", path, (long)getpid());
+
+        FILE * file = fopen(temp, "wb");
+        if(file != NULL)
+        {
+            ast_boolean written = verilog_cache_put_record(
+                file, key, context -> preprocessor, start);
+
+            if(fclose(file) != 0 || !written || rename(temp, path) != 0)
+            {
+                remove(temp);
+            }
+        }
+        free(temp);
+    }
+
+    free(image);
+    free(path);
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Creates a cache which keeps its entries in the given directory.
+*/
+verilog_parse_cache * verilog_new_parse_cache(
+    char * directory
+){
+    assert(directory != NULL);
+
+    if(mkdir(directory, 0777) != 0 && errno != EEXIST)
+    {
+        return NULL;
+    }
+
+    verilog_parse_cache * tr = calloc(1, sizeof(verilog_parse_cache));
+    tr -> directory = strdup(directory);
+    return tr;
+}
+
+/*!
+@brief Frees a cache object. The entries on disk are left alone.
+*/
+void verilog_free_parse_cache(
+    verilog_parse_cache * cache
+){
+    if(cache != NULL)
+    {
+        free(cache -> directory);
+        free(cache);
+    }
+}
+
+/*!
+@brief Parses the file at the supplied path using the supplied context,
+reading it from the cache if it has been parsed before.
+*/
+int verilog_parse_path_cached(
+    verilog_parser_context * context,
+    verilog_parse_cache    * cache,
+    char                   * path
+){
+    verilog_preprocessor_context * preproc  = context -> preprocessor;
+    verilog_source_tree          * tree     = context -> source_tree;
+    unsigned long long             contents = 0;
+
+    if(tree -> description_callback != NULL ||
+       ast_stack_peek(preproc -> ifdefs) != NULL ||
+       !verilog_cache_hash_file(path, &contents))
+    {
+        return verilog_parse_path_r(context, path);
+    }
+
+    unsigned long long key = verilog_cache_key(context, path, contents);
+
+    if(verilog_cache_lookup(context, cache, key))
+    {
+        verilog_preprocessor_set_file(preproc, path);
+        cache -> hits ++;
+        return 0;
+    }
+
+    cache -> misses ++;
+
+    // Parse into a tree of its own, so that only this file is stored.
+    verilog_cache_start start;
+    start.tokens    = preproc -> token_count;
+    start.includes  = preproc -> includes -> items;
+    start.net_types = preproc -> net_types -> items;
+
+    // Sharing the file table means the image records the ids files have in
+    // the tree, so loading it in the next run usually renumbers nothing.
+    context -> source_tree = verilog_new_source_tree_sharing(tree);
+
+    int result = verilog_parse_path_r(context, path);
+
+    if(result == 0 && ast_stack_peek(preproc -> ifdefs) == NULL)
+    {
+        verilog_cache_store(context, cache, key, context -> source_tree,
+                            &start);
+    }
+
+    verilog_source_tree_merge(tree, context -> source_tree);
+    context -> source_tree = tree;
+    return result;
+}
@@ -0,0 +1,88 @@
+/*!
+@file verilog_parse_cache.h
+@brief Contains declarations for keeping parsed files in an on-disk cache,
+so that unchanged files need not be parsed again.
+*/
+
+#include "verilog_parser.h"
+
+#ifndef VERILOG_PARSE_CACHE_H
+#define VERILOG_PARSE_CACHE_H
+
+/*!
+@defgroup parse-cache Parse Cache
+@{
+@ingroup parser-api
+@brief Reuses the results of parsing files which have been parsed before.
+@details Each file parsed through a cache is stored in the cache directory
+as two entries: a source tree image (see @ref ast-image) holding everything
+parsed from the file, and a record of what the file did to the
+preprocessor. The macros it left defined, the `include directives it
+contained, with a hash of the contents of each file they found, its
+`default_nettype directives, and the like.
+
+Both are named after a key made from the file's path and contents, the
+include search directories and the macros defined before it was parsed,
+whether the context is in skeleton mode, and the version of the cache and
+image formats. When a file is parsed again with the same key, and each
+include directive still finds the same file with the same contents, the
+image is loaded and the recorded changes are made to the preprocessor. The
+scanner and parser are not run at all.
+
+Entries are written under temporary names and renamed into place, so
+several processes may share one directory. Nothing is ever removed from it.
+*/
+
+/*!
+@brief Changed whenever the scanner or grammar would build a different tree
+from the same text, so that entries written before are not used.
+*/
+#define VERILOG_PARSE_CACHE_VERSION 1
+
+//! A directory of parsed files, and counts of how it has been used.
+typedef struct verilog_parse_cache_t{
+    char         * directory; //!< Where entries are kept.
+    unsigned int   hits;      //!< Files read from the cache.
+    unsigned int   misses;    //!< Files which had to be parsed.
+} verilog_parse_cache;
+
+/*!
+@brief Creates a cache which keeps its entries in the given directory.
+@details The directory is created if it does not exist.
+@param [in] directory - Where to keep entries. It is copied.
+@returns The new cache, or NULL if the directory could not be created.
+*/
+verilog_parse_cache * verilog_new_parse_cache(
+    char * directory
+);
+
+/*!
+@brief Frees a cache object. The entries on disk are left alone.
+*/
+void verilog_free_parse_cache(
+    verilog_parse_cache * cache
+);
+
+/*!
+@brief Parses the file at the supplied path using the supplied context,
+reading it from the cache if it has been parsed before.
+@details Behaves like @ref verilog_parse_path_r. Files which parse
+successfully are added to the cache. Files which cannot be mapped, and
+contexts whose source tree has a description callback or which are part
+way through a conditional compilation block, bypass the cache.
+@param [inout] context - The context to parse with.
+@param [inout] cache - The cache to look in and add to.
+@param [in] path - The file to parse.
+@returns Zero if the file parsed successfully, or was found in the cache,
+or -1 if it could not be opened.
+@note A cache object may only be used by one thread at a time.
+*/
+int verilog_parse_path_cached(
+    verilog_parser_context * context,
+    verilog_parse_cache    * cache,
+    char                   * path
+);
+
+/*! @} */
+
+#endif
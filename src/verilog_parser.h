@@ -23,13 +23,30 @@ typedef size_t yy_size_t;
 #ifndef YY_BUF_SIZE
     #define YY_BUF_SIZE 16384
 #endif
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void * yyscan_t;
+#endif
+
 typedef struct yy_buffer_state *YY_BUFFER_STATE;
-extern void yyrestart (FILE *input_file  );
-extern void yy_switch_to_buffer (YY_BUFFER_STATE new_buffer  );
-extern YY_BUFFER_STATE yy_create_buffer (FILE *file,int size  );
-extern YY_BUFFER_STATE yy_scan_buffer (char *base,yy_size_t size  );
-extern YY_BUFFER_STATE yy_scan_bytes (const char *bytes,int len  );
-extern void yy_delete_buffer (YY_BUFFER_STATE b  );
+extern int  yylex_init (yyscan_t * scanner);
+extern int  yylex_init_extra (void * user_defined, yyscan_t * scanner);
+extern int  yylex_destroy (yyscan_t scanner);
+extern void yyrestart (FILE *input_file, yyscan_t scanner);
+extern void yy_switch_to_buffer (YY_BUFFER_STATE new_buffer, yyscan_t scanner);
+extern YY_BUFFER_STATE yy_create_buffer (FILE *file,int size, yyscan_t scanner);
+extern YY_BUFFER_STATE yy_scan_buffer (char *base,yy_size_t size,
+                                       yyscan_t scanner);
+extern YY_BUFFER_STATE yy_scan_bytes (const char *bytes,int len,
+                                      yyscan_t scanner);
+extern void yy_delete_buffer (YY_BUFFER_STATE b, yyscan_t scanner);
+extern int  yyget_lineno (yyscan_t scanner);
+extern void yyset_lineno (int line_number, yyscan_t scanner);
+extern void yyset_column (int column_no, yyscan_t scanner);
+extern int  yyget_column (yyscan_t scanner);
+extern int  yyget_leng   (yyscan_t scanner);
+extern char *yyget_text  (yyscan_t scanner);
+extern void *yyget_extra (yyscan_t scanner);
 
 /*!
 @defgroup parser-api Verilog Parser API
@@ -37,6 +54,437 @@ extern void yy_delete_buffer (YY_BUFFER_STATE b  );
 @brief Describes the top level, programmer facing parser API.
 */
 
+/*!
+@brief Tracks the construct being skipped over in skeleton mode.
+@details Used only by the scanner, through @ref verilog_skip_token.
+*/
+typedef struct verilog_skip_state_t{
+    ast_skipped_construct * construct;      //!< Being skipped, or NULL.
+    int                     end_token;      //!< Ends it, or 0 if a statement.
+    unsigned int            depth;          //!< Brackets and blocks open.
+    unsigned int            open_ifs;       //!< Ifs yet to see an else.
+    ast_boolean             statement_done; //!< Waiting to see an else.
+    ast_boolean             in_primitive;   //!< In a UDP declaration.
+} verilog_skip_state;
+
+/*!
+@brief Everything needed to parse one stream of input.
+@details Holds a reentrant scanner along with the preprocessor context and
+source tree it reads into. Contexts share nothing, so separate threads may
+each parse with their own context at the same time.
+
+Setting skeleton to AST_TRUE selects skeleton mode, for tools which only
+need the design hierarchy. Module headers, ports, declarations and
+instantiations are parsed as usual, but always and initial constructs,
+functions, tasks and specify blocks are only scanned. No nodes are built for
+their contents, and each is recorded in its module's skipped_constructs
+list as an @ref ast_skipped_construct, giving its lines and byte offsets.
+
+Setting pipelined to AST_TRUE runs the scanner and preprocessor on a thread
+of their own, a bounded number of tokens ahead of the parser, which speeds
+up large files on machines with a spare core. The tree built is the same.
+It has no effect while the source tree has a description callback. After a
+syntax error, the preprocessor may have read further than the parser.
+
+Setting name_errors to AST_TRUE starts each syntax error message with the
+path of the file the error is in, so that messages printed by contexts
+parsing different files at once can be told apart.
+@see verilog_new_parser_context verilog_parse_file_r
+*/
+typedef struct verilog_parser_context_t{
+    yyscan_t                       scanner;      //!< The flex scanner.
+    verilog_preprocessor_context * preprocessor; //!< Macros, includes, etc.
+    verilog_source_tree          * source_tree;  //!< Parsed constructs.
+    ast_boolean                    skeleton;     //!< Skip behavioural code.
+    ast_boolean                    pipelined;    //!< Scan on another thread.
+    verilog_skip_state             skip;         //!< Used by the scanner.
+    ast_boolean                    tokens_only;  //!< Used by the scanner.
+    ast_boolean                    name_errors;  //!< Give files in errors.
+} verilog_parser_context;
+
+//! What the scanner should do with a token, in skeleton mode.
+typedef enum verilog_skip_action_e{
+    SKIP_EMIT,          //!< Return the token to the parser as usual.
+    SKIP_CONSUME,       //!< Drop the token, it is part of a construct.
+    SKIP_FINISH,        //!< The token ends the construct. Return that.
+    SKIP_FINISH_BEFORE  //!< Return the construct, then scan the token again.
+} verilog_skip_action;
+
+/*!
+@brief Decides what the scanner does with each token when the context is
+in skeleton mode.
+@details Finds the end of a statement by tracking the nesting of brackets,
+begin/end, fork/join and case/endcase, along with any if statements which
+could yet be followed by an else. Functions, tasks and specify blocks just
+run to their closing keyword. Called by the scanner, not the parser.
+@param [inout] context - The context the scanner belongs to.
+@param [in] token - The token just scanned.
+@param [in] start - Byte offset of the start of the token.
+@param [in] end - Byte offset just after the token.
+@returns What to do with the token. When a construct is finished, it is
+left in context -> skip.construct for the scanner to hand on.
+*/
+verilog_skip_action verilog_skip_token(
+    verilog_parser_context * context,
+    int                      token,
+    size_t                   start,
+    size_t                   end
+);
+
+/*!
+@brief Creates a parser context with a new scanner, preprocessor context and
+source tree.
+@details Include search directories, predefined macros and the like may be
+set up on the context's preprocessor before parsing.
+*/
+verilog_parser_context * verilog_new_parser_context();
+
+/*!
+@brief Frees a parser context, along with its scanner, source tree and
+preprocessor context.
+@details To keep using the source tree, set the context's source_tree and
+preprocessor members to NULL first, and free them later, tree first, with
+verilog_free_source_tree and verilog_free_preprocessor_context.
+*/
+void verilog_free_parser_context(verilog_parser_context * context);
+
+/*!
+@brief Parses the supplied file using the supplied context.
+@details Behaves like @ref verilog_parse_file, but reads into the
+context's source tree using its preprocessor, rather than the global ones.
+@param [inout] context - The context to parse with.
+@param [in] to_parse - The open file object to be parsed.
+@returns Zero if the file parsed successfully.
+*/
+int     verilog_parse_file_r(verilog_parser_context * context, FILE * to_parse);
+
+/*!
+@brief Parses the file at the supplied path using the supplied context.
+@details Behaves like @ref verilog_parse_path, but reads into the context's
+source tree using its preprocessor, rather than the global ones.
+@param [inout] context - The context to parse with.
+@param [in] path - The file to parse.
+@returns Zero if the file parsed successfully, or -1 if it could not be
+opened.
+*/
+int     verilog_parse_path_r(verilog_parser_context * context, char * path);
+
+/*!
+@brief Parses the supplied in-memory string using the supplied context.
+@details Behaves like @ref verilog_parse_string, but reads into the
+context's source tree using its preprocessor, rather than the global ones.
+@returns Zero if the string parsed successfully.
+*/
+int     verilog_parse_string_r(
+    verilog_parser_context * context,   //!< The context to parse with.
+    char                   * to_parse,  //!< The string to be parsed.
+    int                      length     //!< How many characters to read.
+);
+
+/*!
+@brief Parses the supplied in-memory buffer using the supplied context.
+@details Behaves like @ref verilog_parse_buffer, but reads into the
+context's source tree using its preprocessor, rather than the global ones.
+@returns Zero if the buffer parsed successfully.
+*/
+int     verilog_parse_buffer_r(
+    verilog_parser_context * context,   //!< The context to parse with.
+    char                   * to_parse,  //!< The buffer to be parsed.
+    int                      length     //!< How many characters to read.
+);
+
+/*!
+@brief A token read by the verilog_tokenize functions.
+@details Tokens which come from the expansion of a macro have the file,
+line and offset of the macro's use, but the length of their own text. Lines
+count from one, the same as @ref verilog_source_tree_get_line gives for the
+token's file and offset.
+*/
+typedef struct verilog_token_t{
+    int          kind;   //!< As defined in verilog_parser.tab.h.
+    ast_file_id  file;   //!< Its file, in the source tree's file table.
+    unsigned int line;   //!< Line it starts on, counting from one.
+    unsigned int length; //!< Length of its text in bytes.
+    size_t       offset; //!< Byte offset of its start within the file.
+} verilog_token;
+
+/*!
+@brief Called by the verilog_tokenize functions for every token they read.
+@param [in] token - The token. Only valid until the callback returns.
+@param [in] text - Its text, null terminated. Only valid until the callback
+returns.
+@param [in] data - The data pointer given to the tokenize function.
+@returns Zero to carry on, anything else to stop.
+*/
+typedef int (*verilog_token_callback)(
+    verilog_token * token,
+    char          * text,
+    void          * data
+);
+
+/*!
+@brief Runs the scanner and preprocessor of a context over the file at the
+supplied path, handing each token to a callback instead of the parser.
+@details Macros are expanded, include files read, and conditional
+compilation obeyed, just as when parsing, so the context's preprocessor
+ends up the same. Only the files tokens come from are added to the source
+tree, to its file table, and no nodes are built for identifiers or strings,
+so this runs about as fast as the scanner can. The context's skeleton
+setting is ignored.
+@param [inout] context - The context to tokenize with.
+@param [in] path - The file to read.
+@param [in] callback - Called for each token, in order.
+@param [in] data - Passed through to callback.
+@returns Zero if every token was read, -1 if the file could not be opened,
+or whatever non-zero value callback returned to stop early.
+*/
+int verilog_tokenize_path(
+    verilog_parser_context * context,
+    char                   * path,
+    verilog_token_callback   callback,
+    void                   * data
+);
+
+/*!
+@brief Runs the scanner and preprocessor of a context over an in-memory
+string, as @ref verilog_tokenize_path does for a file.
+@returns Zero if every token was read, or the non-zero value callback
+returned to stop early.
+*/
+int verilog_tokenize_string(
+    verilog_parser_context * context,   //!< The context to tokenize with.
+    char                   * to_scan,   //!< The string to read.
+    int                      length,    //!< How many characters to read.
+    verilog_token_callback   callback,  //!< Called for each token.
+    void                   * data       //!< Passed through to callback.
+);
+
+//! A growable, contiguous array of tokens.
+typedef struct verilog_token_array_t{
+    verilog_token * tokens;   //!< The tokens, in the order they were read.
+    size_t          count;    //!< Number of tokens.
+    size_t          capacity; //!< Number of tokens there is room for.
+} verilog_token_array;
+
+//! Creates a new, empty, token array.
+verilog_token_array * verilog_new_token_array();
+
+//! Frees a token array and the tokens in it.
+void verilog_free_token_array(verilog_token_array * array);
+
+/*!
+@brief A @ref verilog_token_callback which copies each token onto the end of
+a token array.
+@details To collect every token of a file:
+
+    verilog_token_array * tokens = verilog_new_token_array();
+    verilog_tokenize_path(context, path, verilog_token_array_append, tokens);
+
+@param [in] token - The token to add.
+@param [in] text - Ignored.
+@param [inout] array - The verilog_token_array to add it to.
+@returns Zero, or non-zero if the array could not grow.
+*/
+int verilog_token_array_append(
+    verilog_token * token,
+    char          * text,
+    void          * array
+);
+
+/*!
+@brief Called to configure the parser context of each file parsed by
+@ref verilog_parse_files, before it is parsed.
+@details Typically adds include search directories or predefined macros to
+the context's preprocessor. It is called from worker threads, so it must not
+modify anything shared without locking.
+@param [inout] context - The fresh context which will parse the file.
+@param [in] data - The setup_data pointer given to verilog_parse_files.
+*/
+typedef void (*verilog_context_setup)(
+    verilog_parser_context * context,
+    void                   * data
+);
+
+/*!
+@brief Parses a list of files in parallel, returning them as a single,
+module-resolved, source tree.
+@details Each file is parsed with a parser context of its own, on a pool of
+worker threads. Files are initially shared out between the workers in
+contiguous runs, and a worker which runs out steals files from the front of
+another worker's run, so a few very large files do not leave the rest of
+the pool idle.
+
+Once every file is parsed, the per-file trees are merged with
+@ref verilog_source_tree_merge in the order the files were given, so the
+result does not depend on the number of threads or how work was scheduled.
+Finally @ref verilog_resolve_modules is run over the merged tree.
+@param [in] paths - The paths of the files to parse.
+@param [in] count - The number of paths.
+@param [in] threads - How many worker threads to use. Zero picks one per
+online processor.
+@param [in] setup - Called on each context before it is used, or NULL.
+@param [in] setup_data - Passed through to setup.
+@param [out] results - If not NULL, an array of count integers which each
+receive the result of parsing the corresponding file, as returned by
+@ref verilog_parse_file_r. Files which cannot be opened get -1.
+@returns The merged source tree. The preprocessor contexts used for each
+file are owned by it, and released with it by verilog_free_source_tree.
+@note Each file gets a fresh preprocessor context, so macros defined in one
+file are not visible in the others.
+*/
+verilog_source_tree * verilog_parse_files(
+    char                 ** paths,
+    unsigned int            count,
+    unsigned int            threads,
+    verilog_context_setup   setup,
+    void                  * setup_data,
+    int                   * results
+);
+
+/*!
+@brief Parses a single file, splitting it between top level declarations so
+that the pieces can be parsed in parallel.
+@details Intended for very large files, like synthesised netlists, which
+hold thousands of module declarations. The file is mapped into memory and
+scanned for the ends of its top level module and primitive declarations,
+skipping over comments and strings. It is then cut into pieces of whole
+declarations, which are parsed with separate parser contexts on a pool of
+threads as by @ref verilog_parse_files, and merged back together in source
+order. Each piece is parsed starting from its true line number, so the
+metadata of every node is the same as a serial parse would give.
+
+Compiler directives are allowed before the first declaration, and are
+processed ahead of every piece. If any appear later on, or the file is
+`include'ing others, or is too small to be worth splitting, the whole file
+is parsed by a single context instead.
+@param [in] path - The file to parse.
+@param [in] threads - How many worker threads to use. Zero picks one per
+online processor.
+@param [in] setup - Called on each context before it is used, or NULL.
+@param [in] setup_data - Passed through to setup.
+@param [out] result - If not NULL, receives zero if every piece parsed
+successfully.
+@returns The merged and module-resolved source tree.
+*/
+verilog_source_tree * verilog_parse_file_chunked(
+    char                  * path,
+    unsigned int            threads,
+    verilog_context_setup   setup,
+    void                  * setup_data,
+    int                   * result
+);
+
+/*!
+@brief Reads a file, but leaves the bodies of its modules to be parsed the
+first time they are looked up.
+@details Meant for tools which only look inside a few of the modules in a
+very large design. A quick pass over the text finds each module declaration
+and its name, the same way as @ref verilog_parse_file_chunked, and adds a
+declaration to the context's source tree with only its name and a
+@ref ast_lazy_module record filled in. A snapshot of the preprocessor, after
+the directives at the top of the file, is kept alongside.
+
+@ref verilog_find_module_declaration, and so @ref verilog_resolve_modules,
+find these declarations by name. Only verilog_find_module_declaration
+parses the rest of a module's body, and only the first time the module is
+returned. Module instantiations may be resolved to modules which have not
+been parsed yet; use verilog_find_module_declaration or
+@ref verilog_load_module to be sure of a complete one.
+
+Primitives, and files which cannot be safely split, are parsed straight
+away, as by @ref verilog_parse_path_r.
+@param [inout] context - The context to parse with.
+@param [in] path - The file to parse. It must not change until every
+module in it has been loaded.
+@returns Zero if the file was read successfully, or -1 if it could not be
+opened. Syntax errors in a module body are not seen until it is loaded.
+*/
+int verilog_parse_path_lazy(verilog_parser_context * context, char * path);
+
+/*!
+@brief Parses the body of a module found by @ref verilog_parse_path_lazy, if
+it has not been parsed yet, filling in the declaration in place.
+@details The declaration keeps its address, so existing references to it,
+such as resolved module instantiations, see the whole module afterwards.
+Nodes parsed are owned by the tree. Modules loaded this way are not
+thread safe: only one thread may look up modules in a tree at once.
+@param [inout] tree - The tree the module belongs to.
+@param [inout] module - The module to load.
+@returns AST_TRUE if the module is complete, AST_FALSE if its body could
+not be parsed. A module which fails to load stays empty, with its lazy
+record's failed flag set.
+*/
+ast_boolean verilog_load_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+);
+
+//! Starting value of the 64-bit FNV-1a hash.
+#define VERILOG_HASH_BASIS 14695981039346656037ULL
+
+//! Adds one character to a 64-bit FNV-1a hash.
+#define VERILOG_HASH_STEP(H, C) \
+    ((H) = ((H) ^ (unsigned char)(C)) * 1099511628211ULL)
+
+/*!
+@brief A top level declaration read by @ref verilog_parse_path_incremental,
+and the hash it was read from.
+*/
+typedef struct verilog_unit_record_t{
+    unsigned long long hash;        //!< Hash of the declaration's tokens.
+    unsigned int       line;        //!< Line the declaration's text starts.
+    size_t             offset;      //!< Where the text starts in the file.
+    ast_boolean        module;      //!< Declaration is a module, not a UDP.
+    void             * declaration; //!< The declaration, or NULL.
+} verilog_unit_record;
+
+/*!
+@brief Everything read from one file by @ref verilog_parse_path_incremental.
+@details Kept in the file_units table of the source tree.
+*/
+typedef struct verilog_file_record_t{
+    char             * path;         //!< The file, as it was named.
+    unsigned long long prologue_hash;//!< Hash of the directives at the top.
+    ast_list         * units;        //!< verilog_unit_record, in order.
+} verilog_file_record;
+
+/*!
+@brief Parses a file into a source tree, or brings the parts of the tree
+which came from it up to date with the file, re-parsing as little as
+possible.
+@details The first time a path is parsed into a tree, the whole file is
+parsed, and a hash of the tokens of each top level declaration is kept in
+the tree's file_units table. Comments and white space between tokens do not
+count towards a hash, so neither does where a declaration is in the file.
+
+When the same path is parsed into the same tree again, only declarations
+whose hashes have changed are parsed again. Those which have only moved,
+because lines were added or taken out above them, are kept, and the
+positions in their metadata are moved to match. A module which is parsed
+again under the same name replaces the old declaration in place, with
+@ref verilog_source_tree_replace_module, so any instantiations of it stay
+resolved. New declarations are inserted next to the others from the file,
+and the declarations from the file are kept in the order the file has them.
+Modules which have gone are taken out with
+@ref verilog_source_tree_remove_module. Only the instantiations made by, or
+made of, these modules are resolved again. The tree is always left
+resolved, as by @ref verilog_resolve_modules.
+
+If the directives at the top of the file change, or the file cannot be
+split as by @ref verilog_parse_file_chunked, everything read from the file
+before is replaced.
+@param [inout] context - The context to parse with. Its preprocessor is
+used as it is now, not as it was when the file was last parsed.
+@param [in] path - The file to parse.
+@returns Zero if the file parsed successfully, or -1 if it could not be
+opened, in which case the tree is not changed.
+@note Replaced declarations are not released until the tree is.
+*/
+int verilog_parse_path_incremental(
+    verilog_parser_context * context,
+    char                   * path
+);
+
 /*!
 @brief Sets up the parsing environment ready for input.
 @details Makes sure that there is a vaild preprocessor context and source
@@ -47,6 +495,13 @@ state
 are certain to be either new or existing contexts ready for parsing.
 @note Calling this function, parsing a file, and then calling this function
 again, does *not* destroy the original preprocessor context or source tree.
+Release them with verilog_free_source_tree and
+verilog_free_preprocessor_context (in that order) when they are no longer
+needed.
+@note This function, and the parse functions which use the global
+yy_preproc and yy_verilog_source_tree objects, are kept for compatibility.
+They use a per-thread scanner. New code should prefer a
+verilog_parser_context.
 */
 void    verilog_parser_init();
 
@@ -84,6 +539,22 @@ the second will not.
 */
 int     verilog_parse_file(FILE * to_parse);
 
+/*!
+@brief Perform a parsing operation on the file at the supplied path.
+@details The file is mapped into memory with @ref verilog_map_file and
+scanned in place, so unlike @ref verilog_parse_file, none of its text is
+read() or copied into buffers by the parser. Files included with `include
+are read the same way. Files which cannot be mapped, such as pipes, are
+read with stdio instead. The preprocessor's current file is set to path.
+@param [in] path - The file to parse.
+@pre yy_init has been called atleast once.
+@post Any valid verilog constructs have been added to the 
+yy_verilog_source_tree global object.
+@returns Zero if the file parsed successfully, or -1 if it could not be
+opened. Any other value means the file was syntactically invalid.
+*/
+int     verilog_parse_path(char * path);
+
 /*!
 @brief Perform a parsing operation on the supplied in-memory string.
 @details Parses the supplied string, reading at most "length" bytes, adding
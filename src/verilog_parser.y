@@ -6,25 +6,92 @@
 
 %define parse.error verbose
 
+%define api.pure full
+%param {yyscan_t scanner}
+%locations
+%define api.location.type {ast_location}
+
 %{
     #include <stdio.h>
     #include <string.h>
     #include <assert.h>
 
     #include "verilog_ast.h"
-
-    extern int yylex();
-    extern int yylineno;
-    extern char * yytext;
-
-    void yyerror(const char *msg){
-        printf("line %d - ERROR: %s\n", yylineno,msg);
-        printf("- '%s'\n", yytext);
-    }
+    #include "verilog_preprocessor.h"
 %}
 
 %code requires{
     #include "verilog_ast.h"
+
+    // The flex scanner handle, as declared by the generated scanner.
+    #ifndef YY_TYPEDEF_YY_SCANNER_T
+    #define YY_TYPEDEF_YY_SCANNER_T
+    typedef void * yyscan_t;
+    #endif
+}
+
+%code provides{
+    //! Defined in the generated flex scanner.
+    int yylex(YYSTYPE * yylval_param, YYLTYPE * yylloc_param,
+              yyscan_t yyscanner);
+}
+
+%code{
+    /*
+    Defined in verilog_parser_wrapper.c. Finds the text of the token an
+    error was found at, even when the scanner has moved on from it.
+    */
+    const char * verilog_error_token_text(YYLTYPE * location,
+                                          yyscan_t scanner, int * length);
+
+    //! Defined in verilog_parser_wrapper.c.
+    const char * verilog_error_file(YYLTYPE * location, yyscan_t scanner);
+
+    void yyerror(YYLTYPE * llocp, yyscan_t scanner, const char *msg){
+        int          length;
+        const char * text = verilog_error_token_text(llocp, scanner, &length);
+        const char * file = verilog_error_file(llocp, scanner);
+        if(file != NULL) {
+            printf("%s ", file);
+        }
+        printf("line %d - ERROR: %s\n", llocp -> line, msg);
+        if(text != NULL) {
+            printf("- '%.*s'\n", length, text);
+        }
+    }
+
+    /*
+    Defined in verilog_parser_wrapper.c. Calls yylex, or takes the next token
+    from the scanner thread when the context is pipelined.
+    */
+    int verilog_next_token(YYSTYPE * value, YYLTYPE * location,
+                           yyscan_t scanner);
+    #define yylex verilog_next_token
+
+    /*
+    A rule spans its symbols, from the start of the first which is not empty
+    to the end of the last, unless the last is in another file. An empty
+    rule sits at the end of whatever came before it. Nodes built by the
+    rule's action take this as their position.
+    */
+    #define YYLLOC_DEFAULT(Current, Rhs, N) do {                        \
+        int yyfirst = 1;                                                \
+        while(yyfirst < (N) && YYRHSLOC(Rhs, yyfirst).start ==          \
+                               YYRHSLOC(Rhs, yyfirst).end) {            \
+            yyfirst ++;                                                 \
+        }                                                               \
+        if(N) {                                                         \
+            (Current) = YYRHSLOC(Rhs, yyfirst);                         \
+            if(YYRHSLOC(Rhs, N).file == (Current).file &&               \
+               YYRHSLOC(Rhs, N).end  >  (Current).end) {                \
+                (Current).end = YYRHSLOC(Rhs, N).end;                   \
+            }                                                           \
+        } else {                                                        \
+            (Current)       = YYRHSLOC(Rhs, 0);                         \
+            (Current).start = (Current).end;                            \
+        }                                                               \
+        yy_node_location = &(Current);                                  \
+    } while(0)
 }
 
 
@@ -119,6 +186,7 @@
     ast_udp_port                 * udp_port;
     ast_udp_sequential_entry     * udp_seqential_entry;
     ast_wait_statement           * wait_statement;
+    ast_skipped_construct        * skipped_construct;
 
     char                   boolean;
     char                 * string;
@@ -180,6 +248,9 @@
 
 %token <string> STRING
 
+/* Stands in for a whole behavioural construct in skeleton mode. */
+%token <skipped_construct> SKIPPED_CONSTRUCT
+
 /* Operators Precedence */
 
 %token <operator> STAR
@@ -396,10 +467,10 @@
 %type   <concatenation>              multiple_concatenation
 %type   <concatenation>              net_concatenation
 %type   <concatenation>              net_concatenation_cont
-%type   <concatenation>              net_concatenation_value
+%type   <expression>                 net_concatenation_value
 %type   <concatenation>              variable_concatenation
 %type   <concatenation>              variable_concatenation_cont
-%type   <concatenation>              variable_concatenation_value
+%type   <expression>                 variable_concatenation_value
 %type   <config_declaration>         config_declaration
 %type   <config_rule_statement>      config_rule_statement
 %type   <delay2>                     delay2
@@ -438,8 +509,8 @@
 %type   <expression>                 module_path_expression
 %type   <expression>                 module_path_mintypemax_expression
 %type   <expression>                 ncontrol_terminal
-%type   <expression>                 ordered_parameter_assignment
-%type   <expression>                 ordered_port_connection
+%type   <port_connection>            ordered_parameter_assignment
+%type   <port_connection>            ordered_port_connection
 %type   <expression>                 path_delay_expression
 %type   <expression>                 pcontrol_terminal
 %type   <expression>                 range_expression
@@ -602,7 +673,6 @@
 %type   <list>                       ports
 %type   <list>                       pull_gate_instances
 %type   <list>                       sequential_entrys
-%type   <list>                       source_text
 %type   <list>                       specify_block
 %type   <list>                       specify_items
 %type   <list>                       specify_items_o
@@ -779,32 +849,7 @@ grammar_begin :
     ast_list_append(yy_verilog_source_tree -> configs, $1);
 }
 | source_text {
-    assert(yy_verilog_source_tree != NULL);
-
-    unsigned int i;
-    for(i  = 0; i < $1 -> items; i ++)
-    {
-        ast_source_item * toadd = ast_list_get($1, i);
-
-        if(toadd -> type == SOURCE_MODULE)
-        {
-            ast_list_append(yy_verilog_source_tree -> modules, 
-                toadd -> module);
-        }
-        else if (toadd -> type == SOURCE_UDP)
-        {
-            ast_list_append(yy_verilog_source_tree -> primitives, 
-                toadd -> udp);
-        }
-        else
-        {
-            // Do nothing / unknown / unsupported type.
-            printf("line %d of %s - Unknown source item type: %d",
-                __LINE__,
-                __FILE__,
-                toadd -> type);
-        }
-    }
+    // Each description was added to the tree as soon as it was parsed.
 }
 | {
     // Do nothing, it's an empty file.
@@ -1028,24 +1073,22 @@ use_clause :
 /* A.1.3 Module and primitive source text. */
 
 source_text : 
-  description {
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
-}
-| source_text description{
-    $$ = $1;
-    ast_list_append($$,$2);
-}
+  description {}
+| source_text description {}
 ;
 
+/* Each description is handed to the source tree as soon as it is complete,
+   which may release it straight away. See verilog_source_tree_set_callback. */
 description : 
   module_declaration{
     $$ = ast_new_source_item(SOURCE_MODULE);
     $$ -> module = $1;
+    verilog_source_tree_add_description(yy_verilog_source_tree, $$);
 }
 | udp_declaration     {
     $$ = ast_new_source_item(SOURCE_UDP);
     $$ -> udp = $1;
+    verilog_source_tree_add_description(yy_verilog_source_tree, $$);
 }
 ;
 
@@ -1317,6 +1360,10 @@ module_or_generate_item :
     $$ = ast_new_module_item($1, MOD_ITEM_ALWAYS_CONSTRUCT);
     $$ -> always_construct = $2;
   }
+| attribute_instances SKIPPED_CONSTRUCT{
+    $$ = ast_new_module_item($1, MOD_ITEM_SKIPPED_CONSTRUCT);
+    $$ -> skipped_construct = $2;
+  }
 ;
 
 module_or_generate_item_declaration : 
@@ -1383,7 +1430,7 @@ non_port_module_item :
     $$ -> specify_block = $2;
 }
 | attribute_instances specparam_declaration{
-    $$ = ast_new_module_item($1,MOD_ITEM_PORT_DECLARATION);
+    $$ = ast_new_module_item($1,MOD_ITEM_SPECPARAM_DECLARATION);
     $$ -> specparam_declaration = $2;
 }
 ;
@@ -1597,7 +1644,7 @@ net_dec_p_delay :
   }
 | list_of_net_decl_assignments  SEMICOLON{
     $$ = ast_new_type_declaration(DECLARE_NET);
-    $$ -> identifiers = $1;
+    ast_set_net_decl_assignments($$, $1);
   }
 ;
 
@@ -1832,7 +1879,7 @@ list_of_param_assignments    :
  }
  | list_of_param_assignments COMMA KW_PARAMETER param_assignment{
     $$ = $1;
-    ast_list_append($$,$3);
+    ast_list_append($$,$4);
  }
  ;
 
@@ -2330,16 +2377,16 @@ gate_enable :
     $$ = ast_new_enable_gate_instances($1,NULL,$3,$4);
 }
 | enable_gatetype OB output_terminal COMMA input_terminal COMMA 
-  enable_terminal CB COMMA n_output_gate_instances{
+  enable_terminal CB COMMA enable_gate_instances{
     ast_enable_gate_instance * gate = ast_new_enable_gate_instance(
-        ast_new_identifier("unamed_gate",yylineno), $3,$7,$5);
+        ast_new_identifier("unamed_gate",@$.line), $3,$7,$5);
     ast_list_preappend($10,gate);
     $$ = ast_new_enable_gate_instances($1,NULL,NULL,$10);
 }
 | enable_gatetype OB output_terminal COMMA input_terminal COMMA 
   enable_terminal CB{
     ast_enable_gate_instance * gate = ast_new_enable_gate_instance(
-        ast_new_identifier("unamed_gate",yylineno), $3,$7,$5);
+        ast_new_identifier("unamed_gate",@$.line), $3,$7,$5);
     ast_list * list = ast_list_new();
     ast_list_append(list,gate);
     $$ = ast_new_enable_gate_instances($1,NULL,NULL,list);
@@ -2387,7 +2434,7 @@ gate_n_input :
   }
 | gatetype_n_input OB output_terminal COMMA input_terminals CB {
     ast_n_input_gate_instance * gate = ast_new_n_input_gate_instance(
-        ast_new_identifier("unamed_gate",yylineno), $5,$3);
+        ast_new_identifier("unamed_gate",@$.line), $5,$3);
     ast_list * list = ast_list_new();
     ast_list_append(list,gate);
     $$ = ast_new_n_input_gate_instances($1,NULL,NULL,list);
@@ -2396,7 +2443,7 @@ gate_n_input :
   COMMA n_input_gate_instances{
     
     ast_n_input_gate_instance * gate = ast_new_n_input_gate_instance(
-        ast_new_identifier("unamed_gate",yylineno), $5,$3);
+        ast_new_identifier("unamed_gate",@$.line), $5,$3);
     ast_list * list = $8;
     ast_list_preappend(list,gate);
     $$ = ast_new_n_input_gate_instances($1,NULL,NULL,list);
@@ -2438,8 +2485,8 @@ pass_enable_switch_instances :
     ast_list_append($$,$1);
   }
 | pass_enable_switch_instances COMMA pass_enable_switch_instance{
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
+    $$ = $1;
+    ast_list_append($$,$3);
   }
 ;
 
@@ -2460,8 +2507,8 @@ pull_gate_instances :
     ast_list_append($$,$1);
   }
 | pull_gate_instances COMMA pull_gate_instance{
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
+    $$ = $1;
+    ast_list_append($$,$3);
   }
 ;
 
@@ -2471,8 +2518,8 @@ pass_switch_instances :
     ast_list_append($$,$1);
   }
 | pass_switch_instances COMMA pass_switch_instance{
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
+    $$ = $1;
+    ast_list_append($$,$3);
   }
 ;
 
@@ -2482,8 +2529,8 @@ n_input_gate_instances :
     ast_list_append($$,$1);
   }
  | n_input_gate_instances COMMA n_input_gate_instance{
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
+    $$ = $1;
+    ast_list_append($$,$3);
   }
  ;
 
@@ -2493,8 +2540,8 @@ mos_switch_instances :
     ast_list_append($$,$1);
   }
 | mos_switch_instances COMMA mos_switch_instance{
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
+    $$ = $1;
+    ast_list_append($$,$3);
   }
 ;
 
@@ -2504,8 +2551,8 @@ cmos_switch_instances :
     ast_list_append($$,$1);
   }
 | cmos_switch_instances COMMA cmos_switch_instance{
-    $$ = ast_list_new();
-    ast_list_append($$,$1);
+    $$ = $1;
+    ast_list_append($$,$3);
   }
 ;
 
@@ -2606,7 +2653,7 @@ pullup_strength             :
 
 name_of_gate_instance   : 
   gate_instance_identifier range_o {$$ = $1;}
-| {$$ = ast_new_identifier("Unnamed gate instance", yylineno);}
+| {$$ = ast_new_identifier("Unnamed gate instance", @$.line);}
 ;
 
 /* A.3.3 primitive terminals */
@@ -2693,7 +2740,7 @@ module_instances : module_instance{
 ;
 
 ordered_parameter_assignment : expression{
-    $$=$1;
+    $$ = ast_new_named_port_connection(NULL,$1);
 };
 
 named_parameter_assignment : 
@@ -2739,11 +2786,10 @@ named_port_connections   :
 ;
 
 ordered_port_connection : attribute_instances expression_o{
-    if($2 == NULL){ $$ = NULL;}
-    else{
+    if($2 != NULL){
         $2 -> attributes = $1;
-        $$ = $2;
     }
+    $$ = ast_new_named_port_connection(NULL,$2);
 }
 ;
 
@@ -2759,9 +2805,9 @@ expression_o : expression {$$=$1;}
 /* A.4.2 Generated instantiation */
 
 generated_instantiation : KW_GENERATE generate_items KW_ENDGENERATE {
-    char * id = calloc(25,sizeof(char));
-    sprintf(id,"gen_%d",yylineno);
-    ast_identifier new_id = ast_new_identifier(id,yylineno);
+    char id[25];
+    sprintf(id,"gen_%d",@$.line);
+    ast_identifier new_id = ast_new_identifier(id,@$.line);
     $$ = ast_new_generate_block(new_id,$2);
 };
 
@@ -2861,9 +2907,9 @@ genvar_assignment : genvar_identifier EQ constant_expression{
 
 generate_block : 
   KW_BEGIN generate_items KW_END{
-    char * id = calloc(25,sizeof(char));
-    sprintf(id,"gen_%d",yylineno);
-    ast_identifier new_id = ast_new_identifier(id,yylineno);
+    char id[25];
+    sprintf(id,"gen_%d",@$.line);
+    ast_identifier new_id = ast_new_identifier(id,@$.line);
     $$ = ast_new_generate_block(new_id, $2);
   }
 | KW_BEGIN COLON generate_block_identifier generate_items KW_END{
@@ -2899,7 +2945,7 @@ udp_port_declarations :
   }
 | udp_port_declarations udp_port_declaration{
     $$ = $1;
-    ast_list_append($$,$1);
+    ast_list_append($$,$2);
   }
 ;
 
@@ -2935,7 +2981,7 @@ udp_input_declarations  :
   }
 | udp_input_declarations udp_input_declaration{
     $$ = $1;
-    ast_list_append($$,$1);
+    ast_list_append($$,$2);
   }
 ;
 
@@ -3029,12 +3075,16 @@ level_symbols_o       : level_symbols {$$=$1;} | {$$=NULL;} ;
 
 level_symbols         : 
   level_symbol {
+    ast_level_symbol * symbol = ast_calloc(1,sizeof(ast_level_symbol));
+    *symbol = $1;
     $$ = ast_list_new();
-    ast_list_append($$,&$1);
+    ast_list_append($$,symbol);
   }
 | level_symbols level_symbol{
+    ast_level_symbol * symbol = ast_calloc(1,sizeof(ast_level_symbol));
+    *symbol = $2;
     $$= $1;
-    ast_list_append($$,&$2);
+    ast_list_append($$,symbol);
   }
 ;
 
@@ -4026,19 +4076,29 @@ sq_bracket_expressions :
 
 net_concatenation_value : /* TODO - fix proper identifier stuff. */
   hierarchical_net_identifier {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | hierarchical_net_identifier sq_bracket_expressions {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | hierarchical_net_identifier sq_bracket_expressions range_expression {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | hierarchical_net_identifier range_expression {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | net_concatenation {
-      $$ = $1;
+      ast_primary * p = ast_new_primary(PRIMARY_CONCATENATION);
+      p -> value.concatenation = $1;
+      $$ = ast_new_expression_primary(p);
   }
 ;
 
@@ -4061,19 +4121,29 @@ variable_concatenation_cont :
 
 variable_concatenation_value : /* TODO - fix proper identifier stuff. */
   hierarchical_variable_identifier {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | hierarchical_variable_identifier sq_bracket_expressions {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | hierarchical_variable_identifier sq_bracket_expressions range_expression {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | hierarchical_variable_identifier range_expression {
-      $$ = ast_new_concatenation(CONCATENATION_NET,NULL,$1);
+      ast_primary * p = ast_new_primary(PRIMARY_IDENTIFIER);
+      p -> value.identifier = $1;
+      $$ = ast_new_expression_primary(p);
   }
 | variable_concatenation {
-      $$ = $1;
+      ast_primary * p = ast_new_primary(PRIMARY_CONCATENATION);
+      p -> value.concatenation = $1;
+      $$ = ast_new_expression_primary(p);
   }
 ;
 
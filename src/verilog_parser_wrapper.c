@@ -1,14 +1,2257 @@
-
 /*!
 @file verilog_parser_wrapper.c
 @brief Contains implementations of functions declared in verilog_parser.h
 */
 
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
 #include "verilog_ast.h"
+#include "verilog_ast_image.h"
+#include "verilog_ast_util.h"
 #include "verilog_parser.h"
+#include "verilog_parser.tab.h"
 
 //! This is defined in the generated bison parser code.
-extern int yyparse();
+extern int yyparse(yyscan_t scanner);
+
+//! This is defined in the generated flex scanner code.
+extern void verilog_scanner_pop_buffers(
+    yyscan_t                       scanner,
+    verilog_preprocessor_context * preproc
+);
+
+//! This is defined in the generated flex scanner code.
+extern verilog_line_index * verilog_scanner_push_text(
+    yyscan_t                       scanner,
+    verilog_preprocessor_context * preproc,
+    char                         * text,
+    size_t                         length,
+    ast_boolean                    in_place,
+    unsigned int                   first_line,
+    size_t                         first_offset
+);
+
+//! The context used by the global, non-reentrant, parse functions.
+static AST_THREAD_LOCAL verilog_parser_context * verilog_global_context;
+
+/*!
+@brief Creates a parser context with a new scanner, preprocessor context and
+source tree.
+*/
+verilog_parser_context * verilog_new_parser_context()
+{
+    verilog_parser_context * tr = calloc(1, sizeof(verilog_parser_context));
+
+    yylex_init_extra(tr, &(tr -> scanner));
+    tr -> preprocessor = verilog_new_preprocessor_context();
+    tr -> source_tree  = verilog_new_source_tree();
+
+    return tr;
+}
+
+/*!
+@brief Frees a parser context, along with its scanner, source tree and
+preprocessor context.
+*/
+void verilog_free_parser_context(verilog_parser_context * context)
+{
+    if(context == NULL)
+    {
+        return;
+    }
+
+    yylex_destroy(context -> scanner);
+    verilog_free_source_tree(context -> source_tree);
+    verilog_free_preprocessor_context(context -> preprocessor);
+    free(context);
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief How many tokens the scanner thread may run ahead of the parser in
+pipelined mode. Must be a power of two.
+*/
+#define VERILOG_TOKEN_RING_SIZE 4096
+
+//! Bytes kept between the parts of a ring written by different threads.
+#define VERILOG_CACHE_LINE 64
+
+//! A token passed from the scanner thread to the parser.
+typedef struct verilog_token_record_t{
+    int            token;    //!< The token, or zero at the end of the input.
+    YYSTYPE        value;    //!< Its semantic value.
+    ast_location   location; //!< Where it was read from.
+} verilog_token_record;
+
+/*!
+@brief A bounded queue of tokens, with a single producer and consumer.
+@details Only the scanner thread writes head, and only the parser writes
+tail, so neither needs a lock. Each keeps its own copy of the index the
+other writes, and only reads the real one again when its copy says the ring
+is full or empty. The two sides are kept on separate cache lines, so the
+threads only share one when they have to.
+*/
+typedef struct verilog_token_ring_t{
+    verilog_token_record records[VERILOG_TOKEN_RING_SIZE]; //!< The tokens.
+
+    char         before_head[VERILOG_CACHE_LINE]; //!< Padding.
+    size_t       head;       //!< Tokens written, by the scanner.
+    size_t       tail_seen;  //!< Scanner's copy of tail.
+
+    char         before_tail[VERILOG_CACHE_LINE]; //!< Padding.
+    size_t       tail;       //!< Tokens read, by the parser.
+    size_t       head_seen;  //!< Parser's copy of head.
+    ast_boolean  ended;      //!< The parser has read the last token.
+
+    char         before_closed[VERILOG_CACHE_LINE]; //!< Padding.
+    int          closed;     //!< Set once the parser stops reading.
+    verilog_parser_context * context; //!< Whose scanner is run.
+    verilog_source_tree    * tree;    //!< Used only by the scanner thread.
+    const char             * text;    //!< The buffer being parsed.
+    size_t                   length;  //!< Length of the buffer.
+    size_t                   offset;  //!< Offset of the buffer in its file.
+    ast_file_id              file;    //!< The buffer's file.
+} verilog_token_ring;
+
+//! The ring the parser on this thread reads from, or NULL.
+static AST_THREAD_LOCAL verilog_token_ring * verilog_current_ring;
+
+//! Spins for a while when one side of a ring waits for the other, then
+//! gives up the processor.
+static void verilog_token_ring_pause(unsigned int * spins)
+{
+    if(++ (*spins) > 256)
+    {
+        sched_yield();
+    }
+}
+
+/*!
+@brief The body of the scanner thread of a pipelined parse.
+@details Runs the context's scanner, and its preprocessor, until it
+reaches the end of the input or the parser stops reading. Anything the
+scanner allocates, and the files its tokens come from, go in the ring's own
+source tree, since regions may not be shared between threads.
+*/
+static void * verilog_scan_ahead(void * arg)
+{
+    verilog_token_ring     * ring    = arg;
+    verilog_parser_context * context = ring -> context;
+    size_t                   head    = 0;
+    int                      token   = -1;
+
+    yy_preproc             = context -> preprocessor;
+    yy_verilog_source_tree = ring -> tree;
+    ast_region_set_current(ring -> tree -> region);
+
+    while(token != 0 && !__atomic_load_n(&(ring -> closed), __ATOMIC_ACQUIRE))
+    {
+        unsigned int spins = 0;
+        while(head - ring -> tail_seen == VERILOG_TOKEN_RING_SIZE)
+        {
+            if(__atomic_load_n(&(ring -> closed), __ATOMIC_ACQUIRE))
+            {
+                return NULL;
+            }
+            ring -> tail_seen = __atomic_load_n(&(ring -> tail),
+                                                __ATOMIC_ACQUIRE);
+            verilog_token_ring_pause(&spins);
+        }
+
+        verilog_token_record * record =
+            &(ring -> records[head & (VERILOG_TOKEN_RING_SIZE - 1)]);
+
+        token = yylex(&(record -> value), &(record -> location),
+                      context -> scanner);
+
+        record -> token = token;
+
+        head ++;
+        __atomic_store_n(&(ring -> head), head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/*!
+@brief Reads the next token for the parser.
+@details Called by yyparse in place of yylex. When this thread is parsing
+in pipelined mode, the token and its location are taken from the scanner
+thread's ring.
+*/
+int verilog_next_token(YYSTYPE * value, YYLTYPE * location, yyscan_t scanner)
+{
+    verilog_token_ring * ring = verilog_current_ring;
+
+    if(ring == NULL)
+    {
+        return yylex(value, location, scanner);
+    }
+    else if(ring -> ended)
+    {
+        return 0;
+    }
+
+    unsigned int spins = 0;
+    while(ring -> tail == ring -> head_seen)
+    {
+        ring -> head_seen = __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE);
+        verilog_token_ring_pause(&spins);
+    }
+
+    verilog_token_record * record =
+        &(ring -> records[ring -> tail & (VERILOG_TOKEN_RING_SIZE - 1)]);
+
+    int token         = record -> token;
+    *value            = record -> value;
+    *location         = record -> location;
+    ring -> ended     = token == 0;
+
+    __atomic_store_n(&(ring -> tail), ring -> tail + 1, __ATOMIC_RELEASE);
+
+    return token;
+}
+
+/*!
+@brief Finds the text of the token the parser on this thread is looking at,
+for an error message.
+@details When parsing in pipelined mode, the scanner is busy on another
+thread and has moved on from the token, so its text is found in the buffer
+being parsed from the token's location instead. Tokens from files included
+by the buffer are not in it, and have no text.
+@returns The text, which is not null terminated, or NULL.
+*/
+const char * verilog_error_token_text(
+    YYLTYPE  * location,
+    yyscan_t   scanner,
+    int      * length
+){
+    verilog_token_ring * ring = verilog_current_ring;
+
+    if(ring == NULL)
+    {
+        *length = yyget_leng(scanner);
+        return yyget_text(scanner);
+    }
+    else if(location -> file != ring -> file ||
+            location -> start < ring -> offset ||
+            location -> end   < location -> start ||
+            location -> end   > ring -> offset + ring -> length)
+    {
+        return NULL;
+    }
+
+    *length = (int)(location -> end - location -> start);
+    return ring -> text + (location -> start - ring -> offset);
+}
+
+/*!
+@brief Finds the path of the file a syntax error was found in, if the
+context it was found by names files in its error messages.
+@returns The path, or NULL.
+*/
+const char * verilog_error_file(YYLTYPE * location, yyscan_t scanner)
+{
+    verilog_parser_context * context = yyget_extra(scanner);
+    if(context == NULL || !context -> name_errors)
+    {
+        return NULL;
+    }
+
+    ast_source_file * file = verilog_source_tree_get_file(
+        context -> source_tree, location -> file);
+    return file == NULL ? NULL : file -> path;
+}
+
+/*!
+@brief Runs the parser on this thread, with the context's scanner running
+ahead of it on another.
+@details Falls back to parsing on this thread alone if a thread cannot be
+started. Otherwise behaves exactly like calling yyparse.
+@param [inout] context - The context to parse with.
+@param [in] text - The text of the buffer being parsed.
+@param [in] length - Length of the text in bytes.
+@param [in] offset - Where the text starts in its file.
+@param [in] file - The id of the text's file.
+*/
+static int verilog_parse_pipelined(
+    verilog_parser_context * context,
+    const char             * text,
+    size_t                   length,
+    size_t                   offset,
+    ast_file_id              file
+){
+    verilog_token_ring * ring = calloc(1, sizeof(verilog_token_ring));
+    ring -> context = context;
+    ring -> tree    = verilog_new_source_tree_sharing(context -> source_tree);
+    ring -> text    = text;
+    ring -> length  = length;
+    ring -> offset  = offset;
+    ring -> file    = file;
+
+    pthread_t scanner;
+    if(pthread_create(&scanner, NULL, verilog_scan_ahead, ring) != 0)
+    {
+        verilog_free_source_tree(ring -> tree);
+        free(ring);
+        return yyparse(context -> scanner);
+    }
+
+    verilog_token_ring * previous_ring = verilog_current_ring;
+    verilog_current_ring = ring;
+
+    int result = yyparse(context -> scanner);
+
+    __atomic_store_n(&(ring -> closed), AST_TRUE, __ATOMIC_RELEASE);
+    pthread_join(scanner, NULL);
+
+    verilog_current_ring = previous_ring;
+
+    // Identifiers and strings made by the scanner belong in the tree.
+    verilog_source_tree_merge(context -> source_tree, ring -> tree);
+    free(ring);
+
+    return result;
+}
+
+/*!
+@brief Adds the file or text about to be read by a context to the file table
+of its source tree.
+@details Files go in the file table as they are read, whether or not any
+nodes come from them. Includes are added as they are found. Text read from
+memory gets an entry of its own, which is the tree's text_file until the
+read is over.
+@returns The id of the file or text.
+*/
+static ast_file_id verilog_add_current_file(
+    verilog_parser_context * context,
+    const char             * text,
+    size_t                   length
+){
+    verilog_source_tree * tree = context -> source_tree;
+    char * file = verilog_preprocessor_current_file(context -> preprocessor);
+    if(file != NULL)
+    {
+        return verilog_source_tree_add_file(tree, file);
+    }
+
+    tree -> text_file = verilog_source_tree_add_text(tree, text, length);
+    return tree -> text_file;
+}
+
+/*!
+@brief Runs the parser over the buffer currently selected in the context's
+scanner.
+@details For the duration of the parse, the global yy_preproc and
+yy_verilog_source_tree objects of this thread point at the context's own,
+and all new nodes are allocated from the region owned by its source tree.
+@param [inout] context - The context to parse with.
+@param [in] text - The text of the buffer. If it is not from a file, it
+gets an entry of its own in the file table, so that lines in it can be
+found later.
+@param [in] length - Length of the text in bytes.
+@param [in] offset - Where the text starts in its file.
+*/
+static int verilog_parse_current_buffer(
+    verilog_parser_context * context,
+    const char             * text,
+    size_t                   length,
+    size_t                   offset
+){
+    verilog_preprocessor_context * previous_preproc = yy_preproc;
+    verilog_source_tree          * previous_tree    = yy_verilog_source_tree;
+    ast_location                 * previous_location = yy_node_location;
+
+    yy_preproc              = context -> preprocessor;
+    yy_verilog_source_tree  = context -> source_tree;
+    yy_preproc -> scanner   = context -> scanner;
+
+    // A parse which failed part way through a construct leaves it behind.
+    memset(&(context -> skip), 0, sizeof(verilog_skip_state));
+
+    // File names may have been freed and reused since the last parse.
+    yy_verilog_source_tree -> last_path = NULL;
+
+    ast_file_id file = verilog_add_current_file(context, text, length);
+
+    // With a callback set, each declaration gets a region of its own.
+    ast_region * previous = ast_region_set_current(
+        yy_verilog_source_tree -> description_region != NULL ?
+        yy_verilog_source_tree -> description_region :
+        yy_verilog_source_tree -> region);
+
+    // With a callback, memory is reused declaration by declaration, which
+    // the scanner thread's own region would not be.
+    int result = context -> pipelined &&
+                 yy_verilog_source_tree -> description_region == NULL ?
+        verilog_parse_pipelined(context, text, length, offset, file) :
+        yyparse(context -> scanner);
+
+    // Don't leave buffers behind which point into text we may release.
+    verilog_scanner_pop_buffers(context -> scanner, context -> preprocessor);
+
+    ast_region_set_current(previous);
+
+    context -> source_tree -> text_file = 0;
+    context -> preprocessor -> scanner  = NULL;
+    yy_preproc                          = previous_preproc;
+    yy_verilog_source_tree              = previous_tree;
+    yy_node_location                    = previous_location;
+
+    return result;
+}
+
+/*!
+@brief Perform a parsing operation on the supplied file using the supplied
+context.
+*/
+int     verilog_parse_file_r(verilog_parser_context * context, FILE * to_parse)
+{
+    // Line numbers are found from the whole text, so read it all first.
+    verilog_mapped_file * contents = verilog_read_file(to_parse);
+    if(contents == NULL)
+    {
+        return -1;
+    }
+
+    char * path = verilog_preprocessor_current_file(context -> preprocessor);
+    if(path != NULL)
+    {
+        verilog_source_tree_index_file(context -> source_tree, path,
+                                       contents -> data, contents -> length);
+    }
+
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              contents -> data, contents -> length, AST_TRUE,
+                              0, 0);
+
+    int result = verilog_parse_current_buffer(context, contents -> data,
+                                              contents -> length, 0);
+
+    verilog_unmap_file(contents);
+    return result;
+}
+
+/*!
+@brief Perform a parsing operation on the supplied in-memory string using
+the supplied context.
+*/
+int     verilog_parse_string_r(
+    verilog_parser_context * context,
+    char                   * to_parse,
+    int                      length
+){
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              to_parse, length, AST_FALSE, 0, 0);
+
+    int result = verilog_parse_current_buffer(context, to_parse, length, 0);
+    return result;
+}
+
+/*!
+@brief Perform a parsing operation on the supplied in-memory buffer using
+the supplied context.
+*/
+int     verilog_parse_buffer_r(
+    verilog_parser_context * context,
+    char                   * to_parse,
+    int                      length
+){
+    // The last two bytes are the NULs flex needs at the end.
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              to_parse, length - 2, AST_TRUE, 0, 0);
+
+    int result = verilog_parse_current_buffer(context, to_parse, length - 2,
+                                              0);
+    return result;
+}
+
+/*!
+@brief Perform a parsing operation on the file at the supplied path, using
+the supplied context, without copying the file into memory.
+*/
+int     verilog_parse_path_r(verilog_parser_context * context, char * path)
+{
+    verilog_preprocessor_set_file(context -> preprocessor, path);
+
+    verilog_mapped_file * mapped = verilog_map_file(path);
+    if(mapped == NULL)
+    {
+        // Not something we can map, like a pipe. Read it the slow way.
+        FILE * fh = fopen(path, "r");
+        if(fh == NULL)
+        {
+            return -1;
+        }
+
+        int result = verilog_parse_file_r(context, fh);
+        fclose(fh);
+        return result;
+    }
+
+    // Lines are found now, while the file is at hand, so that they can still
+    // be found if it changes or goes.
+    verilog_source_tree_index_file(context -> source_tree, path,
+                                   mapped -> data, mapped -> length);
+
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              mapped -> data, mapped -> length, AST_TRUE,
+                              0, 0);
+
+    int result = verilog_parse_current_buffer(context, mapped -> data,
+                                              mapped -> length, 0);
+
+    verilog_unmap_file(mapped);
+    return result;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Runs the scanner over the buffer currently selected in the context's
+scanner, handing every token to a callback.
+@details The scanner is told that no semantic values are wanted, so it
+allocates nothing but what the preprocessor needs, from the preprocessor's
+own region.
+*/
+static int verilog_tokenize_current_buffer(
+    verilog_parser_context * context,
+    const char             * text,
+    size_t                   length,
+    verilog_token_callback   callback,
+    void                   * data
+){
+    verilog_preprocessor_context * previous_preproc = yy_preproc;
+    verilog_source_tree          * previous_tree    = yy_verilog_source_tree;
+    ast_location                 * previous_location = yy_node_location;
+    ast_boolean                    skeleton         = context -> skeleton;
+
+    yy_preproc              = context -> preprocessor;
+    yy_verilog_source_tree  = context -> source_tree;
+    yy_preproc -> scanner   = context -> scanner;
+
+    yy_verilog_source_tree -> last_path = NULL;
+    verilog_add_current_file(context, text, length);
+    context -> skeleton     = AST_FALSE;
+    context -> tokens_only  = AST_TRUE;
+
+    ast_region * previous = ast_region_set_current(yy_preproc -> region);
+
+    verilog_token   token;
+    YYSTYPE         value;
+    YYLTYPE         location;
+    int             result    = 0;
+
+    while(result == 0 &&
+          (token.kind = yylex(&value, &location, context -> scanner)))
+    {
+        token.file   = location.file;
+        token.line   = location.line + 1;
+        token.length = yyget_leng(context -> scanner);
+        token.offset = location.start;
+
+        result = callback(&token, yyget_text(context -> scanner), data);
+    }
+
+    // A callback which stops early leaves buffers behind.
+    verilog_scanner_pop_buffers(context -> scanner, context -> preprocessor);
+
+    ast_region_set_current(previous);
+
+    context -> source_tree -> text_file = 0;
+    context -> tokens_only             = AST_FALSE;
+    context -> skeleton                = skeleton;
+    context -> preprocessor -> scanner = NULL;
+    yy_preproc                         = previous_preproc;
+    yy_verilog_source_tree             = previous_tree;
+    yy_node_location                   = previous_location;
+
+    return result;
+}
+
+/*!
+@brief Runs the scanner and preprocessor of a context over the file at the
+supplied path, handing each token to a callback instead of the parser.
+*/
+int verilog_tokenize_path(
+    verilog_parser_context * context,
+    char                   * path,
+    verilog_token_callback   callback,
+    void                   * data
+){
+    verilog_preprocessor_set_file(context -> preprocessor, path);
+
+    verilog_mapped_file * mapped = verilog_map_file(path);
+    if(mapped == NULL)
+    {
+        // Not something we can map, like a pipe. Read it the slow way.
+        FILE * fh = fopen(path, "r");
+        if(fh == NULL)
+        {
+            return -1;
+        }
+
+        mapped = verilog_read_file(fh);
+        fclose(fh);
+        if(mapped == NULL)
+        {
+            return -1;
+        }
+    }
+
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              mapped -> data, mapped -> length, AST_TRUE,
+                              0, 0);
+
+    int result = verilog_tokenize_current_buffer(context, mapped -> data,
+                                                 mapped -> length, callback,
+                                                 data);
+
+    verilog_unmap_file(mapped);
+    return result;
+}
+
+/*!
+@brief Runs the scanner and preprocessor of a context over an in-memory
+string, handing each token to a callback instead of the parser.
+*/
+int verilog_tokenize_string(
+    verilog_parser_context * context,
+    char                   * to_scan,
+    int                      length,
+    verilog_token_callback   callback,
+    void                   * data
+){
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              to_scan, length, AST_FALSE, 0, 0);
+
+    return verilog_tokenize_current_buffer(context, to_scan, (size_t)length,
+                                           callback, data);
+}
+
+//! Creates a new, empty, token array.
+verilog_token_array * verilog_new_token_array()
+{
+    return calloc(1, sizeof(verilog_token_array));
+}
+
+//! Frees a token array and the tokens in it.
+void verilog_free_token_array(verilog_token_array * array)
+{
+    if(array != NULL)
+    {
+        free(array -> tokens);
+        free(array);
+    }
+}
+
+/*!
+@brief A verilog_token_callback which copies each token onto the end of a
+token array.
+*/
+int verilog_token_array_append(
+    verilog_token * token,
+    char          * text,
+    void          * array
+){
+    verilog_token_array * tokens = array;
+    (void)text;
+
+    if(tokens -> count == tokens -> capacity)
+    {
+        size_t          capacity = tokens -> capacity ?
+                                   tokens -> capacity * 2 : 4096;
+        verilog_token * grown    = realloc(tokens -> tokens,
+                                           capacity * sizeof(verilog_token));
+        if(grown == NULL)
+        {
+            return 1;
+        }
+        tokens -> tokens   = grown;
+        tokens -> capacity = capacity;
+    }
+
+    tokens -> tokens[tokens -> count ++] = *token;
+    return 0;
+}
+
+// ------------------------------------------------------------------------
+
+//! Records where the construct being skipped ends.
+static void verilog_skip_set_end(
+    verilog_parser_context * context,
+    size_t                   end
+){
+    ast_skipped_construct * construct = context -> skip.construct;
+
+    // The line of its last character, counted as for the lines of nodes.
+    ast_metadata last;
+    last.file   = ast_current_file();
+    last.offset = end > construct -> start ? end - 1 : construct -> start;
+    last.length = 0;
+
+    construct -> end      = end;
+    construct -> end_line = yy_verilog_source_tree == NULL ? 0 :
+        verilog_source_tree_get_line(yy_verilog_source_tree, &last);
+    ast_set_meta_end(&(construct -> meta), end);
+}
+
+/*!
+@brief Decides what the scanner does with each token when the context is
+in skeleton mode.
+*/
+verilog_skip_action verilog_skip_token(
+    verilog_parser_context * context,
+    int                      token,
+    size_t                   start,
+    size_t                   end
+){
+    verilog_skip_state * skip = &(context -> skip);
+
+    if(skip -> construct == NULL)
+    {
+        ast_module_item_type type;
+        int                  end_token = 0;
+
+        switch(token)
+        {
+            case KW_PRIMITIVE:
+                skip -> in_primitive = AST_TRUE;
+                return SKIP_EMIT;
+            case KW_ENDPRIMITIVE:
+                skip -> in_primitive = AST_FALSE;
+                return SKIP_EMIT;
+            case KW_INITIAL:
+                // UDPs have initial statements of their own.
+                if(skip -> in_primitive)
+                {
+                    return SKIP_EMIT;
+                }
+                type = MOD_ITEM_INITIAL_CONSTRUCT;
+                break;
+            case KW_ALWAYS:
+                type = MOD_ITEM_ALWAYS_CONSTRUCT;
+                break;
+            case KW_FUNCTION:
+                type      = MOD_ITEM_FUNCTION_DECLARATION;
+                end_token = KW_ENDFUNCTION;
+                break;
+            case KW_TASK:
+                type      = MOD_ITEM_TASK_DECLARATION;
+                end_token = KW_ENDTASK;
+                break;
+            case KW_SPECIFY:
+                type      = MOD_ITEM_SPECIFY_BLOCK;
+                end_token = KW_ENDSPECIFY;
+                break;
+            default:
+                return SKIP_EMIT;
+        }
+
+        skip -> construct      = ast_new_skipped_construct(type, start);
+        skip -> end_token      = end_token;
+        skip -> depth          = 0;
+        skip -> open_ifs       = 0;
+        skip -> statement_done = AST_FALSE;
+        return SKIP_CONSUME;
+    }
+
+    if(skip -> end_token != 0)
+    {
+        if(token != skip -> end_token)
+        {
+            return SKIP_CONSUME;
+        }
+        verilog_skip_set_end(context, end);
+        return SKIP_FINISH;
+    }
+
+    if(skip -> statement_done)
+    {
+        // A finished statement may yet be the body of an if with an else.
+        if(token != KW_ELSE)
+        {
+            return SKIP_FINISH_BEFORE;
+        }
+        skip -> open_ifs       -= 1;
+        skip -> statement_done  = AST_FALSE;
+        return SKIP_CONSUME;
+    }
+
+    switch(token)
+    {
+        case OPEN_BRACKET:
+        case OPEN_SQ_BRACKET:
+        case OPEN_SQ_BRACE:
+        case ATTRIBUTE_START:
+        case KW_BEGIN:
+        case KW_FORK:
+        case KW_CASE:
+        case KW_CASEX:
+        case KW_CASEZ:
+            skip -> depth += 1;
+            return SKIP_CONSUME;
+
+        case CLOSE_BRACKET:
+        case CLOSE_SQ_BRACKET:
+        case CLOSE_SQ_BRACE:
+        case ATTRIBUTE_END:
+            if(skip -> depth > 0)
+            {
+                skip -> depth -= 1;
+            }
+            return SKIP_CONSUME;
+
+        case KW_END:
+        case KW_JOIN:
+        case KW_ENDCASE:
+            if(skip -> depth == 0)
+            {
+                // Unbalanced. Leave the parser to report it.
+                verilog_skip_set_end(context, start);
+                return SKIP_FINISH_BEFORE;
+            }
+            skip -> depth -= 1;
+            if(skip -> depth > 0)
+            {
+                return SKIP_CONSUME;
+            }
+            break;
+
+        case KW_IF:
+            if(skip -> depth == 0)
+            {
+                skip -> open_ifs += 1;
+            }
+            return SKIP_CONSUME;
+
+        case SEMICOLON:
+            if(skip -> depth > 0)
+            {
+                return SKIP_CONSUME;
+            }
+            break;
+
+        case KW_ENDMODULE:
+        case KW_MODULE:
+        case KW_MACROMODULE:
+        case KW_ENDGENERATE:
+            // Never part of a statement. Don't run on past a mistake.
+            verilog_skip_set_end(context, start);
+            return SKIP_FINISH_BEFORE;
+
+        default:
+            return SKIP_CONSUME;
+    }
+
+    // The token finished a statement at the outermost level.
+    verilog_skip_set_end(context, end);
+
+    if(skip -> open_ifs == 0)
+    {
+        return SKIP_FINISH;
+    }
+
+    skip -> statement_done = AST_TRUE;
+    return SKIP_CONSUME;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief A file, or a piece of one, to be parsed by the worker pool.
+@details If text is NULL, the file at path is opened and parsed. Otherwise
+text is parsed as though it were found at the given line of path, after the
+pool's prologue has been parsed.
+*/
+typedef struct verilog_parse_job_t{
+    char                   * path;      //!< The file to parse, or its name.
+    const char             * text;      //!< Text to parse instead, or NULL.
+    size_t                   length;    //!< Length of text in bytes.
+    unsigned int             line;      //!< Line of path that text starts on.
+    verilog_parser_context * context;   //!< The context it was parsed with.
+    int                      result;    //!< The result of parsing it.
+} verilog_parse_job;
+
+/*!
+@brief The run of jobs still waiting to be done by one worker.
+@details The jobs are those between front and back in the pool's array. The
+owning worker takes jobs from the back, and other workers steal them from
+the front.
+*/
+typedef struct verilog_work_queue_t{
+    pthread_mutex_t lock;   //!< Held while front or back are examined.
+    unsigned int    front;  //!< Index of the first job left.
+    unsigned int    back;   //!< One past the index of the last job left.
+} verilog_work_queue;
+
+//! State shared by all of the workers of the pool.
+typedef struct verilog_worker_pool_t{
+    verilog_parse_job     * jobs;       //!< Every job, in source order.
+    verilog_work_queue    * queues;     //!< One queue per worker.
+    unsigned int            workers;    //!< Number of workers.
+    verilog_context_setup   setup;      //!< Configures each new context.
+    void                  * setup_data; //!< Passed through to setup.
+    const char            * prologue;   //!< Parsed ahead of each text job.
+    size_t                  prologue_length; //!< Length of the prologue.
+    verilog_source_tree   * tree;       //!< Every job's tree shares its files.
+} verilog_worker_pool;
+
+//! What each worker thread is started with.
+typedef struct verilog_worker_t{
+    verilog_worker_pool * pool; //!< The pool the worker belongs to.
+    unsigned int          id;   //!< Index of the worker's own queue.
+} verilog_worker;
+
+/*!
+@brief Takes a job from a work queue.
+@param [inout] queue - The queue to take from.
+@param [in] steal - If true, take from the front rather than the back.
+@param [out] job - Receives the index of the job taken.
+@returns AST_TRUE if a job was taken, AST_FALSE if the queue was empty.
+*/
+static ast_boolean verilog_work_queue_take(
+    verilog_work_queue * queue,
+    ast_boolean          steal,
+    unsigned int       * job
+){
+    ast_boolean tr = AST_FALSE;
+
+    pthread_mutex_lock(&(queue -> lock));
+    if(queue -> front < queue -> back)
+    {
+        *job = steal ? queue -> front ++ : -- queue -> back;
+        tr   = AST_TRUE;
+    }
+    pthread_mutex_unlock(&(queue -> lock));
+
+    return tr;
+}
+
+/*!
+@brief Parses a piece of text with a context, numbering lines and bytes from
+the supplied line and offset rather than wherever the scanner had got to.
+*/
+static int verilog_parse_text_at_line(
+    verilog_parser_context * context,
+    char                   * path,
+    const char             * text,
+    size_t                   length,
+    unsigned int             line,
+    size_t                   offset
+){
+    // Every parse pops the file it started in when it reaches the end.
+    verilog_preprocessor_set_file(context -> preprocessor, path);
+
+    // The scanner releases the copy it makes when it reaches the end.
+    verilog_scanner_push_text(context -> scanner, context -> preprocessor,
+                              (char*)text, length, AST_FALSE, line, offset);
+
+    return verilog_parse_current_buffer(context, text, length, offset);
+}
+
+//! Parses a single job with a context of its own.
+static void verilog_parse_job_run(
+    verilog_worker_pool * pool,
+    verilog_parse_job   * job
+){
+    job -> context = verilog_new_parser_context();
+
+    verilog_free_source_tree(job -> context -> source_tree);
+    job -> context -> source_tree = verilog_new_source_tree_sharing(
+        pool -> tree);
+
+    if(pool -> setup != NULL)
+    {
+        pool -> setup(job -> context, pool -> setup_data);
+    }
+
+    if(job -> text != NULL)
+    {
+        job -> result = 0;
+
+        if(pool -> prologue_length > 0)
+        {
+            job -> result = verilog_parse_text_at_line(job -> context,
+                job -> path, pool -> prologue, pool -> prologue_length, 0, 0);
+        }
+        if(job -> result == 0)
+        {
+            job -> result = verilog_parse_text_at_line(job -> context,
+                job -> path, job -> text, job -> length, job -> line,
+                job -> text - pool -> prologue);
+        }
+        return;
+    }
+
+    job -> result = verilog_parse_path_r(job -> context, job -> path);
+}
+
+/*!
+@brief The body of each worker thread.
+@details Works through the worker's own queue, then steals from the others
+in turn. Jobs are never added once the workers start, so a worker which
+finds every queue empty is finished.
+*/
+static void * verilog_parse_worker(void * arg)
+{
+    verilog_worker      * worker = arg;
+    verilog_worker_pool * pool   = worker -> pool;
+    unsigned int          job;
+
+    while(AST_TRUE)
+    {
+        ast_boolean found = verilog_work_queue_take(
+            &(pool -> queues[worker -> id]), AST_FALSE, &job);
+
+        unsigned int i;
+        for(i = 1; i < pool -> workers && !found; i ++)
+        {
+            unsigned int victim = (worker -> id + i) % pool -> workers;
+            found = verilog_work_queue_take(&(pool -> queues[victim]),
+                                            AST_TRUE, &job);
+        }
+
+        if(!found)
+        {
+            break;
+        }
+
+        verilog_parse_job_run(pool, &(pool -> jobs[job]));
+    }
+
+    return NULL;
+}
+
+/*!
+@brief Runs every job of a pool, then merges the resulting trees in job
+order and resolves modules across them.
+@details The caller fills in the jobs, job count and anything else the jobs
+need. The queues are set up here.
+@param [inout] pool - The pool to run.
+@param [in] count - The number of jobs.
+@param [in] threads - The number of workers, or zero for one per processor.
+@param [out] results - If not NULL, receives the result of each job.
+*/
+static verilog_source_tree * verilog_worker_pool_run(
+    verilog_worker_pool * pool,
+    unsigned int          count,
+    unsigned int          threads,
+    int                 * results
+){
+    if(threads == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned int)online : 1;
+    }
+    if(threads > count)
+    {
+        threads = count > 0 ? count : 1;
+    }
+
+    pool -> queues  = calloc(threads, sizeof(verilog_work_queue));
+    pool -> workers = threads;
+    pool -> tree    = verilog_new_source_tree();
+
+    // Files the jobs start in get their ids in job order, so that only
+    // those of include files depend on which job reaches them first.
+    unsigned int i;
+    for(i = 0; i < count; i ++)
+    {
+        if(pool -> jobs[i].path != NULL)
+        {
+            verilog_source_tree_add_file(pool -> tree, pool -> jobs[i].path);
+        }
+    }
+
+    // Text jobs are pieces of one file, which is held whole from the start
+    // of the prologue, so its lines are found once, here. Files parsed by
+    // path have theirs found as they are read.
+    if(count > 0 && pool -> jobs[0].text != NULL)
+    {
+        verilog_parse_job * last   = pool -> jobs + count - 1;
+        size_t              length = last -> text + last -> length -
+                                     pool -> prologue;
+        verilog_source_tree_index_file(pool -> tree, pool -> jobs[0].path,
+                                       pool -> prologue, length);
+    }
+
+    verilog_worker * workers = calloc(threads, sizeof(verilog_worker));
+    pthread_t      * handles = calloc(threads, sizeof(pthread_t));
+    ast_boolean    * started = calloc(threads, sizeof(ast_boolean));
+
+    for(i = 0; i < threads; i ++)
+    {
+        pthread_mutex_init(&(pool -> queues[i].lock), NULL);
+        pool -> queues[i].front = (unsigned int)((size_t)count *  i   /threads);
+        pool -> queues[i].back  = (unsigned int)((size_t)count * (i+1)/threads);
+        workers[i].pool         = pool;
+        workers[i].id           = i;
+    }
+
+    // The calling thread acts as the first worker. If a thread cannot be
+    // started, its jobs are simply stolen by the others.
+    for(i = 1; i < threads; i ++)
+    {
+        started[i] = pthread_create(&(handles[i]), NULL,
+                                    verilog_parse_worker, &(workers[i])) == 0;
+    }
+
+    verilog_parse_worker(&(workers[0]));
+
+    for(i = 1; i < threads; i ++)
+    {
+        if(started[i])
+        {
+            pthread_join(handles[i], NULL);
+        }
+    }
+
+    // Merge in job order, so the result is deterministic.
+    verilog_source_tree * tr = pool -> tree;
+
+    for(i = 0; i < count; i ++)
+    {
+        verilog_parser_context * context = pool -> jobs[i].context;
+
+        if(results != NULL)
+        {
+            results[i] = pool -> jobs[i].result;
+        }
+
+        verilog_source_tree_merge(tr, context -> source_tree);
+
+        // Nodes refer to file names held by the preprocessor.
+        ast_region_adopt(tr -> region, context -> preprocessor -> region);
+
+        yylex_destroy(context -> scanner);
+        free(context);
+    }
+
+    verilog_resolve_modules(tr);
+
+    for(i = 0; i < threads; i ++)
+    {
+        pthread_mutex_destroy(&(pool -> queues[i].lock));
+    }
+
+    free(started);
+    free(handles);
+    free(workers);
+    free(pool -> queues);
+    pool -> queues = NULL;
+
+    return tr;
+}
+
+/*!
+@brief Parses a list of files in parallel, returning them as a single,
+module-resolved, source tree.
+*/
+verilog_source_tree * verilog_parse_files(
+    char                 ** paths,
+    unsigned int            count,
+    unsigned int            threads,
+    verilog_context_setup   setup,
+    void                  * setup_data,
+    int                   * results
+){
+    verilog_worker_pool pool;
+    memset(&pool, 0, sizeof(verilog_worker_pool));
+    pool.jobs       = calloc(count > 0 ? count : 1, sizeof(verilog_parse_job));
+    pool.setup      = setup;
+    pool.setup_data = setup_data;
+
+    unsigned int i;
+    for(i = 0; i < count; i ++)
+    {
+        pool.jobs[i].path = paths[i];
+    }
+
+    verilog_source_tree * tr = verilog_worker_pool_run(&pool, count, threads,
+                                                       results);
+    free(pool.jobs);
+    return tr;
+}
+
+// ------------------------------------------------------------------------
+
+//! Where a module or primitive declaration found by the pre-scan ends.
+typedef struct verilog_unit_end_t{
+    size_t       offset;    //!< Offset just past the end keyword.
+    unsigned int line;      //!< Number of newlines before offset.
+    unsigned int name_line; //!< Number of newlines before the name.
+    size_t       name;      //!< Offset of the declaration's name.
+    size_t       name_length; //!< Length of the name, or zero if missing.
+    ast_boolean  module;    //!< A module, rather than a primitive.
+} verilog_unit_end;
+
+//! Returns true if c may appear after the first character of an identifier.
+static ast_boolean verilog_is_identifier_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+//! Returns true if the length bytes at text spell out word exactly.
+static ast_boolean verilog_word_is(
+    const char * text,
+    size_t       length,
+    const char * word
+){
+    return strlen(word) == length && memcmp(text, word, length) == 0;
+}
+
+/*!
+@brief Finds the ends of the top level module and primitive declarations in
+some text, so that it may be split between them and parsed in pieces.
+@details Comments, strings and escaped identifiers are skipped, so keywords
+inside them are not mistaken for declarations. The name of each declaration
+is found along the way. Compiler directives are only
+allowed before the first declaration, where they form a prologue which can
+be parsed ahead of every piece. Anything else might change how a piece is
+preprocessed depending on what came before it, so makes splitting unsafe:
+directives after the first declaration, `include or `line directives, or a
+block comment starting on a directive line.
+@param [in] text - The text to scan.
+@param [in] length - The length of the text.
+@param [out] prologue_end - Receives the offset the prologue ends at.
+@param [out] prologue_lines - Receives the number of newlines before it.
+@param [out] ends - Receives a malloc'd array of declaration ends.
+@param [out] end_count - Receives the number of elements in ends.
+@returns AST_FALSE if the text cannot be safely split.
+*/
+static ast_boolean verilog_find_unit_ends(
+    const char         * text,
+    size_t               length,
+    size_t             * prologue_end,
+    unsigned int       * prologue_lines,
+    verilog_unit_end  ** ends,
+    unsigned int       * end_count
+){
+    size_t           i          = 0;
+    unsigned int     line       = 0;
+    unsigned int     capacity   = 0;
+    ast_boolean      seen_token = AST_FALSE;
+    ast_boolean      safe       = AST_TRUE;
+    const char     * closer     = NULL; // End keyword of the open unit.
+    verilog_unit_end unit;              // The open unit, as far as known.
+    ast_boolean      naming     = AST_FALSE; // Next word is a unit's name.
+
+    *prologue_end   = 0;
+    *prologue_lines = 0;
+    *ends           = NULL;
+    *end_count      = 0;
+
+    while(safe && i < length)
+    {
+        char c    = text[i];
+        char next = i + 1 < length ? text[i+1] : '\0';
+
+        if(c == '\n')
+        {
+            line ++;
+            i    ++;
+        }
+        else if(isspace((unsigned char)c))
+        {
+            i ++;
+        }
+        else if(c == '/' && next == '/')
+        {
+            while(i < length && text[i] != '\n')
+            {
+                i ++;
+            }
+        }
+        else if(c == '/' && next == '*')
+        {
+            i += 2;
+            while(i < length && !(text[i] == '*' && i + 1 < length &&
+                                  text[i+1] == '/'))
+            {
+                line += text[i] == '\n';
+                i    ++;
+            }
+            i = i + 2 < length ? i + 2 : length;
+        }
+        else if(c == '`')
+        {
+            size_t start = i + 1;
+            i = start;
+            while(i < length && verilog_is_identifier_char(text[i]))
+            {
+                i ++;
+            }
+
+            safe = !seen_token &&
+                   !verilog_word_is(text + start, i - start, "include") &&
+                   !verilog_word_is(text + start, i - start, "line");
+
+            // Skip the rest of the directive, including continued lines.
+            while(safe && i < length && text[i] != '\n')
+            {
+                if(text[i] == '/' && i + 1 < length && text[i+1] == '*')
+                {
+                    safe = AST_FALSE;
+                }
+                else if(text[i] == '\\' && i + 1 < length &&
+                        text[i+1] == '\n')
+                {
+                    line ++;
+                    i    ++;
+                }
+                else if(text[i] == '\\' && i + 2 < length &&
+                        text[i+1] == '\r' && text[i+2] == '\n')
+                {
+                    line ++;
+                    i   += 2;
+                }
+                i ++;
+            }
+
+            // The prologue takes the whole line ending with it, so that a
+            // carriage return is not left at its end on its own.
+            if(i < length && text[i] == '\n')
+            {
+                line ++;
+                i    ++;
+            }
+
+            *prologue_end   = i;
+            *prologue_lines = line;
+        }
+        else if(c == '"')
+        {
+            seen_token = AST_TRUE;
+            i ++;
+            while(i < length && text[i] != '"' && text[i] != '\n')
+            {
+                i += text[i] == '\\' && i + 1 < length && text[i+1] != '\n';
+                i ++;
+            }
+            i += i < length && text[i] == '"';
+        }
+        else if(c == '\\')
+        {
+            size_t start = i;
+            seen_token = AST_TRUE;
+            while(i < length && !isspace((unsigned char)text[i]))
+            {
+                i ++;
+            }
+
+            if(naming)
+            {
+                // Named as the scanner would, the backslash included.
+                size_t end = start + 1;
+                while(end < i && verilog_is_identifier_char(text[end]))
+                {
+                    end ++;
+                }
+                unit.name        = start;
+                unit.name_length = end - start;
+                unit.name_line   = line;
+                naming           = AST_FALSE;
+            }
+        }
+        else if(isalpha((unsigned char)c) || c == '_')
+        {
+            size_t start = i;
+            while(i < length && verilog_is_identifier_char(text[i]))
+            {
+                i ++;
+            }
+
+            const char * word = text + start;
+            size_t       len  = i - start;
+            seen_token = AST_TRUE;
+
+            if(closer == NULL)
+            {
+                memset(&unit, 0, sizeof(verilog_unit_end));
+
+                if(verilog_word_is(word, len, "module") ||
+                   verilog_word_is(word, len, "macromodule"))
+                {
+                    closer      = "endmodule";
+                    unit.module = AST_TRUE;
+                }
+                else if(verilog_word_is(word, len, "primitive"))
+                {
+                    closer      = "endprimitive";
+                }
+
+                naming = closer != NULL;
+            }
+            else if(naming)
+            {
+                unit.name        = start;
+                unit.name_length = len;
+                unit.name_line   = line;
+                naming           = AST_FALSE;
+            }
+            else if(verilog_word_is(word, len, closer))
+            {
+                if(*end_count == capacity)
+                {
+                    capacity = capacity ? capacity * 2 : 64;
+                    *ends = realloc(*ends, capacity*sizeof(verilog_unit_end));
+                }
+                unit.offset = i;
+                unit.line   = line;
+                (*ends)[*end_count] = unit;
+                *end_count += 1;
+                closer = NULL;
+            }
+        }
+        else
+        {
+            seen_token = AST_TRUE;
+            i ++;
+        }
+    }
+
+    if(!safe)
+    {
+        free(*ends);
+        *ends      = NULL;
+        *end_count = 0;
+    }
+
+    return safe;
+}
+
+/*!
+@brief Parses a single file, splitting it between top level declarations so
+that the pieces can be parsed in parallel.
+*/
+verilog_source_tree * verilog_parse_file_chunked(
+    char                  * path,
+    unsigned int            threads,
+    verilog_context_setup   setup,
+    void                  * setup_data,
+    int                   * result
+){
+    verilog_worker_pool pool;
+    memset(&pool, 0, sizeof(verilog_worker_pool));
+    pool.setup      = setup;
+    pool.setup_data = setup_data;
+
+    verilog_mapped_file * mapped = verilog_map_file(path);
+    char                * text   = mapped ? mapped -> data   : NULL;
+    size_t                length = mapped ? mapped -> length : 0;
+
+    size_t             prologue_end;
+    unsigned int       prologue_lines;
+    verilog_unit_end * ends      = NULL;
+    unsigned int       end_count = 0;
+    unsigned int       count     = 0;
+
+    if(text != NULL && verilog_find_unit_ends(text, length, &prologue_end,
+       &prologue_lines, &ends, &end_count) && end_count > 1)
+    {
+        if(threads == 0)
+        {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = online > 0 ? (unsigned int)online : 1;
+        }
+
+        // Several pieces per thread, so stealing can even out the load,
+        // but not so many that each context's overhead starts to matter.
+        size_t target = (length - prologue_end) / ((size_t)threads * 8);
+        if(target < 64 * 1024)
+        {
+            target = 64 * 1024;
+        }
+
+        pool.jobs            = calloc(end_count, sizeof(verilog_parse_job));
+        pool.prologue        = text;
+        pool.prologue_length = prologue_end;
+
+        size_t       start      = prologue_end;
+        unsigned int start_line = prologue_lines;
+        unsigned int e;
+
+        for(e = 0; e < end_count; e ++)
+        {
+            ast_boolean last = e + 1 == end_count;
+            if(!last && ends[e].offset - start < target)
+            {
+                continue;
+            }
+
+            // The last piece takes anything after the last declaration.
+            size_t end = last ? length : ends[e].offset;
+
+            pool.jobs[count].path   = path;
+            pool.jobs[count].text   = text + start;
+            pool.jobs[count].length = end - start;
+            pool.jobs[count].line   = start_line;
+            count ++;
+
+            start      = end;
+            start_line = ends[e].line;
+        }
+    }
+
+    if(count < 2)
+    {
+        // Not worth splitting, or not safe to: parse the file as a whole.
+        free(pool.jobs);
+        pool.jobs            = calloc(1, sizeof(verilog_parse_job));
+        pool.jobs[0].path    = path;
+        pool.prologue_length = 0;
+        count                = 1;
+    }
+
+    int                 * results = calloc(count, sizeof(int));
+    verilog_source_tree * tr      = verilog_worker_pool_run(&pool, count,
+                                                            threads, results);
+
+    if(result != NULL)
+    {
+        unsigned int i;
+        *result = 0;
+        for(i = 0; i < count && *result == 0; i ++)
+        {
+            *result = results[i];
+        }
+    }
+
+    free(results);
+    free(pool.jobs);
+    free(ends);
+    verilog_unmap_file(mapped);
+    return tr;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Parses a file's module declarations lazily, only recording where
+each one is until it is needed.
+*/
+int verilog_parse_path_lazy(verilog_parser_context * context, char * path)
+{
+    verilog_source_tree * tree   = context -> source_tree;
+    verilog_mapped_file * mapped = verilog_map_file(path);
+
+    size_t             prologue_end;
+    unsigned int       prologue_lines;
+    verilog_unit_end * ends      = NULL;
+    unsigned int       end_count = 0;
+
+    if(mapped == NULL || !verilog_find_unit_ends(mapped -> data,
+       mapped -> length, &prologue_end, &prologue_lines, &ends, &end_count)
+       || end_count == 0)
+    {
+        // Nothing to gain, or not safe to split: parse it all now.
+        verilog_unmap_file(mapped);
+        return verilog_parse_path_r(context, path);
+    }
+
+    // Modules not loaded yet still need lines, and the file may have gone
+    // or changed by the time they are asked for.
+    verilog_source_tree_index_file(tree, path, mapped -> data,
+                                   mapped -> length);
+
+    char * text   = mapped -> data;
+    int    result = 0;
+
+    // The directives at the top go through the context's own preprocessor,
+    // just as they would for a full parse.
+    if(prologue_end > 0)
+    {
+        result = verilog_parse_text_at_line(context, path, text,
+                                            prologue_end, 0, 0);
+    }
+
+    verilog_preprocessor_context * snapshot =
+        verilog_preprocessor_snapshot(context -> preprocessor);
+    ast_region_adopt(tree -> region, snapshot -> region);
+
+    ast_region * previous = ast_region_set_current(tree -> region);
+    char       * name     = ast_strdup(path);
+    ast_region_set_current(previous);
+
+    size_t       start      = prologue_end;
+    unsigned int start_line = prologue_lines;
+    unsigned int e;
+
+    for(e = 0; e < end_count && result == 0; e ++)
+    {
+        // The last declaration takes anything after it.
+        size_t end = e + 1 == end_count ? mapped -> length : ends[e].offset;
+
+        if(ends[e].module && ends[e].name_length > 0)
+        {
+            previous = ast_region_set_current(tree -> region);
+
+            char * id_text = ast_calloc(ends[e].name_length + 1, 1);
+            memcpy(id_text, text + ends[e].name, ends[e].name_length);
+
+            ast_module_declaration * module = ast_new_module_declaration(
+                NULL, ast_new_identifier(id_text, ends[e].name_line),
+                ast_list_new(), NULL, ast_list_new());
+            module -> meta.offset = ends[e].name;
+            module -> meta.length = ends[e].name_length;
+            module -> meta.file   = verilog_source_tree_add_file(tree, name);
+
+            module -> lazy = ast_calloc(1, sizeof(ast_lazy_module));
+            module -> lazy -> path         = name;
+            module -> lazy -> start        = start;
+            module -> lazy -> length       = end - start;
+            module -> lazy -> line         = start_line;
+            module -> lazy -> preprocessor = snapshot;
+
+            verilog_source_tree_add_module(tree, module);
+            ast_region_set_current(previous);
+        }
+        else
+        {
+            // Primitives are small, and never looked up. Parse them now.
+            result = verilog_parse_text_at_line(context, path, text + start,
+                                                end - start, start_line,
+                                                start);
+        }
+
+        start      = end;
+        start_line = ends[e].line;
+    }
+
+    free(ends);
+    verilog_unmap_file(mapped);
+    return result;
+}
+
+/*!
+@brief Parses the body of a module found by @ref verilog_parse_path_lazy,
+filling in the module declaration in place.
+*/
+ast_boolean verilog_load_module(
+    verilog_source_tree    * tree,
+    ast_module_declaration * module
+){
+    ast_lazy_module * lazy = module -> lazy;
+
+    if(lazy == NULL)
+    {
+        return AST_TRUE;
+    }
+    else if(lazy -> failed)
+    {
+        return AST_FALSE;
+    }
+
+    verilog_mapped_file * mapped = verilog_map_file(lazy -> path);
+    if(mapped == NULL || mapped -> length < lazy -> start + lazy -> length)
+    {
+        // The file has gone, or been cut short, since it was first read.
+        verilog_unmap_file(mapped);
+        lazy -> failed = AST_TRUE;
+        return AST_FALSE;
+    }
+
+    // Parse with the preprocessor as it was when the module was found. A
+    // copy, so that one module's directives do not leak into the next.
+    verilog_parser_context * context = verilog_new_parser_context();
+    verilog_free_preprocessor_context(context -> preprocessor);
+    context -> preprocessor = verilog_preprocessor_snapshot(
+        lazy -> preprocessor);
+
+    // Files get the ids they have in the tree the module is loaded into.
+    verilog_free_source_tree(context -> source_tree);
+    context -> source_tree = verilog_new_source_tree_sharing(tree);
+
+    int result = verilog_parse_text_at_line(context, lazy -> path,
+        mapped -> data + lazy -> start, lazy -> length, lazy -> line,
+        lazy -> start);
+
+    verilog_unmap_file(mapped);
+
+    ast_list               * parsed = context -> source_tree -> modules;
+    ast_module_declaration * loaded = parsed -> items == 1 ?
+                                      ast_list_get(parsed, 0) : NULL;
+
+    if(result != 0 || loaded == NULL ||
+       !ast_identifier_eq(loaded -> identifier, module -> identifier))
+    {
+        lazy -> failed = AST_TRUE;
+    }
+    else
+    {
+        // Fill in the existing declaration, which is already referred to.
+        *module = *loaded;
+        ast_region_adopt(tree -> region, context -> source_tree -> region);
+        context -> source_tree = NULL;
+    }
+
+    verilog_free_parser_context(context);
+    return !lazy -> failed;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Hashes the tokens in some text.
+@details Comments, and the white space between two tokens, make no
+difference, so neither does where the text is in its file. Only line breaks
+which end a compiler directive count, since the directive ends with them.
+*/
+static unsigned long long verilog_hash_tokens(
+    const char * text,
+    size_t       length
+){
+    unsigned long long hash        = VERILOG_HASH_BASIS;
+    ast_boolean        after_token = AST_FALSE; // Not at the start.
+    ast_boolean        gap         = AST_FALSE; // Space since last token.
+    ast_boolean        directive   = AST_FALSE; // A directive is open.
+    size_t             i           = 0;
+
+    while(i < length)
+    {
+        char c = text[i];
+        char n = i + 1 < length ? text[i + 1] : '\0';
+
+        if(c == '\n' && directive)
+        {
+            VERILOG_HASH_STEP(hash, c);
+            directive = AST_FALSE;
+            gap       = AST_FALSE;
+            i ++;
+            continue;
+        }
+        else if(isspace((unsigned char)c))
+        {
+            gap = after_token;
+            i ++;
+            continue;
+        }
+        else if(c == '/' && n == '/')
+        {
+            while(i < length && text[i] != '\n')
+            {
+                i ++;
+            }
+            gap = after_token;
+            continue;
+        }
+        else if(c == '/' && n == '*')
+        {
+            for(i += 2; i < length; i ++)
+            {
+                if(text[i] == '*' && i + 1 < length && text[i + 1] == '/')
+                {
+                    i += 2;
+                    break;
+                }
+                else if(text[i] == '\n' && directive)
+                {
+                    VERILOG_HASH_STEP(hash, '\n');
+                    directive = AST_FALSE;
+                }
+            }
+            gap = after_token;
+            continue;
+        }
+
+        if(gap)
+        {
+            VERILOG_HASH_STEP(hash, ' ');
+            gap = AST_FALSE;
+        }
+        after_token = AST_TRUE;
+        directive   = directive || c == '`';
+
+        VERILOG_HASH_STEP(hash, c);
+        i ++;
+
+        if(c == '"')
+        {
+            // Strings are hashed exactly as they are.
+            while(i < length && text[i] != '"' && text[i] != '\n')
+            {
+                if(text[i] == '\\' && i + 1 < length)
+                {
+                    VERILOG_HASH_STEP(hash, text[i]);
+                    i ++;
+                }
+                VERILOG_HASH_STEP(hash, text[i]);
+                i ++;
+            }
+        }
+    }
+
+    return hash;
+}
+
+//! How far the nodes of a declaration read from a file have moved.
+typedef struct verilog_rebase_t{
+    ast_file_id  file;   //!< The file. Nodes from other files stay put.
+    size_t       offset; //!< Added to offsets, wrapping when moving back.
+    unsigned int lines;  //!< Added to lines, wrapping likewise.
+} verilog_rebase;
+
+//! Moves the position of one node of a declaration.
+static void verilog_rebase_metadata(
+    ast_metadata * meta,
+    unsigned int * line,
+    void         * data
+){
+    verilog_rebase * rebase = data;
+    if(meta -> file != rebase -> file)
+    {
+        return;
+    }
+
+    meta -> offset += rebase -> offset;
+    if(line != NULL)
+    {
+        *line += rebase -> lines;
+    }
+}
+
+/*!
+@brief Gives a declaration kept from the last time a file was parsed the
+positions its text has in the file now.
+*/
+static void verilog_rebase_unit(
+    verilog_source_tree * tree,
+    char                * path,
+    verilog_unit_record * before,
+    verilog_unit_record * now
+){
+    if(before -> offset == now -> offset && before -> line == now -> line)
+    {
+        return;
+    }
+
+    verilog_rebase rebase;
+    rebase.file   = verilog_source_tree_add_file(tree, path);
+    rebase.offset = now -> offset - before -> offset;
+    rebase.lines  = now -> line   - before -> line;
+
+    verilog_declaration_visit_metadata(before -> declaration,
+        before -> module, verilog_rebase_metadata, &rebase);
+
+    if(!before -> module)
+    {
+        return;
+    }
+
+    // Skipped constructs also keep where they end.
+    ast_module_declaration * module = before -> declaration;
+    ast_skipped_construct  * construct;
+    ast_list_foreach(construct, module -> skipped_constructs)
+    {
+        if(construct -> meta.file == rebase.file)
+        {
+            construct -> start    += rebase.offset;
+            construct -> end      += rebase.offset;
+            construct -> end_line += (ast_line)rebase.lines;
+        }
+    }
+}
+
+/*!
+@brief Puts a module which has just been parsed again into a tree, in place
+of a stale declaration of the same name if there is one.
+@returns The declaration which is now in the tree, or the one given if there
+was nothing to replace, in which case it is left to the caller to add.
+*/
+static ast_module_declaration * verilog_splice_module(
+    verilog_source_tree    * tree,
+    ast_hashtable          * stale,
+    ast_list               * gone,
+    ast_module_declaration * parsed
+){
+    void * found = NULL;
+    char * key   = NULL;
+
+    if(parsed -> identifier != NULL)
+    {
+        key = ast_identifier_key(parsed -> identifier, tree -> region);
+    }
+
+    if(key == NULL ||
+       ast_hashtable_get(stale, key, &found) != HASH_SUCCESS)
+    {
+        return parsed;
+    }
+
+    // Reuse the old declaration, which instantiations already refer to.
+    ast_module_declaration * module = found;
+    ast_hashtable_delete(stale, key);
+
+    unsigned int i;
+    for(i = 0; i < gone -> items; i ++)
+    {
+        if(ast_list_get(gone, i) == module)
+        {
+            ast_list_remove_at(gone, i);
+            break;
+        }
+    }
+
+    verilog_source_tree_replace_module(tree, module, parsed);
+    return module;
+}
+
+//! Orders pointers by address, for qsort and bsearch.
+static int verilog_compare_pointers(const void * a, const void * b)
+{
+    const char * x = *(void * const *)a;
+    const char * y = *(void * const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*!
+@brief Adds the declarations of a file which are new to a tree next to the
+ones it already holds, and puts them all in the order of the file.
+@details The declarations already in the tree keep the places in the list
+they have between them, so the rest of the list is not disturbed.
+*/
+static void verilog_place_units(
+    verilog_source_tree * tree,
+    ast_list            * units,
+    ast_boolean           module,
+    ast_list            * added
+){
+    ast_list            * list    = module ? tree -> modules :
+                                             tree -> primitives;
+    void               ** present = malloc((units -> items + 1) *
+                                           sizeof(void*));
+    unsigned int        * slots   = malloc((list -> items + added -> items
+                                            + 1) * sizeof(unsigned int));
+    unsigned int          count   = 0;
+    unsigned int          filled  = 0;
+    unsigned int          i;
+    verilog_unit_record * unit;
+
+    ast_list_foreach(unit, units)
+    {
+        if(unit -> module == module && unit -> declaration != NULL &&
+           !ast_list_contains(added, unit -> declaration))
+        {
+            present[count ++] = unit -> declaration;
+        }
+    }
+
+    qsort(present, count, sizeof(void*), verilog_compare_pointers);
+    for(i = 0; i < list -> items && count > 0; i ++)
+    {
+        void * declaration = ast_list_get(list, i);
+        if(bsearch(&declaration, present, count, sizeof(void*),
+                   verilog_compare_pointers) != NULL)
+        {
+            slots[filled ++] = i;
+        }
+    }
+
+    // New declarations go just after the last of the old ones.
+    unsigned int at = filled > 0 ? slots[filled - 1] + 1 : list -> items;
+    void       * declaration;
+    ast_list_foreach(declaration, added)
+    {
+        if(module)
+        {
+            verilog_source_tree_insert_module(tree, at, declaration);
+        }
+        else
+        {
+            ast_list_insert_at(list, at, declaration);
+        }
+        slots[filled ++] = at ++;
+    }
+
+    i = 0;
+    ast_list_foreach(unit, units)
+    {
+        if(unit -> module == module && unit -> declaration != NULL &&
+           i < filled)
+        {
+            list -> elements[slots[i ++]] = unit -> declaration;
+        }
+    }
+
+    free(present);
+    free(slots);
+}
+
+/*!
+@brief Parses a file into a source tree, or brings the parts of the tree
+which came from it up to date with the file.
+*/
+int verilog_parse_path_incremental(
+    verilog_parser_context * context,
+    char                   * path
+){
+    verilog_source_tree * tree   = context -> source_tree;
+    verilog_file_record * record = NULL;
+    void                * found;
+
+    if(ast_hashtable_get(tree -> file_units, path, &found) == HASH_SUCCESS)
+    {
+        record = found;
+    }
+
+    verilog_mapped_file * mapped = verilog_map_file(path);
+
+    size_t             prologue_end   = 0;
+    unsigned int       prologue_lines = 0;
+    verilog_unit_end * ends           = NULL;
+    unsigned int       end_count      = 0;
+
+    ast_boolean split = mapped != NULL && verilog_find_unit_ends(
+        mapped -> data, mapped -> length, &prologue_end, &prologue_lines,
+        &ends, &end_count) && end_count > 0;
+
+    // Everything is parsed into a tree of its own, then moved across.
+    verilog_source_tree * scratch  = verilog_new_source_tree_sharing(tree);
+    ast_region          * previous = ast_region_set_current(scratch->region);
+    ast_list            * units    = ast_list_new();
+    unsigned long long    prologue_hash = 0;
+    unsigned int          e;
+
+    if(split)
+    {
+        prologue_hash = verilog_hash_tokens(mapped -> data, prologue_end);
+    }
+
+    // Keep anything which has the same tokens as before, wherever it is.
+    ast_boolean  reuse = record != NULL && split &&
+                         record -> prologue_hash == prologue_hash;
+    unsigned int old   = 0;
+
+    for(e = 0; e < end_count && split; e ++)
+    {
+        size_t       start = e == 0 ? prologue_end   : ends[e-1].offset;
+        unsigned int line  = e == 0 ? prologue_lines : ends[e-1].line;
+        size_t       end   = e + 1 == end_count ? mapped -> length :
+                                                  ends[e].offset;
+
+        verilog_unit_record * unit = ast_calloc(1,
+                                                sizeof(verilog_unit_record));
+        unit -> hash   = verilog_hash_tokens(mapped -> data + start,
+                                             end - start);
+        unit -> line   = line;
+        unit -> offset = start;
+        unit -> module = ends[e].module;
+        ast_list_append(units, unit);
+
+        // Declarations between the last one kept and this one are stale.
+        unsigned int k;
+        for(k = old; reuse && k < record -> units -> items; k ++)
+        {
+            verilog_unit_record * before = ast_list_get(record -> units, k);
+            if(before -> hash == unit -> hash &&
+               before -> module == unit -> module &&
+               before -> declaration != NULL)
+            {
+                verilog_rebase_unit(tree, path, before, unit);
+                unit -> declaration   = before -> declaration;
+                before -> declaration = NULL;
+                old = k + 1;
+                break;
+            }
+        }
+    }
+
+    // Whatever was not kept is stale. Modules parsed again under the same
+    // name take the place of the stale ones, the rest go.
+    ast_hashtable * stale      = ast_hashtable_new();
+    ast_list      * gone       = ast_list_new();
+    ast_list      * gone_udps  = ast_list_new();
+    ast_list      * added      = ast_list_new();
+    ast_list      * added_udps = ast_list_new();
+    ast_list      * old_units  = record != NULL ? record -> units : NULL;
+    verilog_unit_record * unit;
+
+    if(old_units != NULL)
+    {
+        ast_list_foreach(unit, old_units)
+        {
+            if(unit -> declaration == NULL)
+            {
+                continue;
+            }
+            else if(!unit -> module)
+            {
+                ast_list_append(gone_udps, unit -> declaration);
+                continue;
+            }
+
+            ast_module_declaration * module = unit -> declaration;
+            ast_list_append(gone, module);
+            if(module -> identifier != NULL)
+            {
+                ast_hashtable_insert(stale, ast_identifier_key(
+                    module -> identifier, tree -> region), module);
+            }
+        }
+    }
+
+    context -> source_tree = scratch;
+    int result = 0;
+
+    if(!split)
+    {
+        // Can't tell the declarations apart, so parse everything.
+        result = verilog_parse_path_r(context, path);
+    }
+    else if(prologue_end > 0)
+    {
+        result = verilog_parse_text_at_line(context, path, mapped -> data,
+                                            prologue_end, 0, 0);
+    }
+
+    for(e = 0; e < end_count && split; e ++)
+    {
+        unit = ast_list_get(units, e);
+        if(unit -> declaration != NULL)
+        {
+            continue;
+        }
+
+        size_t       start = e == 0 ? prologue_end   : ends[e-1].offset;
+        size_t       end   = e + 1 == end_count ? mapped -> length :
+                                                  ends[e].offset;
+        unsigned int modules    = scratch -> modules -> items;
+        unsigned int primitives = scratch -> primitives -> items;
+
+        int unit_result = verilog_parse_text_at_line(context, path,
+            mapped -> data + start, end - start, unit -> line, start);
+        result = result == 0 ? unit_result : result;
+
+        if(scratch -> modules -> items > modules)
+        {
+            void * parsed = ast_list_get(scratch -> modules, modules);
+            unit -> module      = AST_TRUE;
+            unit -> declaration = verilog_splice_module(tree, stale, gone,
+                                                        parsed);
+            if(unit -> declaration == parsed)
+            {
+                ast_list_append(added, parsed);
+            }
+        }
+        else if(scratch -> primitives -> items > primitives)
+        {
+            unit -> module      = AST_FALSE;
+            unit -> declaration = ast_list_get(scratch -> primitives,
+                                               primitives);
+            ast_list_append(added_udps, unit -> declaration);
+        }
+    }
+
+    context -> source_tree = tree;
+    if(mapped != NULL)
+    {
+        // Lines are found from the file as it is now.
+        verilog_source_tree_index_file(tree, path, mapped -> data,
+                                       mapped -> length);
+    }
+    free(ends);
+    verilog_unmap_file(mapped);
+
+    if(result == -1 && !split)
+    {
+        // The file could not be opened. Leave the tree as it was.
+        ast_region_set_current(previous);
+        verilog_free_source_tree(scratch);
+        return result;
+    }
+
+    if(!split)
+    {
+        // The declarations can't be matched up next time, so they are
+        // recorded with no hash.
+        void * declaration;
+        ast_list_foreach(declaration, scratch -> modules)
+        {
+            unit = ast_calloc(1, sizeof(verilog_unit_record));
+            unit -> module      = AST_TRUE;
+            unit -> declaration = verilog_splice_module(tree, stale, gone,
+                                                        declaration);
+            ast_list_append(units, unit);
+            if(unit -> declaration == declaration)
+            {
+                ast_list_append(added, declaration);
+            }
+        }
+        ast_list_foreach(declaration, scratch -> primitives)
+        {
+            unit = ast_calloc(1, sizeof(verilog_unit_record));
+            unit -> declaration = declaration;
+            ast_list_append(units, unit);
+            ast_list_append(added_udps, declaration);
+        }
+    }
+
+    ast_module_declaration * module;
+    ast_list_foreach(module, gone)
+    {
+        verilog_source_tree_remove_module(tree, module);
+    }
+
+    ast_udp_declaration * udp;
+    ast_list_foreach(udp, gone_udps)
+    {
+        for(e = 0; e < tree -> primitives -> items; e ++)
+        {
+            if(ast_list_get(tree -> primitives, e) == udp)
+            {
+                ast_list_remove_at(tree -> primitives, e);
+                break;
+            }
+        }
+    }
+
+    verilog_place_units(tree, units, AST_TRUE,  added);
+    verilog_place_units(tree, units, AST_FALSE, added_udps);
+
+    // The new nodes, and the records of them, now belong to the tree.
+    ast_region_adopt(tree -> region, scratch -> region);
+    ast_region_set_current(tree -> region);
+
+    if(record == NULL)
+    {
+        record         = ast_calloc(1, sizeof(verilog_file_record));
+        record -> path = ast_strdup(path);
+        ast_hashtable_insert(tree -> file_units, record -> path, record);
+    }
+    record -> prologue_hash = prologue_hash;
+    record -> units         = units;
+
+    ast_region_set_current(previous);
+    verilog_resolve_modules(tree);
+
+    return result;
+}
+
+// ------------------------------------------------------------------------
+
+/*!
+@brief Returns this thread's context for the global parse functions, wrapped
+around the current yy_preproc and yy_verilog_source_tree objects.
+*/
+static verilog_parser_context * verilog_global_parser_context()
+{
+    if(verilog_global_context == NULL)
+    {
+        verilog_global_context = calloc(1, sizeof(verilog_parser_context));
+        yylex_init_extra(verilog_global_context,
+                         &(verilog_global_context -> scanner));
+    }
+
+    verilog_global_context -> preprocessor = yy_preproc;
+    verilog_global_context -> source_tree  = yy_verilog_source_tree;
+
+    return verilog_global_context;
+}
 
 void    verilog_parser_init()
 {
@@ -21,12 +2264,15 @@ void    verilog_parser_init()
 */
 int     verilog_parse_file(FILE * to_parse)
 {
-    YY_BUFFER_STATE new_buffer = yy_create_buffer(to_parse, YY_BUF_SIZE);
-    yy_switch_to_buffer(new_buffer);
-    yylineno = 0; // Reset the global line counter, we are in a new file!
-    
-    int result = yyparse();
-    return result;
+    return verilog_parse_file_r(verilog_global_parser_context(), to_parse);
+}
+
+/*!
+@brief Perform a parsing operation on the file at the supplied path.
+*/
+int     verilog_parse_path(char * path)
+{
+    return verilog_parse_path_r(verilog_global_parser_context(), path);
 }
 
 /*!
@@ -34,11 +2280,8 @@ int     verilog_parse_file(FILE * to_parse)
 */
 int     verilog_parse_string(char * to_parse, int length)
 {
-    YY_BUFFER_STATE new_buffer = yy_scan_bytes(to_parse, length);
-    yy_switch_to_buffer(new_buffer);
-    
-    int result = yyparse();
-    return result;
+    return verilog_parse_string_r(verilog_global_parser_context(),
+                                  to_parse, length);
 }
 
 
@@ -47,9 +2290,6 @@ int     verilog_parse_string(char * to_parse, int length)
 */
 int     verilog_parse_buffer(char * to_parse, int length)
 {
-    YY_BUFFER_STATE new_buffer = yy_scan_buffer(to_parse, length);
-    yy_switch_to_buffer(new_buffer);
-    
-    int result = yyparse();
-    return result;
+    return verilog_parse_buffer_r(verilog_global_parser_context(),
+                                  to_parse, length);
 }
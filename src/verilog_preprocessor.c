@@ -3,16 +3,29 @@
 @brief Contains function implementations to support source code preprocessing.
 */
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "verilog_preprocessor.h"
 
+static void verilog_preprocessor_release(void * data);
+
 verilog_preprocessor_context * verilog_new_preprocessor_context()
 {
+    ast_region * region   = ast_region_new();
+    ast_region * previous = ast_region_set_current(region);
+
     verilog_preprocessor_context * tr = 
         ast_calloc(1,sizeof(verilog_preprocessor_context));
 
+    tr -> region         = region;
     tr -> token_count    = 0;
     tr -> in_cell_define = AST_FALSE;
     tr -> emit           = AST_TRUE;
+    tr -> scanner        = NULL;
 
     tr -> current_file   = ast_stack_new();
     tr -> includes       = ast_list_new();
@@ -21,10 +34,81 @@ verilog_preprocessor_context * verilog_new_preprocessor_context()
     tr -> macrodefines   = ast_hashtable_new();
     tr -> ifdefs         = ast_stack_new();
     tr -> search_dirs    = ast_list_new();
+    tr -> include_paths  = ast_hashtable_new();
+    tr -> include_dirs   = ast_list_new();
+    tr -> include_files  = ast_hashtable_new();
+    tr -> include_guards = ast_hashtable_new();
+    tr -> line_indexes   = ast_list_new();
 
     // By default, search CWD for include files.
     ast_list_append(tr -> search_dirs,"./");
 
+    // Contexts are often freed by freeing a region which has adopted theirs.
+    ast_region_at_free(region, verilog_preprocessor_release, tr);
+
+    ast_region_set_current(previous);
+
+    return tr;
+}
+
+
+/*!
+@brief Creates a new pre-processor context in the same state as another.
+*/
+verilog_preprocessor_context * verilog_preprocessor_snapshot(
+    verilog_preprocessor_context * preproc
+){
+    verilog_preprocessor_context * tr = verilog_new_preprocessor_context();
+    ast_region * previous = ast_region_set_current(tr -> region);
+
+    tr -> emit                   = preproc -> emit;
+    tr -> in_cell_define         = preproc -> in_cell_define;
+    tr -> unconnected_drive_pull = preproc -> unconnected_drive_pull;
+
+    if(preproc -> timescale.scale != NULL)
+    {
+        tr -> timescale.scale = ast_strdup(preproc -> timescale.scale);
+    }
+    if(preproc -> timescale.precision != NULL)
+    {
+        tr -> timescale.precision = ast_strdup(preproc -> timescale.precision);
+    }
+
+    char * dir;
+    ast_list_remove_at(tr -> search_dirs, 0);
+    ast_list_foreach(dir, preproc -> search_dirs)
+    {
+        ast_list_append(tr -> search_dirs, ast_strdup(dir));
+    }
+
+    verilog_default_net_type * net_type;
+    ast_list_foreach(net_type, preproc -> net_types)
+    {
+        verilog_default_net_type * copy =
+            ast_calloc(1, sizeof(verilog_default_net_type));
+        *copy = *net_type;
+        ast_list_append(tr -> net_types, copy);
+    }
+
+    unsigned int            position = 0;
+    ast_hashtable_element * element;
+    while((element = ast_hashtable_iterate(preproc -> macrodefines,
+                                           &position)) != NULL)
+    {
+        verilog_macro_directive * macro = element -> data;
+        verilog_macro_directive * copy  =
+            ast_calloc(1, sizeof(verilog_macro_directive));
+
+        copy -> line        = macro -> line;
+        copy -> macro_id    = ast_intern(macro -> macro_id);
+        copy -> macro_value = ast_strdup(macro -> macro_value);
+        copy -> src_file    = macro -> src_file == NULL ? NULL :
+                              ast_strdup(macro -> src_file);
+
+        ast_hashtable_insert(tr -> macrodefines, copy -> macro_id, copy);
+    }
+
+    ast_region_set_current(previous);
     return tr;
 }
 
@@ -56,10 +140,220 @@ char * verilog_preprocessor_current_file(
     return ast_stack_peek(preproc -> current_file);
 }
 
+//! Defined in the generated flex scanner.
+extern unsigned int verilog_scanner_current_line(
+    void                         * yyscanner,
+    verilog_preprocessor_context * preproc
+);
+
+/*!
+@brief Starts an index of the newlines in the text of a scanner buffer.
+*/
+verilog_line_index * verilog_preprocessor_index_buffer(
+    verilog_preprocessor_context * preproc,
+    void                         * buffer,
+    const char                   * text,
+    size_t                         length,
+    unsigned int                   first_line,
+    size_t                         first_offset
+){
+    verilog_line_index * tr = calloc(1, sizeof(verilog_line_index));
+    tr -> buffer       = buffer;
+    tr -> text         = text;
+    tr -> length       = length;
+    tr -> first_line   = first_line;
+    tr -> first_offset = first_offset;
+
+    ast_list_append(preproc -> line_indexes, tr);
+    return tr;
+}
+
+/*!
+@brief Returns the index of the newlines in the scanner's current buffer, or
+NULL if it has no buffers.
+*/
+verilog_line_index * verilog_preprocessor_current_index(
+    verilog_preprocessor_context * preproc
+){
+    unsigned int count = preproc -> line_indexes -> items;
+    return count > 0 ? ast_list_get(preproc -> line_indexes, count - 1) :
+                       NULL;
+}
+
+/*!
+@brief Returns the line number of a position within the text of an index.
+*/
+unsigned int verilog_line_index_line(
+    verilog_line_index * index,
+    size_t               position
+){
+    if(index -> expansion_end != 0)
+    {
+        return index -> first_line;
+    }
+    else if(position > index -> length)
+    {
+        position = index -> length;
+    }
+
+    if(position >= index -> searched)
+    {
+        // Never search past the position. Flex keeps a NUL in place of the
+        // character after the token it has just matched.
+        while(index -> searched < position)
+        {
+            const char * found = memchr(index -> text + index -> searched,
+                                        '\n', position - index -> searched);
+            if(found == NULL)
+            {
+                index -> searched = position;
+                break;
+            }
+
+            if(index -> count == index -> capacity)
+            {
+                index -> capacity = index -> capacity == 0 ? 1024 :
+                                    index -> capacity * 2;
+                index -> newlines = realloc(index -> newlines,
+                    index -> capacity * sizeof(size_t));
+            }
+
+            index -> searched = (size_t)(found - index -> text) + 1;
+            index -> newlines[index -> count ++] = index -> searched - 1;
+        }
+
+        // Every newline found so far comes before the position.
+        return index -> first_line + (unsigned int)index -> count;
+    }
+
+    // A token was pushed back, so count the newlines before it instead.
+    size_t low  = 0;
+    size_t high = index -> count;
+    while(low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if(index -> newlines[middle] < position)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return index -> first_line + (unsigned int)low;
+}
+
+//! Frees an index of the newlines in a scanner buffer.
+static void verilog_free_line_index(verilog_line_index * index)
+{
+    free(index -> newlines);
+    free(index -> copy);
+    free(index);
+}
+
+/*!
+@brief Unmaps the include files read by a preprocessor context, and frees
+the indexes of any buffers it was still scanning.
+@details Registered with @ref ast_region_at_free on the context's region,
+since these live outside of it.
+*/
+static void verilog_preprocessor_release(void * data)
+{
+    verilog_preprocessor_context * preproc = data;
+
+    unsigned int            position = 0;
+    ast_hashtable_element * element;
+    while((element = ast_hashtable_iterate(preproc -> include_files,
+                                           &position)) != NULL)
+    {
+        verilog_unmap_file(element -> data);
+    }
+
+    verilog_line_index * index;
+    ast_list_foreach(index, preproc -> line_indexes)
+    {
+        verilog_free_line_index(index);
+    }
+}
+
+/*!
+@brief Releases the index of a buffer's newlines once the scanner has
+finished with the buffer.
+*/
+void verilog_preprocessor_release_buffer(
+    verilog_preprocessor_context * preproc,
+    void                         * buffer
+){
+    // Includes nest, so the ones we want are nearly always the last.
+    unsigned int i = preproc -> line_indexes -> items;
+    while(i > 0)
+    {
+        i --;
+        verilog_line_index * index = ast_list_get(preproc -> line_indexes, i);
+        if(index -> buffer == buffer)
+        {
+            ast_list_remove_at(preproc -> line_indexes, i);
+            verilog_free_line_index(index);
+            return;
+        }
+    }
+}
+
+/*!
+@brief Returns the line the context's scanner has reached, or zero if the
+context is not being used to parse anything.
+@param [in] preproc - The context to get the current line for.
+*/
+unsigned int verilog_preprocessor_current_line(
+    verilog_preprocessor_context * preproc
+){
+    if(preproc -> scanner == NULL)
+    {
+        return 0;
+    }
+
+    return verilog_scanner_current_line(preproc -> scanner, preproc);
+}
+
+//! Defined in the generated flex scanner.
+extern size_t verilog_scanner_current_offset(
+    void                         * yyscanner,
+    verilog_preprocessor_context * preproc
+);
+
+/*!
+@brief Returns the byte offset the context's scanner has reached in the
+file it is reading, or zero if the context is not being used to parse
+anything.
+@param [in] preproc - The context to get the current offset for.
+*/
+size_t verilog_preprocessor_current_offset(
+    verilog_preprocessor_context * preproc
+){
+    if(preproc -> scanner == NULL)
+    {
+        return 0;
+    }
+
+    return verilog_scanner_current_offset(preproc -> scanner, preproc);
+}
+
 
 void verilog_free_preprocessor_context(verilog_preprocessor_context * tofree)
 {
-    printf("ERROR: Function not implemented. preprocessor context at %p not freed.\n", tofree);
+    if(tofree == NULL)
+    {
+        return;
+    }
+    else if(tofree == yy_preproc)
+    {
+        yy_preproc = NULL;
+    }
+
+    // The context itself lives inside its own region, and what it holds
+    // outside of it is released by verilog_preprocessor_release.
+    ast_region_free(tofree -> region);
 }
 
 void verilog_preproc_enter_cell_define()
@@ -78,8 +372,8 @@ verilog_default_net_type * verilog_new_default_net_type(
     unsigned int line_number,   //!< Line number of the directive.
     ast_net_type type           //!< The net type.
 ){
-    verilog_default_net_type * tr = 
-        ast_calloc(1,sizeof(verilog_default_net_type));
+    verilog_default_net_type * tr = ast_region_calloc(yy_preproc -> region,
+        1,sizeof(verilog_default_net_type));
 
     tr -> token_number = token_number;
     tr -> line_number  = line_number;
@@ -140,50 +434,490 @@ verilog_include_directive * verilog_preprocessor_include(
     char * filename,
     unsigned int lineNumber
 ){
-    verilog_include_directive * toadd = 
-        ast_calloc(1,sizeof(verilog_include_directive));
+    verilog_include_directive * toadd = ast_region_calloc(yy_preproc->region,
+        1,sizeof(verilog_include_directive));
 
     filename = filename + 1; // Remove leading quote mark.
     size_t length = strlen(filename);
     
-    toadd -> filename = ast_strdup(filename);
+    toadd -> filename = ast_region_strdup(yy_preproc -> region, filename);
     toadd -> filename[length-1] = '\0';
+    toadd -> name       = toadd -> filename;
+    toadd -> parent     = verilog_preprocessor_current_file(yy_preproc);
     toadd -> lineNumber = lineNumber;
 
     ast_list_append(yy_preproc -> includes, toadd);
 
     // Search the possible include paths to find a match.
-    unsigned int d = 0;
-    for(d = 0; d < yy_preproc -> search_dirs -> items; d ++)
+    char * full_name = verilog_preprocessor_find_include(yy_preproc,
+                                                         toadd -> name);
+    if(full_name != NULL)
+    {
+        toadd -> filename   = full_name;
+        toadd -> file_found = AST_TRUE;
+        
+        // Since we are diving into an include file, update the stack of
+        // files currently being parsed.
+        ast_stack_push(yy_preproc -> current_file, full_name);
+
+        // Files go in the file table as they are read, whether or not any
+        // nodes come from them.
+        if(yy_verilog_source_tree != NULL)
+        {
+            verilog_source_tree_add_include(yy_verilog_source_tree,
+                full_name, toadd -> parent, lineNumber);
+        }
+    }
+    else
     {
-        char * dir       = ast_list_get(yy_preproc -> search_dirs, d);
-        size_t dirlen    = strlen(dir)+1;
-        size_t namelen   = strlen(toadd -> filename);
-        char * full_name = ast_calloc(dirlen+namelen, sizeof(char));
+        toadd -> file_found = AST_FALSE;
+    }
 
-        strcat(full_name, dir);
-        strcat(full_name, toadd -> filename);
+    return toadd;
+}
+
+/*!
+@brief Empties the cache of include file paths of a context if its search
+directories have changed since the cache was filled.
+@details The directories are compared by their text, against copies taken
+when the cache was filled, so that strings which are edited in place, or
+freed and their memory reused, are still noticed.
+*/
+static void verilog_preprocessor_check_search_dirs(
+    verilog_preprocessor_context * preproc
+){
+    ast_list   * dirs = preproc -> search_dirs;
+    ast_list   * seen = preproc -> include_dirs;
+    unsigned int i;
 
-        FILE * handle = fopen(full_name,"r");
-        if(handle)
+    if(dirs -> items == seen -> items)
+    {
+        for(i = 0; i < dirs -> items; i ++)
+        {
+            if(strcmp(ast_list_get(dirs, i), ast_list_get(seen, i)) != 0)
+            {
+                break;
+            }
+        }
+        if(i == dirs -> items)
         {
-            fclose(handle);
-            toadd -> filename = full_name;
-            toadd -> file_found = AST_TRUE;
-            
-            // Since we are diving into an include file, update the stack of
-            // files currently being parsed.
-            ast_stack_push(yy_preproc -> current_file, filename);
+            return;
+        }
+    }
+
+    ast_region * previous = ast_region_set_current(preproc -> region);
+
+    preproc -> include_paths = ast_hashtable_new();
+    preproc -> include_dirs  = ast_list_new();
+    for(i = 0; i < dirs -> items; i ++)
+    {
+        ast_list_append(preproc -> include_dirs,
+                        ast_strdup(ast_list_get(dirs, i)));
+    }
+
+    ast_region_set_current(previous);
+}
+
+/*!
+@brief Finds an include file by looking in each of the search directories
+of a context in turn.
+*/
+char * verilog_preprocessor_find_include(
+    verilog_preprocessor_context * preproc,
+    char                         * name
+){
+    verilog_preprocessor_check_search_dirs(preproc);
+
+    // Names which were not found are remembered too, as NULL.
+    char * tr;
+    if(ast_hashtable_get(preproc -> include_paths, name, (void**)&tr) ==
+       HASH_SUCCESS)
+    {
+        return tr;
+    }
 
+    tr = NULL;
+
+    size_t namelen = strlen(name);
+    char * dir;
+    ast_list_foreach(dir, preproc -> search_dirs)
+    {
+        size_t dirlen    = strlen(dir);
+        char * full_name = malloc(dirlen + namelen + 1);
+
+        memcpy(full_name, dir, dirlen);
+        memcpy(full_name + dirlen, name, namelen + 1);
+
+        // One system call, rather than the three of opening and closing.
+        if(access(full_name, R_OK) == 0)
+        {
+            tr = ast_region_strdup(preproc -> region, full_name);
+            free(full_name);
             break;
         }
+        free(full_name);
+    }
+
+    ast_hashtable_insert(preproc -> include_paths,
+                         ast_region_strdup(preproc -> region, name), tr);
+    return tr;
+}
+
+//! Skips white space and comments, returning the offset of what follows.
+static size_t verilog_guard_skip_blank(
+    char   * data,
+    size_t   i,
+    size_t   length
+){
+    while(i < length)
+    {
+        if(isspace((unsigned char)data[i]))
+        {
+            i ++;
+        }
+        else if(data[i] == '/' && data[i+1] == '/')
+        {
+            while(i < length && data[i] != '\n')
+            {
+                i ++;
+            }
+        }
+        else if(data[i] == '/' && data[i+1] == '*')
+        {
+            i += 2;
+            while(i < length && !(data[i] == '*' && data[i+1] == '/'))
+            {
+                i ++;
+            }
+            i += 2;
+        }
         else
-        {   
-            toadd -> file_found = AST_FALSE;
+        {
+            break;
         }
     }
+    return i < length ? i : length;
+}
 
-    return toadd;
+//! Returns the offset of the end of the simple identifier starting at i.
+static size_t verilog_guard_skip_identifier(
+    char   * data,
+    size_t   i,
+    size_t   length
+){
+    if(i < length && (isalpha((unsigned char)data[i]) || data[i] == '_'))
+    {
+        while(i < length && (isalnum((unsigned char)data[i]) ||
+                             data[i] == '_' || data[i] == '$'))
+        {
+            i ++;
+        }
+    }
+    return i;
+}
+
+//! Returns AST_TRUE if the directive starting at data[i] is the one given.
+static ast_boolean verilog_guard_is_directive(
+    char       * data,
+    size_t       i,
+    size_t       end,
+    const char * directive
+){
+    size_t length = strlen(directive);
+    return end - i == length && memcmp(data + i, directive, length) == 0;
+}
+
+/*!
+@brief Finds the macro guarding the whole of an include file, if any.
+@details This is a cut down scanner which only understands comments,
+strings and conditional compilation directives. Anything it is unsure of
+means the file is treated as unguarded, which is always safe.
+@returns The name of the guard macro, allocated from the context's region,
+or NULL if the file is not guarded.
+*/
+static char * verilog_preprocessor_find_guard(
+    verilog_preprocessor_context * preproc,
+    verilog_mapped_file          * file
+){
+    char   * data   = file -> data;
+    size_t   length = file -> length;
+
+    size_t i = verilog_guard_skip_blank(data, 0, length);
+    if(i >= length || data[i] != '`')
+    {
+        return NULL;
+    }
+
+    size_t end = verilog_guard_skip_identifier(data, i + 1, length);
+    if(!verilog_guard_is_directive(data, i, end, "`ifndef"))
+    {
+        return NULL;
+    }
+
+    size_t name     = verilog_guard_skip_blank(data, end, length);
+    size_t name_end = verilog_guard_skip_identifier(data, name, length);
+    if(name_end == name)
+    {
+        return NULL;
+    }
+
+    unsigned int depth = 1;
+    i = name_end;
+    while(i < length)
+    {
+        i = verilog_guard_skip_blank(data, i, length);
+        if(i >= length)
+        {
+            break;
+        }
+        else if(data[i] == '"')
+        {
+            for(i ++; i < length && data[i] != '"' && data[i] != '\n'; i ++)
+            {
+                if(data[i] == '\\')
+                {
+                    i ++;
+                }
+            }
+            i ++;
+        }
+        else if(data[i] == '`')
+        {
+            end = verilog_guard_skip_identifier(data, i + 1, length);
+            if(verilog_guard_is_directive(data, i, end, "`ifdef") ||
+               verilog_guard_is_directive(data, i, end, "`ifndef"))
+            {
+                depth ++;
+            }
+            else if(depth == 1 &&
+                    (verilog_guard_is_directive(data, i, end, "`else") ||
+                     verilog_guard_is_directive(data, i, end, "`elsif")))
+            {
+                return NULL;
+            }
+            else if(verilog_guard_is_directive(data, i, end, "`endif"))
+            {
+                depth --;
+                if(depth == 0)
+                {
+                    // Only allowed to be the last thing in the file.
+                    if(verilog_guard_skip_blank(data, end, length) < length)
+                    {
+                        return NULL;
+                    }
+                    size_t namelen = name_end - name;
+                    char * tr = ast_region_calloc(preproc -> region,
+                                                  namelen + 1, 1);
+                    memcpy(tr, data + name, namelen);
+                    return tr;
+                }
+            }
+            else if(verilog_guard_is_directive(data, i, end, "`define"))
+            {
+                // The body may hold directives which are not run here.
+                while(end < length && data[end] != '\n')
+                {
+                    if(data[end] == '\\' && data[end+1] == '\n')
+                    {
+                        end ++;
+                    }
+                    end ++;
+                }
+            }
+            i = end > i + 1 ? end : i + 1;
+        }
+        else
+        {
+            i ++;
+        }
+    }
+
+    return NULL;
+}
+
+/*!
+@brief Returns the contents of an include file, reading it the first time
+it is asked for and keeping it until the context is freed.
+*/
+verilog_mapped_file * verilog_preprocessor_read_include(
+    verilog_preprocessor_context * preproc,
+    char                         * path
+){
+    verilog_mapped_file * tr;
+    if(ast_hashtable_get(preproc -> include_files, path, (void**)&tr) ==
+       HASH_SUCCESS)
+    {
+        return tr;
+    }
+
+    tr = verilog_map_file(path);
+    if(tr == NULL)
+    {
+        // Not something we can map, like a pipe. Read it the slow way.
+        FILE * file = fopen(path, "r");
+        if(file == NULL)
+        {
+            return NULL;
+        }
+        tr = verilog_read_file(file);
+        fclose(file);
+        if(tr == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    char * key   = ast_region_strdup(preproc -> region, path);
+    char * guard = verilog_preprocessor_find_guard(preproc, tr);
+
+    ast_hashtable_insert(preproc -> include_files, key, tr);
+    if(guard != NULL)
+    {
+        ast_hashtable_insert(preproc -> include_guards, key, guard);
+    }
+    return tr;
+}
+
+/*!
+@brief Checks whether including a file again would add nothing, because
+everything in it is inside an include guard which is already defined.
+*/
+ast_boolean verilog_preprocessor_include_guarded(
+    verilog_preprocessor_context * preproc,
+    char                         * path
+){
+    char * guard;
+    void * macro;
+
+    if(ast_hashtable_get(preproc -> include_guards, path, (void**)&guard) ==
+       HASH_SUCCESS &&
+       ast_hashtable_get(preproc -> macrodefines, guard, &macro) ==
+       HASH_SUCCESS)
+    {
+        return AST_TRUE;
+    }
+    return AST_FALSE;
+}
+
+/*!
+@brief Maps a file into memory, ready to be scanned in place.
+*/
+verilog_mapped_file * verilog_map_file(char * path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t length = (size_t)info.st_size;
+    size_t page   = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped = (length + 2 + page - 1) / page * page;
+
+    // Reserve zeroed memory for the file plus its padding, then map the
+    // file over the front of it. The last page of the file is zero filled
+    // past its end, and any page after that is left as reserved.
+    char * data = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if(length > 0 && mmap(data, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(data, mapped);
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping keeps its own reference to the file.
+    close(fd);
+
+    verilog_mapped_file * tr = calloc(1, sizeof(verilog_mapped_file));
+    tr -> data   = data;
+    tr -> length = length;
+    tr -> mapped = mapped;
+    return tr;
+}
+
+/*!
+@brief Reads the rest of a stream into memory, in the same form as a mapped
+file, for streams which cannot be mapped.
+*/
+verilog_mapped_file * verilog_read_file(FILE * file)
+{
+    size_t   capacity = 65536;
+    size_t   length   = 0;
+    char   * data     = malloc(capacity);
+
+    while(data != NULL)
+    {
+        // Always keep room for the two NULs at the end.
+        if(capacity - length < 3)
+        {
+            char * grown = realloc(data, capacity * 2);
+            if(grown == NULL)
+            {
+                free(data);
+                return NULL;
+            }
+            data      = grown;
+            capacity *= 2;
+        }
+
+        size_t read = fread(data + length, 1, capacity - length - 2, file);
+        if(read == 0)
+        {
+            break;
+        }
+        length += read;
+    }
+
+    if(data == NULL)
+    {
+        return NULL;
+    }
+
+    data[length]     = '\0';
+    data[length + 1] = '\0';
+
+    verilog_mapped_file * tr = calloc(1, sizeof(verilog_mapped_file));
+    tr -> data   = data;
+    tr -> length = length;
+    tr -> mapped = 0;
+    return tr;
+}
+
+/*!
+@brief Releases a mapping made by @ref verilog_map_file, or the contents
+read by @ref verilog_read_file.
+*/
+void verilog_unmap_file(verilog_mapped_file * file)
+{
+    if(file == NULL)
+    {
+        return;
+    }
+
+    if(file -> mapped == 0)
+    {
+        free(file -> data);
+    }
+    else
+    {
+        munmap(file -> data, file -> mapped);
+    }
+    free(file);
 }
 
 /*
@@ -195,8 +929,8 @@ void verilog_preprocessor_macro_define(
     char * macro_text,  //!< The value the macro expands to.
     size_t text_len     //!< Length in bytes of macro_text.
 ){
-    verilog_macro_directive * toadd = 
-        ast_calloc(1, sizeof(verilog_macro_directive));
+    verilog_macro_directive * toadd = ast_region_calloc(yy_preproc -> region,
+        1, sizeof(verilog_macro_directive));
     
     toadd -> line = line;
 
@@ -206,7 +940,8 @@ void verilog_preprocessor_macro_define(
 
     // Make space for, and duplicate, the macro text, into the thing
     // we will put into the hashtable.
-    toadd -> macro_id    = ast_strdup(macro_name);
+    toadd -> macro_id    = ast_region_intern(yy_preproc -> region, macro_name,
+                                             strlen(macro_name));
 
     if(text_len > 0){
         // Make sure we exclude all comments from the macro text.
@@ -221,7 +956,8 @@ void verilog_preprocessor_macro_define(
             }
         }
 
-        toadd -> macro_value = ast_strdup(macro_text);
+        toadd -> macro_value = ast_region_strdup(yy_preproc -> region,
+                                                 macro_text);
     } else {
         toadd -> macro_value = "";
     }
@@ -230,7 +966,11 @@ void verilog_preprocessor_macro_define(
 
     // Set source file of the macro
     char * current_file = verilog_preprocessor_current_file(yy_preproc);
-    toadd -> src_file   = ast_strdup(current_file);
+    if(current_file != NULL)
+    {
+        toadd -> src_file = ast_region_strdup(yy_preproc -> region,
+                                              current_file);
+    }
 
     ast_hashtable_insert(
         yy_preproc -> macrodefines,
@@ -262,8 +1002,9 @@ verilog_preprocessor_conditional_context *
     char        * condition,          //!< The definition to check for.
     int           line_number         //!< Where the `ifdef came from.
 ){
-    verilog_preprocessor_conditional_context * tr = 
-        ast_calloc(1,sizeof(verilog_preprocessor_conditional_context));
+    verilog_preprocessor_conditional_context * tr = ast_region_calloc(
+        yy_preproc -> region,
+        1,sizeof(verilog_preprocessor_conditional_context));
 
     tr -> line_number = line_number;
     tr -> condition   = condition;
@@ -87,6 +87,8 @@ void verilog_preprocessor_nounconnected_drive(
 //! Stores information on an include directive.
 typedef struct verilog_include_directive_t{
     char       * filename;      //!< The file to include.
+    char       * name;          //!< The file as named by the directive.
+    char       * parent;        //!< The file the directive is in.
     unsigned int lineNumber;    //!< The line number of the directive.
     ast_boolean  file_found;    //!< Can we find the file?
 } verilog_include_directive;
@@ -100,6 +102,87 @@ verilog_include_directive * verilog_preprocessor_include(
     unsigned int lineNumber //!< The line number of the directive.
 );
 
+/*!
+@brief A source file mapped into memory so that it can be scanned in place.
+@details The contents are followed by at least two NUL bytes, which is what
+flex's yy_scan_buffer expects to find at the end of a buffer. The mapping is
+private and writable, since the scanner briefly writes NULs into the text
+as it goes. Pages are only copied by the operating system when written to.
+*/
+typedef struct verilog_mapped_file_t{
+    char   * data;      //!< The file contents, then at least two NULs.
+    size_t   length;    //!< Length of the file contents in bytes.
+    size_t   mapped;    //!< Bytes mapped, or zero if read into the heap.
+} verilog_mapped_file;
+
+/*!
+@brief Maps a file into memory, ready to be scanned in place.
+@details The file is mapped directly after a reservation of zeroed memory,
+so the NUL padding costs at most one extra page, rather than a copy of the
+whole file.
+@param [in] path - The file to map.
+@returns The mapping, or NULL if the file cannot be mapped, for example
+because it does not exist or is not a regular file.
+@warning Truncating the file while it is mapped will crash the scanner.
+*/
+verilog_mapped_file * verilog_map_file(char * path);
+
+/*!
+@brief Reads the rest of a stream into memory, in the same form as a mapped
+file, for streams which cannot be mapped.
+@param [in] file - The stream to read. It is not closed.
+@returns The contents, or NULL if there was not enough memory.
+*/
+verilog_mapped_file * verilog_read_file(FILE * file);
+
+/*!
+@brief Releases a mapping made by @ref verilog_map_file, or the contents
+read by @ref verilog_read_file.
+*/
+void verilog_unmap_file(verilog_mapped_file * file);
+
+// ----------------------- Line Numbers ---------------------------------
+
+/*!
+@brief Finds line numbers from the byte offsets the scanner keeps, so that
+it need not count newlines itself.
+@details Each scanner buffer gets an index of the newlines in its text when
+it is pushed, and the indexes are kept in the same order as the scanner's
+stack of buffers. Newlines are found with memchr, only as
+far as the furthest offset asked about so far, so text which comes after
+the last node built is never searched.
+
+The text of a macro expansion is not in any file, so each token in it is
+given the position of the macro use instead: from first_offset up to
+expansion_end, on first_line.
+*/
+typedef struct verilog_line_index_t{
+    void         * buffer;       //!< The scanner buffer the text is in.
+    const char   * text;         //!< The start of the buffer's text.
+    size_t         length;       //!< Length of the text in bytes.
+    unsigned int   first_line;   //!< Line number the text starts on.
+    size_t         first_offset; //!< File offset the text starts at.
+    size_t         expansion_end;//!< Where a macro use ends, or zero.
+    size_t         searched;     //!< Bytes searched for newlines so far.
+    size_t       * newlines;     //!< Positions of the newlines found.
+    size_t         count;        //!< Number of newlines found.
+    size_t         capacity;     //!< Number of entries newlines can hold.
+    char         * copy;         //!< Text copied for the scanner, or NULL.
+} verilog_line_index;
+
+/*!
+@brief Returns the line number of a position within the text of an index.
+@details The scanner only ever moves forwards, other than when it pushes
+back a token, so nearly every call only searches the text the scanner has
+read since the last.
+@param [inout] index - The index to search, and extend.
+@param [in] position - Bytes from the start of the index's text.
+*/
+unsigned int verilog_line_index_line(
+    verilog_line_index * index,
+    size_t               position
+);
+
 // ----------------------- `define Directives ---------------------------
 
 /*!
@@ -211,6 +294,13 @@ typedef struct verilog_preprocessor_context_t{
     ast_primitive_strength unconnected_drive_pull; //!< nounconnectedrive
     ast_stack     * ifdefs;         //!< Storage for conditional compile stack.
     ast_list      * search_dirs;    //!< Where to look for include files.
+    ast_region    * region;         //!< Owns all memory for the context.
+    void          * scanner;        //!< The scanner reading input, if any.
+    ast_hashtable * include_paths;  //!< Include names already looked for.
+    ast_list      * include_dirs;   //!< Copy of search_dirs when they were.
+    ast_hashtable * include_files;  //!< Contents of include files, by path.
+    ast_hashtable * include_guards; //!< Guard macro of include files, by path.
+    ast_list      * line_indexes;   //!< Newlines of each scanner buffer.
 } verilog_preprocessor_context;
 
 
@@ -222,17 +312,33 @@ default directives. For example, if I was writing my own simulated and
 wanted to add my own "__IS_MY_SIMULATOR__" pre-defined macro, it can be
 done by accessing this variable, and using the 
 verilog_preprocessor_macro_define function.
-@note This is a global variable. Treat it with care!
+@note This is a global variable. Treat it with care! Each thread has its
+own, which the parse functions point at the preprocessor of the parser
+context being used.
 */
-extern verilog_preprocessor_context * yy_preproc;
+extern AST_THREAD_LOCAL verilog_preprocessor_context * yy_preproc;
 
 
 /*!
 @brief Creates a new pre-processor context.
-@details This is called *once* at the beginning of a parse call.
+@details This is called *once* at the beginning of a parse call. The context
+gets a memory region of its own, from which all macro definitions, include
+records and file names are allocated.
 */
 verilog_preprocessor_context * verilog_new_preprocessor_context();
 
+/*!
+@brief Creates a new pre-processor context in the same state as another.
+@details Macro definitions, the timescale, default net types, include
+search directories and the like are all copied into the new context's own
+region, so it stays valid after the original is freed. Nothing about any
+file being parsed is copied.
+@param [in] preproc - The context to copy.
+*/
+verilog_preprocessor_context * verilog_preprocessor_snapshot(
+    verilog_preprocessor_context * preproc
+);
+
 /*!
 @brief Clears the stack of files being parsed, and sets the current file to
 the supplied string.
@@ -252,8 +358,117 @@ char * verilog_preprocessor_current_file(
     verilog_preprocessor_context * preproc
 );
 
+/*!
+@brief Returns the line the context's scanner has reached, or zero if the
+context is not being used to parse anything.
+@param [in] preproc - The context to get the current line for.
+*/
+unsigned int verilog_preprocessor_current_line(
+    verilog_preprocessor_context * preproc
+);
+
+/*!
+@brief Returns the byte offset the context's scanner has reached in the
+file it is reading, or zero if the context is not being used to parse
+anything.
+@param [in] preproc - The context to get the current offset for.
+*/
+size_t verilog_preprocessor_current_offset(
+    verilog_preprocessor_context * preproc
+);
+
+/*!
+@brief Finds an include file by looking in each of the search directories
+of a context in turn.
+@details Each name is only looked for once, unless the search directories
+are changed, after which every name is looked for again.
+@param [in] preproc - The context whose search directories are used.
+@param [in] name - The file named by the include directive.
+@returns The path of the first match, allocated from the context's region,
+or NULL if there is none.
+*/
+char * verilog_preprocessor_find_include(
+    verilog_preprocessor_context * preproc,
+    char                         * name
+);
+
+/*!
+@brief Returns the contents of an include file, reading it the first time
+it is asked for and keeping it until the context is freed.
+@details A header included by every file of a design is only opened and
+mapped once per context. Files are assumed not to change while a context
+is being used.
+@param [inout] preproc - The context to keep the contents in.
+@param [in] path - The path of the file, as found by
+@ref verilog_preprocessor_find_include.
+@returns The contents, or NULL if the file cannot be read. They are owned
+by the context, and must not be unmapped.
+*/
+verilog_mapped_file * verilog_preprocessor_read_include(
+    verilog_preprocessor_context * preproc,
+    char                         * path
+);
+
+/*!
+@brief Checks whether including a file again would add nothing, because
+everything in it is inside an include guard which is already defined.
+@details A file is guarded if, ignoring comments and white space, it starts
+with an `ifndef directive and ends with the matching `endif, with no `else
+or `elsif between them. Guards are found when the file is first read by
+@ref verilog_preprocessor_read_include, so the file need not be opened
+again to skip it.
+@param [in] preproc - The context the file was read by.
+@param [in] path - The path of the file, as found by
+@ref verilog_preprocessor_find_include.
+@returns AST_TRUE if the file may be skipped, AST_FALSE if it has not been
+read yet, is not guarded, or its guard macro is not defined.
+*/
+ast_boolean verilog_preprocessor_include_guarded(
+    verilog_preprocessor_context * preproc,
+    char                         * path
+);
+
+/*!
+@brief Starts an index of the newlines in the text of a scanner buffer.
+@param [inout] preproc - The context to keep the index in.
+@param [in] buffer - The scanner buffer.
+@param [in] text - The start of the buffer's text.
+@param [in] length - Length of the text in bytes.
+@param [in] first_line - The line number the text starts on.
+@param [in] first_offset - The scanner's offset at the start of the text.
+Offsets in macro expansions count on from the use of the macro.
+*/
+verilog_line_index * verilog_preprocessor_index_buffer(
+    verilog_preprocessor_context * preproc,
+    void                         * buffer,
+    const char                   * text,
+    size_t                         length,
+    unsigned int                   first_line,
+    size_t                         first_offset
+);
+
+/*!
+@brief Returns the index of the newlines in the scanner's current buffer, or
+NULL if it has no buffers.
+*/
+verilog_line_index * verilog_preprocessor_current_index(
+    verilog_preprocessor_context * preproc
+);
+
+/*!
+@brief Releases the index of a buffer's newlines once the scanner has
+finished with the buffer, along with any copy of the text made for it.
+@param [inout] preproc - The context the index is kept in.
+@param [in] buffer - The scanner buffer which has just been deleted.
+*/
+void verilog_preprocessor_release_buffer(
+    verilog_preprocessor_context * preproc,
+    void                         * buffer
+);
+
 /*!
 @brief Frees a preprocessor context and all child constructs.
+@details Releases the memory region owned by the context.
 */
 void verilog_free_preprocessor_context(
     verilog_preprocessor_context * tofree
@@ -0,0 +1,2360 @@
+/*!
+@file parser_checks.c
+@brief Checks of what the parser puts in the tree, for behaviour which can't
+be seen just from whether a file parses.
+@details Each check writes the files it needs to a scratch directory, parses
+them, and looks at the result. The program exits with a non-zero status if
+any check fails.
+*/
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "verilog_ast.h"
+#include "verilog_ast_image.h"
+#include "verilog_ast_util.h"
+#include "verilog_parse_cache.h"
+#include "verilog_parser.h"
+#include "verilog_preprocessor.h"
+
+//! Number of checks which have failed so far.
+static int failures = 0;
+
+//! Directory the files for the checks are written to.
+static char scratch[] = "/tmp/verilog-parser-checks-XXXXXX";
+
+//! The same directory, as an include search directory.
+static char search_dir[sizeof(scratch) + 1];
+
+//! Paths of the files and directories made, so they can be removed again.
+static char * written[64];
+static int    written_count = 0;
+
+#define CHECK(condition, ...) {                                 \
+    if(!(condition)) {                                          \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);             \
+        printf(__VA_ARGS__);                                    \
+        printf("\n");                                           \
+        failures ++;                                            \
+    }                                                           \
+}
+
+/*!
+@brief Writes a file to the scratch directory.
+@returns The full path of the file.
+*/
+static char * write_file(const char * name, const char * text)
+{
+    char * path = malloc(strlen(scratch) + strlen(name) + 2);
+    sprintf(path, "%s/%s", scratch, name);
+
+    FILE * fh = fopen(path, "w");
+    if(fh == NULL)
+    {
+        printf("Could not write %s\n", path);
+        exit(1);
+    }
+    fputs(text, fh);
+    fclose(fh);
+
+    written[written_count ++] = path;
+    return path;
+}
+
+/*!
+@brief Makes a directory inside the scratch directory.
+@returns The full path of the directory, ending in a slash.
+*/
+static char * make_dir(const char * name)
+{
+    char * path = malloc(strlen(scratch) + strlen(name) + 3);
+    sprintf(path, "%s/%s", scratch, name);
+
+    if(mkdir(path, 0700) != 0)
+    {
+        printf("Could not make %s\n", path);
+        exit(1);
+    }
+
+    written[written_count ++] = path;
+
+    char * tr = malloc(strlen(path) + 2);
+    sprintf(tr, "%s/", path);
+    return tr;
+}
+
+/*!
+@brief Finds a net declared in a module, by name.
+@returns The declaration, or NULL if there is none.
+*/
+static ast_net_declaration * find_net(
+    ast_module_declaration * module,
+    const char             * name
+){
+    unsigned int i;
+    for(i = 0; i < module -> net_declarations -> items; i ++)
+    {
+        ast_net_declaration * net = ast_list_get(module -> net_declarations,
+                                                 i);
+        if(strcmp(ast_identifier_tostring(net -> identifier), name) == 0)
+        {
+            return net;
+        }
+    }
+    return NULL;
+}
+
+/*!
+@brief Gives the path of the file some node metadata points at.
+*/
+static char * file_of(verilog_source_tree * tree, ast_metadata * meta)
+{
+    ast_source_file * file = verilog_source_tree_get_file(tree, meta -> file);
+    return file == NULL ? "(none)" : file -> path;
+}
+
+/*!
+@brief Checks that region blocks are aligned and zeroed, that they grow
+in place only when they can, and that reset and adopted regions can still
+be allocated from and read.
+*/
+static void check_region(void)
+{
+    ast_region * region = ast_region_new();
+    size_t       big_size = AST_REGION_MIN_CHUNK / 2 + 4096;
+    size_t       i;
+
+    char * first  = ast_region_calloc(region, 1, 3);
+    char * second = ast_region_calloc(region, 1, 5);
+    CHECK(((size_t)first  % AST_REGION_ALIGN) == 0 &&
+          ((size_t)second % AST_REGION_ALIGN) == 0,
+          "region blocks are not aligned");
+
+    // The last block grows in place while its chunk has room.
+    memset(second, 'b', 5);
+    char * grown = ast_region_realloc(region, second, 5, 100);
+#ifndef VERILOG_PARSER_MALLOC_DEBUG
+    CHECK(grown == second, "the last block was not grown in place");
+#endif
+    CHECK(grown[4] == 'b' && grown[5] == 0 && grown[99] == 0,
+          "the grown block was not kept and zeroed");
+
+    // Fill most of the first chunk, so that the next block is big enough
+    // to be given a chunk of its own, behind the current one.
+    char * filler = ast_region_realloc(region, grown, 100,
+                                       AST_REGION_MIN_CHUNK - 4096);
+    char * big    = ast_region_calloc(region, 1, big_size);
+    CHECK(filler != NULL && big != NULL, "region allocation failed");
+    for(i = 0; i < big_size; i ++)
+    {
+        big[i] = (char)i;
+    }
+
+    // The big block is the last one, but must not be grown as if it was in
+    // the current chunk.
+    size_t new_size = AST_REGION_MAX_CHUNK / 4;
+    char * moved = ast_region_realloc(region, big,
+                                      big_size, new_size);
+    CHECK(moved != NULL, "the big block could not be grown");
+    if(moved != NULL)
+    {
+        size_t wrong = 0;
+        for(i = 0; i < big_size; i ++)
+        {
+            wrong += moved[i] != (char)i;
+        }
+        for(; i < new_size; i ++)
+        {
+            wrong += moved[i] != 0;
+        }
+        CHECK(wrong == 0, "%zu bytes of the grown big block are wrong",
+              wrong);
+
+        char * after = ast_region_calloc(region, 1, 1024);
+        CHECK(after != NULL && (after + 1024 <= moved ||
+                                after >= moved + new_size),
+              "a later block overlaps the grown big block");
+    }
+
+    // A reset region is empty, but can be allocated from again.
+    ast_region_reset(region);
+    CHECK(region -> allocations == 0 && region -> allocated == 0,
+          "the reset region still counts %zu allocations",
+          (size_t)region -> allocations);
+    char * again = ast_region_calloc(region, 1, 64);
+    CHECK(again != NULL && again[63] == 0,
+          "the reset region could not be allocated from");
+
+    // An adopted region lives as long as its parent.
+    ast_region * child = ast_region_new();
+    char       * text  = ast_region_strdup(child, "adopted");
+    ast_region_adopt(region, child);
+    CHECK(strcmp(text, "adopted") == 0, "the adopted region was released");
+
+    ast_region_free(region);
+}
+
+/*!
+@brief Counts the elements of a hash table which could not be found by
+probing from their home slot, because an empty slot comes first.
+*/
+static unsigned int hashtable_unreachable(ast_hashtable * table)
+{
+    unsigned int mask = table -> capacity - 1;
+    unsigned int tr   = 0;
+    unsigned int slot;
+
+    for(slot = 0; slot < table -> capacity; slot ++)
+    {
+        if(table -> elements[slot].key == NULL)
+        {
+            continue;
+        }
+
+        unsigned int at = table -> elements[slot].hash & mask;
+        while(at != slot && table -> elements[at].key != NULL)
+        {
+            at = (at + 1) & mask;
+        }
+        tr += at != slot;
+    }
+    return tr;
+}
+
+/*!
+@brief Checks that a hash table finds every key as it grows, that deleting
+keys shifts the others back so none are lost behind an empty slot, and that
+reserving room stops it growing.
+*/
+static void check_hashtable(void)
+{
+    ast_region   * region   = ast_region_new();
+    ast_region   * previous = ast_region_set_current(region);
+    unsigned int   count    = 5000;
+    char        ** keys     = ast_calloc(count, sizeof(char*));
+    unsigned int   i;
+
+    ast_hashtable * table = ast_hashtable_new();
+    for(i = 0; i < count; i ++)
+    {
+        char key[16];
+        sprintf(key, "key_%u", i);
+        keys[i] = ast_strdup(key);
+        ast_hashtable_insert(table, keys[i], keys[i]);
+    }
+
+    unsigned int capacity = ast_hashtable_capacity(table);
+    CHECK(table -> size == count && (capacity & (capacity - 1)) == 0 &&
+          count <= capacity - capacity / 4,
+          "%u keys are in %u slots", table -> size, capacity);
+    CHECK(ast_hashtable_insert(table, keys[7], NULL) == HASH_KEY_COLLISION,
+          "a key was inserted twice");
+
+    unsigned int missing = 0;
+    for(i = 0; i < count; i ++)
+    {
+        void * value = NULL;
+        missing += ast_hashtable_get(table, keys[i], &value) != HASH_SUCCESS ||
+                   value != keys[i];
+    }
+    CHECK(missing == 0, "%u keys were lost as the table grew", missing);
+
+    // Delete every other key, which leaves gaps all through the probe runs.
+    for(i = 0; i < count; i += 2)
+    {
+        ast_hashtable_delete(table, keys[i]);
+    }
+
+    unsigned int wrong = 0;
+    for(i = 0; i < count; i ++)
+    {
+        void * value = NULL;
+        wrong += (ast_hashtable_get(table, keys[i], &value) == HASH_SUCCESS)
+                 != (i % 2 == 1);
+    }
+    CHECK(wrong == 0, "%u keys were wrongly found or lost after deleting",
+          wrong);
+    CHECK(table -> size == count / 2, "%u keys are left, not %u",
+          table -> size, count / 2);
+    CHECK(hashtable_unreachable(table) == 0,
+          "%u keys are behind an empty slot after deleting",
+          hashtable_unreachable(table));
+    CHECK(ast_hashtable_delete(table, keys[0]) == HASH_KEY_NOT_FOUND,
+          "a key was deleted twice");
+
+    unsigned int            position = 0;
+    unsigned int            visited  = 0;
+    ast_hashtable_element * element;
+    while((element = ast_hashtable_iterate(table, &position)) != NULL)
+    {
+        visited ++;
+    }
+    CHECK(visited == count / 2, "iterating visited %u keys, not %u",
+          visited, count / 2);
+
+    // A table with room reserved does not grow while it is filled.
+    ast_hashtable * reserved = ast_hashtable_new();
+    ast_hashtable_reserve(reserved, count);
+    capacity = ast_hashtable_capacity(reserved);
+    for(i = 0; i < count; i ++)
+    {
+        ast_hashtable_insert(reserved, keys[i], keys[i]);
+    }
+    CHECK(ast_hashtable_capacity(reserved) == capacity,
+          "the reserved table grew from %u to %u slots", capacity,
+          ast_hashtable_capacity(reserved));
+
+    ast_hashtable_free(reserved);
+    ast_hashtable_free(table);
+    ast_region_set_current(previous);
+    ast_region_free(region);
+}
+
+/*!
+@brief Checks that a list gives the same items as a plain array does after
+a long run of appends, preappends, inserts and removals, including ones
+which make it grow at either end.
+*/
+static void check_list_edits(void)
+{
+    ast_region   * region   = ast_region_new();
+    ast_region   * previous = ast_region_set_current(region);
+    ast_list     * list     = ast_list_new();
+    size_t         limit    = 4096;
+    size_t       * model    = calloc(limit, sizeof(size_t));
+    unsigned int   count    = 0;
+    unsigned int   seed     = 1;
+    unsigned int   step;
+
+    for(step = 0; step < 20000; step ++)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned int choice = (seed >> 16) % 8;
+        unsigned int at     = count > 0 ? (seed >> 8) % (count + 1) : 0;
+        size_t       value  = step + 1;
+
+        if(choice < 5 && count + 1 < limit)
+        {
+            if(choice < 2)
+            {
+                ast_list_append(list, (void*)value);
+                at = count;
+            }
+            else if(choice < 4)
+            {
+                ast_list_preappend(list, (void*)value);
+                at = 0;
+            }
+            else
+            {
+                ast_list_insert_at(list, at, (void*)value);
+            }
+            memmove(model + at + 1, model + at, (count - at) * sizeof(size_t));
+            model[at] = value;
+            count ++;
+        }
+        else if(count > 0)
+        {
+            at = at % count;
+            ast_list_remove_at(list, at);
+            memmove(model + at, model + at + 1,
+                    (count - at - 1) * sizeof(size_t));
+            count --;
+        }
+    }
+
+    unsigned int wrong = 0;
+    unsigned int i;
+    for(i = 0; i < count; i ++)
+    {
+        wrong += (size_t)ast_list_get(list, i) != model[i];
+    }
+    CHECK(list -> items == count && wrong == 0,
+          "%u of %u items of the edited list are wrong", wrong, count);
+    CHECK(ast_list_get(list, count) == NULL,
+          "an item was found past the end of the list");
+
+    // Inserting past the end appends.
+    ast_list_insert_at(list, count + 10, (void*)1);
+    CHECK(list -> items == count + 1 && ast_list_get(list, count) == (void*)1,
+          "inserting past the end of the list did not append");
+
+    ast_list * tail = ast_list_new();
+    ast_list_append(tail, (void*)2);
+    ast_list_append(tail, (void*)3);
+    ast_list_concat(list, tail);
+    CHECK(list -> items == count + 3 &&
+          ast_list_get(list, count + 2) == (void*)3 && tail -> items == 2,
+          "concatenating lists went wrong");
+    CHECK(ast_list_contains(list, (void*)3) &&
+          !ast_list_contains(list, (void*)(size_t)(step + 1)),
+          "the list does not know what it contains");
+
+    free(model);
+    ast_region_set_current(previous);
+    ast_region_free(region);
+}
+
+/*!
+@brief Walks a list of numbers many times with nested loops, as each of the
+threads in check_list_iterators does.
+@returns The sum of every pair of items, per walk, or zero if the walks did
+not all agree.
+*/
+static void * walk_list(void * data)
+{
+    ast_list * list = data;
+    size_t     tr   = 0;
+    int        walk;
+
+    for(walk = 0; walk < 50; walk ++)
+    {
+        void * outer_item;
+        void * inner_item;
+        size_t sum = 0;
+
+        ast_list_foreach(outer_item, list)
+        {
+            ast_list_foreach(inner_item, list)
+            {
+                sum += (size_t)outer_item * (size_t)inner_item;
+            }
+        }
+
+        if(walk > 0 && sum != tr)
+        {
+            return (void*)0;
+        }
+        tr = sum;
+    }
+    return (void*)tr;
+}
+
+/*!
+@brief Checks that iterators over the same list, nested or in different
+threads, do not disturb each other, and that empty lists are walked
+without touching their items.
+*/
+static void check_list_iterators(void)
+{
+    ast_region * region   = ast_region_new();
+    ast_region * previous = ast_region_set_current(region);
+    ast_list   * list     = ast_list_new();
+    ast_list   * empty    = ast_list_new();
+    size_t       expected = 0;
+    size_t       i;
+
+    for(i = 1; i <= 300; i ++)
+    {
+        ast_list_append(list, (void*)i);
+        expected += i;
+    }
+    expected *= expected;
+
+    void * item;
+    int    visited = 0;
+    ast_list_foreach(item, empty)
+    {
+        (void)item;
+        visited ++;
+    }
+    CHECK(visited == 0 && ast_list_iterator_done(ast_list_begin(empty)),
+          "an empty list had %d items to walk", visited);
+
+    pthread_t threads[4];
+    void    * sums[4];
+    for(i = 0; i < 4; i ++)
+    {
+        pthread_create(&threads[i], NULL, walk_list, list);
+    }
+    for(i = 0; i < 4; i ++)
+    {
+        pthread_join(threads[i], &sums[i]);
+        CHECK((size_t)sums[i] == expected,
+              "thread %zu summed the list to %zu, not %zu", i,
+              (size_t)sums[i], expected);
+    }
+
+    ast_region_set_current(previous);
+    ast_region_free(region);
+}
+
+/*!
+@brief Checks that declarations after an include guard has stopped a file
+being read again still belong to the including file.
+*/
+static void check_guarded_include(void)
+{
+    write_file("guarded.vh",
+        "`ifndef GUARDED_VH\n"
+        "`define GUARDED_VH\n"
+        "wire from_header;\n"
+        "`endif\n");
+
+    char * top = write_file("guarded.v",
+        "module guarded();\n"
+        "`include \"guarded.vh\"\n"
+        "`include \"guarded.vh\"\n"
+        "wire after_second;\n"
+        "wire last;\n"
+        "endmodule\n");
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    ast_list_append(context -> preprocessor -> search_dirs, search_dir);
+
+    int result = verilog_parse_path_r(context, top);
+    CHECK(result == 0, "%s did not parse", top);
+
+    verilog_source_tree * tree = context -> source_tree;
+    CHECK(tree -> modules -> items == 1, "expected one module");
+    if(result != 0 || tree -> modules -> items != 1)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    ast_module_declaration * module = ast_list_get(tree -> modules, 0);
+    ast_net_declaration    * after  = find_net(module, "after_second");
+
+    CHECK(after != NULL, "after_second is missing");
+    if(after != NULL)
+    {
+        CHECK(strcmp(file_of(tree, &after -> meta), top) == 0,
+              "after_second comes from %s, not %s",
+              file_of(tree, &after -> meta), top);
+
+        ast_line line = verilog_source_tree_get_line(tree, &after -> meta);
+        CHECK(line == 4, "after_second is on line %d, not 4", line);
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that changing the text of a search directory, without
+changing the list it is in, makes include files be looked for again.
+*/
+static void check_search_dir_edited(void)
+{
+    char * dir_a = make_dir("a");
+    char * dir_b = make_dir("b");
+    write_file("b/only_in_b.vh", "wire from_b;\n");
+
+    char * top = write_file("search.v",
+        "module search();\n"
+        "`include \"only_in_b.vh\"\n"
+        "endmodule\n");
+
+    verilog_parser_context       * context = verilog_new_parser_context();
+    verilog_preprocessor_context * preproc = context -> preprocessor;
+
+    // Edited in place below, so the list holds the same pointer throughout.
+    char search[256];
+    strcpy(search, dir_a);
+    ast_list_append(preproc -> search_dirs, search);
+
+    verilog_parse_path_r(context, top);
+    verilog_include_directive * first = ast_list_get(preproc -> includes,
+        preproc -> includes -> items - 1);
+    CHECK(first -> file_found == AST_FALSE,
+          "only_in_b.vh should not be found in %s", dir_a);
+
+    strcpy(search, dir_b);
+
+    verilog_parse_path_r(context, top);
+    verilog_include_directive * second = ast_list_get(preproc -> includes,
+        preproc -> includes -> items - 1);
+    CHECK(second != first && second -> file_found == AST_TRUE,
+          "only_in_b.vh should be found once the search path is %s", dir_b);
+
+    verilog_free_parser_context(context);
+    free(dir_a);
+    free(dir_b);
+}
+
+/*!
+@brief Checks that the digits of a number do not run on into the token
+after it, which the parser has usually read by the time it uses them.
+*/
+static void check_number_text(void)
+{
+    char * top = write_file("number.v",
+        "module number();\n"
+        "wire a;\n"
+        "assign a = 12;\n"
+        "assign a = 4'hF;\n"
+        "endmodule\n");
+
+    const char * expected[] = {"12", "F"};
+
+    verilog_parser_context * context = verilog_new_parser_context();
+
+    int result = verilog_parse_path_r(context, top);
+    CHECK(result == 0, "%s did not parse", top);
+
+    verilog_source_tree * tree = context -> source_tree;
+    if(result != 0 || tree -> modules -> items != 1)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    ast_module_declaration * module = ast_list_get(tree -> modules, 0);
+    unsigned int i;
+
+    CHECK(module -> continuous_assignments -> items == 2,
+          "expected two assignments");
+
+    for(i = 0; i < module -> continuous_assignments -> items && i < 2; i ++)
+    {
+        ast_continuous_assignment * assign =
+            ast_list_get(module -> continuous_assignments, i);
+        ast_single_assignment     * single =
+            ast_list_get(assign -> assignments, 0);
+        ast_primary               * value  = single -> expression -> primary;
+
+        CHECK(value != NULL && value -> value_type == PRIMARY_NUMBER,
+              "assignment %u is not of a number", i);
+        if(value != NULL && value -> value_type == PRIMARY_NUMBER)
+        {
+            CHECK(strcmp(value -> value.number -> as_bits, expected[i]) == 0,
+                  "number has digits \"%s\", not \"%s\"",
+                  value -> value.number -> as_bits, expected[i]);
+        }
+    }
+
+    verilog_free_parser_context(context);
+}
+
+//! What check_token_offsets needs to look at each token.
+typedef struct token_text_t{
+    const char          * text;       //!< The text which was tokenized.
+    verilog_source_tree * tree;       //!< The tree tokens were read into.
+    unsigned int          count;      //!< Tokens seen.
+    unsigned int          mismatched; //!< Tokens whose offset is wrong.
+    unsigned int          misplaced;  //!< Tokens whose line is wrong.
+} token_text;
+
+/*!
+@brief Checks that a token's offset and length give back its text, and that
+its line is the one its offset is on, as the source tree counts lines.
+*/
+static int check_token_text(verilog_token * token, char * text, void * data)
+{
+    token_text   * seen = data;
+    ast_metadata   meta;
+    unsigned int   line = 1;
+    size_t         i;
+
+    seen -> count ++;
+    if(strlen(text) != token -> length ||
+       strncmp(seen -> text + token -> offset, text, token -> length) != 0)
+    {
+        seen -> mismatched ++;
+    }
+
+    for(i = 0; i < token -> offset; i ++)
+    {
+        line += seen -> text[i] == '\n';
+    }
+
+    memset(&meta, 0, sizeof(ast_metadata));
+    meta.file   = token -> file;
+    meta.offset = token -> offset;
+    if(token -> line != line ||
+       verilog_source_tree_get_line(seen -> tree, &meta) != (ast_line)line)
+    {
+        seen -> misplaced ++;
+    }
+    return 0;
+}
+
+/*!
+@brief Checks that the offsets of tokens are those of their text, including
+after a token has been pushed back to be scanned again.
+*/
+static void check_token_offsets(void)
+{
+    const char * text =
+        "module offsets(input a, output b);\n"
+        "  assign b = a;\n"
+        "  always @(a) begin\n"
+        "    if(a) $display(\"%d\", 4'b1010);\n"
+        "  end\n"
+        "endmodule\n";
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    token_text seen = {text, context -> source_tree, 0, 0, 0};
+
+    int result = verilog_tokenize_string(context, (char*)text,
+                                         (int)strlen(text),
+                                         check_token_text, &seen);
+
+    CHECK(result == 0, "tokenizing stopped early");
+    CHECK(seen.count > 0, "no tokens were read");
+    CHECK(seen.mismatched == 0, "%u of %u tokens have the wrong offset",
+          seen.mismatched, seen.count);
+    CHECK(seen.misplaced == 0, "%u of %u tokens have the wrong line",
+          seen.misplaced, seen.count);
+
+    verilog_free_parser_context(context);
+
+    // The same, read from a file.
+    char * path = write_file("offsets.v", text);
+    context = verilog_new_parser_context();
+    token_text from_file = {text, context -> source_tree, 0, 0, 0};
+
+    result = verilog_tokenize_path(context, path, check_token_text,
+                                   &from_file);
+    CHECK(result == 0 && from_file.count == seen.count,
+          "%s gave %u tokens, not %u", path, from_file.count, seen.count);
+    CHECK(from_file.mismatched == 0 && from_file.misplaced == 0,
+          "%u of the tokens of %s are in the wrong place",
+          from_file.mismatched + from_file.misplaced, path);
+
+    verilog_free_parser_context(context);
+
+    // Skeleton mode pushes back the token after a skipped construct.
+    ast_skipped_construct * construct = NULL;
+    context = verilog_new_parser_context();
+    context -> skeleton = AST_TRUE;
+
+    result = verilog_parse_string_r(context, (char*)text, (int)strlen(text));
+    CHECK(result == 0, "skeleton parse failed");
+
+    if(result == 0 && context -> source_tree -> modules -> items == 1)
+    {
+        ast_module_declaration * module = ast_list_get(
+            context -> source_tree -> modules, 0);
+        if(module -> skipped_constructs -> items > 0)
+        {
+            construct = ast_list_get(module -> skipped_constructs, 0);
+        }
+    }
+
+    CHECK(construct != NULL, "the always block was not skipped");
+    if(construct != NULL)
+    {
+        CHECK(strncmp(text + construct -> start, "always", 6) == 0 &&
+              strncmp(text + construct -> end - 3, "end", 3) == 0,
+              "the skipped construct is at %zu-%zu, not the always block",
+              construct -> start, construct -> end);
+        CHECK(construct -> meta.offset == construct -> start &&
+              construct -> meta.offset + construct -> meta.length ==
+                  construct -> end,
+              "the skipped construct's metadata is not its span");
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that nodes record where they start and end, and that lines
+and columns are found from that.
+*/
+static void check_node_positions(void)
+{
+    const char * text =
+        "module positions();\n"
+        "wire first;\n"
+        "  wire [3:0] second;\n"
+        "endmodule\n";
+
+    char * top = write_file("positions.v", text);
+
+    verilog_parser_context * context = verilog_new_parser_context();
+
+    int result = verilog_parse_path_r(context, top);
+    CHECK(result == 0, "%s did not parse", top);
+
+    verilog_source_tree * tree = context -> source_tree;
+    if(result != 0 || tree -> modules -> items != 1)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    CHECK(verilog_source_tree_file_count(tree) == 1,
+          "expected one file, not %u", verilog_source_tree_file_count(tree));
+    CHECK(strcmp(file_of(tree, &((ast_module_declaration*)ast_list_get(
+              tree -> modules, 0)) -> meta), top) == 0,
+          "the module is not from %s", top);
+
+    ast_module_declaration * module = ast_list_get(tree -> modules, 0);
+    ast_net_declaration    * second = find_net(module, "second");
+
+    CHECK(second != NULL, "second is missing");
+    if(second != NULL)
+    {
+        ast_metadata * meta = &second -> meta;
+        const char   * from = text + meta -> offset;
+
+        CHECK(meta -> offset + meta -> length <= strlen(text) &&
+              strstr(from, "second") != NULL &&
+              strstr(from, "second") + 6 <= from + meta -> length,
+              "second is at %zu, length %u", meta -> offset, meta -> length);
+
+        ast_line     line   = verilog_source_tree_get_line(tree, meta);
+        unsigned int column = verilog_source_tree_get_column(tree, meta);
+        CHECK(line == 3, "second is on line %d, not 3", line);
+        CHECK(column == (unsigned int)(meta -> offset - 32) + 1,
+              "second is in column %u", column);
+    }
+
+    verilog_free_parser_context(context);
+
+    // Text parsed from memory gets an entry of its own.
+    context = verilog_new_parser_context();
+    result  = verilog_parse_string_r(context, (char*)text, (int)strlen(text));
+    CHECK(result == 0, "the string did not parse");
+
+    tree = context -> source_tree;
+    if(result == 0 && tree -> modules -> items == 1)
+    {
+        module = ast_list_get(tree -> modules, 0);
+        second = find_net(module, "second");
+        CHECK(second != NULL &&
+              verilog_source_tree_get_line(tree, &second -> meta) == 3,
+              "second is not on line 3 of the string");
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that merging trees with file tables of their own gives their
+nodes the ids their files have in the tree merged into.
+*/
+static void check_merged_files(void)
+{
+    char * first  = write_file("merge_a.v", "module merge_a();\nendmodule\n");
+    char * second = write_file("merge_b.v",
+                               "\n\nmodule merge_b();\nendmodule\n");
+
+    verilog_parser_context * a = verilog_new_parser_context();
+    verilog_parser_context * b = verilog_new_parser_context();
+
+    CHECK(verilog_parse_path_r(a, first) == 0, "%s did not parse", first);
+    CHECK(verilog_parse_path_r(b, second) == 0, "%s did not parse", second);
+
+    // Both files have id 1 in their own tables.
+    verilog_source_tree_merge(a -> source_tree, b -> source_tree);
+    b -> source_tree = NULL;
+
+    verilog_source_tree * tree = a -> source_tree;
+    CHECK(verilog_source_tree_file_count(tree) == 2,
+          "expected two files, not %u", verilog_source_tree_file_count(tree));
+
+    if(tree -> modules -> items == 2)
+    {
+        ast_module_declaration * merged = ast_list_get(tree -> modules, 1);
+        CHECK(strcmp(file_of(tree, &merged -> meta), second) == 0,
+              "merge_b comes from %s, not %s",
+              file_of(tree, &merged -> meta), second);
+        CHECK(strcmp(file_of(tree, &merged -> identifier -> meta),
+                     second) == 0,
+              "the name of merge_b comes from %s, not %s",
+              file_of(tree, &merged -> identifier -> meta), second);
+        CHECK(verilog_source_tree_get_line(tree, &merged -> meta) == 3,
+              "merge_b is not on line 3");
+    }
+    else
+    {
+        CHECK(0, "expected two modules");
+    }
+
+    verilog_free_parser_context(a);
+    verilog_free_parser_context(b);
+}
+
+/*!
+@brief Finds a module in a tree by name.
+@returns The module's place in the modules list, or -1 if it is not there.
+*/
+static int module_at(verilog_source_tree * tree, const char * name)
+{
+    unsigned int i;
+    for(i = 0; i < tree -> modules -> items; i ++)
+    {
+        ast_module_declaration * module = ast_list_get(tree -> modules, i);
+        if(strcmp(ast_identifier_tostring(module -> identifier), name) == 0)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*!
+@brief Checks that parsing an edited file again keeps the declarations
+which have only moved, in the order of the file, at their new positions, and
+leaves nothing waiting for modules which are no longer instantiated.
+*/
+static void check_incremental_edits(void)
+{
+    const char * before =
+        "module inc_leaf();\n"
+        "endmodule\n"
+        "module inc_top();\n"
+        "  inc_leaf leaf();\n"
+        "  inc_missing missing();\n"
+        "endmodule\n"
+        "module inc_last();\n"
+        "  wire w;\n"
+        "endmodule\n";
+
+    // Two lines above everything, and a new module in the middle.
+    const char * after =
+        "\n"
+        "\n"
+        "module inc_leaf();\n"
+        "endmodule\n"
+        "module inc_new();\n"
+        "endmodule\n"
+        "module inc_top();\n"
+        "  inc_leaf leaf();\n"
+        "  inc_missing missing();\n"
+        "endmodule\n"
+        "module inc_last();\n"
+        "  wire w;\n"
+        "endmodule\n";
+
+    char * path = write_file("incremental.v", before);
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    verilog_source_tree    * tree    = context -> source_tree;
+
+    CHECK(verilog_parse_path_incremental(context, path) == 0,
+          "%s did not parse", path);
+    CHECK(tree -> modules -> items == 3, "expected three modules, not %u",
+          tree -> modules -> items);
+    if(tree -> modules -> items != 3)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    ast_module_declaration * leaf = ast_list_get(tree -> modules, 0);
+    ast_module_declaration * top  = ast_list_get(tree -> modules, 1);
+    ast_module_declaration * last = ast_list_get(tree -> modules, 2);
+    ast_net_declaration    * w    = find_net(last, "w");
+    unsigned int             from = w != NULL ? w -> identifier -> from_line
+                                              : 0;
+    void                   * waiting;
+
+    write_file("incremental.v", after);
+    CHECK(verilog_parse_path_incremental(context, path) == 0,
+          "%s did not parse after the edit", path);
+
+    CHECK(ast_list_get(tree -> modules, 0) == leaf &&
+          ast_list_get(tree -> modules, 2) == top &&
+          ast_list_get(tree -> modules, 3) == last,
+          "modules which only moved were parsed again");
+    CHECK(module_at(tree, "inc_new") == 1,
+          "inc_new is at %d, not after inc_leaf", module_at(tree, "inc_new"));
+
+    w = find_net(last, "w");
+    CHECK(w != NULL, "w is missing");
+    if(w != NULL)
+    {
+        ast_identifier name = w -> identifier;
+        CHECK(name -> meta.offset < strlen(after) &&
+              strncmp(after + name -> meta.offset, "w;", 2) == 0,
+              "w is at offset %zu", name -> meta.offset);
+        CHECK(verilog_source_tree_get_line(tree, &name -> meta) == 12,
+              "w is on line %d, not 12",
+              verilog_source_tree_get_line(tree, &name -> meta));
+        CHECK(name -> from_line == from + 4, "w came from line %u, not %u",
+              name -> from_line, from + 4);
+    }
+
+    // A changed module replaces the old one, which stops waiting.
+    write_file("incremental.v",
+        "module inc_leaf();\n"
+        "endmodule\n"
+        "module inc_top();\n"
+        "  inc_other other();\n"
+        "endmodule\n"
+        "module inc_last();\n"
+        "  wire w;\n"
+        "endmodule\n");
+    CHECK(verilog_parse_path_incremental(context, path) == 0,
+          "%s did not parse after the second edit", path);
+
+    CHECK(module_at(tree, "inc_new") == -1, "inc_new was not removed");
+    CHECK(ast_list_get(tree -> modules, 1) == top,
+          "inc_top was not replaced in place");
+    CHECK(ast_hashtable_get(tree -> pending_instantiations, "inc_missing",
+                            &waiting) != HASH_SUCCESS,
+          "the old inc_top still waits for inc_missing");
+    CHECK(ast_hashtable_get(tree -> pending_instantiations, "inc_other",
+                            &waiting) == HASH_SUCCESS,
+          "the new inc_top does not wait for inc_other");
+
+    // A removed module stops waiting too.
+    write_file("incremental.v",
+        "module inc_leaf();\n"
+        "endmodule\n"
+        "module inc_last();\n"
+        "  wire w;\n"
+        "endmodule\n");
+    CHECK(verilog_parse_path_incremental(context, path) == 0,
+          "%s did not parse after the third edit", path);
+
+    CHECK(tree -> modules -> items == 2 && module_at(tree, "inc_top") == -1,
+          "inc_top was not removed");
+    CHECK(ast_hashtable_get(tree -> pending_instantiations, "inc_other",
+                            &waiting) != HASH_SUCCESS,
+          "the removed inc_top still waits for inc_other");
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Parses some text into a tree of its own.
+@returns The context parsed with, or NULL if the text did not parse into
+exactly one module.
+*/
+static verilog_parser_context * parse_module_text(const char * text)
+{
+    verilog_parser_context * context = verilog_new_parser_context();
+    int result = verilog_parse_string_r(context, (char*)text,
+                                        (int)strlen(text));
+
+    CHECK(result == 0 && context -> source_tree -> modules -> items == 1,
+          "the text did not parse into one module");
+    if(result != 0 || context -> source_tree -> modules -> items != 1)
+    {
+        verilog_free_parser_context(context);
+        return NULL;
+    }
+    return context;
+}
+
+//! Gives the number of gates in a gate instantiation.
+static unsigned int gate_count(ast_gate_instantiation * gates)
+{
+    switch(gates -> type)
+    {
+        case GATE_CMOS:
+        case GATE_MOS:
+        case GATE_PASS:
+            return gates -> switches -> switches -> items;
+        case GATE_ENABLE:
+            return gates -> enable -> instances -> items;
+        case GATE_N_OUT:
+            return gates -> n_out -> instances -> items;
+        case GATE_N_IN:
+            return gates -> n_in -> instances -> items;
+        case GATE_PASS_EN:
+            return gates -> pass_en -> switches -> items;
+        default:
+            return gates -> pull_gates -> items;
+    }
+}
+
+/*!
+@brief Checks that every gate in a list of gate instances is kept, not only
+the last.
+*/
+static void check_gate_instances(void)
+{
+    verilog_parser_context * context = parse_module_text(
+        "module gates(o1, o2, o3, a, b, c, e);\n"
+        "  output o1, o2, o3;\n"
+        "  input  a, b, c, e;\n"
+        "  and     g1(o1, a, b), g2(o2, b, c), g3(o3, a, c);\n"
+        "  bufif0  (o1, a, e), e1(o2, b, e), e2(o3, c, e);\n"
+        "  nmos    m1(o1, a, e), m2(o2, b, e);\n"
+        "  cmos    c1(o1, a, e, b), c2(o2, b, e, a);\n"
+        "  tran    t1(o1, a), t2(o2, b);\n"
+        "  tranif0 #1 p1(o1, a, e), p2(o2, b, e);\n"
+        "  pullup  u1(o1), u2(o2);\n"
+        "endmodule\n");
+    if(context == NULL)
+    {
+        return;
+    }
+
+    ast_module_declaration * module = ast_list_get(
+        context -> source_tree -> modules, 0);
+    unsigned int expected[] = {3, 3, 2, 2, 2, 2, 2};
+    unsigned int count      = sizeof(expected) / sizeof(expected[0]);
+
+    CHECK(module -> gate_instantiations -> items == count,
+          "expected %u gate instantiations, not %u", count,
+          module -> gate_instantiations -> items);
+
+    unsigned int i;
+    for(i = 0; i < count && i < module -> gate_instantiations -> items; i ++)
+    {
+        ast_gate_instantiation * gates = ast_list_get(
+            module -> gate_instantiations, i);
+        CHECK(gate_count(gates) == expected[i],
+              "instantiation %u has %u gates, not %u", i, gate_count(gates),
+              expected[i]);
+    }
+
+    // The gates after an unnamed enable gate are enable gates too.
+    ast_gate_instantiation * enable = ast_list_get(
+        module -> gate_instantiations, 1);
+    if(enable != NULL && enable -> type == GATE_ENABLE &&
+       enable -> enable -> instances -> items == 3)
+    {
+        ast_enable_gate_instance * gate = ast_list_get(
+            enable -> enable -> instances, 2);
+        CHECK(strcmp(ast_identifier_tostring(gate -> name), "e2") == 0 &&
+              gate -> output_terminal != NULL &&
+              gate -> enable_terminal != NULL &&
+              gate -> input_terminal  != NULL,
+              "e2 is not an enable gate with three terminals");
+    }
+    else
+    {
+        CHECK(0, "the enable gates are missing");
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that each port declaration of a UDP is kept in its list of
+ports, in order.
+*/
+static void check_udp_ports(void)
+{
+    const char * text =
+        "primitive udp_declared(o, a, b);\n"
+        "  output o;\n"
+        "  input  a;\n"
+        "  input  b;\n"
+        "  table\n"
+        "    0 0 : 0;\n"
+        "    1 1 : 1;\n"
+        "  endtable\n"
+        "endprimitive\n"
+        "primitive udp_ansi(output o, input a input b);\n"
+        "  table\n"
+        "    0 0 : 0;\n"
+        "    1 1 : 1;\n"
+        "  endtable\n"
+        "endprimitive\n";
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    int result = verilog_parse_string_r(context, (char*)text,
+                                        (int)strlen(text));
+    verilog_source_tree * tree = context -> source_tree;
+
+    CHECK(result == 0 && tree -> primitives -> items == 2,
+          "the primitives did not parse");
+
+    ast_port_direction directions[] = {PORT_OUTPUT, PORT_INPUT, PORT_INPUT};
+    unsigned int p;
+    for(p = 0; p < tree -> primitives -> items && result == 0; p ++)
+    {
+        ast_udp_declaration * udp = ast_list_get(tree -> primitives, p);
+        CHECK(udp -> ports -> items == 3, "%s has %u ports, not 3",
+              ast_identifier_tostring(udp -> identifier),
+              udp -> ports -> items);
+
+        unsigned int i;
+        for(i = 0; i < udp -> ports -> items && i < 3; i ++)
+        {
+            ast_udp_port * port = ast_list_get(udp -> ports, i);
+            CHECK((void*)port != (void*)udp -> ports &&
+                  port -> direction == directions[i],
+                  "port %u of %s is not a port declaration", i,
+                  ast_identifier_tostring(udp -> identifier));
+        }
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that the level symbols of each entry in a UDP table are kept
+in the tree, not on the parser's stack.
+*/
+static void check_udp_levels(void)
+{
+    const char * text =
+        "primitive udp_levels(output o, input a, b);\n"
+        "  table\n"
+        "    x ? : 0;\n"
+        "    ? x : 1;\n"
+        "    ? ? : x;\n"
+        "  endtable\n"
+        "endprimitive\n";
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    int result = verilog_parse_string_r(context, (char*)text,
+                                        (int)strlen(text));
+    verilog_source_tree * tree = context -> source_tree;
+
+    CHECK(result == 0 && tree -> primitives -> items == 1,
+          "the primitive did not parse");
+
+    ast_udp_declaration * udp = ast_list_get(tree -> primitives, 0);
+    ast_level_symbol expected[3][2] = {
+        {LEVEL_X, LEVEL_Q}, {LEVEL_Q, LEVEL_X}, {LEVEL_Q, LEVEL_Q}
+    };
+
+    CHECK(udp == NULL || udp -> body_entries -> items == 3,
+          "expected three table entries");
+    unsigned int e;
+    for(e = 0; udp != NULL && e < udp -> body_entries -> items && e < 3;
+        e ++)
+    {
+        ast_udp_combinatorial_entry * entry = ast_list_get(
+            udp -> body_entries, e);
+        CHECK(entry -> input_levels -> items == 2,
+              "entry %u has %u levels, not 2", e,
+              entry -> input_levels -> items);
+
+        unsigned int i;
+        for(i = 0; i < entry -> input_levels -> items && i < 2; i ++)
+        {
+            ast_level_symbol * level = ast_list_get(entry -> input_levels,
+                                                    i);
+            CHECK(*level == expected[e][i], "level %u of entry %u is %d, "
+                  "not %d", i, e, *level, expected[e][i]);
+        }
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that connections and parameter values given by position are
+port connections with no name, as those given by name are.
+*/
+static void check_ordered_connections(void)
+{
+    verilog_parser_context * context = parse_module_text(
+        "module ordered(a, b);\n"
+        "  input a, b;\n"
+        "  leaf #(4, 5) by_position(a, , b);\n"
+        "  leaf #(.W(4)) by_name(.x(a), .y());\n"
+        "endmodule\n");
+    if(context == NULL)
+    {
+        return;
+    }
+
+    ast_module_declaration * module = ast_list_get(
+        context -> source_tree -> modules, 0);
+    CHECK(module -> module_instantiations -> items == 2,
+          "expected two instantiations, not %u",
+          module -> module_instantiations -> items);
+    if(module -> module_instantiations -> items != 2)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    ast_module_instantiation * positional = ast_list_get(
+        module -> module_instantiations, 0);
+    ast_module_instance      * instance   = ast_list_get(
+        positional -> module_instances, 0);
+    ast_port_connection      * connection;
+    unsigned int               i;
+
+    CHECK(positional -> module_parameters -> items == 2,
+          "expected two parameter values");
+    ast_list_foreach(connection, positional -> module_parameters)
+    {
+        CHECK(connection != NULL && connection -> port_name == NULL &&
+              connection -> expression != NULL,
+              "a parameter value given by position is not a connection");
+    }
+
+    CHECK(instance -> port_connections -> items == 3,
+          "expected three port connections, not %u",
+          instance -> port_connections -> items);
+    for(i = 0; i < instance -> port_connections -> items; i ++)
+    {
+        connection = ast_list_get(instance -> port_connections, i);
+        CHECK(connection != NULL && connection -> port_name == NULL &&
+              (connection -> expression == NULL) == (i == 1),
+              "port connection %u is not a connection by position", i);
+    }
+
+    // Named connections are unchanged.
+    ast_module_instantiation * named = ast_list_get(
+        module -> module_instantiations, 1);
+    instance   = ast_list_get(named -> module_instances, 0);
+    connection = ast_list_get(instance -> port_connections, 1);
+    CHECK(connection != NULL && connection -> port_name != NULL &&
+          connection -> expression == NULL,
+          "the unconnected named port is not a connection with a name");
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that the items of a concatenation being assigned to are
+expressions, as those of any other concatenation are.
+*/
+static void check_lvalue_concatenation(void)
+{
+    verilog_parser_context * context = parse_module_text(
+        "module concatenated(a, b, c, d);\n"
+        "  output a, b, c;\n"
+        "  input  [2:0] d;\n"
+        "  assign {a, {b, c}} = d;\n"
+        "endmodule\n");
+    if(context == NULL)
+    {
+        return;
+    }
+
+    ast_module_declaration    * module = ast_list_get(
+        context -> source_tree -> modules, 0);
+    ast_continuous_assignment * assign = ast_list_get(
+        module -> continuous_assignments, 0);
+    ast_single_assignment     * single = assign == NULL ? NULL :
+        ast_list_get(assign -> assignments, 0);
+
+    CHECK(single != NULL && single -> lval -> type == NET_CONCATENATION,
+          "the assignment is not to a concatenation");
+    if(single == NULL || single -> lval -> type != NET_CONCATENATION)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    ast_list * items = single -> lval -> data.concatenation -> items;
+    CHECK(items -> items == 2, "expected two items, not %u", items -> items);
+
+    ast_expression * first  = ast_list_get(items, 0);
+    ast_expression * second = ast_list_get(items, 1);
+
+    CHECK(first != NULL && first -> type == PRIMARY_EXPRESSION &&
+          first -> primary -> value_type == PRIMARY_IDENTIFIER &&
+          strcmp(ast_identifier_tostring(
+              first -> primary -> value.identifier), "a") == 0,
+          "the first item is not an expression naming a");
+    CHECK(second != NULL && second -> type == PRIMARY_EXPRESSION &&
+          second -> primary -> value_type == PRIMARY_CONCATENATION &&
+          second -> primary -> value.concatenation -> items -> items == 2,
+          "the second item is not an expression holding {b, c}");
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that a specparam declared in a module with an ANSI style
+header is kept with the module's specparams.
+*/
+static void check_module_specparams(void)
+{
+    verilog_parser_context * context = parse_module_text(
+        "module timed(input a);\n"
+        "  specparam t_rise = 1;\n"
+        "endmodule\n");
+    if(context == NULL)
+    {
+        return;
+    }
+
+    ast_module_declaration * module = ast_list_get(
+        context -> source_tree -> modules, 0);
+    CHECK(module -> specparams -> items == 1,
+          "expected one specparam, not %u", module -> specparams -> items);
+    CHECK(module -> module_ports -> items == 1,
+          "expected one port, not %u", module -> module_ports -> items);
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks that each parameter in a module's parameter port list is kept
+as an assignment, including those which repeat the parameter keyword.
+*/
+static void check_parameter_port_list(void)
+{
+    verilog_parser_context * context = parse_module_text(
+        "module parameterised #(\n"
+        "  parameter WIDTH = 4,\n"
+        "  parameter DEPTH = 8\n"
+        ")(input a);\n"
+        "endmodule\n");
+    if(context == NULL)
+    {
+        return;
+    }
+
+    ast_module_declaration     * module = ast_list_get(
+        context -> source_tree -> modules, 0);
+    ast_parameter_declarations * params = ast_list_get(
+        module -> module_parameters, 0);
+    const char                 * names[] = {"WIDTH", "DEPTH"};
+
+    CHECK(params != NULL && params -> assignments -> items == 2,
+          "expected two parameters");
+    unsigned int i;
+    for(i = 0; params != NULL && i < params -> assignments -> items && i < 2;
+        i ++)
+    {
+        ast_single_assignment * assignment = ast_list_get(
+            params -> assignments, i);
+        CHECK(((size_t)assignment % sizeof(void*)) == 0 &&
+              assignment -> lval -> type == PARAM_ID &&
+              strcmp(ast_identifier_tostring(
+                  assignment -> lval -> data.identifier), names[i]) == 0,
+              "parameter %u is not an assignment to %s", i, names[i]);
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Writes a design big enough to be split into pieces: a timescale
+directive followed by "count" small modules.
+@param [in] name - The name of the file to write.
+@param [in] count - How many modules to write.
+@param [in] newline - The line ending to use.
+@returns The full path of the file.
+*/
+static char * write_design(
+    const char   * name,
+    unsigned int   count,
+    const char   * newline
+){
+    size_t       size = 64 + (size_t)count * 128;
+    char       * text = malloc(size);
+    size_t       used = 0;
+    unsigned int i;
+
+    used += sprintf(text + used, "`timescale 1ns/1ps%s", newline);
+    for(i = 0; i < count; i ++)
+    {
+        used += sprintf(text + used,
+                        "module design_%u(input a, output b);%s"
+                        "  wire w;%s"
+                        "  assign b = a;%s"
+                        "endmodule%s",
+                        i, newline, newline, newline, newline);
+    }
+
+    char * path = write_file(name, text);
+    free(text);
+    return path;
+}
+
+/*!
+@brief Checks that two trees hold the same modules, in the same order, with
+their nets at the same places.
+@returns The number of modules which differ.
+*/
+static unsigned int compare_designs(
+    verilog_source_tree * expected,
+    verilog_source_tree * actual
+){
+    unsigned int differ = 0;
+    unsigned int i;
+
+    if(expected -> modules -> items != actual -> modules -> items)
+    {
+        return expected -> modules -> items;
+    }
+
+    for(i = 0; i < expected -> modules -> items; i ++)
+    {
+        ast_module_declaration * want = ast_list_get(expected -> modules, i);
+        ast_module_declaration * got  = ast_list_get(actual -> modules, i);
+        ast_net_declaration    * want_net = find_net(want, "w");
+        ast_net_declaration    * got_net  = find_net(got, "w");
+
+        if(strcmp(ast_identifier_tostring(want -> identifier),
+                  ast_identifier_tostring(got -> identifier)) != 0 ||
+           want_net == NULL || got_net == NULL ||
+           want_net -> meta.offset != got_net -> meta.offset ||
+           verilog_source_tree_get_line(expected, &want_net -> meta) !=
+               verilog_source_tree_get_line(actual, &got_net -> meta))
+        {
+            differ ++;
+        }
+    }
+    return differ;
+}
+
+/*!
+@brief Checks that a file split into pieces and parsed in parallel gives the
+same tree as parsing it all at once, with either kind of line ending.
+*/
+static void check_chunked_parse(void)
+{
+    const char * newlines[] = {"\n", "\r\n"};
+    const char * names[]    = {"chunked_lf.v", "chunked_crlf.v"};
+    unsigned int count      = 3000;
+    int          n;
+
+    for(n = 0; n < 2; n ++)
+    {
+        char * path = write_design(names[n], count, newlines[n]);
+
+        verilog_parser_context * serial = verilog_new_parser_context();
+        CHECK(verilog_parse_path_r(serial, path) == 0,
+              "%s did not parse", path);
+
+        int result = -1;
+        verilog_source_tree * chunked = verilog_parse_file_chunked(
+            path, 4, NULL, NULL, &result);
+        CHECK(result == 0, "%s did not parse in pieces", path);
+        CHECK(chunked -> modules -> items == count,
+              "%s has %u modules parsed in pieces, not %u", path,
+              chunked -> modules -> items, count);
+
+        unsigned int differ = compare_designs(serial -> source_tree,
+                                              chunked);
+        CHECK(differ == 0, "%u modules of %s differ when parsed in pieces",
+              differ, path);
+
+        verilog_free_source_tree(chunked);
+        verilog_free_parser_context(serial);
+    }
+}
+
+/*!
+@brief Checks that modules read lazily are left unparsed until they are
+loaded, and are then the same as if the file had been parsed all at once,
+with either kind of line ending.
+*/
+static void check_lazy_parse(void)
+{
+    const char * newlines[] = {"\n", "\r\n"};
+    const char * names[]    = {"lazy_lf.v", "lazy_crlf.v"};
+    unsigned int count      = 200;
+    unsigned int i;
+    int          n;
+
+    for(n = 0; n < 2; n ++)
+    {
+        char * path = write_design(names[n], count, newlines[n]);
+
+        verilog_parser_context * serial = verilog_new_parser_context();
+        CHECK(verilog_parse_path_r(serial, path) == 0,
+              "%s did not parse", path);
+
+        verilog_parser_context * lazy = verilog_new_parser_context();
+        CHECK(verilog_parse_path_lazy(lazy, path) == 0,
+              "%s did not parse lazily", path);
+
+        verilog_source_tree * tree     = lazy -> source_tree;
+        unsigned int          unloaded = 0;
+        unsigned int          failed   = 0;
+
+        for(i = 0; i < tree -> modules -> items; i ++)
+        {
+            ast_module_declaration * module = ast_list_get(tree -> modules,
+                                                           i);
+            unloaded += module -> lazy != NULL &&
+                        module -> net_declarations -> items == 0;
+        }
+        CHECK(tree -> modules -> items == count && unloaded == count,
+              "%u of %u modules of %s were left to be loaded", unloaded,
+              tree -> modules -> items, path);
+
+        for(i = 0; i < tree -> modules -> items; i ++)
+        {
+            failed += !verilog_load_module(tree,
+                                           ast_list_get(tree -> modules, i));
+        }
+        CHECK(failed == 0, "%u modules of %s could not be loaded", failed,
+              path);
+
+        unsigned int differ = compare_designs(serial -> source_tree, tree);
+        CHECK(differ == 0, "%u modules of %s differ when loaded lazily",
+              differ, path);
+
+        verilog_free_parser_context(lazy);
+        verilog_free_parser_context(serial);
+    }
+}
+
+/*!
+@brief Parses a file with stdout sent to another file, so that what the
+parser prints can be looked at.
+@param [inout] context - The context to parse with.
+@param [in] path - The file to parse.
+@param [in] output - Receives what was printed, null terminated, which
+must be freed.
+@returns The result of parsing the file.
+*/
+static int parse_capturing_output(
+    verilog_parser_context * context,
+    char                   * path,
+    char                  ** output
+){
+    char * capture = write_file("captured.txt", "");
+
+    fflush(stdout);
+    int saved = dup(fileno(stdout));
+    if(freopen(capture, "w", stdout) == NULL)
+    {
+        printf("Could not write %s\n", capture);
+        exit(1);
+    }
+
+    int result = verilog_parse_path_r(context, path);
+
+    fflush(stdout);
+    dup2(saved, fileno(stdout));
+    close(saved);
+
+    FILE * fh   = fopen(capture, "r");
+    size_t used = 0;
+    *output     = calloc(4096, 1);
+    if(fh != NULL)
+    {
+        used = fread(*output, 1, 4095, fh);
+        fclose(fh);
+    }
+    (*output)[used] = '\0';
+
+    return result;
+}
+
+/*!
+@brief Checks that a pipelined parse, with the scanner on another thread,
+gives the same tree as a direct one, and still says which token a syntax
+error was found at.
+*/
+static void check_pipelined_parse(void)
+{
+    char * path = write_design("pipelined.v", 2000, "\n");
+
+    verilog_parser_context * direct    = verilog_new_parser_context();
+    verilog_parser_context * pipelined = verilog_new_parser_context();
+    pipelined -> pipelined = AST_TRUE;
+
+    CHECK(verilog_parse_path_r(direct, path) == 0, "%s did not parse", path);
+    CHECK(verilog_parse_path_r(pipelined, path) == 0,
+          "%s did not parse pipelined", path);
+
+    unsigned int differ = compare_designs(direct -> source_tree,
+                                          pipelined -> source_tree);
+    CHECK(differ == 0, "%u modules of %s differ when parsed pipelined",
+          differ, path);
+
+    verilog_free_parser_context(direct);
+    verilog_free_parser_context(pipelined);
+
+    char * broken = write_file("pipelined_error.v",
+        "module broken(a);\n"
+        "input a\n"
+        "endmodule\n");
+
+    pipelined = verilog_new_parser_context();
+    pipelined -> pipelined = AST_TRUE;
+
+    char * output;
+    int    result = parse_capturing_output(pipelined, broken, &output);
+    CHECK(result != 0, "%s parsed pipelined", broken);
+    CHECK(strstr(output, "- 'endmodule'") != NULL,
+          "the pipelined syntax error does not name its token: %s", output);
+
+    free(output);
+    verilog_free_parser_context(pipelined);
+}
+
+/*!
+@brief Checks that a context set to name files in its error messages gives
+the path of the file each syntax error is in.
+*/
+static void check_named_errors(void)
+{
+    char * broken = write_file("named_error.v",
+        "module broken(a);\n"
+        "input a\n"
+        "endmodule\n");
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    context -> name_errors = AST_TRUE;
+
+    char * output;
+    int    result = parse_capturing_output(context, broken, &output);
+    CHECK(result != 0, "%s parsed", broken);
+    CHECK(strncmp(output, broken, strlen(broken)) == 0 &&
+          strstr(output, " line ") == output + strlen(broken),
+          "the syntax error does not name %s: %s", broken, output);
+
+    free(output);
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Checks the lines of the module written by check_kept_lines, in a tree
+made from it some way or other.
+@param [in] tree - The tree.
+@param [in] how - How the tree was made, for messages.
+@param [in] nets - Whether the module's nets are in the tree yet.
+*/
+static void check_kept_module(
+    verilog_source_tree * tree,
+    const char          * how,
+    ast_boolean           nets
+){
+    CHECK(tree -> modules -> items == 1, "expected one module %s", how);
+    if(tree -> modules -> items != 1)
+    {
+        return;
+    }
+
+    ast_module_declaration * module = ast_list_get(tree -> modules, 0);
+    ast_line                 line   = verilog_source_tree_get_line(
+        tree, &module -> meta);
+    CHECK(line == 2, "the module is on line %d %s, not 2", line, how);
+
+    if(nets)
+    {
+        ast_net_declaration * w      = find_net(module, "w");
+        ast_net_declaration * header = find_net(module, "from_header");
+        CHECK(w != NULL && verilog_source_tree_get_line(tree,
+              &w -> meta) == 4, "w is not on line 4 %s", how);
+        CHECK(header != NULL && verilog_source_tree_get_line(tree,
+              &header -> meta) == 3, "from_header is not on line 3 %s", how);
+    }
+}
+
+/*!
+@brief Checks that lines are still found once the files a tree was parsed
+from have gone, however the tree was made.
+*/
+static void check_kept_lines(void)
+{
+    const char * top =
+        "`timescale 1ns/1ps\n"
+        "module kept(input a);\n"
+        "\n"
+        "  wire w;\n"
+        "`include \"kept.vh\"\n"
+        "endmodule\n";
+    const char * header =
+        "\n"
+        "\n"
+        "  wire from_header;\n";
+
+    char * image = write_file("kept.ast", "");
+    char * path  = write_file("kept.v", top);
+    write_file("kept.vh", header);
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    ast_list_append(context -> preprocessor -> search_dirs, search_dir);
+    CHECK(verilog_parse_path_r(context, path) == 0, "%s did not parse", path);
+    CHECK(verilog_source_tree_save(context -> source_tree, image) == 0,
+          "the tree of %s was not saved", path);
+
+    remove(path);
+    remove(written[written_count - 1]);
+    check_kept_module(context -> source_tree, "once parsed", AST_TRUE);
+
+    // A parse cache hit loads an image, then merges it.
+    verilog_source_tree * loaded = verilog_source_tree_load(image);
+    CHECK(loaded != NULL, "%s did not load", image);
+    if(loaded != NULL)
+    {
+        check_kept_module(loaded, "once loaded", AST_TRUE);
+
+        verilog_source_tree * merged = verilog_new_source_tree();
+        verilog_source_tree_merge(merged, loaded);
+        check_kept_module(merged, "once merged", AST_TRUE);
+        verilog_free_source_tree(merged);
+    }
+    verilog_free_parser_context(context);
+
+    // Modules which are never loaded still have lines.
+    path = write_file("kept_lazy.v", top);
+    write_file("kept.vh", header);
+
+    context = verilog_new_parser_context();
+    ast_list_append(context -> preprocessor -> search_dirs, search_dir);
+    CHECK(verilog_parse_path_lazy(context, path) == 0,
+          "%s did not parse lazily", path);
+
+    remove(path);
+    check_kept_module(context -> source_tree, "once read lazily", AST_FALSE);
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Looks a module up by name, as a user of the tree would.
+*/
+static ast_module_declaration * find_module(
+    verilog_source_tree * tree,
+    const char          * name
+){
+    ast_region * region   = ast_region_new();
+    ast_region * previous = ast_region_set_current(region);
+
+    ast_identifier           id = ast_new_identifier(
+        ast_strdup((char*)name), 0);
+    ast_module_declaration * tr = verilog_find_module_declaration(tree, id);
+
+    ast_region_set_current(previous);
+    ast_region_free(region);
+    return tr;
+}
+
+/*!
+@brief Checks that modules are found by name among many, that the first of
+two modules with the same name is the one found, and that the second is
+found once the first is removed.
+*/
+static void check_module_index(void)
+{
+    unsigned int count = 500;
+    size_t       size  = 256 + (size_t)count * 48;
+    char       * text  = malloc(size);
+    size_t       used  = 0;
+    unsigned int i;
+
+    used += sprintf(text + used, "module twin(); wire first; endmodule\n");
+    for(i = 0; i < count; i ++)
+    {
+        used += sprintf(text + used, "module indexed_%u(); endmodule\n", i);
+    }
+    used += sprintf(text + used, "module twin(); wire second; endmodule\n");
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    CHECK(verilog_parse_string_r(context, text, (int)used) == 0,
+          "the modules did not parse");
+    free(text);
+
+    verilog_source_tree * tree    = context -> source_tree;
+    unsigned int          missing = 0;
+    for(i = 0; i < count; i ++)
+    {
+        char name[32];
+        sprintf(name, "indexed_%u", i);
+        ast_module_declaration * module = find_module(tree, name);
+        missing += module == NULL || strcmp(ast_identifier_tostring(
+            module -> identifier), name) != 0;
+    }
+    CHECK(missing == 0, "%u of %u modules were not found by name", missing,
+          count);
+    CHECK(find_module(tree, "indexed") == NULL &&
+          find_module(tree, "absent") == NULL,
+          "a module which does not exist was found");
+
+    ast_module_declaration * twin = find_module(tree, "twin");
+    CHECK(twin != NULL && find_net(twin, "first") != NULL,
+          "the first module named twin is not the one found");
+
+    if(twin != NULL)
+    {
+        verilog_source_tree_remove_module(tree, twin);
+        twin = find_module(tree, "twin");
+        CHECK(twin != NULL && find_net(twin, "second") != NULL,
+              "the second module named twin is not found once the first "
+              "is removed");
+    }
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Parses some text into a context which may already hold modules.
+*/
+static void parse_more_text(
+    verilog_parser_context * context,
+    const char             * text
+){
+    CHECK(verilog_parse_string_r(context, (char*)text, (int)strlen(text))
+          == 0, "the text did not parse: %s", text);
+}
+
+/*!
+@brief Gives the declaration the i'th instantiation of a module was
+resolved to, or NULL if it is not resolved.
+*/
+static ast_module_declaration * instantiated(
+    ast_module_declaration * module,
+    unsigned int             i
+){
+    ast_module_instantiation * instance = ast_list_get(
+        module -> module_instantiations, i);
+    return instance != NULL && instance -> resolved ?
+        instance -> declaration : NULL;
+}
+
+/*!
+@brief Checks that instantiations of modules which do not exist yet wait
+until a module of the right name is added, and that removing a module makes
+instantiations of it wait again.
+*/
+static void check_pending_instantiations(void)
+{
+    verilog_parser_context * context = verilog_new_parser_context();
+    verilog_source_tree    * tree    = context -> source_tree;
+    void                   * waiting;
+
+    parse_more_text(context,
+        "module top(); leaf l1(); middle m(); leaf l2(); endmodule\n");
+    verilog_resolve_modules(tree);
+
+    ast_module_declaration * top = find_module(tree, "top");
+    if(top == NULL || top -> module_instantiations -> items != 3)
+    {
+        CHECK(0, "top does not have three instantiations");
+        verilog_free_parser_context(context);
+        return;
+    }
+    CHECK(instantiated(top, 0) == NULL && instantiated(top, 1) == NULL,
+          "an instantiation of a missing module was resolved");
+    CHECK(ast_hashtable_get(tree -> pending_instantiations, "leaf",
+                            &waiting) == HASH_SUCCESS &&
+          ast_hashtable_get(tree -> pending_instantiations, "middle",
+                            &waiting) == HASH_SUCCESS,
+          "the instantiations are not waiting for their modules");
+
+    // Adding the module resolves what waits for it, without being asked.
+    parse_more_text(context, "module leaf(); endmodule\n");
+    ast_module_declaration * leaf = find_module(tree, "leaf");
+    CHECK(leaf != NULL && instantiated(top, 0) == leaf &&
+          instantiated(top, 2) == leaf,
+          "the instantiations of leaf were not resolved as it was added");
+    CHECK(instantiated(top, 1) == NULL,
+          "the instantiation of middle was resolved before it was added");
+
+    // Only modules new since the last call are looked at by the next one.
+    parse_more_text(context, "module middle(); leaf l3(); endmodule\n");
+    verilog_resolve_modules(tree);
+    ast_module_declaration * middle = find_module(tree, "middle");
+    CHECK(middle != NULL && instantiated(top, 1) == middle &&
+          instantiated(middle, 0) == leaf,
+          "middle and its instantiation of leaf were not resolved");
+    CHECK(ast_hashtable_get(tree -> pending_instantiations, "middle",
+                            &waiting) != HASH_SUCCESS ||
+          ((ast_list*)waiting) -> items == 0,
+          "instantiations still wait for middle once it is added");
+
+    // Removing leaf leaves its instantiations waiting for another.
+    verilog_source_tree_remove_module(tree, leaf);
+    CHECK(instantiated(top, 0) == NULL && instantiated(middle, 0) == NULL,
+          "instantiations of leaf stayed resolved once it was removed");
+    CHECK(strcmp(ast_identifier_tostring(((ast_module_instantiation*)
+          ast_list_get(top -> module_instantiations, 0)) -> module_identifer),
+          "leaf") == 0, "an unresolved instantiation lost its name");
+
+    parse_more_text(context, "module leaf(); wire again; endmodule\n");
+    leaf = find_module(tree, "leaf");
+    CHECK(leaf != NULL && find_net(leaf, "again") != NULL &&
+          instantiated(top, 0) == leaf && instantiated(middle, 0) == leaf,
+          "instantiations of leaf were not resolved to the new one");
+
+    verilog_free_parser_context(context);
+}
+
+//! What description_seen has seen of the declarations parsed.
+typedef struct description_record_t{
+    unsigned int   seen;        //!< Declarations passed to the callback.
+    unsigned int   kept;        //!< Those it kept.
+    ast_region   * region;      //!< The region of the first released one.
+    unsigned int   moved;       //!< Times a released one was elsewhere.
+    size_t         most;        //!< Most bytes any one was given.
+} description_record;
+
+/*!
+@brief A description callback which keeps modules whose names start with
+"keep_", and releases everything else.
+*/
+static ast_boolean description_seen(
+    verilog_source_tree * tree,
+    ast_source_item     * item,
+    void                * data
+){
+    description_record * record = data;
+    ast_region         * region = tree -> description_region;
+
+    record -> seen ++;
+    if(region -> allocated > record -> most)
+    {
+        record -> most = region -> allocated;
+    }
+
+    ast_boolean keep = item -> type == SOURCE_MODULE && strncmp(
+        ast_identifier_tostring(item -> module -> identifier), "keep_",
+        5) == 0;
+
+    if(keep)
+    {
+        record -> kept ++;
+    }
+    else if(record -> region == NULL)
+    {
+        record -> region = region;
+    }
+    else if(region != record -> region)
+    {
+        record -> moved ++;
+    }
+    return keep;
+}
+
+/*!
+@brief Writes the text of some modules, each of which declares a wire.
+@param [in] count - How many modules to write.
+@param [in] keep_every - Every keep_every'th module is named to be kept by
+description_seen, or none are if it is zero.
+@returns The text, which must be freed.
+*/
+static char * description_text(unsigned int count, unsigned int keep_every)
+{
+    char       * text = malloc(64 + (size_t)count * 64);
+    size_t       used = 0;
+    unsigned int i;
+
+    for(i = 0; i < count; i ++)
+    {
+        ast_boolean keep = keep_every > 0 && i % keep_every == 0;
+        used += sprintf(text + used,
+                        "module %s_%u(input a); wire w; endmodule\n",
+                        keep ? "keep" : "drop", i);
+    }
+    return text;
+}
+
+/*!
+@brief Checks that a description callback sees every declaration, that only
+those it keeps go in the tree and are still whole once parsing is over, and
+that released declarations reuse the same memory.
+*/
+static void check_description_callback(void)
+{
+    unsigned int count = 2000;
+    unsigned int i;
+
+    // Release everything: one region is reset for each declaration.
+    char                   * text    = description_text(count, 0);
+    verilog_parser_context * context = verilog_new_parser_context();
+    description_record       record;
+    memset(&record, 0, sizeof(description_record));
+
+    verilog_source_tree_set_callback(context -> source_tree,
+                                     description_seen, &record);
+    CHECK(verilog_parse_string_r(context, text, (int)strlen(text)) == 0,
+          "the released modules did not parse");
+    CHECK(record.seen == count && context -> source_tree -> modules -> items
+          == 0, "%u of %u modules were seen and %u kept", record.seen, count,
+          context -> source_tree -> modules -> items);
+    CHECK(record.moved == 0,
+          "released modules were parsed into %u other regions",
+          record.moved);
+    CHECK(record.most < AST_REGION_MIN_CHUNK,
+          "one module was given %zu bytes", record.most);
+
+    verilog_free_parser_context(context);
+    free(text);
+
+    // Keep some: released ones after a kept one must not clobber it.
+    text    = description_text(count, 7);
+    context = verilog_new_parser_context();
+    memset(&record, 0, sizeof(description_record));
+
+    verilog_source_tree_set_callback(context -> source_tree,
+                                     description_seen, &record);
+    CHECK(verilog_parse_string_r(context, text, (int)strlen(text)) == 0,
+          "the kept modules did not parse");
+
+    verilog_source_tree * tree   = context -> source_tree;
+    unsigned int          broken = 0;
+    for(i = 0; i < tree -> modules -> items; i ++)
+    {
+        ast_module_declaration * module = ast_list_get(tree -> modules, i);
+        char                     name[32];
+        sprintf(name, "keep_%u", i * 7);
+        broken += strcmp(ast_identifier_tostring(module -> identifier),
+                         name) != 0 || find_net(module, "w") == NULL;
+    }
+    CHECK(record.seen == count && tree -> modules -> items == record.kept &&
+          record.kept == (count + 6) / 7,
+          "%u modules were kept, not %u", tree -> modules -> items,
+          (count + 6) / 7);
+    CHECK(broken == 0, "%u kept modules were changed by later ones", broken);
+
+    verilog_free_parser_context(context);
+    free(text);
+}
+
+/*!
+@brief Checks that skeleton mode records the span of every kind of
+construct it skips, however its end is hidden, and keeps what it does not
+skip.
+*/
+static void check_skeleton_spans(void)
+{
+    const char * text =
+        "`define FINISH end\n"
+        "module spans(input clk, output reg q);\n"
+        "  wire w;\n"
+        "  always @(posedge clk) begin\n"
+        "    case(q)\n"
+        "      1'b0: begin q <= 1; end\n"
+        "      default: q <= 0;\n"
+        "    endcase\n"
+        "    $display(\"end endcase\"); // end\n"
+        "  end\n"
+        "  initial if(clk) q = 0; else q = 1;\n"
+        "  function f; input a; /* endfunction */ f = a; endfunction\n"
+        "  task t; begin end endtask\n"
+        "  specify (clk => q) = 1; endspecify\n"
+        "  always begin\n"
+        "    q = 0;\n"
+        "  `FINISH\n"
+        "  child c(.a(w));\n"
+        "endmodule\n";
+
+    //! What each construct starts and ends with, and its lines.
+    struct {
+        ast_module_item_type type;
+        const char         * first;
+        const char         * last;
+        ast_line             line;
+        ast_line             end_line;
+    } expected[] = {
+        {MOD_ITEM_ALWAYS_CONSTRUCT,     "always @",   "  end",        4, 10},
+        {MOD_ITEM_INITIAL_CONSTRUCT,    "initial",    "q = 1;",      11, 11},
+        {MOD_ITEM_FUNCTION_DECLARATION, "function",   "endfunction", 12, 12},
+        {MOD_ITEM_TASK_DECLARATION,     "task",       "endtask",     13, 13},
+        {MOD_ITEM_SPECIFY_BLOCK,        "specify",    "endspecify",  14, 14},
+        {MOD_ITEM_ALWAYS_CONSTRUCT,     "always beg", "`FINISH",     15, 17}
+    };
+    unsigned int count = sizeof(expected) / sizeof(expected[0]);
+
+    verilog_parser_context * context = verilog_new_parser_context();
+    context -> skeleton = AST_TRUE;
+
+    int result = verilog_parse_string_r(context, (char*)text,
+                                        (int)strlen(text));
+    CHECK(result == 0 && context -> source_tree -> modules -> items == 1,
+          "the skeleton parse failed");
+    if(result != 0 || context -> source_tree -> modules -> items != 1)
+    {
+        verilog_free_parser_context(context);
+        return;
+    }
+
+    verilog_source_tree    * tree   = context -> source_tree;
+    ast_module_declaration * module = ast_list_get(tree -> modules, 0);
+    unsigned int             i;
+
+    CHECK(module -> skipped_constructs -> items == count,
+          "%u constructs were skipped, not %u",
+          module -> skipped_constructs -> items, count);
+
+    for(i = 0; i < count && i < module -> skipped_constructs -> items; i ++)
+    {
+        ast_skipped_construct * construct = ast_list_get(
+            module -> skipped_constructs, i);
+        size_t                  last      = strlen(expected[i].last);
+
+        CHECK(construct -> type == expected[i].type,
+              "construct %u is of type %d, not %d", i, construct -> type,
+              expected[i].type);
+        CHECK(strncmp(text + construct -> start, expected[i].first,
+                      strlen(expected[i].first)) == 0 &&
+              construct -> end >= last &&
+              strncmp(text + construct -> end - last, expected[i].last,
+                      last) == 0,
+              "construct %u is '%.*s'", i,
+              (int)(construct -> end - construct -> start),
+              text + construct -> start);
+
+        ast_line line = verilog_source_tree_get_line(tree, &construct -> meta);
+        CHECK(line == expected[i].line &&
+              construct -> end_line == expected[i].end_line,
+              "construct %u is on lines %d to %d, not %d to %d", i, line,
+              construct -> end_line, expected[i].line, expected[i].end_line);
+    }
+
+    CHECK(find_net(module, "w") != NULL, "the net was not kept");
+    CHECK(module -> module_ports -> items == 2,
+          "%u ports were kept, not 2", module -> module_ports -> items);
+    CHECK(module -> module_instantiations -> items == 1,
+          "the instantiation after the skipped constructs was not kept");
+
+    verilog_free_parser_context(context);
+}
+
+/*!
+@brief Parses a file through a parse cache with a new context, as a run of
+the parser would.
+@returns The context, whose tree holds the file.
+*/
+static verilog_parser_context * parse_cached(
+    verilog_parse_cache * cache,
+    char                * path
+){
+    verilog_parser_context * context = verilog_new_parser_context();
+    ast_list_append(context -> preprocessor -> search_dirs, search_dir);
+    CHECK(verilog_parse_path_cached(context, cache, path) == 0,
+          "%s did not parse through the cache", path);
+    return context;
+}
+
+/*!
+@brief Checks what a tree parsed through the cache holds: the module, the
+net from its header, and the macro the header defines.
+*/
+static void check_cached_module(
+    verilog_parser_context * context,
+    const char             * net,
+    const char             * how
+){
+    verilog_source_tree * tree = context -> source_tree;
+    void                * macro;
+
+    CHECK(tree -> modules -> items == 1, "expected one module %s", how);
+    if(tree -> modules -> items == 1)
+    {
+        ast_module_declaration * module = ast_list_get(tree -> modules, 0);
+        ast_net_declaration    * found  = find_net(module, net);
+        CHECK(found != NULL && verilog_source_tree_get_line(tree,
+              &found -> meta) == 2, "%s is not on line 2 of the header %s",
+              net, how);
+        CHECK(verilog_source_tree_get_line(tree, &module -> meta) == 1,
+              "the module is not on line 1 %s", how);
+    }
+    CHECK(ast_hashtable_get(context -> preprocessor -> macrodefines,
+                            "CACHED_WIDTH", &macro) == HASH_SUCCESS,
+          "the macro from the header is not defined %s", how);
+}
+
+/*!
+@brief Checks that a file parsed through the cache a second time is read
+from it, giving the same tree and macros, and that editing a file it
+includes makes it be parsed again.
+*/
+static void check_parse_cache(void)
+{
+    char * directory = make_dir("cache");
+    char * path      = write_file("cached.v",
+        "module cached();\n"
+        "`include \"cached.vh\"\n"
+        "endmodule\n");
+    write_file("cached.vh",
+        "`define CACHED_WIDTH 4\n"
+        "  wire before;\n");
+
+    verilog_parse_cache * cache = verilog_new_parse_cache(directory);
+    CHECK(cache != NULL, "the cache in %s could not be made", directory);
+    if(cache == NULL)
+    {
+        free(directory);
+        return;
+    }
+
+    verilog_parser_context * context = parse_cached(cache, path);
+    CHECK(cache -> hits == 0 && cache -> misses == 1,
+          "the first parse was not a miss");
+    check_cached_module(context, "before", "when parsed");
+    verilog_free_parser_context(context);
+
+    context = parse_cached(cache, path);
+    CHECK(cache -> hits == 1 && cache -> misses == 1,
+          "the second parse was not a hit");
+    check_cached_module(context, "before", "when read from the cache");
+    verilog_free_parser_context(context);
+
+    // The key is the file itself, so only checking includes notices this.
+    write_file("cached.vh",
+        "`define CACHED_WIDTH 8\n"
+        "  wire after;\n");
+
+    context = parse_cached(cache, path);
+    CHECK(cache -> hits == 1 && cache -> misses == 2,
+          "the parse after editing the header was not a miss");
+    check_cached_module(context, "after", "once the header changed");
+    verilog_free_parser_context(context);
+
+    context = parse_cached(cache, path);
+    CHECK(cache -> hits == 2 && cache -> misses == 2,
+          "the parse of the edited header was not a hit");
+    check_cached_module(context, "after", "when read from the cache again");
+    verilog_free_parser_context(context);
+
+    verilog_free_parse_cache(cache);
+
+    // The entries are not in the list of files written.
+    DIR           * entries = opendir(directory);
+    struct dirent * entry;
+    while(entries != NULL && (entry = readdir(entries)) != NULL)
+    {
+        char * name = malloc(strlen(directory) + strlen(entry -> d_name) + 1);
+        sprintf(name, "%s%s", directory, entry -> d_name);
+        if(entry -> d_name[0] != '.')
+        {
+            remove(name);
+        }
+        free(name);
+    }
+    if(entries != NULL)
+    {
+        closedir(entries);
+    }
+    free(directory);
+}
+
+int main()
+{
+    int i;
+
+    if(mkdtemp(scratch) == NULL)
+    {
+        printf("Could not make a scratch directory.\n");
+        return 1;
+    }
+    sprintf(search_dir, "%s/", scratch);
+
+    check_region();
+    check_hashtable();
+    check_list_edits();
+    check_list_iterators();
+    check_guarded_include();
+    check_search_dir_edited();
+    check_number_text();
+    check_token_offsets();
+    check_node_positions();
+    check_merged_files();
+    check_incremental_edits();
+    check_gate_instances();
+    check_udp_ports();
+    check_udp_levels();
+    check_ordered_connections();
+    check_lvalue_concatenation();
+    check_module_specparams();
+    check_parameter_port_list();
+    check_chunked_parse();
+    check_lazy_parse();
+    check_pipelined_parse();
+    check_named_errors();
+    check_kept_lines();
+    check_module_index();
+    check_pending_instantiations();
+    check_description_callback();
+    check_skeleton_spans();
+    check_parse_cache();
+
+    // Files and directories are removed the other way round to how they
+    // were made, so the directories are empty by then.
+    for(i = written_count - 1; i >= 0; i --)
+    {
+        remove(written[i]);
+        free(written[i]);
+    }
+    rmdir(scratch);
+
+    if(failures > 0)
+    {
+        printf("%d check(s) failed.\n", failures);
+        return 1;
+    }
+    return 0;
+}